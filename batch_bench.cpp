@@ -0,0 +1,236 @@
+/*
+    collabREate batch_bench.cpp
+    Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+    Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+    This program is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 2 of the License, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+    more details.
+
+    You should have received a copy of the GNU General Public License along with
+    this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+    Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Standalone Linux harness for the plugin's outgoing BatchWriter. No IDA SDK
+ * is needed. Synthetic update messages shaped like the ones collab_hooks.cpp
+ * produces are written over a loopback TCP connection to a draining reader
+ * thread, once per batch size, so the cost of one send() per update can be
+ * compared against batched sends. A trickle phase then writes isolated
+ * messages to show the time based flush bounds their delivery latency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <vector>
+#include <string>
+
+#include "collab_client.h"
+
+using namespace std;
+
+struct Reader {
+   int sock;
+   uint64_t bytes;
+   volatile uint64_t lines;
+   volatile uint64_t last_ms;   //monotonic_ms when the most recent line arrived
+   Reader(int s) : sock(s), bytes(0), lines(0), last_ms(0) {};
+};
+
+static void *drain(void *arg) {
+   Reader *r = (Reader*)arg;
+   char buf[65536];
+   int len;
+   while ((len = (int)recv(r->sock, buf, sizeof(buf), 0)) > 0) {
+      r->bytes += len;
+      for (int i = 0; i < len; i++) {
+         if (buf[i] == '\n') {
+            r->lines++;
+         }
+      }
+      r->last_ms = monotonic_ms();
+   }
+   return NULL;
+}
+
+//a connected loopback pair, *out is the writing end
+static bool loopback(int *out, int *in) {
+   int lsock = socket(AF_INET, SOCK_STREAM, 0);
+   sockaddr_in addr;
+   socklen_t alen = sizeof(addr);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (lsock < 0 || bind(lsock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(lsock, 1) != 0 ||
+       getsockname(lsock, (sockaddr*)&addr, &alen) != 0) {
+      perror("loopback listen");
+      return false;
+   }
+   *out = socket(AF_INET, SOCK_STREAM, 0);
+   if (connect(*out, (sockaddr*)&addr, sizeof(addr)) != 0) {
+      perror("loopback connect");
+      return false;
+   }
+   *in = accept(lsock, NULL, NULL);
+   close(lsock);
+   return *in >= 0;
+}
+
+static bool sock_sink(const char *buf, size_t len, void *user) {
+   int err;
+   return send_fully(*(int*)user, buf, len, &err);
+}
+
+//updates shaped like the renames and comments a bulk operation produces
+static void make_updates(vector<string> &updates, uint32_t count) {
+   char line[256];
+   for (uint32_t i = 0; i < count; i++) {
+      uint64_t ea = 0x401000 + (uint64_t)i * 0x10;
+      if (i & 1) {
+         snprintf(line, sizeof(line), "{\"addr\":%llu,\"type\":\"cmt_changed\",\"rep\":false,"
+                  "\"cmt\":\"comment %u\",\"user\":\"bench\"}\n", (unsigned long long)ea, i);
+      }
+      else {
+         snprintf(line, sizeof(line), "{\"addr\":%llu,\"type\":\"renamed\",\"local\":false,"
+                  "\"new_name\":\"sub_%llx_%u\",\"user\":\"bench\"}\n", (unsigned long long)ea,
+                  (unsigned long long)ea, i);
+      }
+      updates.push_back(line);
+   }
+}
+
+static bool run_bulk(const vector<string> &updates, size_t max_bytes, uint32_t delay_ms) {
+   int out, in;
+   if (!loopback(&out, &in)) {
+      return false;
+   }
+   Reader r(in);
+   pthread_t tid;
+   pthread_create(&tid, NULL, drain, &r);
+
+   BatchWriter w(sock_sink, &out, max_bytes, delay_ms);
+   w.start();
+   uint64_t start = monotonic_ms();
+   for (size_t i = 0; i < updates.size(); i++) {
+      if (!w.write(updates[i])) {
+         fprintf(stderr, "write failed\n");
+         break;
+      }
+   }
+   //the end of the bulk operation is a boundary
+   w.flush();
+   w.stop();
+   shutdown(out, SHUT_WR);
+   pthread_join(tid, NULL);
+   uint64_t elapsed = r.last_ms > start ? r.last_ms - start : 1;
+   close(out);
+   close(in);
+
+   printf("max_bytes %-8u updates %-8u sends %-8llu avg batch %-10.1f %8.1f ms %12.0f updates/s%s\n",
+          (uint32_t)max_bytes, (uint32_t)w.messages, (unsigned long long)w.batches,
+          w.batches ? (double)w.bytes / w.batches : 0.0, (double)elapsed,
+          updates.size() * 1000.0 / elapsed, r.lines == updates.size() ? "" : "  LOST UPDATES");
+   return r.lines == updates.size();
+}
+
+//isolated writes with no boundary, only the timer gets them out
+static bool run_trickle(const vector<string> &updates, uint32_t count, uint32_t delay_ms) {
+   int out, in;
+   if (!loopback(&out, &in)) {
+      return false;
+   }
+   Reader r(in);
+   pthread_t tid;
+   pthread_create(&tid, NULL, drain, &r);
+
+   BatchWriter w(sock_sink, &out, BATCH_MAX_BYTES, delay_ms);
+   w.start();
+   uint64_t worst = 0;
+   for (uint32_t i = 0; i < count && i < updates.size(); i++) {
+      uint64_t sent = monotonic_ms();
+      w.write(updates[i]);
+      while (r.lines <= i && monotonic_ms() - sent < 10 * (uint64_t)delay_ms + 1000) {
+         usleep(500);
+      }
+      uint64_t latency = monotonic_ms() - sent;
+      if (latency > worst) {
+         worst = latency;
+      }
+   }
+   w.stop();
+   shutdown(out, SHUT_WR);
+   pthread_join(tid, NULL);
+   close(out);
+   close(in);
+   printf("trickle       updates %-8u sends %-8llu worst delivery %llu ms (max delay %u ms)\n",
+          count, (unsigned long long)w.batches, (unsigned long long)worst, delay_ms);
+   return r.lines == count;
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options]\n", prog);
+   fprintf(stderr, "   -n count     updates per bulk run (default 100000)\n");
+   fprintf(stderr, "   -s bytes     batch size to run, may be repeated, 0 is unbatched\n");
+   fprintf(stderr, "                (default 0, 4096 and %u)\n", BATCH_MAX_BYTES);
+   fprintf(stderr, "   -d ms        maximum batching delay (default %u)\n", BATCH_MAX_DELAY_MS);
+   fprintf(stderr, "   -t count     isolated updates for the trickle run (default 20, 0 to skip)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   uint32_t count = 100000;
+   uint32_t delay_ms = BATCH_MAX_DELAY_MS;
+   uint32_t trickle = 20;
+   vector<size_t> sizes;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:s:d:t:h")) != -1) {
+      switch (opt) {
+         case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+         case 's':
+            sizes.push_back(strtoul(optarg, NULL, 0));
+            break;
+         case 'd':
+            delay_ms = strtoul(optarg, NULL, 0);
+            break;
+         case 't':
+            trickle = strtoul(optarg, NULL, 0);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (sizes.empty()) {
+      sizes.push_back(0);
+      sizes.push_back(4096);
+      sizes.push_back(BATCH_MAX_BYTES);
+   }
+   vector<string> updates;
+   make_updates(updates, count > trickle ? count : trickle);
+
+   bool ok = true;
+   for (size_t i = 0; i < sizes.size(); i++) {
+      vector<string> bulk(updates.begin(), updates.begin() + count);
+      ok = run_bulk(bulk, sizes[i], delay_ms) && ok;
+   }
+   if (trickle) {
+      ok = run_trickle(updates, trickle, delay_ms) && ok;
+   }
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,668 @@
+/*
+    collabREate client library, no IDA SDK dependencies
+    Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+    Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+    This program is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 2 of the License, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+    more details.
+
+    You should have received a copy of the GNU General Public License along with
+    this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+    Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include "collab_client.h"
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SOCKET_ERROR -1
+#endif
+
+bool send_fully(_SOCKET sock, const char *buf, size_t len, int *err) {
+   while (len > 0) {
+      int res = ::send(sock, buf, (int)len, 0);
+      if (res == SOCKET_ERROR) {
+#ifdef _WIN32
+         *err = WSAGetLastError();
+#else
+         if (errno == EINTR) {
+            continue;
+         }
+         *err = errno;
+#endif
+         return false;
+      }
+      //short send, try again with the remainder
+      buf += res;
+      len -= res;
+   }
+   return true;
+}
+
+uint64_t monotonic_ms() {
+#ifdef _WIN32
+   return GetTickCount64();
+#else
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+ClientMutex::ClientMutex() {
+#ifdef _WIN32
+   InitializeCriticalSection(&cs);
+#else
+   pthread_mutex_init(&mtx, NULL);
+#endif
+}
+
+ClientMutex::~ClientMutex() {
+#ifdef _WIN32
+   DeleteCriticalSection(&cs);
+#else
+   pthread_mutex_destroy(&mtx);
+#endif
+}
+
+void ClientMutex::lock() {
+#ifdef _WIN32
+   EnterCriticalSection(&cs);
+#else
+   pthread_mutex_lock(&mtx);
+#endif
+}
+
+void ClientMutex::unlock() {
+#ifdef _WIN32
+   LeaveCriticalSection(&cs);
+#else
+   pthread_mutex_unlock(&mtx);
+#endif
+}
+
+BatchWriter::BatchWriter(BatchSink sink, void *user, size_t max_bytes, uint32_t max_delay_ms) {
+   this->sink = sink;
+   this->user = user;
+   this->max_bytes = max_bytes;
+   this->max_delay_ms = max_delay_ms ? max_delay_ms : 1;
+   messages = 0;
+   batches = 0;
+   bytes = 0;
+   oldest = 0;
+   error = false;
+   running = false;
+   stopping = false;
+   thread = 0;
+   if (max_bytes) {
+      buf.reserve(max_bytes);
+   }
+}
+
+BatchWriter::~BatchWriter() {
+   stop();
+}
+
+bool BatchWriter::write(const char *data, size_t len, bool boundary) {
+   mtx.lock();
+   if (error) {
+      mtx.unlock();
+      return false;
+   }
+   messages++;
+   if (buf.empty()) {
+      oldest = monotonic_ms();
+   }
+   buf.append(data, len);
+   bool res = true;
+   if (boundary || buf.length() >= max_bytes) {
+      res = flushLocked();
+   }
+   mtx.unlock();
+   return res;
+}
+
+bool BatchWriter::flush() {
+   mtx.lock();
+   bool res = flushLocked();
+   mtx.unlock();
+   return res;
+}
+
+bool BatchWriter::flushIfDue() {
+   mtx.lock();
+   bool res = !error;
+   if (!buf.empty() && monotonic_ms() - oldest >= max_delay_ms) {
+      res = flushLocked();
+   }
+   mtx.unlock();
+   return res;
+}
+
+size_t BatchWriter::pending() {
+   mtx.lock();
+   size_t len = buf.length();
+   mtx.unlock();
+   return len;
+}
+
+bool BatchWriter::flushLocked() {
+   if (error) {
+      return false;
+   }
+   if (buf.empty()) {
+      return true;
+   }
+   batches++;
+   bytes += buf.length();
+   if (!(*sink)(buf.c_str(), buf.length(), user)) {
+      error = true;
+   }
+   buf.clear();
+   return !error;
+}
+
+bool BatchWriter::start() {
+   if (running || max_bytes == 0) {
+      //nothing is ever left waiting when writing straight through
+      return running;
+   }
+   stopping = false;
+#ifdef _WIN32
+   running = (thread = CreateThread(NULL, 0, timerThread, this, 0, NULL)) != NULL;
+#else
+   running = pthread_create(&thread, NULL, timerThread, this) == 0;
+#endif
+   return running;
+}
+
+void BatchWriter::stop() {
+   if (running) {
+      stopping = true;
+#ifdef _WIN32
+      WaitForSingleObject(thread, INFINITE);
+      CloseHandle(thread);
+#else
+      pthread_join(thread, NULL);
+#endif
+      thread = 0;
+      running = false;
+   }
+}
+
+//wakes at half the maximum delay so nothing waits much past max_delay_ms
+#ifdef _WIN32
+DWORD WINAPI BatchWriter::timerThread(void *arg) {
+#else
+void *BatchWriter::timerThread(void *arg) {
+#endif
+   BatchWriter *w = (BatchWriter*)arg;
+   uint32_t tick = w->max_delay_ms / 2 ? w->max_delay_ms / 2 : 1;
+   while (!w->stopping) {
+#ifdef _WIN32
+      Sleep(tick);
+#else
+      usleep(tick * 1000);
+#endif
+      if (!w->flushIfDue()) {
+         break;
+      }
+   }
+   return 0;
+}
+
+DispatchQueue::DispatchQueue() {
+   pushed = 0;
+   batches = 0;
+   scheduled = false;
+}
+
+DispatchQueue::~DispatchQueue() {
+   flush();
+}
+
+bool DispatchQueue::push(json_object *obj) {
+   mtx.lock();
+   incoming.push_back(obj);
+   pushed++;
+   bool schedule = !scheduled;
+   scheduled = true;
+   mtx.unlock();
+   return schedule;
+}
+
+bool DispatchQueue::take(std::vector<json_object*> &batch) {
+   batch.clear();
+   mtx.lock();
+   incoming.swap(batch);
+   if (batch.empty()) {
+      //the consumer is done, the next push must schedule it again
+      scheduled = false;
+   }
+   else {
+      batches++;
+   }
+   mtx.unlock();
+   return !batch.empty();
+}
+
+void DispatchQueue::flush() {
+   mtx.lock();
+   for (std::vector<json_object*>::iterator i = incoming.begin(); i != incoming.end(); i++) {
+      json_object_put(*i);
+   }
+   incoming.clear();
+   mtx.unlock();
+}
+
+FrameReader::FrameReader() {
+   tok = json_tokener_new();
+   data = NULL;
+   len = 0;
+   pos = 0;
+   objects = 0;
+   bytes = 0;
+}
+
+FrameReader::~FrameReader() {
+   json_tokener_free(tok);
+}
+
+void FrameReader::feed(const char *data, size_t len) {
+   this->data = data;
+   this->len = len;
+   pos = 0;
+}
+
+int FrameReader::next(json_object **obj) {
+   *obj = NULL;
+   while (pos < len) {
+      json_object *jobj = json_tokener_parse_ex(tok, data + pos, (int)(len - pos));
+      enum json_tokener_error jerr = json_tokener_get_error(tok);
+      if (jerr == json_tokener_continue) {
+         //incomplete, the tokener remembers where it was
+         bytes += len - pos;
+         pos = len;
+         break;
+      }
+      if (jerr != json_tokener_success) {
+         return FRAME_ERROR;
+      }
+      bytes += tok->char_offset;
+      pos += tok->char_offset;
+      if (jobj != NULL) {
+         objects++;
+         *obj = jobj;
+         return FRAME_OBJECT;
+      }
+      //a bare null, nothing to hand back
+   }
+   data = NULL;
+   len = 0;
+   pos = 0;
+   return FRAME_MORE;
+}
+
+void FrameReader::reset() {
+   json_tokener_reset(tok);
+   data = NULL;
+   len = 0;
+   pos = 0;
+}
+
+bool FileJournalStore::load(uint32_t key, std::string &data) {
+   FILE *f = fopen(path(key).c_str(), "rb");
+   if (f == NULL) {
+      return false;
+   }
+   char buf[16384];
+   size_t len;
+   data.clear();
+   while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+      data.append(buf, len);
+   }
+   fclose(f);
+   return true;
+}
+
+bool FileJournalStore::save(uint32_t key, const std::string &data) {
+   FILE *f = fopen(path(key).c_str(), "wb");
+   if (f == NULL) {
+      return false;
+   }
+   bool res = fwrite(data.data(), 1, data.length(), f) == data.length();
+   return fclose(f) == 0 && res;
+}
+
+void FileJournalStore::remove(uint32_t key) {
+   ::remove(path(key).c_str());
+}
+
+std::string FileJournalStore::path(uint32_t key) {
+   char name[32];
+   snprintf(name, sizeof(name), "/journal.%u", key);
+   return dir + name;
+}
+
+/*
+ * commands that completely replace the state of a single item, keep these
+ * in step with the tables in server/c++/compactor.cpp
+ */
+static const struct {
+   const char *cmd;
+   const char *scope;
+   const char *item;   //field naming the item
+   const char *slot;   //optional field naming a slot within the item
+} journal_setters[] = {
+   {"renamed", "A:", "addr", NULL},
+   {"cmt_changed", "A:", "addr", "rep"},
+   {"ti_changed", "A:", "addr", NULL},
+   {"op_ti_changed", "A:", "addr", "opnum"},
+   {"op_type_changed", "A:", "addr", "opnum"},
+   {"set_stack_var_name", "A:", "func_addr", "offset"},
+   {"struc_cmt_changed", "S:", "struc_name", "rep"},
+   {"set_struc_mbr_name", "S:", "struc_name", "offset"},
+   {"enum_cmt_changed", "E:", "enum_name", "rep"},
+   {NULL, NULL, NULL, NULL}
+};
+
+/*
+ * commands that change what existing keys refer to, nothing on either
+ * side of them is coalesced for the named items (or the whole scope)
+ */
+static const struct {
+   const char *cmd;
+   const char *scope;
+   const char *item1;
+   const char *item2;
+} journal_barriers[] = {
+   {"struc_renamed", "S:", "oldname", "newname"},
+   {"struc_deleted", "S:", "struc_name", NULL},
+   {"enum_renamed", "E:", "oldname", "newname"},
+   {"enum_deleted", "E:", "enum_name", NULL},
+   {"move_segm", "A:", NULL, NULL},
+   {"segm_moved", "A:", NULL, NULL},
+   {NULL, NULL, NULL, NULL}
+};
+
+static const char *journal_field(json_object *rec, const char *name) {
+   json_object *val;
+   if (!json_object_object_get_ex(rec, name, &val)) {
+      return NULL;
+   }
+   return json_object_get_string(val);
+}
+
+typedef std::pair<uint32_t,uint32_t> RecordPos;   //segment, record within it
+
+static void journal_invalidate(std::map<std::string,RecordPos> &live, const std::string &prefix) {
+   std::map<std::string,RecordPos>::iterator first = live.lower_bound(prefix);
+   std::map<std::string,RecordPos>::iterator last = first;
+   while (last != live.end() && last->first.compare(0, prefix.length(), prefix) == 0) {
+      last++;
+   }
+   live.erase(first, last);
+}
+
+//feed one record through the coalescing rules, marking whatever it supersedes dead
+static void journal_supersede(std::map<std::string,RecordPos> &live, std::set<RecordPos> &dead,
+                              RecordPos pos, json_object *rec) {
+   const char *cmd = journal_field(rec, "type");
+   if (cmd == NULL) {
+      return;
+   }
+   for (int i = 0; journal_setters[i].cmd; i++) {
+      if (strcmp(cmd, journal_setters[i].cmd) == 0) {
+         const char *item = journal_field(rec, journal_setters[i].item);
+         if (item == NULL) {
+            return;
+         }
+         std::string key = journal_setters[i].scope;
+         key += item;
+         key += ':';
+         key += cmd;
+         if (journal_setters[i].slot) {
+            const char *slot = journal_field(rec, journal_setters[i].slot);
+            if (slot == NULL) {
+               return;
+            }
+            key += ':';
+            key += slot;
+         }
+         std::map<std::string,RecordPos>::iterator prev = live.find(key);
+         if (prev != live.end()) {
+            dead.insert(prev->second);
+            prev->second = pos;
+         }
+         else {
+            live[key] = pos;
+         }
+         return;
+      }
+   }
+   for (int i = 0; journal_barriers[i].cmd; i++) {
+      if (strcmp(cmd, journal_barriers[i].cmd) == 0) {
+         if (journal_barriers[i].item1 == NULL) {
+            journal_invalidate(live, journal_barriers[i].scope);
+            return;
+         }
+         const char *item = journal_field(rec, journal_barriers[i].item1);
+         if (item) {
+            journal_invalidate(live, std::string(journal_barriers[i].scope) + item + ":");
+         }
+         if (journal_barriers[i].item2 && (item = journal_field(rec, journal_barriers[i].item2)) != NULL) {
+            journal_invalidate(live, std::string(journal_barriers[i].scope) + item + ":");
+         }
+         return;
+      }
+   }
+}
+
+OfflineJournal::OfflineJournal(JournalStore *store, size_t max_bytes, size_t segment_bytes) {
+   this->store = store;
+   this->max_bytes = max_bytes;
+   this->segment_bytes = segment_bytes;
+   first = 1;
+   current = 1;
+   total = 0;
+   appended = 0;
+   coalesced = 0;
+   dropped = 0;
+   full = false;
+}
+
+OfflineJournal::~OfflineJournal() {
+}
+
+bool OfflineJournal::open() {
+   std::string meta;
+   unsigned long long t = 0;
+   active.clear();
+   if (!store->load(0, meta) || sscanf(meta.c_str(), "%u %u %llu", &first, &current, &t) != 3 ||
+       first == 0 || current < first) {
+      //nothing stored, or nothing usable
+      first = 1;
+      current = 1;
+      total = 0;
+      return true;
+   }
+   total = t;
+   store->load(current, active);
+   return true;
+}
+
+bool OfflineJournal::saveMeta() {
+   char meta[64];
+   snprintf(meta, sizeof(meta), "%u %u %llu", first, current, (unsigned long long)total);
+   return store->save(0, meta);
+}
+
+bool OfflineJournal::loadSegment(uint32_t seg, std::string &data) {
+   if (seg == current) {
+      data = active;
+      return true;
+   }
+   return store->load(seg, data);
+}
+
+void OfflineJournal::setSegment(uint32_t seg, const std::string &data) {
+   if (seg == current) {
+      active = data;
+   }
+   else if (data.empty()) {
+      store->remove(seg);
+   }
+   else {
+      store->save(seg, data);
+   }
+}
+
+bool OfflineJournal::append(const char *rec, size_t len) {
+   if (total + len > max_bytes) {
+      //try coalescing once, don't rescan the whole journal for every
+      //update if that didn't help
+      if (full || (compact(), total + len > max_bytes)) {
+         full = true;
+         dropped++;
+         return false;
+      }
+   }
+   active.append(rec, len);
+   total += len;
+   appended++;
+   if (active.length() >= segment_bytes) {
+      //seal it, from here on it is only read back at compaction or replay
+      bool res = store->save(current, active);
+      current++;
+      active.clear();
+      return saveMeta() && res;
+   }
+   return true;
+}
+
+bool OfflineJournal::sync() {
+   bool res = true;
+   if (active.empty()) {
+      store->remove(current);
+   }
+   else {
+      res = store->save(current, active);
+   }
+   return saveMeta() && res;
+}
+
+size_t OfflineJournal::compact() {
+   std::map<std::string,RecordPos> live;
+   std::set<RecordPos> dead;
+   std::string data;
+   //first pass finds the superseded records
+   for (uint32_t seg = first; seg <= current; seg++) {
+      if (!loadSegment(seg, data)) {
+         continue;
+      }
+      uint32_t idx = 0;
+      for (size_t start = 0, end; start < data.length(); start = end + 1, idx++) {
+         if ((end = data.find('\n', start)) == std::string::npos) {
+            end = data.length();
+         }
+         json_object *rec = json_tokener_parse(data.substr(start, end - start).c_str());
+         if (rec) {
+            journal_supersede(live, dead, RecordPos(seg, idx), rec);
+            json_object_put(rec);
+         }
+      }
+   }
+   if (dead.empty()) {
+      return 0;
+   }
+   //second pass rewrites only the segments that lost records
+   for (std::set<RecordPos>::iterator d = dead.begin(); d != dead.end(); ) {
+      uint32_t seg = d->first;
+      if (!loadSegment(seg, data)) {
+         while (d != dead.end() && d->first == seg) {
+            d++;
+         }
+         continue;
+      }
+      std::string kept;
+      uint32_t idx = 0;
+      for (size_t start = 0, end; start < data.length(); start = end + 1, idx++) {
+         if ((end = data.find('\n', start)) == std::string::npos) {
+            end = data.length() - 1;
+         }
+         if (d != dead.end() && d->first == seg && d->second == idx) {
+            d++;
+            coalesced++;
+            continue;
+         }
+         kept.append(data, start, end - start + 1);
+      }
+      while (d != dead.end() && d->first == seg) {
+         d++;
+      }
+      total -= data.length() - kept.length();
+      setSegment(seg, kept);
+   }
+   saveMeta();
+   return dead.size();
+}
+
+bool OfflineJournal::replay(BatchSink sink, void *user) {
+   compact();
+   std::string data;
+   for (uint32_t seg = first; seg <= current; seg++) {
+      if (!loadSegment(seg, data) || data.empty()) {
+         continue;
+      }
+      if (!(*sink)(data.c_str(), data.length(), user)) {
+         //resume from this segment next time
+         first = seg;
+         saveMeta();
+         return false;
+      }
+      total -= data.length();
+      if (seg == current) {
+         active.clear();
+      }
+      store->remove(seg);
+      first = seg + 1 < current ? seg + 1 : current;
+      saveMeta();
+   }
+   //empty again, start numbering over so segment keys stay small
+   first = 1;
+   current = 1;
+   total = 0;
+   full = false;
+   saveMeta();
+   return true;
+}
+
+void OfflineJournal::clear() {
+   for (uint32_t seg = first; seg <= current; seg++) {
+      store->remove(seg);
+   }
+   store->remove(0);
+   active.clear();
+   first = 1;
+   current = 1;
+   total = 0;
+   full = false;
+}
@@ -0,0 +1,281 @@
+/*
+    collabREate client library, no IDA SDK dependencies
+    Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+    Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+    This program is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 2 of the License, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+    more details.
+
+    You should have received a copy of the GNU General Public License along with
+    this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+    Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __COLLAB_CLIENT_H__
+#define __COLLAB_CLIENT_H__
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "idanet.h"
+
+//flush once this many bytes are waiting
+#define BATCH_MAX_BYTES    (64 * 1024)
+//flush once the oldest waiting message is this old
+#define BATCH_MAX_DELAY_MS 20
+
+//size of the chunks read from the server
+#define FRAME_CHUNK_SIZE   (64 * 1024)
+
+//offline journal segments are sealed once they reach this size
+#define JOURNAL_SEGMENT_BYTES (64 * 1024)
+//the offline journal stops accepting updates beyond this size
+#define JOURNAL_MAX_BYTES     (64 * 1024 * 1024)
+
+//receives each batch, returns false if the data could not be delivered
+typedef bool (*BatchSink)(const char *buf, size_t len, void *user);
+
+//write all of buf to sock, retrying short sends
+//returns false on error with the socket error code in *err
+bool send_fully(_SOCKET sock, const char *buf, size_t len, int *err);
+
+//milliseconds from an arbitrary fixed point
+uint64_t monotonic_ms();
+
+class ClientMutex {
+public:
+   ClientMutex();
+   ~ClientMutex();
+   void lock();
+   void unlock();
+private:
+#ifdef _WIN32
+   CRITICAL_SECTION cs;
+#else
+   pthread_mutex_t mtx;
+#endif
+};
+
+/*
+ * BatchWriter coalesces small outgoing messages into larger writes.
+ * Messages are appended in order and handed to the sink once
+ * BATCH_MAX_BYTES are waiting, once the oldest waiting message is
+ * BATCH_MAX_DELAY_MS old, or at an explicit boundary (write with
+ * boundary set, or flush). A max_bytes of 0 writes every message
+ * straight through. The sink is always called with the writer lock
+ * held so batches never interleave.
+ */
+class BatchWriter {
+public:
+   BatchWriter(BatchSink sink, void *user, size_t max_bytes = BATCH_MAX_BYTES,
+               uint32_t max_delay_ms = BATCH_MAX_DELAY_MS);
+   ~BatchWriter();
+
+   //queue a message, boundary forces everything queued so far out
+   bool write(const char *data, size_t len, bool boundary = false);
+   bool write(const std::string &s, bool boundary = false) {return write(s.c_str(), s.length(), boundary);};
+   bool flush();
+   //flush if the oldest waiting message has exceeded max_delay_ms
+   bool flushIfDue();
+
+   //start and stop the thread that enforces max_delay_ms
+   bool start();
+   void stop();
+
+   //true once the sink has reported an error, nothing more is written
+   bool failed() {return error;};
+   size_t pending();
+
+   uint64_t messages;   //messages written
+   uint64_t batches;    //sink calls
+   uint64_t bytes;      //bytes handed to the sink
+
+private:
+   bool flushLocked();
+#ifdef _WIN32
+   static DWORD WINAPI timerThread(void *arg);
+   HANDLE thread;
+#else
+   static void *timerThread(void *arg);
+   pthread_t thread;
+#endif
+   bool running;
+   volatile bool stopping;
+
+   BatchSink sink;
+   void *user;
+   size_t max_bytes;
+   uint32_t max_delay_ms;
+   std::string buf;
+   uint64_t oldest;     //monotonic_ms of the first message in buf
+   bool error;
+   ClientMutex mtx;
+};
+
+/*
+ * DispatchQueue hands objects received on the network thread to the thread
+ * that applies them, in whole batches. The producer appends to one vector
+ * under the lock, the consumer swaps it for its own (already drained)
+ * vector, so each batch costs one lock round trip and no per object erases.
+ * push reports when the consumer needs to be scheduled, only one drain is
+ * ever outstanding.
+ */
+class DispatchQueue {
+public:
+   DispatchQueue();
+   ~DispatchQueue();
+
+   //queue an object, the queue takes ownership of the reference
+   //returns true if the consumer must be scheduled to drain the queue
+   bool push(json_object *obj);
+   //swap out everything queued so far, batch must have been drained
+   //returns false, and marks the consumer idle, once nothing is left
+   bool take(std::vector<json_object*> &batch);
+   //release anything still queued
+   void flush();
+
+   uint64_t pushed;    //objects queued
+   uint64_t batches;   //non-empty takes
+
+private:
+   std::vector<json_object*> incoming;
+   bool scheduled;
+   ClientMutex mtx;
+};
+
+//FrameReader::next results
+#define FRAME_OBJECT 1
+#define FRAME_MORE   0
+#define FRAME_ERROR  -1
+
+/*
+ * FrameReader splits the stream of concatenated json objects sent by the
+ * server back into objects. The tokener keeps the state of a partially
+ * received object between chunks, so each received byte is parsed exactly
+ * once and nothing already parsed is buffered, copied or shifted, however
+ * large the object. Each connection needs its own reader.
+ */
+class FrameReader {
+public:
+   FrameReader();
+   ~FrameReader();
+
+   //hand the reader the next received chunk, it must stay valid
+   //until next has returned FRAME_MORE for it
+   void feed(const char *data, size_t len);
+   //FRAME_OBJECT with the next complete object (caller owns it) in *obj,
+   //FRAME_MORE once the current chunk is used up, FRAME_ERROR if the
+   //stream is not valid json, after which the reader must be reset
+   int next(json_object **obj);
+   //discard any partial object, e.g. after a reconnect
+   void reset();
+
+   uint64_t objects;   //complete objects returned
+   uint64_t bytes;     //bytes consumed
+
+private:
+   json_tokener *tok;
+   const char *data;
+   size_t len;
+   size_t pos;
+};
+
+/*
+ * JournalStore is where OfflineJournal keeps its data. Each key holds one
+ * opaque blob, key 0 is the journal's own bookkeeping and segments use
+ * the keys after it. The plugin stores blobs in its netnode, FileJournalStore
+ * lets the journal be exercised without IDA.
+ */
+class JournalStore {
+public:
+   virtual ~JournalStore() {};
+   //false if nothing is stored under key
+   virtual bool load(uint32_t key, std::string &data) = 0;
+   virtual bool save(uint32_t key, const std::string &data) = 0;
+   virtual void remove(uint32_t key) = 0;
+};
+
+//one file per key, named journal.<key>, in an existing directory
+class FileJournalStore : public JournalStore {
+public:
+   FileJournalStore(const char *dir) : dir(dir) {};
+   bool load(uint32_t key, std::string &data);
+   bool save(uint32_t key, const std::string &data);
+   void remove(uint32_t key);
+private:
+   std::string path(uint32_t key);
+   std::string dir;
+};
+
+/*
+ * OfflineJournal records updates made while disconnected from the server.
+ * Records (one serialized message each) are appended to an in memory
+ * segment that is written out once it reaches JOURNAL_SEGMENT_BYTES, so
+ * appending never copies more than one segment and sync only writes the
+ * segment still being filled. Updates that set the whole state of an item
+ * (a name, a comment, a type) are coalesced, only the latest one for each
+ * item survives, the same rules the server's Compactor uses. Replay hands
+ * the sink one segment at a time and records its progress in the store,
+ * if the sink fails the next replay resumes with the segment that failed.
+ * Not thread safe, the plugin only uses it from the IDA thread.
+ */
+class OfflineJournal {
+public:
+   OfflineJournal(JournalStore *store, size_t max_bytes = JOURNAL_MAX_BYTES,
+                  size_t segment_bytes = JOURNAL_SEGMENT_BYTES);
+   ~OfflineJournal();
+
+   //pick up whatever an earlier session left in the store
+   bool open();
+   //add one record, false once the journal is full even after coalescing
+   bool append(const char *rec, size_t len);
+   //write the segment being filled and the bookkeeping to the store
+   bool sync();
+   //drop superseded records, returns how many were dropped
+   size_t compact();
+   //coalesce then hand everything, in order, to sink
+   //false if the sink failed, what was delivered is not replayed again
+   bool replay(BatchSink sink, void *user);
+   //forget everything
+   void clear();
+
+   bool empty() {return total == 0;};
+   uint64_t bytes() {return total;};
+
+   uint64_t appended;    //records appended
+   uint64_t coalesced;   //records dropped as superseded
+   uint64_t dropped;     //records refused because the journal was full
+
+private:
+   bool saveMeta();
+   bool loadSegment(uint32_t seg, std::string &data);
+   void setSegment(uint32_t seg, const std::string &data);
+
+   JournalStore *store;
+   size_t max_bytes;
+   size_t segment_bytes;
+   uint32_t first;       //oldest segment still holding records
+   uint32_t current;     //segment being filled, kept in active
+   uint64_t total;       //bytes in all segments
+   bool full;            //coalescing could not make room, refuse appends
+   std::string active;
+};
+
+#endif
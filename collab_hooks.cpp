@@ -1873,6 +1873,13 @@ void change_range_comment(range_kind_t rk, const range_t *r, const char *cmt, bo
 }
 #endif
 
+//bulk operations (applying a type library, undefining a range) raise
+//thousands of notifications, let the updates they generate be batched
+struct batch_scope_t {
+   batch_scope_t() {batch_depth++;};
+   ~batch_scope_t() {batch_depth--;};
+};
+
 //notification hook function for idb notifications
 #if IDA_SDK_VERSION < 700
 int idaapi idb_hook(void * /*user_data*/, int notification_code, va_list va) {
@@ -1883,6 +1890,7 @@ ssize_t idaapi idb_hook(void * /*user_data*/, int notification_code, va_list va)
       //should only be called if we are publishing
       return 0;
    }
+   batch_scope_t batch;
    //some efforts to stop generating extra messages in response to updates
    //so far all have failed
 /*
@@ -2404,6 +2412,7 @@ ssize_t idaapi idp_hook(void * /*user_data*/, int notification_code, va_list va)
       //should only be called if we are publishing
       return 0;
    }
+   batch_scope_t batch;
    //some efforts to stop generating extra messages in response to updates
    //so far all have failed
 /*
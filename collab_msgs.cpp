@@ -30,6 +30,7 @@
 
 #include "collabreate.h"
 #include "collabreate_ui.h"
+#include "collab_client.h"
 
 #include <pro.h>
 #include <ida.hpp>
@@ -76,6 +77,12 @@ static unsigned char pwhash[16];
 
 static qvector<qstring> updates;
 
+//token from the last project join, lets a dropped connection resume
+//without asking for the password, only good for the project it came from
+static qstring resume_token;
+static unsigned char resume_gpid[GPID_SIZE];
+static bool resuming = false;
+
 #ifndef DEBUG
 //#define DEBUG 1
 #endif
@@ -99,6 +106,31 @@ void sendProjectLeave() {
 
 void do_project_leave() {
    sendProjectLeave();
+   forgetResumeToken();
+}
+
+void forgetResumeToken() {
+   resume_token.clear();
+   memset(resume_gpid, 0, sizeof(resume_gpid));
+}
+
+//offer the server our resume token instead of answering its challenge
+//returns false if there is no token for this idb's project
+bool sendResumeRequest() {
+   unsigned char gpid[GPID_SIZE];
+   if (resume_token.empty() || getGpid(gpid, sizeof(gpid)) <= 0 ||
+       memcmp(gpid, resume_gpid, GPID_SIZE) != 0) {
+      return false;
+   }
+   json_object *obj = json_object_new_object();
+   append_json_string_val(obj, "token", resume_token.c_str());
+   append_json_int32_val(obj, "protocol", PROTOCOL_VERSION);
+   append_json_uint32_val(obj, "caps", CAP_CUMULATIVE_ACK | CAP_JOIN_CATCHUP | CAP_HANDOVER);
+   //tokens are single use, the server sends a new one when we are back in
+   forgetResumeToken();
+   resuming = true;
+   send_json(MSG_RESUME_REQUEST, obj);
+   return true;
 }
 
 //void do_clean_netnode( void ) {
@@ -156,6 +188,56 @@ void sendProjPermsChoice() {
    send_json(MSG_SET_PROJ_PERMS, obj);
 }
 
+/*
+ * ask the server to only send updates within the given address ranges
+ * spec is a comma separated list of hex start-end ranges and segment names,
+ * an empty spec removes the filter
+ */
+void sendAddrFilter(const char *spec, bool unaddressed) {
+   json_object *ranges = json_object_new_array();
+   const char *p = spec;
+   while (*p) {
+      while (*p == ' ' || *p == ',') {
+         p++;
+      }
+      const char *e = p;
+      while (*e && *e != ',') {
+         e++;
+      }
+      qstring tok(p, e - p);
+      while (tok.length() > 0 && tok.last() == ' ') {
+         tok.remove_last();
+      }
+      p = e;
+      if (tok.length() == 0) {
+         continue;
+      }
+      char *end;
+      uint64_t start = strtoull(tok.c_str(), &end, 16);
+      uint64_t stop = 0;
+      if (end != tok.c_str() && *end == '-') {
+         stop = strtoull(end + 1, &end, 16);
+      }
+      else {
+         segment_t *seg = get_segm_by_name(tok.c_str());
+         if (seg == NULL) {
+            msg(PLUGIN_NAME": Unknown segment or bad range: %s\n", tok.c_str());
+            continue;
+         }
+         start = seg->start_ea;
+         stop = seg->end_ea;
+      }
+      json_object *range = json_object_new_object();
+      append_json_uint64_val(range, "start", start);
+      append_json_uint64_val(range, "end", stop);
+      json_object_array_add(ranges, range);
+   }
+   json_object *obj = json_object_new_object();
+   json_object_object_add_ex(obj, "ranges", ranges, JSON_NEW_CONST_KEY);
+   append_json_bool_val(obj, "unaddressed", unaddressed);
+   send_json(MSG_SET_FILTER, obj);
+}
+
 void freeProjectFields() {
    qfree(snapUpdateIDs);
    snapUpdateIDs = NULL;
@@ -221,6 +303,9 @@ void sendAuthData(unsigned char *challenge, int challenge_len) {
    append_json_hex_val(obj, "hmac", hmac, sizeof(hmac));
    //send plugin protocol version
    append_json_int32_val(obj, "protocol", PROTOCOL_VERSION);
+   //ack_updateid handling is already cumulative, setLastUpdate keeps the max,
+   //and every join reply is answered with sendLastUpdate
+   append_json_uint32_val(obj, "caps", CAP_CUMULATIVE_ACK | CAP_JOIN_CATCHUP | CAP_HANDOVER);
 #ifdef DEBUG
    msg(PLUGIN_NAME": sending auth data\n");
 #endif   
@@ -1334,7 +1419,10 @@ int initial_challenge(json_object *json) {
    if (challenge == NULL || clen != CHALLENGE_SIZE) {
       return -1;
    }
-   if (do_auth(challenge, CHALLENGE_SIZE) != 0) {
+   if (sendResumeRequest()) {
+      msg(PLUGIN_NAME": Resuming previous session.\n");
+   }
+   else if (do_auth(challenge, CHALLENGE_SIZE) != 0) {
       cleanup();         //user canceled dialog
    }
    else {
@@ -1369,7 +1457,19 @@ int auth_reply(json_object *json) {
    if (!int32_from_json(json, "reply", &reply)) {
       return -1;
    }
-   if (reply == AUTH_REPLY_FAIL) {
+   bool resumed = false;
+   bool_from_json(json, "resumed", &resumed);
+#ifdef DEBUG
+   uint32_t caps = 0;
+   uint32_from_json(json, "caps", &caps);
+   msg(PLUGIN_NAME": server capabilities 0x%x\n", caps);
+#endif
+   if (reply == AUTH_REPLY_FAIL && resuming) {
+      //the server follows up with a new challenge, answer that one
+      resuming = false;
+      msg(PLUGIN_NAME": Previous session has expired.\n");
+   }
+   else if (reply == AUTH_REPLY_FAIL) {
       //use saved challenge from initial_challenge message
       if (do_auth(challenge, CHALLENGE_SIZE) != 0) {
          cleanup();       //user cancelled dialog
@@ -1377,7 +1477,15 @@ int auth_reply(json_object *json) {
       authenticated = false;
       msg(PLUGIN_NAME": authentication failed.\n");
    }
+   else if (resumed) {
+      //the server has put us back in our project, its join reply follows
+      resuming = false;
+      authenticated = true;
+      msg(PLUGIN_NAME": Successfully resumed session.\n");
+      postCollabMessage("Successfully resumed session.");
+   }
    else {
+      resuming = false;
       authenticated = true;
       msg(PLUGIN_NAME": Successfully authenticated.\n");
       postCollabMessage("Successfully authenticated.");
@@ -1413,6 +1521,11 @@ void sendLastUpdate() {
    msg(PLUGIN_NAME": Requesting all updates greater than %s\n", formatLongLong(last));
    json_object *obj = json_object_new_object();
    append_json_uint64_val(obj, "last_update", last);
+   if (last == 0) {
+      //on a cold join the server may send its materialized project state
+      //as MSG_PROJECT_STATE chunks rather than the entire update history
+      append_json_bool_val(obj, "state", true);
+   }
    send_json(MSG_SEND_UPDATES, obj);
 }
 
@@ -1437,6 +1550,11 @@ void queueUpdate(json_object *obj) {
    queueUpdate(json);
 }
 
+//sink for the offline journal, each call carries one segment of records
+static bool send_journal(const char *buf, size_t len, void * /*user*/) {
+   return send_all(qstring(buf, len)) != 0;
+}
+
 int project_join_reply(json_object *json) {
 #ifdef DEBUG
    msg(PLUGIN_NAME": in PROJECT_JOIN_REPLY\n");
@@ -1459,16 +1577,24 @@ int project_join_reply(json_object *json) {
       msg(PLUGIN_NAME": Successfully joined project.\n");
       postCollabMessage("Successfully joined project.");
       setGpid(gpid, GPID_SIZE);
+      const char *token = string_from_json(json, "resume");
+      if (token != NULL) {
+         resume_token = token;
+         memcpy(resume_gpid, gpid, GPID_SIZE);
+      }
+      else {
+         forgetResumeToken();
+      }
       hookAll();
       fork_pending = false;
       clearPendingUpdates();  //delete all pending updates from previous project
       //need to send a MSG_SEND_UPDATES message
       sendLastUpdate();
-      if (changeCache != NULL) {
-//                  msg("sending change cache of size %d\n", changeCache->size());
-         send_all(*changeCache);
-         changeCache->clear();
-         cnn.delblob(1, COLLABREATE_CACHE_TAG);
+      if (journal != NULL && !journal->empty()) {
+//                  msg("sending offline journal of size %d\n", journal->bytes());
+         if (!journal->replay(send_journal, NULL)) {
+            msg(PLUGIN_NAME": Sending offline changes was interrupted, the rest will be sent on the next join.\n");
+         }
       }
       qfree(gpid);
    }
@@ -1574,6 +1700,76 @@ int set_proj_perms_reply(json_object *json) {
    return 0;
 }
 
+/*
+ * apply one chunk of the server's materialized project state, the whole
+ * chunk is applied with hooks disabled and a single refresh at the end
+ */
+int project_state(json_object *json) {
+   uint64_t updateid;
+   bool last = false;
+   json_object *updates;
+   if (!uint64_from_json(json, "updateid", &updateid) ||
+       !json_object_object_get_ex(json, "updates", &updates)) {
+      return -1;
+   }
+   bool_from_json(json, "last", &last);
+   if (!subscribe) {
+      return 0;
+   }
+   size_t len = json_object_array_length(updates);
+   if (fork_pending) {
+      for (size_t i = 0; i < len; i++) {
+         queueUpdate(json_object_array_get_idx(updates, i));
+      }
+      return 0;
+   }
+   unhookAll();
+   for (size_t i = 0; i < len; i++) {
+      json_object *update = json_object_array_get_idx(updates, i);
+      const char *cmd = string_from_json(update, "type");
+      map<string,CmdHandler>::iterator mi = cmd ? ida_handlers.find(cmd) : ida_handlers.end();
+      if (mi != ida_handlers.end()) {
+         (*mi->second)(update);
+      }
+   }
+   if (last) {
+      //the chunks carry the project state up to updateid, live updates follow
+      setLastUpdate(updateid);
+      msg(PLUGIN_NAME": Received project state up to update %s\n", formatLongLong(updateid));
+   }
+   refresh_idaview_anyway();
+   hookAll();
+   return 0;
+}
+
+int catchup_status(json_object *json) {
+   uint32_t position = 0;
+   uint32_t eta = 0;
+   uint64_t updates = 0;
+   uint32_from_json(json, "position", &position);
+   uint32_from_json(json, "eta", &eta);
+   uint64_from_json(json, "updates", &updates);
+   if (position == 0) {
+      msg(PLUGIN_NAME": Receiving %s missed updates, about %u seconds\n", formatLongLong(updates), eta);
+   }
+   else {
+      msg(PLUGIN_NAME": Waiting to receive missed updates, %u in line, about %u seconds\n", position, eta);
+   }
+   return 0;
+}
+
+int set_filter_reply(json_object *json) {
+   uint32_t ranges = 0;
+   uint32_from_json(json, "ranges", &ranges);
+   if (ranges == 0) {
+      msg(PLUGIN_NAME": Receiving updates for all addresses\n");
+   }
+   else {
+      msg(PLUGIN_NAME": Receiving updates for %u address ranges\n", ranges);
+   }
+   return 0;
+}
+
 int ack_updateid(json_object *json) {
    //msg(PLUGIN_NAME": in ACK_UPDATEID \n");
    uint64_t updateid;
@@ -1581,8 +1777,11 @@ int ack_updateid(json_object *json) {
       return -1;
    }
 #ifdef DEBUG
-   msg(PLUGIN_NAME": got updateid: %s\n", formatLongLong(updateid));
+   uint32_t count = 1;
+   uint32_from_json(json, "count", &count);
+   msg(PLUGIN_NAME": got updateid: %s covering %u updates\n", formatLongLong(updateid), count);
 #endif
+   //a cumulative ack covers all of our updates up to updateid
    setLastUpdate(updateid);
    return 0;
 }
@@ -1606,6 +1805,19 @@ int collab_fatal(json_object *json) {
    return 0;
 }
 
+//the server has handed over to a new process, reconnect and resume our
+//session there, anything recorded meanwhile goes to the offline journal
+int server_restart(json_object *json) {
+   msg(PLUGIN_NAME": Server is restarting, reconnecting.\n");
+   authenticated = false;
+   if (!reconnect()) {
+      warning("Unable to reconnect to the collabREate server after it restarted.\n"
+              "You should reconnect to the server before sending\n"
+              "additional updates.");
+   }
+   return 0;
+}
+
 int collab_ping(json_object *json) {
    uint64_t id;
    if (uint64_from_json(json, "id", &id)) {
@@ -1713,9 +1925,13 @@ void build_handler_map() {
    ctrl_handlers[MSG_GET_PROJ_PERMS_REPLY] = get_proj_perms_reply;
    ctrl_handlers[MSG_SET_PROJ_PERMS_REPLY] = set_proj_perms_reply;
    ctrl_handlers[MSG_ACK_UPDATEID] = ack_updateid;
+   ctrl_handlers[MSG_PROJECT_STATE] = project_state;
+   ctrl_handlers[MSG_CATCHUP_STATUS] = catchup_status;
+   ctrl_handlers[MSG_SET_FILTER_REPLY] = set_filter_reply;
    ctrl_handlers[MSG_ERROR] = collab_error;
    ctrl_handlers[MSG_FATAL] = collab_fatal;
    ctrl_handlers[MSG_PING] = collab_ping;
+   ctrl_handlers[MSG_SERVER_RESTART] = server_restart;
 
    ida_handlers[COMMAND_UNDEFINE] = cmd_undefine;
    ida_handlers[COMMAND_MAKE_CODE] = cmd_make_code;
@@ -65,6 +65,7 @@ using std::map;
 using std::string;
 
 #include "collabreate_ui.h"
+#include "collab_client.h"
 
 bool authenticated = false;
 bool fork_pending = false;
@@ -78,7 +79,34 @@ void unhookAll();
 //where we stash collab specific infoze
 netnode cnn(COLLABREATE_NETNODE, 0, true);
 qstrvec_t msgHistory;
-qstring *changeCache = NULL;
+OfflineJournal *journal = NULL;
+
+//each journal key gets its own run of blob indices in our netnode
+#define JOURNAL_BLOB_STRIDE 0x10000
+
+class NetnodeJournalStore : public JournalStore {
+public:
+   bool load(uint32_t key, string &data) {
+      size_t sz = 0;
+      void *blob = cnn.getblob(NULL, &sz, (nodeidx_t)key * JOURNAL_BLOB_STRIDE, COLLABREATE_JOURNAL_TAG);
+      if (blob == NULL) {
+         return false;
+      }
+      data.assign((char*)blob, sz);
+      qfree(blob);
+      return true;
+   };
+   bool save(uint32_t key, const string &data) {
+      //setblob replaces the blob in place, get rid of any longer old one first
+      remove(key);
+      return data.empty() || cnn.setblob(data.c_str(), data.length(), (nodeidx_t)key * JOURNAL_BLOB_STRIDE, COLLABREATE_JOURNAL_TAG);
+   };
+   void remove(uint32_t key) {
+      cnn.delblob((nodeidx_t)key * JOURNAL_BLOB_STRIDE, COLLABREATE_JOURNAL_TAG);
+   };
+};
+
+static NetnodeJournalStore journalStore;
 
 #ifndef DEBUG
 //#define DEBUG 1
@@ -177,16 +205,26 @@ int idaapi init(void) {
    ssize_t sz = getGpid(gpid, sizeof(gpid));
    if (sz > 0) {
       msg(PLUGIN_NAME": Operating in caching mode until connected.\n");
-      if (changeCache == NULL) {
+      if (journal == NULL) {
+         journal = new OfflineJournal(&journalStore);
+         journal->open();
+         //carry over a change cache saved by an older version of the plugin
          size_t sz = 0;
          void *tcache = cnn.getblob(NULL, &sz, 1, COLLABREATE_CACHE_TAG);
-         if (tcache != NULL && sz > 0) {
-            changeCache = new qstring((char*)tcache);
-         }
-         else {
-            changeCache = new qstring();
+         if (tcache != NULL && sz > 1) {
+            char *sptr = (char*)tcache;
+            char *endp;
+            while ((endp = strchr(sptr, '\n')) != NULL) {
+               journal->append(sptr, endp - sptr + 1);
+               sptr = endp + 1;
+            }
+            journal->sync();
+            cnn.delblob(1, COLLABREATE_CACHE_TAG);
          }
          qfree(tcache);
+         if (!journal->empty()) {
+            msg(PLUGIN_NAME": %u bytes of offline changes waiting to be sent.\n", (uint32_t)journal->bytes());
+         }
          hookAll();
       }
    }
@@ -241,10 +279,10 @@ void idaapi term(void) {
       cnn.setblob(temp.c_str(), temp.length() + 1, 1, COLLABREATE_MSGHISTORY_TAG);
       msgHistory.clear();
    }
-   if (changeCache != NULL && changeCache->length() > 0) {
-      cnn.setblob(changeCache->c_str(), changeCache->length() + 1, 1, COLLABREATE_CACHE_TAG);
-      delete changeCache;
-      changeCache = NULL;
+   if (journal != NULL) {
+      journal->sync();
+      delete journal;
+      journal = NULL;
    }
    unhookAll();
 }
@@ -346,9 +384,28 @@ bool idaapi run(size_t /*arg*/) {
             break;
          }
 #endif
+         case USER_FILTER: {
+#if IDA_SDK_VERSION < 700
+            desc = askstr(HIST_CMT, "", "Address ranges (start-end) or segment names, blank for all");
+            if (desc) {
+               //struct and enum updates carry no address
+               int unaddressed = askyn_c(1, "Also receive struct and enum updates?");
+               sendAddrFilter(desc, unaddressed != 0);
+            }
+#else
+            if (ask_str(&desc, HIST_CMT, "Address ranges (start-end) or segment names, blank for all")) {
+               //struct and enum updates carry no address
+               int unaddressed = ask_yn(ASKBTN_YES, "Also receive struct and enum updates?");
+               sendAddrFilter(desc.c_str(), unaddressed != ASKBTN_NO);
+            }
+#endif
+            break;
+         }
          case USER_DISCONNECT: {
             authenticated = false;
             msg(PLUGIN_NAME": De-activating collabREate\n");
+            //an explicit disconnect asks for the password next time
+            forgetResumeToken();
             cleanup();
             unhookAll();
             msg(PLUGIN_NAME": command   rx   tx\n");
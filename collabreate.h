@@ -37,6 +37,12 @@
 
 #define PROTOCOL_VERSION             4
 
+//optional features a plugin lists in the "caps" of its auth or resume
+//request, the auth reply carries the subset the server will use
+#define CAP_CUMULATIVE_ACK           0x00000001   //one ack_updateid may cover several updates
+#define CAP_JOIN_CATCHUP             0x00000002   //send_updates always follows a join, hold live updates until then
+#define CAP_HANDOVER                 0x00000004   //reconnects and resumes when sent MSG_SERVER_RESTART
+
 #define JSON_NEW_CONST_KEY (JSON_C_OBJECT_ADD_KEY_IS_NEW | JSON_C_OBJECT_KEY_IS_CONSTANT)
 
 #define COMMAND_BYTE_PATCHED         "byte_patched"
@@ -123,6 +129,7 @@
 #define MSG_INITIAL_CHALLENGE        "initial_challenge"
 #define MSG_AUTH_REQUEST             "auth_request"
 #define MSG_AUTH_REPLY               "auth_reply"
+#define MSG_RESUME_REQUEST           "resume_request"
 #define AUTH_REPLY_SUCCESS           1
 #define AUTH_REPLY_FAIL              0
 #define MSG_PROJECT_LIST             "project_list"
@@ -134,6 +141,8 @@
 #define MSG_SEND_UPDATES             "send_updates"
 #define MSG_PROJECT_REJOIN_REQUEST   "project_rejoin_request"
 #define MSG_ACK_UPDATEID             "ack_updateid"
+#define MSG_PROJECT_STATE            "project_state"
+#define MSG_CATCHUP_STATUS           "catchup_status"
 #define MSG_PROJECT_SNAPSHOT_REQUEST "project_snapshot_request"
 #define MSG_PROJECT_SNAPSHOT_REPLY   "project_snapshot_reply"
 #define PROJECT_SNAPSHOT_SUCCESS 1
@@ -150,23 +159,28 @@
 #define MSG_GET_PROJ_PERMS_REPLY     "get_proj_perms_reply"
 #define MSG_SET_PROJ_PERMS           "set_proj_perms"
 #define MSG_SET_PROJ_PERMS_REPLY     "set_proj_perms_reply"
+#define MSG_SET_FILTER               "set_filter"
+#define MSG_SET_FILTER_REPLY         "set_filter_reply"
 
 #define MSG_ERROR                    "collab_error"
 #define MSG_FATAL                    "collab_fatal"
 #define MSG_PING                     "ping"
 #define MSG_PONG                     "pong"
+#define MSG_SERVER_RESTART           "server_restart"
 
 class netnode;
 extern netnode cnn;
 extern qstrvec_t msgHistory;
-extern qstring *changeCache;
+class OfflineJournal;
+extern OfflineJournal *journal;
 
 #define COLLABREATE_NETNODE "$ COLLABREATE NETNODE"
 
 #define COLLABREATE_ENUMS_TAG 'E'
 #define COLLABREATE_STRUCTS_TAG 'T'
 #define COLLABREATE_MSGHISTORY_TAG ((char)0x81)
-#define COLLABREATE_CACHE_TAG ((char)0x82)
+#define COLLABREATE_CACHE_TAG ((char)0x82)   //pre-journal change cache, read once to migrate it
+#define COLLABREATE_JOURNAL_TAG ((char)0x83)
 
 #define GPID_SUPVAL 1
 #define LAST_SERVER_SUPVAL 2
@@ -188,9 +202,10 @@ extern qstring *changeCache;
 #define USER_CHECKPOINT 1
 #define USER_PERMS      2
 #define PROJECT_PERMS   3
-#define USER_DISCONNECT 4
-#define SHOW_NETNODE    5
-#define CLEAN_NETNODE   6
+#define USER_FILTER     4
+#define USER_DISCONNECT 5
+#define SHOW_NETNODE    6
+#define CLEAN_NETNODE   7
 
 extern bool publish;
 extern bool userPublish;
@@ -232,8 +247,10 @@ bool getUserOpts(Options &user);
 
 bool is_connected();
 void cleanup(bool warn = false);
+bool reconnect();
 int send_all(const qstring &s);
-int send_msg(const qstring &s);
+//boundary false lets the message wait for more to be batched with it
+int send_msg(const qstring &s, bool boundary = true);
 
 bool init_network();
 bool term_network();
@@ -259,12 +276,15 @@ bool getFileMd5(unsigned char *md5, int len);
 void do_project_rejoin();
 void sendProjectLeave();
 void do_project_leave();
+void forgetResumeToken();
+bool sendResumeRequest();
 void sendProjectChoice(int project);
 void sendProjectSnapFork(int project, const char *desc);
 void sendProjectGetList();
 void sendNewProjectCreate(const char *description);
 void sendReqPermsChoice();
 void sendProjPermsChoice();
+void sendAddrFilter(const char *spec, bool unaddressed);
 void freeProjectFields();
 void selectProject(int index);
 void sendAuthData(unsigned char *challenge, int challenge_len);
@@ -275,6 +295,10 @@ bool do_choose_perms(json_object *json);
 
 void do_send_user_message(const char *msg);
 
+//updates generated while inside an idb/idp notification are batched,
+//any other message is a boundary that flushes them
+extern int batch_depth;
+
 int send_json(json_object *obj);
 int send_json(const char *type, json_object *obj);
 int send_json(ea_t ea, const char *type, json_object *obj);
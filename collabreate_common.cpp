@@ -40,6 +40,8 @@ bool publish  = true;
 bool userPublish  = true;
 bool subscribe = true;
 
+int batch_depth = 0;
+
 //global pointer to the incoming project list buffer.  Used to fill
 //the project list dialog
 //static Buffer *projectBuffer;
@@ -192,6 +194,7 @@ const char *runCommands[] = {
    "Set checkpoint",
    "Manage requested permissions",
    "Manage project permissions (owner only)",
+   "Limit updates to address ranges",
 #ifdef DEBUG
    "Disconnect from server",
    "Show collab netnode",
@@ -344,7 +347,7 @@ int send_json(json_object *obj) {
    size_t jlen;
    qstring json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
    json += '\n';
-   int res = send_msg(json);
+   int res = send_msg(json, batch_depth == 0);
    json_object_put(obj);   //release the object
    return res;
 }
@@ -54,9 +54,13 @@ CREATE TABLE projects (
    pub BIGINT,
    snapupdateid BIGINT DEFAULT 0, -- replaces entire snapshot table
    protocol INTEGER NOT NULL,     --server protocol used to create this project
+   updateid_hwm BIGINT DEFAULT 0, --updateids up to here have been leased by the server
    PRIMARY KEY (pid)
 );
 
+--to upgrade an existing database:
+--ALTER TABLE projects ADD COLUMN updateid_hwm BIGINT DEFAULT 0;
+
 CREATE TABLE tablename (
     colname integer NOT NULL DEFAULT nextval('projects_pid_seq')
 );
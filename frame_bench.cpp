@@ -0,0 +1,256 @@
+/*
+    collabREate frame_bench.cpp
+    Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+    Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+    This program is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 2 of the License, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+    more details.
+
+    You should have received a copy of the GNU General Public License along with
+    this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+    Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Standalone Linux harness for the plugin's FrameReader. No IDA SDK is
+ * needed. A catch-up stream, exactly as the server writes it to the socket,
+ * is replayed through the reader in fixed size chunks the way recvHandler
+ * receives it. The stream is either read from a file (a capture of the
+ * server's side of a connection) or synthesized: many small updates with
+ * an occasional large project_state chunk. The old recvHandler framing
+ * (append to one buffer, reparse from its start, shift out each object) is
+ * run on the same stream for comparison, and every run must produce the
+ * same objects or the exit status reports a failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <vector>
+#include <string>
+
+#include "collab_client.h"
+
+using namespace std;
+
+//order sensitive digest of the objects a run produced
+struct Digest {
+   uint64_t count;
+   uint64_t hash;
+   Digest() : count(0), hash(1469598103934665603ULL) {};
+   void add(json_object *obj) {
+      json_object *val;
+      int64_t id = 0;
+      if (json_object_object_get_ex(obj, "updateid", &val)) {
+         id = json_object_get_int64(val);
+      }
+      hash = (hash ^ (uint64_t)id ^ json_object_object_length(obj)) * 1099511628211ULL;
+      count++;
+      json_object_put(obj);
+   }
+   bool operator==(const Digest &d) const {return count == d.count && hash == d.hash;};
+};
+
+//the pre-existing recvHandler framing, kept here only for comparison
+static bool legacy_replay(const string &stream, size_t chunk, Digest &d) {
+   string b;
+   json_tokener *tok = json_tokener_new();
+   bool ok = true;
+   for (size_t off = 0; off < stream.length() && ok; off += chunk) {
+      size_t len = stream.length() - off < chunk ? stream.length() - off : chunk;
+      b.append(stream, off, len);
+      while (1) {
+         json_object *jobj = json_tokener_parse_ex(tok, b.c_str(), (int)b.length());
+         enum json_tokener_error jerr = json_tokener_get_error(tok);
+         if (jerr == json_tokener_continue) {
+            break;
+         }
+         else if (jerr != json_tokener_success) {
+            ok = false;
+            break;
+         }
+         else if (jobj != NULL) {
+            if ((size_t)tok->char_offset < b.length()) {
+               b.erase(0, tok->char_offset);
+            }
+            else {
+               b.clear();
+            }
+            d.add(jobj);
+         }
+      }
+      json_tokener_reset(tok);
+   }
+   json_tokener_free(tok);
+   return ok;
+}
+
+static bool reader_replay(const string &stream, size_t chunk, Digest &d) {
+   FrameReader reader;
+   vector<char> buf(chunk);
+   for (size_t off = 0; off < stream.length(); off += chunk) {
+      size_t len = stream.length() - off < chunk ? stream.length() - off : chunk;
+      //copy into a receive buffer, as recv would
+      memcpy(&buf[0], stream.data() + off, len);
+      reader.feed(&buf[0], len);
+      json_object *obj;
+      int res;
+      while ((res = reader.next(&obj)) == FRAME_OBJECT) {
+         d.add(obj);
+      }
+      if (res == FRAME_ERROR) {
+         return false;
+      }
+   }
+   return true;
+}
+
+//small updates, with a project_state message of state_kb every state_every updates
+static void synthesize(string &stream, uint32_t count, uint32_t state_every, uint32_t state_kb) {
+   char line[256];
+   uint64_t id = 1;
+   for (uint32_t i = 0; i < count; i++) {
+      snprintf(line, sizeof(line), "{\"type\":\"renamed\",\"addr\":%u,\"name\":\"sub_%x\","
+               "\"local\":false,\"updateid\":%llu,\"user\":\"bench\"}", 0x401000 + i * 16,
+               0x401000 + i * 16, (unsigned long long)id++);
+      stream += line;
+      if (state_every && (i % state_every) == state_every - 1) {
+         string state = "{\"type\":\"project_state\",\"seq\":0,\"last\":false,\"updateid\":";
+         snprintf(line, sizeof(line), "%llu,\"updates\":[", (unsigned long long)id++);
+         state += line;
+         for (uint32_t n = 0; state.length() < state_kb * 1024; n++) {
+            snprintf(line, sizeof(line), "%s{\"type\":\"cmt_changed\",\"addr\":%u,\"rep\":false,"
+                     "\"cmt\":\"state comment %u\",\"updateid\":%u}", n ? "," : "", 0x500000 + n, n, n + 1);
+            state += line;
+         }
+         state += "]}";
+         stream += state;
+      }
+   }
+}
+
+static bool run(const char *name, bool legacy, const string &stream, size_t chunk, Digest &d) {
+   uint64_t start = monotonic_ms();
+   bool ok = legacy ? legacy_replay(stream, chunk, d) : reader_replay(stream, chunk, d);
+   uint64_t elapsed = monotonic_ms() - start;
+   if (elapsed == 0) {
+      elapsed = 1;
+   }
+   printf("%-8s chunk %-7u objects %-8llu %8llu ms %10.1f MB/s %12.0f objects/s%s\n",
+          name, (uint32_t)chunk, (unsigned long long)d.count, (unsigned long long)elapsed,
+          stream.length() / 1048576.0 * 1000.0 / elapsed, d.count * 1000.0 / elapsed,
+          ok ? "" : "  PARSE ERROR");
+   return ok;
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options]\n", prog);
+   fprintf(stderr, "   -f file      replay a captured server stream instead of a synthetic one\n");
+   fprintf(stderr, "   -w file      save the synthetic stream for later replay\n");
+   fprintf(stderr, "   -n count     synthetic small updates (default 200000)\n");
+   fprintf(stderr, "   -s count     small updates between project_state messages (default 20000, 0 for none)\n");
+   fprintf(stderr, "   -k kb        size of each project_state message (default 256)\n");
+   fprintf(stderr, "   -c bytes     chunk size to replay with, may be repeated\n");
+   fprintf(stderr, "                (default 2048 and %u)\n", FRAME_CHUNK_SIZE);
+   fprintf(stderr, "   -l           skip the legacy framing runs\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   const char *in = NULL;
+   const char *out = NULL;
+   uint32_t count = 200000;
+   uint32_t state_every = 20000;
+   uint32_t state_kb = 256;
+   bool legacy = true;
+   vector<size_t> chunks;
+   int opt;
+   while ((opt = getopt(argc, argv, "f:w:n:s:k:c:lh")) != -1) {
+      switch (opt) {
+         case 'f':
+            in = optarg;
+            break;
+         case 'w':
+            out = optarg;
+            break;
+         case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+         case 's':
+            state_every = strtoul(optarg, NULL, 0);
+            break;
+         case 'k':
+            state_kb = strtoul(optarg, NULL, 0);
+            break;
+         case 'c':
+            chunks.push_back(strtoul(optarg, NULL, 0));
+            break;
+         case 'l':
+            legacy = false;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (chunks.empty()) {
+      chunks.push_back(2048);
+      chunks.push_back(FRAME_CHUNK_SIZE);
+   }
+   string stream;
+   if (in) {
+      FILE *f = fopen(in, "rb");
+      if (f == NULL) {
+         perror(in);
+         return 1;
+      }
+      char buf[65536];
+      size_t len;
+      while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+         stream.append(buf, len);
+      }
+      fclose(f);
+   }
+   else {
+      synthesize(stream, count, state_every, state_kb);
+      if (out) {
+         FILE *f = fopen(out, "wb");
+         if (f == NULL || fwrite(stream.data(), 1, stream.length(), f) != stream.length()) {
+            perror(out);
+            return 1;
+         }
+         fclose(f);
+      }
+   }
+   printf("stream   %.1f MB\n", stream.length() / 1048576.0);
+
+   bool ok = true;
+   Digest first;
+   bool have_first = false;
+   for (size_t i = 0; i < chunks.size(); i++) {
+      if (chunks[i] == 0) {
+         continue;
+      }
+      for (int l = legacy ? 1 : 0; l >= 0; l--) {
+         Digest d;
+         ok = run(l ? "legacy" : "reader", l != 0, stream, chunks[i], d) && ok;
+         if (!have_first) {
+            first = d;
+            have_first = true;
+         }
+         else if (!(d == first)) {
+            printf("         objects differ from the first run\n");
+            ok = false;
+         }
+      }
+   }
+   return ok ? 0 : 1;
+}
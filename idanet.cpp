@@ -40,6 +40,7 @@
 
 #include "collabreate.h"
 #include "idanet.h"
+#include "collab_client.h"
 
 //array to track send and receive stats for all of the collabreate commands
 extern int stats[2][MSG_IDA_MAX + 1];
@@ -59,18 +60,21 @@ extern int stats[2][MSG_IDA_MAX + 1];
 #endif
 
 struct disp_request_t : public exec_request_t {
-   disp_request_t(Dispatcher disp) : _disp(disp) {mtx = qmutex_create();};
+   disp_request_t(Dispatcher disp) : _disp(disp) {};
    ~disp_request_t();
    virtual int idaapi execute(void);
 
    //disp_requst_t takes ownership of the buffer
    //it will be deleted eventually in execute
-   void queueObject(json_object *obj);
+   //returns true if dispatch must be called to get it applied
+   bool queueObject(json_object *obj);
+   //apply everything queued so far on the IDA thread
+   void dispatch(void);
 
    void flush(void);
 
-   qvector<json_object*> objects;
-   qmutex_t mtx;
+   DispatchQueue queue;
+   std::vector<json_object*> batch;   //only touched by execute
    Dispatcher _disp;
 };
 
@@ -81,9 +85,13 @@ public:
    bool connect(const char *host, short port);
    bool close();
    void cleanup(bool warn = false);
+   ~CollabSocket();
    bool sendAll(const qstring &s);
-   bool sendMsg(const qstring &s);
+   bool sendMsg(const qstring &s, bool boundary);
    int recv(unsigned char *buf, unsigned int len);
+   const qstring &getHost() {return host;};
+   short getPort() {return port;};
+   Dispatcher getDispatcher() {return _disp;};
 private:
 #ifdef _WIN32
    HANDLE thread;
@@ -92,10 +100,12 @@ private:
    pthread_t thread;
    static void *recvHandler(void *sock);
 #endif
+   static bool sendBatch(const char *buf, size_t len, void *sock);
    qstring host;
    short port;
    Dispatcher _disp;
    disp_request_t *drt;
+   BatchWriter *writer;
    _SOCKET conn;
    bool connected;
    static bool initNetwork();
@@ -182,27 +192,18 @@ bool connect_to(const char *host, short port, _SOCKET *sock) {
 
 disp_request_t::~disp_request_t() {
    flush();
-   qmutex_free(mtx);
 };
 
-//this is the callback that gets called by execute_sync, in theory new datagrams
-//can arrive and be processed during the loop since queue synchronization takes
-//place within the StringList
+//this is the callback that gets called by execute_sync. Each pass takes
+//everything received so far in one swap, datagrams that arrive while a
+//batch is being dispatched are picked up by the next pass
 int idaapi disp_request_t::execute(void) {
-   while (objects.size() > 0) {
-      qmutex_lock(mtx);
-      qvector<json_object*>::iterator i = objects.begin();
-      json_object *obj = *i;
-      objects.erase(i);
-      qmutex_unlock(mtx);
-      bool res = (*_disp)(obj);
-      if (!res) {  //not sure we really care what is returned here
-//         msg(PLUGIN_NAME": connection to server severed at dispatch.\n");
-//         comm->cleanup(true);     //probably not the right thing to do??
-//         break;
-      }
-      else {
-         //msg(PLUGIN_NAME": dispatch routine called successfully.\n");
+   while (queue.take(batch)) {
+      for (std::vector<json_object*>::iterator i = batch.begin(); i != batch.end(); i++) {
+         bool res = (*_disp)(*i);
+         if (!res) {  //not sure we really care what is returned here
+//            msg(PLUGIN_NAME": connection to server severed at dispatch.\n");
+         }
       }
    }
    return 0;
@@ -210,28 +211,18 @@ int idaapi disp_request_t::execute(void) {
 
 //queue up a received datagram for eventual handlng via IDA's execute_sync mechanism
 //call no sdk functions other than execute_sync
-void disp_request_t::queueObject(json_object *obj) {
-   bool call_exec = false;
-   qmutex_lock(mtx);
-   objects.push_back(obj);
-   call_exec = objects.size() == 1;
-   qmutex_unlock(mtx);
-
-   if (call_exec) {
-      //only invoke execute_sync if the buffer just added was at the head of the queue
-      //in theory this allows multiple datagrams to get queued for handling
-      //in a single execute_sync callback
-      execute_sync(*this, MFF_WRITE);
-   }
+bool disp_request_t::queueObject(json_object *obj) {
+   //true only for the first datagram queued since the last drain, anything
+   //queued after it rides along in the same batch
+   return queue.push(obj);
+}
+
+void disp_request_t::dispatch() {
+   execute_sync(*this, MFF_WRITE);
 }
 
 void disp_request_t::flush() {
-   qmutex_lock(mtx);
-   for (qvector<json_object*>::iterator i = objects.begin(); i != objects.end(); i++) {
-      json_object_put(*i);
-   }
-   objects.clear();
-   qmutex_unlock(mtx);
+   queue.flush();
 }
 
 bool connect_to(const char *host, short port, Dispatcher disp) {
@@ -263,6 +254,9 @@ void CollabSocket::cleanup(bool warn) {
    //cancel all notifications. if we don't do this ida will crash on exit.
    msg(PLUGIN_NAME": cleanup called.\n");
    if (connected) {
+      //push out anything still waiting in the writer before closing
+      writer->stop();
+      writer->flush();
       int res = ::closesocket(conn);
       msg("closesocket returned %d\n", res);
       connected = false;
@@ -316,6 +310,18 @@ void cleanup(bool warn) {
    }
 }
 
+//drop the current connection and connect to the same server again
+bool reconnect() {
+   if (comm == NULL) {
+      return false;
+   }
+   qstring host = comm->getHost();
+   short port = comm->getPort();
+   Dispatcher disp = comm->getDispatcher();
+   cleanup();
+   return connect_to(host.c_str(), port, disp);
+}
+
 //connect to a remote host as specified by host and port
 //host may be wither an ip address or a host name
 bool CollabSocket::connect(const char *host, short port) {
@@ -336,6 +342,7 @@ bool CollabSocket::connect(const char *host, short port) {
       }
       else {
          connected = true;
+         writer->start();
       }
    }
    else {
@@ -344,33 +351,33 @@ bool CollabSocket::connect(const char *host, short port) {
    return connected;
 }
 
-bool CollabSocket::sendAll(const qstring &s) {
-   qstring buf = s;
-   while (true) {
-//      msg("sending new buffer\n");
-      int len = ::send(conn, buf.c_str(), (int)buf.length(), 0);
-      if (len == (int)buf.length()) {
-         break;
-      }
-      if (len == SOCKET_ERROR) {
-#ifdef _WIN32
-         int sockerr = WSAGetLastError();
-#else
-         int sockerr = errno;
-#endif
-         cleanup();
-         msg(PLUGIN_NAME": Failed to send requested data. %d != %d. Error: 0x%x(%d)\n", len, buf.length(), sockerr, sockerr);
-         return false;
-      }
-      else if (len != (int)buf.length()) {
-         //shift the remainder and try again
-         buf = buf.c_str() + len;
-         //msg(PLUGIN_NAME": Short send. %d != %d.", len, out.size());
-      }
+//BatchWriter sink, called with the writer lock held from either the
+//sending thread or the writer's timer thread. Errors are reported back
+//through the writer, cleanup happens on the next send
+bool CollabSocket::sendBatch(const char *buf, size_t len, void *_sock) {
+   CollabSocket *sock = (CollabSocket*)_sock;
+   int sockerr = 0;
+   if (!send_fully(sock->conn, buf, len, &sockerr)) {
+      msg(PLUGIN_NAME": Failed to send requested data. Error: 0x%x(%d)\n", sockerr, sockerr);
+      return false;
    }
    return true;
 }
 
+//queue a message for sending, boundary pushes it out along with
+//anything queued ahead of it
+bool CollabSocket::sendMsg(const qstring &s, bool boundary) {
+   if (!writer->write(s.c_str(), s.length(), boundary)) {
+      cleanup();
+      return false;
+   }
+   return true;
+}
+
+bool CollabSocket::sendAll(const qstring &s) {
+   return sendMsg(s, true);
+}
+
 CollabSocket::CollabSocket(Dispatcher disp) {
    _disp = disp;
    thread = 0;
@@ -378,6 +385,11 @@ CollabSocket::CollabSocket(Dispatcher disp) {
    conn = (_SOCKET)INVALID_SOCKET;
    connected = false;
    drt = new disp_request_t(_disp);
+   writer = new BatchWriter(sendBatch, this);
+}
+
+CollabSocket::~CollabSocket() {
+   delete writer;
 }
 
 bool CollabSocket::close() {
@@ -397,13 +409,14 @@ DWORD WINAPI CollabSocket::recvHandler(void *_sock) {
 #else
 void *CollabSocket::recvHandler(void *_sock) {
 #endif
-   static qstring b;
-   unsigned char buf[2048];  //read a large chunk, we'll be notified if there is more
+   //read a large chunk, we'll be notified if there is more
+   unsigned char *buf = new unsigned char[FRAME_CHUNK_SIZE];
    CollabSocket *sock = (CollabSocket*)_sock;
-   json_tokener *tok = json_tokener_new();
+   FrameReader reader;   //per connection, nothing carries over from a previous one
+   bool pending = false;
 
    while (sock->isConnected()) {
-      int len = sock->recv(buf, sizeof(buf) - 1);
+      int len = sock->recv(buf, FRAME_CHUNK_SIZE);
       if (len == 0) {
          //end of file
          break;
@@ -428,43 +441,26 @@ void *CollabSocket::recvHandler(void *_sock) {
       }
       if (sock->_disp) {
          json_object *jobj = NULL;
-         enum json_tokener_error jerr;
-         buf[len] = 0;
-         b.append((char*)buf, len);   //append new data into static buffer
-
-         while (1) {
-            jobj = json_tokener_parse_ex(tok, b.c_str(), (int)b.length());
-            jerr = json_tokener_get_error(tok);
-            if (jerr == json_tokener_continue) {
-               //json object is syntactically correct, but incomplete
-//               msg("json_tokener_continue for %s\n", b.c_str());
-               break;
-            }
-            else if (jerr != json_tokener_success) {
-               //need to reconnect socket and in the meantime start caching event locally
-//               msg("jerr != json_tokener_success for %s\n", b.c_str());
-               //need to break out of both loops
-               goto end_loop;
-            }
-            else if (jobj != NULL) {
-               //we extracted a json object from the front of the string
-               //queue it and trim the string
-//               msg("json_tokener_success for %s\n", b.c_str());
-               if (tok->char_offset < b.length()) {
-                  //shift any remaining portions of the buffer to the front
-                  b.remove(0, tok->char_offset); 
-               }
-               else {
-                  b.clear();
-               }
-               sock->drt->queueObject(jobj);
-            }
+         int res;
+         reader.feed((const char*)buf, len);
+         while ((res = reader.next(&jobj)) == FRAME_OBJECT) {
+            pending = sock->drt->queueObject(jobj) || pending;
+         }
+         if (res == FRAME_ERROR) {
+            //need to reconnect socket and in the meantime start caching event locally
+            break;
+         }
+         //hand over everything parsed from this chunk in one execute_sync
+         if (pending) {
+            sock->drt->dispatch();
+            pending = false;
          }
-         json_tokener_reset(tok);
       }
    }
-end_loop:
-   json_tokener_free(tok);
+   if (pending) {
+      sock->drt->dispatch();
+   }
+   delete [] buf;
    sock->cleanup();
    return 0;
 }
@@ -476,15 +472,19 @@ int send_all(const qstring &s) {
    return 0;
 }
 
-int send_msg(const qstring &s) {
+int send_msg(const qstring &s, bool boundary) {
    if (comm) {
-      return comm->sendAll(s);
+      return comm->sendMsg(s, boundary);
    }
    else {
-      if (changeCache != NULL) {
-//         msg("writing to change cache\n");
-         *changeCache += s;
-         return (int)s.length();
+      if (journal != NULL) {
+//         msg("writing to offline journal\n");
+         if (journal->append(s.c_str(), s.length())) {
+            return (int)s.length();
+         }
+         if (journal->dropped == 1) {
+            msg(PLUGIN_NAME": Offline journal is full, further changes will not be sent to the server.\n");
+         }
       }
    }
    return 0;
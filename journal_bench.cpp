@@ -0,0 +1,228 @@
+/*
+    collabREate journal_bench.cpp
+    Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+    Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+    This program is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 2 of the License, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+    more details.
+
+    You should have received a copy of the GNU General Public License along with
+    this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+    Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Standalone Linux harness for the plugin's OfflineJournal, using the file
+ * backed store in a scratch directory in place of the netnode. No IDA SDK is
+ * needed. An offline session of renames and comments (many of them to the
+ * same items), code creation and a segment move is journaled, the journal
+ * is reopened as if IDA had been restarted, a replay is interrupted part way
+ * through and a second replay finishes the job. What the sink received must
+ * be exactly the records that survive coalescing, in order, with nothing
+ * sent twice. A small journal is then filled to check it refuses updates
+ * once coalescing can't make room. The exit status reports the result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <vector>
+#include <string>
+#include <set>
+
+#include "collab_client.h"
+
+using namespace std;
+
+struct Record {
+   string json;
+   string key;      //empty if the record is never coalesced
+   bool barrier;
+};
+
+//an offline session over items distinct items with a segment move halfway
+static void make_session(vector<Record> &recs, uint32_t count, uint32_t items) {
+   char line[256];
+   srand(1);
+   for (uint32_t i = 0; i < count; i++) {
+      Record r;
+      r.barrier = false;
+      uint32_t addr = 0x401000 + (rand() % items) * 16;
+      int kind = rand() % 10;
+      if (i == count / 2) {
+         snprintf(line, sizeof(line), "{\"type\":\"segm_moved\",\"from\":4198400,\"to\":8392704,"
+                  "\"size\":4096,\"seq\":%u,\"user\":\"bench\"}\n", i);
+         r.barrier = true;
+      }
+      else if (kind < 6) {
+         snprintf(line, sizeof(line), "{\"type\":\"renamed\",\"addr\":%u,\"name\":\"sub_%x_%u\","
+                  "\"local\":false,\"seq\":%u,\"user\":\"bench\"}\n", addr, addr, i, i);
+         snprintf(line + 200, 56, "renamed:%u", addr);
+         r.key = line + 200;
+      }
+      else if (kind < 9) {
+         snprintf(line, sizeof(line), "{\"type\":\"cmt_changed\",\"addr\":%u,\"rep\":%s,"
+                  "\"cmt\":\"comment %u\",\"seq\":%u,\"user\":\"bench\"}\n", addr,
+                  (kind & 1) ? "true" : "false", i, i);
+         snprintf(line + 200, 56, "cmt:%u:%d", addr, kind & 1);
+         r.key = line + 200;
+      }
+      else {
+         snprintf(line, sizeof(line), "{\"type\":\"make_code\",\"addr\":%u,\"len\":4,\"seq\":%u,"
+                  "\"user\":\"bench\"}\n", addr, i);
+      }
+      r.json = line;
+      recs.push_back(r);
+   }
+}
+
+//what should survive: the last record for each key between barriers
+static string expected(const vector<Record> &recs) {
+   vector<bool> keep(recs.size(), true);
+   set<string> seen;
+   for (size_t i = recs.size(); i-- > 0; ) {
+      if (recs[i].barrier) {
+         seen.clear();
+      }
+      else if (!recs[i].key.empty() && !seen.insert(recs[i].key).second) {
+         keep[i] = false;
+      }
+   }
+   string out;
+   for (size_t i = 0; i < recs.size(); i++) {
+      if (keep[i]) {
+         out += recs[i].json;
+      }
+   }
+   return out;
+}
+
+struct Sink {
+   string received;
+   uint32_t calls;
+   uint32_t fail_at;   //fail this call, 0 never fails
+};
+
+static bool collect(const char *buf, size_t len, void *user) {
+   Sink *s = (Sink*)user;
+   if (++s->calls == s->fail_at) {
+      return false;
+   }
+   s->received.append(buf, len);
+   return true;
+}
+
+static bool check(bool cond, const char *what) {
+   printf("%-52s %s\n", what, cond ? "ok" : "FAILED");
+   return cond;
+}
+
+int main(int argc, char **argv) {
+   uint32_t count = 200000;
+   uint32_t items = 5000;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:i:h")) != -1) {
+      switch (opt) {
+         case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+         case 'i':
+            items = strtoul(optarg, NULL, 0);
+            break;
+         default:
+            fprintf(stderr, "usage: %s [-n updates (default 200000)] [-i distinct items (default 5000)]\n", argv[0]);
+            return 1;
+      }
+   }
+   if (items == 0) {
+      items = 1;
+   }
+   char dir[] = "/tmp/journal_benchXXXXXX";
+   if (mkdtemp(dir) == NULL) {
+      perror("mkdtemp");
+      return 1;
+   }
+   vector<Record> recs;
+   make_session(recs, count, items);
+   string want = expected(recs);
+   uint64_t raw = 0;
+   for (size_t i = 0; i < recs.size(); i++) {
+      raw += recs[i].json.length();
+   }
+
+   bool ok = true;
+   FileJournalStore store(dir);
+   OfflineJournal *j = new OfflineJournal(&store);
+   j->open();
+   uint64_t start = monotonic_ms();
+   for (size_t i = 0; i < recs.size(); i++) {
+      j->append(recs[i].json.c_str(), recs[i].json.length());
+   }
+   j->sync();
+   uint64_t append_ms = monotonic_ms() - start;
+   printf("append   %u updates, %.1f MB in %llu ms\n", count, raw / 1048576.0, (unsigned long long)append_ms);
+   ok = check(j->bytes() == raw, "journal holds every appended byte") && ok;
+   delete j;
+
+   //as if IDA was restarted before reconnecting
+   j = new OfflineJournal(&store);
+   j->open();
+   ok = check(j->bytes() == raw, "reopened journal holds every byte") && ok;
+
+   Sink sink;
+   sink.calls = 0;
+   sink.fail_at = 3;
+   start = monotonic_ms();
+   bool res = j->replay(collect, &sink);
+   uint64_t first_ms = monotonic_ms() - start;
+   ok = check(!res, "interrupted replay reports failure") && ok;
+   printf("replay   interrupted after %u segments (%llu ms, %llu records coalesced)\n",
+          sink.calls - 1, (unsigned long long)first_ms, (unsigned long long)j->coalesced);
+   delete j;
+
+   j = new OfflineJournal(&store);
+   j->open();
+   sink.fail_at = 0;
+   start = monotonic_ms();
+   res = j->replay(collect, &sink);
+   uint64_t second_ms = monotonic_ms() - start;
+   ok = check(res, "resumed replay completes") && ok;
+   printf("replay   resumed in %llu ms, %.1f MB of %.1f MB sent\n", (unsigned long long)second_ms,
+          sink.received.length() / 1048576.0, raw / 1048576.0);
+   ok = check(sink.received == want, "sent exactly the surviving records, in order") && ok;
+   ok = check(j->empty(), "journal is empty after replay") && ok;
+   delete j;
+
+   //bounded: unique items can't be coalesced away, repeats can
+   OfflineJournal small(&store, 64 * 1024, 4096);
+   small.open();
+   char line[128];
+   uint32_t accepted = 0;
+   for (uint32_t i = 0; i < 5000; i++) {
+      snprintf(line, sizeof(line), "{\"type\":\"renamed\",\"addr\":%u,\"name\":\"n%u\",\"seq\":%u}\n", i, i, i);
+      accepted += small.append(line, strlen(line));
+   }
+   ok = check(small.bytes() <= 64 * 1024 && small.dropped > 0 && accepted < 5000,
+              "full journal refuses updates it can't coalesce") && ok;
+   small.clear();
+   accepted = 0;
+   for (uint32_t i = 0; i < 5000; i++) {
+      snprintf(line, sizeof(line), "{\"type\":\"renamed\",\"addr\":%u,\"name\":\"n%u\",\"seq\":%u}\n", i % 16, i, i);
+      accepted += small.append(line, strlen(line));
+   }
+   ok = check(accepted == 5000 && small.coalesced > 0, "coalescing makes room for repeated renames") && ok;
+   small.clear();
+
+   rmdir(dir);
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/*
+    collabREate queue_bench.cpp
+    Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+    Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+    This program is free software; you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 2 of the License, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+    more details.
+
+    You should have received a copy of the GNU General Public License along with
+    this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+    Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Standalone Linux harness for the plugin's inbound DispatchQueue. No IDA SDK
+ * is needed. A receive thread queues numbered json objects and, like
+ * recvHandler, makes a blocking execute_sync style hand off to a separate
+ * "UI" thread that applies them. The old disp_request_t behaviour (erase
+ * from the front of a vector under the lock for every object, hand off
+ * whenever the queue goes from empty to one) is run alongside for
+ * comparison. Every run checks that each object arrives exactly once and in
+ * order and the exit status reflects the result.
+ *
+ * stream   objects arrive in chunks, one hand off per chunk at most
+ * backlog  all objects are queued before the UI thread gets to run
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <vector>
+
+#include "collab_client.h"
+
+using namespace std;
+
+//the pre-existing queue, kept here only for comparison
+struct LegacyQueue {
+   vector<json_object*> objects;
+   ClientMutex mtx;
+
+   bool push(json_object *obj) {
+      mtx.lock();
+      objects.push_back(obj);
+      bool call_exec = objects.size() == 1;
+      mtx.unlock();
+      return call_exec;
+   }
+};
+
+struct Harness {
+   bool legacy;
+   LegacyQueue old_queue;
+   DispatchQueue queue;
+   vector<json_object*> batch;
+
+   sem_t run;        //posted to ask the UI thread to execute
+   sem_t done;       //posted by the UI thread when execute returns
+   volatile bool quit;
+
+   int64_t expect;   //next sequence number the UI thread should see
+   uint64_t errors;
+   uint64_t executes;
+
+   Harness(bool l) : legacy(l), quit(false), expect(0), errors(0), executes(0) {
+      sem_init(&run, 0, 0);
+      sem_init(&done, 0, 0);
+   };
+   ~Harness() {
+      sem_destroy(&run);
+      sem_destroy(&done);
+   };
+
+   void apply(json_object *obj) {
+      if (json_object_get_int64(obj) != expect) {
+         errors++;
+      }
+      expect = json_object_get_int64(obj) + 1;
+      json_object_put(obj);
+   }
+
+   //disp_request_t::execute, old and new
+   void execute() {
+      executes++;
+      if (legacy) {
+         while (old_queue.objects.size() > 0) {
+            old_queue.mtx.lock();
+            vector<json_object*>::iterator i = old_queue.objects.begin();
+            json_object *obj = *i;
+            old_queue.objects.erase(i);
+            old_queue.mtx.unlock();
+            apply(obj);
+         }
+      }
+      else {
+         while (queue.take(batch)) {
+            for (vector<json_object*>::iterator i = batch.begin(); i != batch.end(); i++) {
+               apply(*i);
+            }
+         }
+      }
+   }
+
+   //blocking hand off, the way execute_sync(MFF_WRITE) behaves
+   void execute_sync() {
+      sem_post(&run);
+      sem_wait(&done);
+   }
+};
+
+static void *ui_thread(void *arg) {
+   Harness *h = (Harness*)arg;
+   while (true) {
+      sem_wait(&h->run);
+      if (h->quit) {
+         break;
+      }
+      h->execute();
+      sem_post(&h->done);
+   }
+   return NULL;
+}
+
+//queue count objects, chunk at a time, handing off after each chunk
+//a chunk of 0 queues everything before the first hand off
+static bool run(bool legacy, bool backlog, uint32_t count, uint32_t chunk) {
+   Harness h(legacy);
+   vector<json_object*> objs;
+   objs.reserve(count);
+   for (uint32_t i = 0; i < count; i++) {
+      objs.push_back(json_object_new_int64(i));
+   }
+   pthread_t tid;
+   pthread_create(&tid, NULL, ui_thread, &h);
+
+   uint64_t start = monotonic_ms();
+   bool pending = false;
+   for (uint32_t i = 0; i < count; i++) {
+      if (legacy) {
+         //the old code handed off inside queueObject for every
+         //object that found the queue empty
+         if (h.old_queue.push(objs[i]) && !backlog) {
+            h.execute_sync();
+         }
+         else if (backlog) {
+            pending = true;
+         }
+      }
+      else {
+         pending = h.queue.push(objs[i]) || pending;
+         if (pending && !backlog && ((i + 1) % chunk) == 0) {
+            h.execute_sync();
+            pending = false;
+         }
+      }
+   }
+   if (pending) {
+      h.execute_sync();
+   }
+   uint64_t elapsed = monotonic_ms() - start;
+   if (elapsed == 0) {
+      elapsed = 1;
+   }
+   h.quit = true;
+   sem_post(&h.run);
+   pthread_join(tid, NULL);
+
+   bool ok = h.errors == 0 && h.expect == (int64_t)count;
+   printf("%-7s %-8s objects %-8u executes %-8llu %8llu ms %12.0f objects/s%s\n",
+          backlog ? "backlog" : "stream", legacy ? "legacy" : "batched", count,
+          (unsigned long long)h.executes, (unsigned long long)elapsed,
+          count * 1000.0 / elapsed, ok ? "" : "  ORDER/LOSS ERROR");
+   return ok;
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options]\n", prog);
+   fprintf(stderr, "   -n count     objects per stream run (default 200000)\n");
+   fprintf(stderr, "   -b count     objects per backlog run (default 50000)\n");
+   fprintf(stderr, "   -c count     objects per received chunk in stream runs (default 16)\n");
+   fprintf(stderr, "   -l           skip the legacy queue runs\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   uint32_t count = 200000;
+   uint32_t backlog = 50000;
+   uint32_t chunk = 16;
+   bool legacy = true;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:b:c:lh")) != -1) {
+      switch (opt) {
+         case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+         case 'b':
+            backlog = strtoul(optarg, NULL, 0);
+            break;
+         case 'c':
+            chunk = strtoul(optarg, NULL, 0);
+            break;
+         case 'l':
+            legacy = false;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (chunk == 0) {
+      chunk = 1;
+   }
+   bool ok = true;
+   if (legacy) {
+      ok = run(true, false, count, chunk) && ok;
+   }
+   ok = run(false, false, count, chunk) && ok;
+   if (backlog) {
+      if (legacy) {
+         ok = run(true, true, backlog, chunk) && ok;
+      }
+      ok = run(false, true, backlog, chunk) && ok;
+   }
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+/*
+   collabREate addrfilter.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include "utils.h"
+#include "addrfilter.h"
+
+/*
+ * fields that hold the address an update applies to, in order of preference
+ */
+static const char *addr_fields[] = {
+   "addr", "from", "startea", "funcea", "func_addr", "ownerea", "old_start", NULL
+};
+
+AddrFilter::AddrFilter() {
+   unaddressed = true;
+}
+
+void AddrFilter::add(uint64_t start, uint64_t end) {
+   if (end <= start) {
+      return;
+   }
+   //absorb any range that overlaps or abuts the new one
+   map<uint64_t,uint64_t>::iterator i = index.upper_bound(start);
+   if (i != index.begin()) {
+      map<uint64_t,uint64_t>::iterator prev = i;
+      prev--;
+      if (prev->second >= start) {
+         i = prev;
+      }
+   }
+   while (i != index.end() && i->first <= end) {
+      if (i->first < start) {
+         start = i->first;
+      }
+      if (i->second > end) {
+         end = i->second;
+      }
+      index.erase(i++);
+   }
+   index[start] = end;
+}
+
+void AddrFilter::clear() {
+   index.clear();
+   unaddressed = true;
+}
+
+bool AddrFilter::accepts(bool hasAddr, uint64_t ea) const {
+   if (index.empty()) {
+      return true;
+   }
+   if (!hasAddr) {
+      return unaddressed;
+   }
+   map<uint64_t,uint64_t>::const_iterator i = index.upper_bound(ea);
+   if (i == index.begin()) {
+      return false;
+   }
+   i--;
+   return ea < i->second;
+}
+
+bool AddrFilter::address(json_object *update, uint64_t *ea) {
+   for (int i = 0; addr_fields[i]; i++) {
+      if (uint64_from_json(update, addr_fields[i], ea)) {
+         return true;
+      }
+   }
+   return false;
+}
@@ -0,0 +1,81 @@
+/*
+   collabREate addrfilter.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef __ADDRFILTER_H
+#define __ADDRFILTER_H
+
+#include <map>
+#include <stdint.h>
+#include <json-c/json.h>
+
+using namespace std;
+
+/**
+ * AddrFilter
+ * An optional per client subscription filter on update addresses. Ranges
+ * are merged as they are added and kept in an interval index keyed on
+ * range start, so checking an address is a single ordered lookup however
+ * many ranges a client asks for. Updates that carry no address (struct and
+ * enum changes for example) are governed by a separate rule. A filter with
+ * no ranges accepts everything.
+ */
+
+class AddrFilter {
+public:
+   AddrFilter();
+
+   /**
+    * add adds the half open range [start, end) to the filter
+    */
+   void add(uint64_t start, uint64_t end);
+
+   /**
+    * clear removes all ranges, the filter then accepts everything
+    */
+   void clear();
+
+   /**
+    * accepts checks an update against the filter
+    * @param hasAddr true if the update carries an address
+    * @param ea the update's address, ignored if hasAddr is false
+    */
+   bool accepts(bool hasAddr, uint64_t ea) const;
+
+   /**
+    * ranges returns the number of disjoint ranges in the filter
+    */
+   size_t ranges() const {return index.size();};
+
+   /**
+    * address finds the address an update applies to
+    * @param update the update to inspect
+    * @param ea receives the address
+    * @return false if the update carries no address
+    */
+   static bool address(json_object *update, uint64_t *ea);
+
+   bool unaddressed;   //whether updates without an address are accepted
+
+private:
+   map<uint64_t,uint64_t> index;   //range start to range end, disjoint and merged
+};
+
+#endif
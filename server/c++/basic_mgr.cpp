@@ -18,16 +18,19 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <inttypes.h>
 #include <string.h>
 #include <string>
 #include <map>
 #include <vector>
+#include <algorithm>
 #include "utils.h"
 #include "proj_info.h"
 #include "client.h"
 #include "basic_mgr.h"
 #include "projectmap.h"
 #include "clientset.h"
+#include "snapshot.h"
 
 using namespace std;
 
@@ -47,6 +50,8 @@ BasicConnectionManager::BasicConnectionManager(json_object *conf) : ConnectionMa
    sem_init(&pidLock, 0, 1);
    sem_init(&uidLock, 0, 1);
    sem_init(&mapLock, 0, 1);
+   compact_interval = getIntOption(conf, "COMPACT_INTERVAL", 0);
+   compact_tail = getIntOption(conf, "COMPACT_TAIL", 10000);
 }
 
 BasicConnectionManager::~BasicConnectionManager() {
@@ -69,7 +74,7 @@ uint32_t BasicConnectionManager::uid_for_user(const char *user) {
    return uid;
 }
 
-uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
+uint32_t BasicConnectionManager::doAuth(NetworkIO *nio, ResumeInfo *resumed, uint32_t *caps) {
    uint64_t challenge[4] = {0xdeadbeefdeadbeefll, 0xdeadbeefdeadbeefll, 0xdeadbeefdeadbeefll, 0xdeadbeefdeadbeefll};
    json_object *obj = json_object_new_object();
    append_json_hex_val(obj, "challenge", (uint8_t*)challenge, CHALLENGE_SIZE);
@@ -95,8 +100,14 @@ uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
       return AUTH_INVALID_PROTO;
    }
 
+   *caps = authCaps(obj);
    uint32_t rlen;
    const char *type = string_from_json(obj, "type");
+   if (type != NULL && strcmp(type, MSG_RESUME_REQUEST) == 0) {
+      uint32_t result = resumeAuth(obj, resumed);
+      json_object_put(obj);
+      return result;
+   }
    uint8_t *response = hex_from_json(obj, "hmac", &rlen);
    const char *user = string_from_json(obj, "user");
    json_object_put(obj);
@@ -107,7 +118,7 @@ uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
    uint32_t uid = uid_for_user(user);
    if (response != NULL) {  //no memcmp here in basic mode
       result = uid;
-      user_map[uid] = UserInfo(user, uid, FULL_PERMISSIONS, FULL_PERMISSIONS);
+      setUserInfo(UserInfo(user, uid, FULL_PERMISSIONS, FULL_PERMISSIONS));
       delete [] response;
    }
    else {
@@ -128,9 +139,62 @@ uint32_t BasicConnectionManager::doAuth(NetworkIO *nio) {
 void BasicConnectionManager::importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj) {
    BasicProject *p = findProject(pid);
    if (p != NULL) {
+      sem_wait(&queueMutex);
+      uint64_t uid;
+      if (!uint64_from_json(obj, "updateid", &uid)) {
+         uid = p->next_uid();
+         append_json_uint64_val(obj, "updateid", uid);
+      }
+      else if (uid <= p->curr_uid()) {
+         //stored updates must stay in updateid order for first_after
+         sem_post(&queueMutex);
+         log(LERROR, "import for project %d has out of order updateid %" PRIu64 "\n", pid, uid);
+         return;
+      }
       const char *json = json_object_to_json_string(obj);
-      p->append_update(json);
+      p->append_update(json, uid);
+      sem_post(&queueMutex);
+   }
+}
+
+/**
+ * importUpdates archives a batch of migrated updates in one operation
+ * @param newowner the new uid to attribute the updates to
+ * @param pid the local project id for the migrated project
+ * @param updates json array of complete update objects
+ * @return the number of updates imported, -1 on failure
+ */
+int BasicConnectionManager::importUpdates(const char *newowner, int pid, json_object *updates) {
+   BasicProject *p = findProject(pid);
+   if (p == NULL || !json_object_is_type(updates, json_type_array)) {
+      return -1;
+   }
+   size_t num_updates = json_object_array_length(updates);
+   vector<const char*> batch;
+   vector<uint64_t> uids;
+   batch.reserve(num_updates);
+   uids.reserve(num_updates);
+   //serialize outside the lock, then append the whole batch at once
+   for (size_t i = 0; i < num_updates; i++) {
+      json_object *update = json_object_array_get_idx(updates, i);
+      uint64_t uid;
+      if (!uint64_from_json(update, "updateid", &uid) || (!uids.empty() && uid <= uids.back())) {
+         log(LERROR, "import batch for project %d has missing or out of order updateids\n", pid);
+         return -1;
+      }
+      json_object_object_add_ex(update, "pid", json_object_new_int64(pid), JSON_C_OBJECT_KEY_IS_CONSTANT);
+      batch.push_back(json_object_to_json_string_ext(update, JSON_C_TO_STRING_PLAIN));
+      uids.push_back(uid);
+   }
+   sem_wait(&queueMutex);
+   if (!uids.empty() && p->curr_uid() >= uids.front()) {
+      sem_post(&queueMutex);
+      log(LERROR, "import batch for project %d overlaps existing updates\n", pid);
+      return -1;
    }
+   p->append_updates(batch, uids);
+   sem_post(&queueMutex);
+   return (int)num_updates;
 }
 
 /**
@@ -143,13 +207,25 @@ void BasicConnectionManager::importUpdate(const char *newowner, int pid, const c
 void BasicConnectionManager::post(Client *src, const char * cmd, json_object *obj) {
    BasicProject *p = findProject(src->getPid());
    if (p) {
+      sem_wait(&queueMutex);  //prevent simultaneous update to these storage structures
+      //allocate the updateid under the lock so that stored updates stay in updateid order
       Packet *pkt = new Packet(src, cmd, obj, p->next_uid());
       const char *json = json_object_to_json_string(pkt->obj);
-      sem_wait(&queueMutex);  //prevent simultaneous update to these storage structures
-      p->append_update(json);
+      p->append_update(json, pkt->uid);
       queue.push_back(pkt);   //add a new packet with the binary data to the queue
+      bool compact = compact_interval != 0 && ++p->since_compact >= compact_interval;
+      if (compact) {
+         p->since_compact = 0;
+      }
       sem_post(&queueMutex);
       sem_post(&queueSem);  //notify is the compliment to wait
+      if (compact) {
+         pthread_attr_t attr;
+         pthread_attr_init(&attr);
+         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+         pthread_t tid;
+         pthread_create(&tid, &attr, compact_thread, new pair<BasicConnectionManager*,uint32_t>(this, p->lpid));
+      }
    }
 }
 
@@ -160,22 +236,171 @@ void BasicConnectionManager::post(Client *src, const char * cmd, json_object *ob
  * this function is typically called when a user is re-joining a project that they had previously worked on
  * @param c the client requesting updates
  * @param lastUpdate the last update the client received
+ * @param state true if a cold joining client accepts the project snapshot
+ * @param until send nothing after this updateid, 0 for no limit
+ * @return the last updateid the client has been sent, in updates or state
  */
-void BasicConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
+uint64_t BasicConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate, bool state, uint64_t until) {
    BasicProject *p = findProject(c->getPid());
    if (p) {
-      const vector<char*> &updates = p->get_updates();
-      for (vector<char*>::const_iterator i = updates.cbegin(); i != updates.cend(); i++) {
-         json_object *obj = json_tokener_parse(*i);
-         uint64_t uid;
-         if (uint64_from_json(obj, "updateid", &uid) && uid > lastUpdate) {
+      vector<string> batch;
+      vector<uint64_t> ids;
+      if (state && lastUpdate == 0) {
+         Snapshot *s = getSnapshot(p->lpid);
+         sem_wait(&s->lock);
+         sem_wait(&queueMutex);
+         size_t pending = p->get_updates().size() - p->first_after(s->updateid);
+         sem_post(&queueMutex);
+         if (pending >= snapshot_interval) {
+            //bring the snapshot up to date before handing it out
+            while (copyUpdates(p, s->updateid, until, EXPORT_BATCH_UPDATES, batch, ids) > 0) {
+               for (size_t i = 0; i < batch.size(); i++) {
+                  json_object *obj = json_tokener_parse(batch[i].c_str());
+                  s->apply(ids[i], obj);
+                  json_object_put(obj);
+               }
+            }
+         }
+         //a snapshot refreshed past until by someone else still works for
+         //clients holding live updates since they joined, the ones it covers
+         //are dropped when the held updates are sent
+         vector<json_object*> chunks;
+         if (until == 0 || s->updateid <= until || (c->getCaps() & CAP_JOIN_CATCHUP)) {
+            s->chunks(c, chunks);
+            lastUpdate = s->updateid;
+         }
+         sem_post(&s->lock);
+         for (size_t i = 0; i < chunks.size(); i++) {
+            c->send_data(MSG_PROJECT_STATE, chunks[i]);
+         }
+      }
+      //updates are stored in updateid order, skip the ones the client already has
+      while (copyUpdates(p, lastUpdate, until, EXPORT_BATCH_UPDATES, batch, ids) > 0) {
+         for (size_t i = 0; i < batch.size(); i++) {
+            json_object *obj = json_tokener_parse(batch[i].c_str());
             const char *cmd = string_from_json(obj, "type");
-            if (cmd) {
-               c->post(cmd, obj);
+            if (cmd && c->inScope(obj)) {
+               if (!c->replay(cmd, obj, batch[i].length())) {
+                  //the client has left or joined another project
+                  return lastUpdate;
+               }
+            }
+            else {
+               json_object_put(obj);
             }
          }
+         lastUpdate = ids.back();
+      }
+   }
+   return lastUpdate > until ? lastUpdate : until;
+}
+
+/**
+ * lastUpdateid gets the newest update stored for a project
+ * @param pid the local pid of the project
+ */
+uint64_t BasicConnectionManager::lastUpdateid(uint32_t pid) {
+   uint64_t uid = 0;
+   BasicProject *p = findProject(pid);
+   if (p) {
+      //updateids are taken and stored under queueMutex
+      sem_wait(&queueMutex);
+      uid = p->curr_uid();
+      sem_post(&queueMutex);
+   }
+   return uid;
+}
+
+/**
+ * copyUpdates copies stored updates out from under queueMutex, the stored
+ * strings may be freed by compaction once the lock is released
+ * @param p the project to copy from
+ * @param after only updates with an updateid greater than this are copied
+ * @param until only updates with an updateid up to this are copied, 0 for no limit
+ * @param max the maximum number of updates to copy
+ * @param batch receives the updates
+ * @param ids receives the updateid of each update in batch
+ * @return the number of updates copied
+ */
+size_t BasicConnectionManager::copyUpdates(BasicProject *p, uint64_t after, uint64_t until, size_t max,
+                                           vector<string> &batch, vector<uint64_t> &ids) {
+   batch.clear();
+   ids.clear();
+   sem_wait(&queueMutex);
+   const vector<char*> &vu = p->get_updates();
+   const vector<uint64_t> &vi = p->get_update_ids();
+   for (size_t next = p->first_after(after); next < vu.size() && batch.size() < max; next++) {
+      if (until != 0 && vi[next] > until) {
+         break;
+      }
+      batch.push_back(vu[next]);
+      ids.push_back(vi[next]);
+   }
+   sem_post(&queueMutex);
+   return batch.size();
+}
+
+/**
+ * compactProject removes stored updates that are superseded by later ones
+ * compaction picks up where the previous run for the project left off
+ * @param pid the local project id of the project to compact
+ * @param watermark only updates up to this updateid are compacted, 0 for all
+ * @return the number of updates removed, -1 if the project doesn't exist
+ */
+int BasicConnectionManager::compactProject(uint32_t pid, uint64_t watermark) {
+   BasicProject *p = findProject(pid);
+   if (p == NULL) {
+      return -1;
+   }
+   if (watermark == 0) {
+      watermark = p->curr_uid();
+   }
+   sem_wait(&p->compactMutex);
+   uint64_t after = p->compactor.watermark;
+   vector<string> batch;
+   vector<uint64_t> ids;
+   vector<uint64_t> superseded;
+   //parse outside of queueMutex, only the final removal blocks posting
+   while (after < watermark && copyUpdates(p, after, watermark, EXPORT_BATCH_UPDATES, batch, ids) > 0) {
+      for (size_t i = 0; i < batch.size(); i++) {
+         json_object *obj = json_tokener_parse(batch[i].c_str());
+         uint64_t prev = p->compactor.supersede(ids[i], obj);
+         if (prev != 0) {
+            superseded.push_back(prev);
+         }
+         json_object_put(obj);
+      }
+      after = ids.back();
+   }
+   sort(superseded.begin(), superseded.end());
+   sem_wait(&queueMutex);
+   size_t removed = p->remove_updates(superseded);
+   size_t remaining = p->get_updates().size();
+   sem_post(&queueMutex);
+   if (watermark > p->compactor.watermark) {
+      p->compactor.watermark = watermark;
+   }
+   sem_post(&p->compactMutex);
+   log(LINFO, "compacted project %u up to update %" PRIu64 ", removed %u updates, %u remain\n",
+       pid, watermark, (uint32_t)removed, (uint32_t)remaining);
+   return (int)removed;
+}
+
+/*
+ * online compaction, started from post once enough updates have arrived
+ */
+void *BasicConnectionManager::compact_thread(void *arg) {
+   pair<BasicConnectionManager*,uint32_t> *job = (pair<BasicConnectionManager*,uint32_t>*)arg;
+   BasicConnectionManager *mgr = job->first;
+   BasicProject *p = mgr->findProject(job->second);
+   if (p != NULL) {
+      uint64_t curr = p->curr_uid();
+      if (curr > mgr->compact_tail) {
+         mgr->compactProject(job->second, curr - mgr->compact_tail);
       }
    }
+   delete job;
+   return NULL;
 }
 
 /**
@@ -249,7 +474,7 @@ int BasicConnectionManager::joinProject(Client *c, uint32_t lpid) {
       //c->setSub(c.getReqSub());
       c->setPub(FULL_PERMISSIONS);
       c->setSub(FULL_PERMISSIONS);
-      projects.addClient(c);
+      addClient(c);
       rval = 0;
    }
    else {
@@ -373,22 +598,35 @@ int BasicConnectionManager::importProject(const char *owner, const string &gpid,
 }
 
 /**
- * exportProject dumps all project updates
+ * exportProject streams project updates, in updateid order, to a callback
  * @param pid the local project id of the prject to be exported
+ * @param since only updates with an updateid greater than this are exported
+ * @param until only updates with an updateid up to this are exported, 0 for no limit
+ * @param func called with each serialized update, return false to stop
+ * @param user passed through to func
+ * @return the number of updates exported, -1 if the project doesn't exist
  */
 
-json_object *BasicConnectionManager::exportProject(uint32_t pid) {
+int BasicConnectionManager::exportProject(uint32_t pid, uint64_t since, uint64_t until, ecb func, void *user) {
    BasicProject *p = findProject(pid);
    if (p == NULL) {
-      return NULL;
+      return -1;
    }
-   json_object *updates = json_object_new_array();
-   const vector<char*> &vu = p->get_updates();
-   for (vector<char*>::const_iterator vi = vu.cbegin(); vi != vu.cend(); vi++) {
-      json_object *obj = json_tokener_parse(*vi);
-      json_object_array_add(updates, obj);
+   vector<string> batch;
+   vector<uint64_t> ids;
+   int count = 0;
+   //post appends to the update vector while holding queueMutex, only
+   //hold it long enough to copy out the next batch
+   while (copyUpdates(p, since, until, EXPORT_BATCH_UPDATES, batch, ids) > 0) {
+      for (size_t i = 0; i < batch.size(); i++) {
+         if (!(*func)(ids[i], batch[i].c_str(), user)) {
+            return count;
+         }
+         count++;
+      }
+      since = ids.back();
    }
-   return updates;
+   return count;
 }
 
 //Find a project given only an lpid
@@ -454,7 +692,7 @@ int BasicConnectionManager::addProject(Client *c, const string &hash, const stri
    c->setReqSub(FULL_PERMISSIONS);
 
    if (lpid != -1) {
-      projects.addClient(c);
+      addClient(c);
    }
 
    return lpid;
@@ -56,17 +56,32 @@ private:
    map<string,uint32_t> basic_mode_users;
    uint32_t uid_for_user(const char *user);
 
+   //online compaction runs every compact_interval updates, leaving the
+   //most recent compact_tail updates as they are
+   uint32_t compact_interval;
+   uint32_t compact_tail;
+   static void *compact_thread(void *arg);
+
+   //copy out up to max stored updates with an updateid greater than after
+   size_t copyUpdates(BasicProject *p, uint64_t after, uint64_t until, size_t max,
+                      vector<string> &batch, vector<uint64_t> &ids);
+
 public:
    BasicConnectionManager(json_object *conf);
    virtual ~BasicConnectionManager();
 
+   //projects are kept in memory, they end with this process
+   virtual bool persistent() {return false;};
+
    /**
     * doAuth authenticates a user
     * This is mostly a NOP in basic mode
     * @param nio The network connection to authenticate
+    * @param resumed receives the session restored if the client presented a resume token
+    * @param caps receives the capabilities agreed with the plugin
     * @return the user id of an authenticated user, or failure code
     */
-   uint32_t doAuth(NetworkIO *nio);
+   uint32_t doAuth(NetworkIO *nio, ResumeInfo *resumed, uint32_t *caps);
 
    /**
     * importUpdate is very similar to 'post', importUpdate only
@@ -78,6 +93,15 @@ public:
     */
    void importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj);
 
+   /**
+    * importUpdates archives a batch of migrated updates in one operation
+    * @param newowner the new uid to attribute the updates to
+    * @param pid the local project id for the migrated project
+    * @param updates json array of complete update objects
+    * @return the number of updates imported, -1 on failure
+    */
+   int importUpdates(const char *newowner, int pid, json_object *updates);
+
    /**
     * post both queues a newly received update to be sent to other clients and (if in DB mode)
     * archives the udpate in the database so that future clients can receive it
@@ -94,8 +118,17 @@ public:
     * this function is typically called when a user is re-joining a project that they had previously worked on
     * @param c the client requesting updates
     * @param lastUpdate the last update the client received
+    * @param state true if a cold joining client accepts the project snapshot
+    * @param until send nothing after this updateid, 0 for no limit
+    * @return the last updateid the client has been sent, in updates or state
     */
-   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+   uint64_t sendLatestUpdates(Client *c, uint64_t lastUpdate, bool state = false, uint64_t until = 0);
+
+   /**
+    * lastUpdateid gets the newest update stored for a project
+    * @param pid the local pid of the project
+    */
+   uint64_t lastUpdateid(uint32_t pid);
 
    /**
     * getProject gets information related to a local project
@@ -203,11 +236,25 @@ public:
    int importProject(const char *owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
 
    /**
-    * exportProject dumps all project updates
+    * exportProject streams project updates, in updateid order, to a callback
     * @param pid the local project id of the prject to be exported
+    * @param since only updates with an updateid greater than this are exported
+    * @param until only updates with an updateid up to this are exported, 0 for no limit
+    * @param func called with each serialized update, return false to stop
+    * @param user passed through to func
+    * @return the number of updates exported, -1 if the project doesn't exist
     */
 
-   json_object *exportProject(uint32_t pid);
+   int exportProject(uint32_t pid, uint64_t since, uint64_t until, ecb func, void *user);
+
+   /**
+    * compactProject removes stored updates that are superseded by later ones
+    * compaction picks up where the previous run for the project left off
+    * @param pid the local project id of the project to compact
+    * @param watermark only updates up to this updateid are compacted, 0 for all
+    * @return the number of updates removed, -1 if the project doesn't exist
+    */
+   int compactProject(uint32_t pid, uint64_t watermark);
 
    /**
     * addProject adds a project to the database and reflector (or merely a reflector in non-DB mode)
@@ -0,0 +1,320 @@
+/*
+   collabREate catchup.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "client.h"
+#include "cli_mgr.h"
+#include "catchup.h"
+
+//most worker threads CATCHUP_WORKERS may ask for
+#define MAX_CATCHUP_WORKERS 64
+
+//updates per second assumed for estimates until a catch-up has been timed
+#define INITIAL_CATCHUP_RATE 20000.0
+
+//catch-ups shorter than this don't say much about throughput
+#define MIN_TIMED_UPDATES 1000
+
+CatchupScheduler::CatchupScheduler(ConnectionManager *cm, json_object *conf) {
+   this->cm = cm;
+   int n = getIntOption(conf, "CATCHUP_WORKERS", 4);
+   workers = n < 1 ? 1 : (n > MAX_CATCHUP_WORKERS ? MAX_CATCHUP_WORKERS : n);
+   small = getIntOption(conf, "CATCHUP_SMALL", 1000);
+   rate = getIntOption(conf, "CATCHUP_KBPS", 8192) * 1024;
+   sem_init(&lock, 0, 1);
+   sem_init(&notifyLock, 0, 1);
+   sem_init(&ready, 0, 0);
+   last_pid = 0;
+   completed = 0;
+   sent = 0;
+   per_sec = INITIAL_CATCHUP_RATE;
+}
+
+void CatchupScheduler::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (uint32_t i = 0; i < workers; i++) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, worker, this);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+void CatchupScheduler::submit(Client *c, uint64_t lastUpdate, bool state) {
+   Request *r = new Request;
+   r->c = c;
+   c->acquire();
+   r->pid = c->getPid();
+   r->join = c->joinCount();
+   r->lastUpdate = lastUpdate;
+   r->state = state;
+   //history stops at the join mark, the rest arrives live
+   uint64_t from = lastUpdate;
+   uint64_t base = 0;
+   if (state && lastUpdate == 0) {
+      //a cold join is sent the project state and the tail after it
+      base = cm->snapshotSize(r->pid, &from);
+   }
+   r->estimate = base + (c->joinMark() > from ? c->joinMark() - from : 0);
+   r->position = 0;
+   r->told = 0;
+
+   vector<Status> st;
+   sem_wait(&lock);
+   if (r->estimate <= small) {
+      express.push_back(r);
+   }
+   else {
+      queued[r->pid].push_back(r);
+   }
+   changed(st);
+   sem_post(&ready);
+   notify(st);
+}
+
+void *CatchupScheduler::worker(void *arg) {
+   CatchupScheduler *cs = (CatchupScheduler*)arg;
+   while (true) {
+      vector<Status> st;
+      sem_wait(&cs->ready);
+      sem_wait(&cs->lock);
+      Request *r = cs->next();
+      cs->running.push_back(r);
+      if (r->told != 0) {
+         //the client has been told it is waiting, now it isn't
+         Status s = {r->c, 0, r->estimate, cs->eta(r->estimate)};
+         r->c->acquire();
+         st.push_back(s);
+         r->told = 0;
+      }
+      r->position = 0;
+      cs->changed(st);
+      cs->notify(st);
+
+      uint64_t start = monotonic_ms();
+      cs->run(r);
+      uint64_t ms = monotonic_ms() - start;
+      uint64_t n = r->c->catchupSent();
+
+      sem_wait(&cs->lock);
+      for (vector<Request*>::iterator i = cs->running.begin(); i != cs->running.end(); i++) {
+         if (*i == r) {
+            cs->running.erase(i);
+            break;
+         }
+      }
+      cs->completed++;
+      cs->sent += n;
+      if (n >= MIN_TIMED_UPDATES) {
+         double measured = n * 1000.0 / (ms ? ms : 1);
+         cs->per_sec = (cs->per_sec * 3 + measured) / 4;
+      }
+      sem_post(&cs->lock);
+      r->c->release();
+      delete r;
+   }
+   return NULL;
+}
+
+/**
+ * run streams a client's missing history, then releases the live
+ * updates held for it meanwhile
+ */
+void CatchupScheduler::run(Request *r) {
+   Client *c = r->c;
+   uint64_t mark;
+   if (!c->beginCatchup(r->join, &mark, rate)) {
+      //the client has left or joined another project since it asked
+      return;
+   }
+   uint64_t covered = mark;
+   try {
+      //nothing after the join mark, the client gets those live, and
+      //nothing at all if the project was empty when the client joined
+      if (mark != 0) {
+         covered = cm->sendLatestUpdates(c, r->lastUpdate, r->state, mark);
+      }
+   } catch (IOException ex) {
+      log(LERROR, "An IOException occurred during catch-up: %s\n", ex.getMessage().c_str());
+   }
+   c->endCatchup(covered);
+}
+
+/**
+ * next takes the request to run next, small catch-ups first, then each
+ * project in turn, lock must be held and a request must be queued
+ */
+CatchupScheduler::Request *CatchupScheduler::next() {
+   Request *r;
+   if (!express.empty()) {
+      r = express.front();
+      express.pop_front();
+      return r;
+   }
+   map<uint32_t,deque<Request*> >::iterator i = queued.upper_bound(last_pid);
+   if (i == queued.end()) {
+      i = queued.begin();
+   }
+   r = i->second.front();
+   i->second.pop_front();
+   last_pid = i->first;
+   if (i->second.empty()) {
+      queued.erase(i);
+   }
+   return r;
+}
+
+/**
+ * order lists the queued requests in the order next will return them,
+ * lock must be held
+ */
+void CatchupScheduler::order(vector<Request*> &out) {
+   out.assign(express.begin(), express.end());
+   //round robin over the projects, starting after last_pid
+   vector<pair<deque<Request*>*,size_t> > turns;
+   map<uint32_t,deque<Request*> >::iterator first = queued.upper_bound(last_pid);
+   for (map<uint32_t,deque<Request*> >::iterator i = first; i != queued.end(); i++) {
+      turns.push_back(make_pair(&i->second, (size_t)0));
+   }
+   for (map<uint32_t,deque<Request*> >::iterator i = queued.begin(); i != first; i++) {
+      turns.push_back(make_pair(&i->second, (size_t)0));
+   }
+   bool more = true;
+   while (more) {
+      more = false;
+      for (size_t t = 0; t < turns.size(); t++) {
+         if (turns[t].second < turns[t].first->size()) {
+            out.push_back((*turns[t].first)[turns[t].second++]);
+            more = true;
+         }
+      }
+   }
+}
+
+/**
+ * eta estimates the seconds needed to send a number of updates when the
+ * work is shared by all of the workers, lock must be held
+ */
+uint32_t CatchupScheduler::eta(uint64_t updates) {
+   double secs = updates / per_sec;
+   if (rate != 0) {
+      //no faster than the byte rate allows, guessing 200 bytes an update
+      double paced = updates * 200.0 / rate;
+      if (paced > secs) {
+         secs = paced;
+      }
+   }
+   return (uint32_t)(secs + 0.5);
+}
+
+/**
+ * worth_telling decides if a waiting client is sent its new position.
+ * Telling every waiter each time the line moves would cost a message per
+ * waiter per dequeue, so a client only hears when it joins, when it is
+ * next up and when its position has moved by a quarter, a few messages
+ * over its whole wait.  Lock must be held.
+ */
+bool CatchupScheduler::worth_telling(const Request *r) {
+   if (r->position == r->told) {
+      return false;
+   }
+   if (r->told == 0 || r->position <= workers) {
+      return true;
+   }
+   return r->position * 4 <= r->told * 3 || r->position * 4 >= r->told * 5;
+}
+
+/**
+ * changed renumbers the queued requests and collects the status of those
+ * whose clients should hear of it, lock must be held
+ */
+void CatchupScheduler::changed(vector<Status> &out) {
+   vector<Request*> line;
+   order(line);
+   //work still to do by the running catch-ups
+   uint64_t ahead = 0;
+   for (vector<Request*>::iterator i = running.begin(); i != running.end(); i++) {
+      uint64_t done = (*i)->c->catchupSent();
+      ahead += (*i)->estimate > done ? (*i)->estimate - done : 0;
+   }
+   for (size_t i = 0; i < line.size(); i++) {
+      Request *r = line[i];
+      ahead += r->estimate;
+      r->position = i + 1;
+      if (worth_telling(r)) {
+         r->told = r->position;
+         //the line moves workers at a time
+         Status s = {r->c, r->position, r->estimate, eta(ahead / workers + r->estimate)};
+         r->c->acquire();
+         out.push_back(s);
+      }
+   }
+}
+
+/**
+ * notify releases lock and sends MSG_CATCHUP_STATUS, outside of lock since a
+ * client's socket may be slow to take it but under notifyLock, taken first,
+ * so a client can't be told it is waiting after it was told it has started
+ */
+void CatchupScheduler::notify(vector<Status> &st) {
+   sem_wait(&notifyLock);
+   sem_post(&lock);
+   for (vector<Status>::iterator i = st.begin(); i != st.end(); i++) {
+      json_object *obj = json_object_new_object();
+      append_json_uint32_val(obj, "position", i->position);
+      append_json_uint64_val(obj, "updates", i->estimate);
+      append_json_uint32_val(obj, "eta", i->eta);
+      i->c->send_data(MSG_CATCHUP_STATUS, obj);
+      i->c->release();
+   }
+   sem_post(&notifyLock);
+}
+
+string CatchupScheduler::dumpStats() {
+   char buf[256];
+   string sb;
+   sem_wait(&lock);
+   vector<Request*> line;
+   order(line);
+   snprintf(buf, sizeof(buf), "Catch-up:\n%u of %u workers busy, %u queued, %llu completed (%llu updates), ~%.0f updates/s each\n",
+            (uint32_t)running.size(), workers, (uint32_t)line.size(), (unsigned long long)completed,
+            (unsigned long long)sent, per_sec);
+   sb += buf;
+   for (vector<Request*>::iterator i = running.begin(); i != running.end(); i++) {
+      Request *r = *i;
+      snprintf(buf, sizeof(buf), "  running  %s:%u %s project %u, %llu/%llu updates\n",
+               r->c->getPeerAddr().c_str(), r->c->getPeerPort(), r->c->getUser().c_str(), r->pid,
+               (unsigned long long)r->c->catchupSent(), (unsigned long long)r->estimate);
+      sb += buf;
+   }
+   for (vector<Request*>::iterator i = line.begin(); i != line.end(); i++) {
+      Request *r = *i;
+      snprintf(buf, sizeof(buf), "  %-8u %s:%u %s project %u, %llu updates\n", r->position,
+               r->c->getPeerAddr().c_str(), r->c->getPeerPort(), r->c->getUser().c_str(), r->pid,
+               (unsigned long long)r->estimate);
+      sb += buf;
+   }
+   sem_post(&lock);
+   return sb;
+}
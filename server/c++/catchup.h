@@ -0,0 +1,120 @@
+/*
+   collabREate catchup.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __CATCHUP_H
+#define __CATCHUP_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <semaphore.h>
+#include <json-c/json.h>
+
+using namespace std;
+
+class Client;
+class ConnectionManager;
+
+/**
+ * CatchupScheduler
+ * Admission control for MSG_SEND_UPDATES.  Catch-ups are run by a fixed
+ * number of worker threads so a crowd of clients reconnecting at once can't
+ * swamp the database or the dispatcher.  Catch-ups expected to send no
+ * more than small updates skip ahead of the rest, which are taken from
+ * each project in turn so one busy project can't hold up the others.  Each
+ * catch-up is paced to a byte rate.  Waiting clients are sent
+ * MSG_CATCHUP_STATUS when they join the line, when their place in it has
+ * moved by a quarter since they were last told and when they are next up.
+ */
+class CatchupScheduler {
+public:
+   CatchupScheduler(ConnectionManager *cm, json_object *conf);
+
+   /**
+    * start launches the worker threads
+    */
+   void start();
+
+   /**
+    * submit queues a catch-up for a client that has joined a project
+    * @param c the client requesting updates
+    * @param lastUpdate the last update the client received
+    * @param state true if a cold joining client accepts the project snapshot
+    */
+   void submit(Client *c, uint64_t lastUpdate, bool state);
+
+   /**
+    * dumpStats describes the running and queued catch-ups
+    */
+   string dumpStats();
+
+private:
+   struct Request {
+      Client *c;           //holds a reference
+      uint32_t pid;
+      uint32_t join;       //the client's joinCount when it asked
+      uint64_t lastUpdate;
+      bool state;
+      uint64_t estimate;   //updates the catch-up is expected to send
+      uint32_t position;   //place in line, 0 once running
+      uint32_t told;       //last position sent to the client
+   };
+
+   struct Status {
+      Client *c;           //holds a reference
+      uint32_t position;
+      uint64_t estimate;
+      uint32_t eta;        //seconds
+   };
+
+   static void *worker(void *arg);
+   void run(Request *r);
+
+   //the following require lock
+   Request *next();
+   void order(vector<Request*> &out);
+   uint32_t eta(uint64_t updates);
+   void changed(vector<Status> &out);
+   bool worth_telling(const Request *r);
+
+   //releases lock, sending st in the order the statuses were collected
+   void notify(vector<Status> &st);
+
+   ConnectionManager *cm;
+   uint32_t workers;
+   uint32_t small;        //catch-ups of up to this many updates go first
+   uint32_t rate;         //bytes per second per catch-up, 0 for no limit
+
+   sem_t lock;
+   sem_t notifyLock;      //taken before lock is released, keeps statuses in order
+   sem_t ready;           //counts queued requests
+   deque<Request*> express;
+   map<uint32_t,deque<Request*> > queued;   //by project
+   uint32_t last_pid;     //project most recently served from queued
+   vector<Request*> running;
+
+   uint64_t completed;
+   uint64_t sent;         //updates sent by completed catch-ups
+   double per_sec;        //recent updates per second of a single catch-up
+};
+
+#endif
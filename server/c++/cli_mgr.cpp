@@ -20,14 +20,22 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "utils.h"
 #include "client.h"
 #include "proj_info.h"
 #include "cli_mgr.h"
+#include "snapshot.h"
+#include "resume.h"
+#include "addrfilter.h"
 #include "projectmap.h"
 #include "clientset.h"
+#include "catchup.h"
+#include "ratelimit.h"
+#include "timerwheel.h"
 #include "io.h"
 
 UserInfo::UserInfo(const char *uname, uint32_t _uid, uint64_t _pub, uint64_t _sub) : username(uname) {
@@ -44,10 +52,25 @@ UserInfo::UserInfo() : username("invalid") {
 
 Packet::Packet(Client *src, const char *cmd, json_object *obj, uint64_t updateid) {
    c = src;
+   c->acquire();
    this->cmd = cmd;
    this->obj = obj;
    uid = updateid;
    append_json_uint64_val(obj, "updateid", updateid);   //is this really necessary?
+   addr = 0;
+   hasAddr = AddrFilter::address(obj, &addr);
+   text = NULL;
+}
+
+Packet::~Packet() {
+   c->release();
+}
+
+const char *Packet::json() {
+   if (text == NULL) {
+      text = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+   }
+   return text;
 }
 
 /**
@@ -58,17 +81,119 @@ const char * const ConnectionManager::EMPTY_GPID = "0000000000000000000000000000
 ConnectionManager::ConnectionManager(json_object *conf) {
    this->conf = conf;
    done = false;
+   moving = false;
    sem_init(&pidLock, 0, 1);
    sem_init(&queueSem, 0, 0);
    sem_init(&queueMutex, 0, 1);
+   sem_init(&snapLock, 0, 1);
+   sem_init(&userLock, 0, 1);
+   snapshot_interval = getIntOption(conf, "SNAPSHOT_INTERVAL", 1000);
+   resume = new ResumeTokens(getIntOption(conf, "RESUME_TTL", 300));
+   ack_batch = getIntOption(conf, "ACK_BATCH", 64);
+   ack_delay = getIntOption(conf, "ACK_DELAY_MS", 10);
+   out_queue = getIntOption(conf, "OUT_QUEUE", 1024);
+   auth_timeout = getIntOption(conf, "AUTH_TIMEOUT", 30);
+   timers = new TimerWheel();
+   catchups = new CatchupScheduler(this, conf);
+   limits = new PublishLimiter(this, conf);
+   caps = CAP_JOIN_CATCHUP | CAP_HANDOVER;
+   if (ack_batch > 1) {
+      caps |= CAP_CUMULATIVE_ACK;
+   }
+}
+
+uint32_t ConnectionManager::authCaps(json_object *obj) {
+   uint32_t want = 0;
+   uint32_from_json(obj, "caps", &want);
+   return want & caps;
 }
 
-const UserInfo &ConnectionManager::getUserInfo(uint32_t uid) {
-   static UserInfo invalid;
-   if (user_map.find(uid) == user_map.end()) {
-      return invalid;
+/**
+ * getSnapshot finds the snapshot for a project, creating an empty one on first use
+ * @param pid the local pid of the project
+ * @return the project's snapshot
+ */
+Snapshot *ConnectionManager::getSnapshot(uint32_t pid) {
+   sem_wait(&snapLock);
+   Snapshot *&s = snapshots[pid];
+   if (s == NULL) {
+      s = new Snapshot();
+   }
+   sem_post(&snapLock);
+   return s;
+}
+
+size_t ConnectionManager::snapshotSize(uint32_t pid, uint64_t *updateid) {
+   Snapshot *s = getSnapshot(pid);
+   sem_wait(&s->lock);
+   size_t n = s->size();
+   *updateid = s->updateid;
+   sem_post(&s->lock);
+   return n;
+}
+
+UserInfo ConnectionManager::getUserInfo(uint32_t uid) {
+   UserInfo ui;
+   sem_wait(&userLock);
+   map<uint32_t,UserInfo>::iterator i = user_map.find(uid);
+   if (i != user_map.end()) {
+      ui = i->second;
    }
-   return user_map[uid];
+   sem_post(&userLock);
+   return ui;
+}
+
+//record an authenticated user, clients authenticate concurrently
+void ConnectionManager::setUserInfo(const UserInfo &ui) {
+   sem_wait(&userLock);
+   user_map[ui.uid] = ui;
+   sem_post(&userLock);
+}
+
+/**
+ * resumeAuth redeems the token carried by a MSG_RESUME_REQUEST
+ * @param obj the resume request
+ * @param resumed receives the session the token was issued for
+ * @return the user id of the resumed session, or failure code
+ */
+uint32_t ConnectionManager::resumeAuth(json_object *obj, ResumeInfo *resumed) {
+   const char *token = string_from_json(obj, "token");
+   if (token == NULL) {
+      return AUTH_INVALID_PROTO;
+   }
+   ResumeInfo ri;
+   if (!resume->redeem(token, ri)) {
+      log(LINFO4, "Unknown or expired resume token\n");
+      return AUTH_INVALID_USER;
+   }
+   log(LINFO4, "Resuming session for %s\n", ri.user.username.c_str());
+   setUserInfo(ri.user);
+   if (resumed != NULL) {
+      *resumed = ri;
+   }
+   return ri.user.uid;
+}
+
+/**
+ * resumeProject puts a client back into the project recorded in its
+ * resume token, nothing is looked up in the database
+ * @param c the newly authenticated client
+ * @param ri the session being resumed
+ * @return 0 on success, negative value on failure
+ */
+int ConnectionManager::resumeProject(Client *c, const ResumeInfo &ri) {
+   if (ri.pid == INVALID_PID) {
+      return -1;
+   }
+   c->setPid(ri.pid);
+   c->setGpid(ri.gpid);
+   c->setHash(ri.hash);
+   c->setReqPub(ri.rpub);
+   c->setReqSub(ri.rsub);
+   c->setPub(ri.pub);
+   c->setSub(ri.sub);
+   addClient(c);
+   return 0;
 }
 
 void ConnectionManager::start() {
@@ -77,6 +202,10 @@ void ConnectionManager::start() {
    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
    pthread_t tid;
    pthread_create(&tid, &attr, run, (void*)this);
+   pthread_attr_destroy(&attr);
+   catchups->start();
+   limits->start();
+   timers->start();
 }
 
 static bool termClients(Client *c, void *user) {
@@ -105,6 +234,51 @@ void ConnectionManager::terminate() {
 void ConnectionManager::remove(Client *c) {
 //  logln("Removing client from " + c->getGpid() + " chain", LINFO1);
    projects.removeClient(c);
+   c->leaveProject();
+   limits->forget(c);
+}
+
+void ConnectionManager::addClient(Client *c) {
+   limits->forget(c);
+   c->beginJoin();
+   projects.addClient(c);
+   //anything stored after this was queued after c could see it
+   c->endJoin(lastUpdateid(c->getPid()));
+   if (moving) {
+      c->handover();
+   }
+}
+
+static bool handoverClient(Client *c, void *user) {
+   c->handover();
+   return true;
+}
+
+void ConnectionManager::handover() {
+   moving = true;
+   projects.loopClients(handoverClient, NULL);
+}
+
+static bool countClients(Client *c, void *user) {
+   (*(uint32_t*)user)++;
+   return true;
+}
+
+uint32_t ConnectionManager::numClients() {
+   uint32_t n = 0;
+   projects.loopClients(countClients, &n);
+   return n;
+}
+
+void ConnectionManager::catchUp(Client *c, uint64_t lastUpdate, bool state) {
+   catchups->submit(c, lastUpdate, state);
+}
+
+uint32_t ConnectionManager::queueDepth() {
+   sem_wait(&queueMutex);
+   uint32_t n = queue.size();
+   sem_post(&queueMutex);
+   return n;
 }
 
 static bool clientStats(Client *c, void *user) {
@@ -125,18 +299,34 @@ string ConnectionManager::dumpStats() {
    else {
       sb = "Stats:\n" + sb;
    }
+   sb += catchups->dumpStats();
+   sb += limits->dumpStats();
+   sb += timers->dumpStats();
    return sb;
 }
 
-static bool dispatch(Client *c, void *user) {
+/**
+ * dispatch is the per client callback used when fanning a Packet out to a project
+ * @param c the client being visited
+ * @param user the Packet being dispatched
+ */
+bool ConnectionManager::dispatch(Client *c, void *user) {
    Packet *p = (Packet*)user;
 
    if (c != p->c) {  //only send to other than originator
-      //increment ref count on json object before sending
-      //because writeJson will decrement it and we can't have the object
-      //garbage collected until all clients have received it
-      json_object_get(p->obj);
-      c->post(p->cmd, p->obj);
+      if (!c->inScope(p->hasAddr, p->addr)) {
+         //outside of the client's address filter
+         return true;
+      }
+      //rendered once, each client is queued a copy of the text
+      c->deliver(p->cmd, p->json(), p->uid);
+   }
+   else if (c->holdAck(p->uid)) {
+      //sent after the client's catch-up, in updateid order
+   }
+   else if (c->getCaps() & CAP_CUMULATIVE_ACK) {
+      //acked along with the originator's other recent updates
+      c->deferAck(p->uid);
    }
    else {
       //send updateid back to the originator
@@ -156,7 +346,14 @@ static bool dispatch(Client *c, void *user) {
 void *ConnectionManager::run(void *arg) {
    ConnectionManager *mgr = (ConnectionManager*)arg;
    while (!mgr->done) {
-      sem_wait(&mgr->queueSem);
+      if (mgr->ackers.empty()) {
+         sem_wait(&mgr->queueSem);
+      }
+      else if (!mgr->waitQueue(mgr->ack_delay)) {
+         //nothing more arrived, don't hold the acks any longer
+         mgr->flushAcks(true);
+         continue;
+      }
       sem_wait(&mgr->queueMutex);
       Packet *p = mgr->queue[0];
       //*** does add/remove need to be synchronized on vectors?
@@ -164,12 +361,59 @@ void *ConnectionManager::run(void *arg) {
       sem_post(&mgr->queueMutex);
       //get the project associated with this notification
       mgr->projects.loopProject(p->c->getPid(), dispatch, p);
+      if (p->c->pendingAcks() > 0 && mgr->ackers.insert(p->c).second) {
+         p->c->acquire();
+      }
       json_object_put(p->obj);
       delete p;
+      if (!mgr->ackers.empty()) {
+         mgr->flushAcks(false);
+      }
    }
    return NULL;
 }
 
+/**
+ * waitQueue waits a limited time for the next queued packet
+ * @param ms how long to wait
+ * @return true if a packet is ready, false on timeout
+ */
+bool ConnectionManager::waitQueue(uint32_t ms) {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += ms / 1000;
+   ts.tv_nsec += (ms % 1000) * 1000000;
+   if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+   }
+   while (sem_timedwait(&queueSem, &ts) != 0) {
+      if (errno != EINTR) {
+         return false;
+      }
+   }
+   return true;
+}
+
+/**
+ * flushAcks sends the deferred acks of clients that have waited long enough
+ * @param all true to flush every client regardless
+ */
+void ConnectionManager::flushAcks(bool all) {
+   uint64_t now = monotonic_ms();
+   for (set<Client*>::iterator i = ackers.begin(); i != ackers.end(); ) {
+      Client *c = *i;
+      if (all || c->pendingAcks() >= ack_batch || now - c->ackSince() >= ack_delay) {
+         c->flushAck();
+         c->release();
+         ackers.erase(i++);
+      }
+      else {
+         i++;
+      }
+   }
+}
+
 static bool clientList(Client *c, void *user) {
    string *s = (string*)user;
    char buf[64];
@@ -35,7 +35,13 @@
 using namespace std;
 
 class Project;
+class Snapshot;
 class NetworkIO;
+class ResumeTokens;
+class CatchupScheduler;
+class TimerWheel;
+class PublishLimiter;
+struct ResumeInfo;
 
 #define AUTH_INVALID_USER ((uint32_t)-1)
 #define AUTH_FAIL ((uint32_t)-2)
@@ -43,6 +49,9 @@ class NetworkIO;
 #define AUTH_INVALID_REPLY ((uint32_t)-4)
 #define FIRST_BAD_UID 0x80000000
 
+//export callback function, receives one serialized update at a time
+typedef bool (*ecb)(uint64_t updateid, const char *update, void *user);
+
 struct UserInfo {
    UserInfo(const char *uname, uint32_t _uid, uint64_t _pub, uint64_t _sub);
    UserInfo();
@@ -62,7 +71,21 @@ public:
    const char *cmd;
    json_object *obj;
    uint64_t uid;
+   //address the update applies to, looked up once rather than per subscriber
+   bool hasAddr;
+   uint64_t addr;
+   //holds a reference to src until the packet is deleted
    Packet(Client *src, const char *cmd, json_object *obj, uint64_t updateid);
+   ~Packet();
+
+   /**
+    * json renders obj the first time a subscriber needs it, the text is
+    * shared by every subscriber and valid until obj is released
+    */
+   const char *json();
+
+private:
+   const char *text;
 };
 
 class ConnectionManager {
@@ -72,8 +95,32 @@ public:
    ProjectMap projects;
    bool done;
 
+   //set once the server has handed over to a new process, see handover
+   bool moving;
+
+   //lets a client whose connection dropped back in without authenticating again
+   ResumeTokens *resume;
+
+   //runs MSG_SEND_UPDATES catch-ups a few at a time
+   CatchupScheduler *catchups;
+
+   //per user and per project limits on published updates
+   PublishLimiter *limits;
+
+   //handshake deadlines and keepalive pings for every connection
+   TimerWheel *timers;
+
 protected:
    map<uint32_t,UserInfo> user_map;
+   sem_t userLock;
+   void setUserInfo(const UserInfo &ui);
+
+   //project snapshots for cold joins, refreshed once snapshot_interval
+   //updates have accumulated after them
+   map<uint32_t,Snapshot*> snapshots;
+   sem_t snapLock;
+   uint32_t snapshot_interval;
+   Snapshot *getSnapshot(uint32_t pid);
 
    vector<Packet*> queue;
    sem_t pidLock;
@@ -86,7 +133,7 @@ public:
    ConnectionManager(json_object *conf);
    virtual ~ConnectionManager() {};
 
-   const UserInfo &getUserInfo(uint32_t uid);
+   UserInfo getUserInfo(uint32_t uid);
 
    void start();
 
@@ -96,6 +143,61 @@ public:
     */
    void remove(Client *c);
 
+   /**
+    * addClient makes a client a member of the project it has just joined
+    * and records the newest update stored at that point, the client is sent
+    * updates up to there by catch-up and ones after it live
+    * @param c the client, its pid must already be set
+    */
+   void addClient(Client *c);
+
+   /**
+    * catchUp answers MSG_SEND_UPDATES.  The history is streamed by one of
+    * the catch-up scheduler's threads so the client's thread keeps reading
+    * its updates, and live updates for the client are held until the
+    * history has been sent
+    * @param c the client requesting updates
+    * @param lastUpdate the last update the client received
+    * @param state true if a cold joining client accepts the project snapshot
+    */
+   void catchUp(Client *c, uint64_t lastUpdate, bool state);
+
+   /**
+    * queueDepth counts the updates waiting to be dispatched
+    */
+   uint32_t queueDepth();
+
+   /**
+    * outQueue is how many updates, and separately how many replies, may
+    * wait to be written to one client before a catch-up sending them is
+    * held up or the client is given up on
+    */
+   uint32_t outQueue() {return out_queue;};
+
+   /**
+    * authTimeout is how many seconds a new connection has to authenticate,
+    * 0 for no limit
+    */
+   uint32_t authTimeout() {return auth_timeout;};
+
+   /**
+    * persistent is false for a manager whose projects live only in this
+    * process, such a server refuses to be taken over
+    */
+   virtual bool persistent() {return true;};
+
+   /**
+    * handover tells every client that can resume elsewhere that a new
+    * server process has taken over, they reconnect to it and resume their
+    * sessions.  Clients that join a project from here on are told as well.
+    */
+   void handover();
+
+   /**
+    * numClients counts the clients in all projects
+    */
+   uint32_t numClients();
+
    /**
     * terminate terminates the connection manager
     * terminates all clients connected to all projects
@@ -114,9 +216,36 @@ public:
     * doAuth authenticates a user
     * Authentication requirements may differ in different ConnectionManager subclasses
     * @param nio The network connection to authenticate
+    * @param resumed receives the session restored if the client presented a resume token
+    * @param caps receives the capabilities agreed with the plugin
     * @return the user id of an authenticated user, or failure code
     */
-   virtual uint32_t doAuth(NetworkIO *nio) = 0;
+   virtual uint32_t doAuth(NetworkIO *nio, ResumeInfo *resumed, uint32_t *caps) = 0;
+
+   /**
+    * authCaps works out the CAP_ flags to use with a plugin
+    * @param obj the plugin's auth or resume request
+    * @return the capabilities both sides support
+    */
+   uint32_t authCaps(json_object *obj);
+
+   /**
+    * resumeAuth redeems the token carried by a MSG_RESUME_REQUEST, this
+    * stands in for the challenge/response in every ConnectionManager
+    * @param obj the resume request
+    * @param resumed receives the session the token was issued for
+    * @return the user id of the resumed session, or failure code
+    */
+   uint32_t resumeAuth(json_object *obj, ResumeInfo *resumed);
+
+   /**
+    * resumeProject puts a client back into the project recorded in its
+    * resume token, nothing is looked up in the database
+    * @param c the newly authenticated client
+    * @param ri the session being resumed
+    * @return 0 on success, negative value on failure
+    */
+   int resumeProject(Client *c, const ResumeInfo &ri);
 
    /**
     * importUpdate is very similar to 'post', importUpdate only
@@ -128,6 +257,15 @@ public:
     */
    virtual void importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj) = 0;
 
+   /**
+    * importUpdates archives a batch of migrated updates in one operation
+    * @param newowner the new uid to attribute the updates to
+    * @param pid the local project id for the migrated project
+    * @param updates json array of complete update objects
+    * @return the number of updates imported, -1 on failure
+    */
+   virtual int importUpdates(const char *newowner, int pid, json_object *updates) = 0;
+
    /**
     * post both queues a newly received update to be sent to other clients and (if in DB mode)
     * archives the udpate in the database so that future clients can receive it
@@ -149,8 +287,26 @@ public:
     * this function is typically called when a user is re-joining a project that they had previously worked on
     * @param c the client requesting updates
     * @param lastUpdate the last update the client received
+    * @param state true if a cold joining client accepts the project snapshot
+    * @param until send nothing after this updateid, 0 for no limit
+    * @return the last updateid the client has been sent, in updates or state
+    */
+   virtual uint64_t sendLatestUpdates(Client *c, uint64_t lastUpdate, bool state = false, uint64_t until = 0) = 0;
+
+   /**
+    * lastUpdateid gets the newest update stored for a project, every update
+    * up to it can be read by sendLatestUpdates once this returns
+    * @param pid the local pid of the project
     */
-   virtual void sendLatestUpdates(Client *c, uint64_t lastUpdate) = 0;
+   virtual uint64_t lastUpdateid(uint32_t pid) = 0;
+
+   /**
+    * snapshotSize gets the size of the project state a cold join is sent
+    * @param pid the local pid of the project
+    * @param updateid receives the updateid the state reaches
+    * @return the number of updates in the state
+    */
+   size_t snapshotSize(uint32_t pid, uint64_t *updateid);
 
    /**
     * getProject gets information related to a local project
@@ -262,11 +418,24 @@ public:
    virtual int importProject(const char *owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub) = 0;
 
    /**
-    * exportProject dumps all project updates
+    * exportProject streams project updates, in updateid order, to a callback
     * @param pid the local project id of the prject to be exported
+    * @param since only updates with an updateid greater than this are exported
+    * @param until only updates with an updateid up to this are exported, 0 for no limit
+    * @param func called with each serialized update, return false to stop
+    * @param user passed through to func
+    * @return the number of updates exported, -1 if the project doesn't exist
     */
 
-   virtual json_object *exportProject(uint32_t pid) = 0;
+   virtual int exportProject(uint32_t pid, uint64_t since, uint64_t until, ecb func, void *user) = 0;
+
+   /**
+    * compactProject removes stored updates that are superseded by later ones
+    * @param pid the local project id of the project to compact
+    * @param watermark only updates up to this updateid are compacted, 0 for all
+    * @return the number of updates removed, -1 if the project doesn't exist
+    */
+   virtual int compactProject(uint32_t pid, uint64_t watermark) = 0;
 
    /**
     * addProject adds a project to the database and reflector (or merely a reflector in non-DB mode)
@@ -296,12 +465,34 @@ public:
     */
    virtual int gpid2lpid(const string &gpid) = 0;
 
+   /**
+    * dispatch sends a queued Packet to one client of the originating project,
+    * other clients receive the update, the originator receives its updateid
+    * @param c the client to send to
+    * @param user the Packet being dispatched
+    * @return true to continue the loop
+    */
+   static bool dispatch(Client *c, void *user);
+
 protected:
    static void *run(void *arg);
 
 private:
    json_object *conf;
 
+   //CAP_ flags this server supports
+   uint32_t caps;
+
+   //cumulative acks, clients with deferred acks are only touched by run
+   uint32_t ack_batch;    //send once this many updates are waiting
+   uint32_t ack_delay;    //or once the oldest has waited this many ms
+   set<Client*> ackers;   //each holds a reference
+
+   uint32_t out_queue;    //bulk lane limit of each client's Outbound
+   uint32_t auth_timeout;
+   bool waitQueue(uint32_t ms);
+   void flushAcks(bool all);
+
 };
 
 
@@ -21,9 +21,11 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <string.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <unistd.h>
 #include <map>
 #include <json-c/json.h>
 
@@ -31,6 +33,10 @@
 #include "utils.h"
 #include "proj_info.h"
 #include "cli_mgr.h"
+#include "resume.h"
+#include "ratelimit.h"
+#include "outbound.h"
+#include "timerwheel.h"
 
 map<string,ClientMsgHandler> *Client::handlers;
 map<string,uint32_t> perms_map;
@@ -46,7 +52,7 @@ map<string,uint32_t> perms_map;
  * @version 0.4.0, August 2012
  */
 
-Client::Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid) {
+Client::Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid, int sock) : idle(idleCheck, this) {
    if (handlers == NULL) {
       init_handlers();
    }
@@ -68,9 +74,37 @@ Client::Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid) {
    pid = INVALID_PID;  //not associated with a project yet
 
    memset(stats, 0, sizeof(stats));
+   sem_init(&filterLock, 0, 1);
+   refs = 1;   //the creating thread's
+   moved = 0;
+   overflowed = 0;
+   caps = 0;
+   ack_uid = 0;
+   ack_count = 0;
+   ack_pid = INVALID_PID;
+   ack_since = 0;
+   sem_init(&catchupLock, 0, 1);
+   sem_init(&catchupIdle, 0, 1);
+   join_mark = 0;
+   joins = 0;
+   holding = false;
+   cancelled = false;
+   catchup_rate = 0;
+   catchup_sent = 0;
+   catchup_bytes = 0;
+   catchup_start = 0;
 
    cm = mgr;
    conn = s;
+   this->sock = sock;
+   sem_init(&sockLock, 0, 1);
+   out = new Outbound(s, mgr->outQueue());
+   last_rx = monotonic_ms();
+   ping_sent = 0;
+   ping_id = 0;
+   if (ping_timeout > 0) {
+      cm->timers->schedule(&idle, ping_timeout * 500);
+   }
 
    //the dummy gpid need to consist entirely of hex values.
    gpid = "deadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeef";
@@ -106,15 +140,35 @@ void Client::clog(int verbosity, const char *format, ...) {
    va_end(argp);
 }
 
+Client::~Client() {
+   cm->timers->cancel(&idle);
+   delete out;
+   dropHeld();
+   sem_destroy(&filterLock);
+   sem_destroy(&catchupLock);
+   sem_destroy(&catchupIdle);
+   sem_destroy(&sockLock);
+}
+
+void Client::acquire() {
+   __sync_fetch_and_add(&refs, 1);
+}
+
+void Client::release() {
+   if (__sync_sub_and_fetch(&refs, 1) == 0) {
+      delete this;
+   }
+}
+
 /**
  * post is the function that actually posts updates to clients (if subscribing)
  * @param data the bytearray containing the update to send
  */
-void Client::post(const char *msg, json_object *obj) {
+void Client::post(const char *msg, json_object *obj, bool wait) {
    if (checkPermissions(msg, subscribe)) {
       //only post if client is subscribing and is allowed to recieve that particular command
       log(LDEBUG, "post- %s\n", json_object_to_json_string(obj));
-      conn->writeJson(obj);
+      queueBulk(obj, wait);
 //      stats[0][data[7] & 0xff]++;
    }
    else {
@@ -122,9 +176,270 @@ void Client::post(const char *msg, json_object *obj) {
       log(LINFO3, "Client %s:%s:%d failed to post data. (probably subscribe permission: "
                          + parseCommand(data) + ")", hash.c_str(), conn->getInetAddress().getHostAddress(), conn->getPeerPort());
 */
+      json_object_put(obj);
+   }
+}
+
+void Client::queueBulk(json_object *obj, bool wait) {
+   if (overflowed) {
+      //on its way out, nothing more is sent
+      json_object_put(obj);
+   }
+   else if (!out->send(obj, LANE_BULK, wait)) {
+      overflow();
    }
 }
 
+void Client::overflow() {
+   if (__sync_bool_compare_and_swap(&overflowed, 0, 1)) {
+      clog(LINFO, "Fell %u messages behind, disconnecting\n", cm->outQueue());
+      disconnect();
+   }
+}
+
+void Client::disconnect() {
+   //terminate clears sock before closing it, so it can't have been reused
+   sem_wait(&sockLock);
+   if (sock >= 0) {
+      shutdown(sock, SHUT_RDWR);
+   }
+   sem_post(&sockLock);
+}
+
+void Client::deferAck(uint64_t uid) {
+   if (ack_count > 0 && ack_pid != pid) {
+      //the plugin records acks against the project it is in now
+      flushAck();
+   }
+   if (ack_count++ == 0) {
+      ack_since = monotonic_ms();
+   }
+   if (uid > ack_uid) {
+      ack_uid = uid;
+   }
+   ack_pid = pid;
+}
+
+bool Client::flushAck() {
+   if (ack_count == 0) {
+      return false;
+   }
+   sendAck(ack_uid, ack_count);
+   ack_count = 0;
+   ack_uid = 0;
+   return true;
+}
+
+void Client::sendAck(uint64_t uid, uint32_t count, bool wait) {
+   json_object *obj = json_object_new_object();
+   append_json_string_val(obj, "type", MSG_ACK_UPDATEID);
+   append_json_uint64_val(obj, "updateid", uid);
+   if (caps & CAP_CUMULATIVE_ACK) {
+      append_json_uint32_val(obj, "count", count);
+   }
+   queueBulk(obj, wait);
+}
+
+//join_mark while the client is being added to a project
+#define JOIN_PENDING 0xffffffffffffffffULL
+
+void Client::beginJoin() {
+   sem_wait(&catchupLock);
+   cancelled = true;
+   dropHeld();
+   //the join reply mustn't be followed by the last project's updates
+   out->dropBulk();
+   joins++;
+   join_mark = JOIN_PENDING;
+   holding = (caps & CAP_JOIN_CATCHUP) != 0;
+   __sync_synchronize();
+}
+
+void Client::endJoin(uint64_t mark) {
+   join_mark = mark;
+   sem_post(&catchupLock);
+}
+
+void Client::leaveProject() {
+   sem_wait(&catchupLock);
+   cancelled = true;
+   dropHeld();
+   out->dropBulk();
+   joins++;
+   join_mark = 0;
+   holding = false;
+   sem_post(&catchupLock);
+}
+
+//catchupLock must be held
+void Client::dropHeld() {
+   for (vector<HeldUpdate>::iterator i = held.begin(); i != held.end(); i++) {
+      if (i->obj != NULL) {
+         json_object_put(i->obj);
+      }
+   }
+   held.clear();
+}
+
+bool Client::beginCatchup(uint32_t join, uint64_t *mark, uint32_t rate) {
+   //one catch-up at a time, a cancelled one finishes quickly
+   sem_wait(&catchupIdle);
+   sem_wait(&catchupLock);
+   bool current = join == joins;
+   if (current) {
+      cancelled = false;
+      holding = true;
+      *mark = join_mark;
+      catchup_rate = rate;
+      catchup_sent = 0;
+      catchup_bytes = 0;
+      catchup_start = monotonic_ms();
+   }
+   sem_post(&catchupLock);
+   if (!current) {
+      sem_post(&catchupIdle);
+   }
+   return current;
+}
+
+void Client::endCatchup(uint64_t covered) {
+   sem_wait(&catchupLock);
+   if (!cancelled) {
+      //acks are coalesced only between updates so they stay in order
+      uint64_t acked = 0;
+      uint32_t acks = 0;
+      bool cumulative = (caps & CAP_CUMULATIVE_ACK) != 0;
+      for (vector<HeldUpdate>::iterator i = held.begin(); i != held.end(); i++) {
+         if (i->obj == NULL) {
+            acked = i->uid;
+            acks++;
+            if (!cumulative) {
+               sendAck(acked, acks, true);
+               acks = 0;
+            }
+            continue;
+         }
+         if (acks > 0) {
+            sendAck(acked, acks, true);
+            acks = 0;
+         }
+         if (i->uid > covered) {
+            post(i->cmd.c_str(), i->obj, true);
+         }
+         else {
+            //already part of the project state the client was sent
+            json_object_put(i->obj);
+         }
+      }
+      if (acks > 0) {
+         sendAck(acked, acks, true);
+      }
+      held.clear();
+      holding = false;
+   }
+   sem_post(&catchupLock);
+   sem_post(&catchupIdle);
+}
+
+bool Client::replay(const char *msg, json_object *obj, size_t len) {
+   sem_wait(&catchupLock);
+   bool res = !cancelled;
+   if (res) {
+      post(msg, obj, true);
+   }
+   else {
+      json_object_put(obj);
+   }
+   sem_post(&catchupLock);
+   catchup_sent++;
+   catchup_bytes += len;
+   if (res && catchup_rate != 0) {
+      //pace outside of catchupLock so live updates can still be held
+      uint64_t due = catchup_bytes * 1000 / catchup_rate;
+      uint64_t elapsed = monotonic_ms() - catchup_start;
+      if (due > elapsed) {
+         usleep((due - elapsed) * 1000);
+      }
+   }
+   return res;
+}
+
+//json-c objects can't be shared between threads, each writer is given
+//one of its own that writes out the text rendered for every recipient
+void Client::deliver(const char *msg, const char *json, uint64_t uid) {
+   if (holding || join_mark == JOIN_PENDING) {
+      sem_wait(&catchupLock);
+      if (uid <= join_mark) {
+         //predates the join, catch-up sends it
+      }
+      else if (holding) {
+         //sent by the catch-up thread once the history is out
+         HeldUpdate h = {uid, msg, json_object_new_raw(json)};
+         held.push_back(h);
+      }
+      else if (canReceive(msg)) {
+         post(msg, json_object_new_raw(json));
+      }
+      sem_post(&catchupLock);
+   }
+   else if (uid > join_mark && canReceive(msg)) {
+      post(msg, json_object_new_raw(json));
+   }
+}
+
+void Client::idleCheck(void *arg) {
+   Client *c = (Client*)arg;
+   uint64_t limit = ping_timeout * 1000;
+   uint64_t now = monotonic_ms();
+   uint64_t last = c->last_rx;
+   uint64_t quiet = now > last ? now - last : 0;
+   if (quiet >= limit) {
+      //a half open connection, shut down rather than closed so the
+      //reading thread wakes, sees it end and is the one to close it
+      c->clog(LINFO, "Nothing heard for %u seconds, disconnecting\n", (uint32_t)(quiet / 1000));
+      c->disconnect();
+      return;
+   }
+   if (quiet < limit / 2) {
+      c->cm->timers->schedule(&c->idle, limit / 2 - quiet);
+      return;
+   }
+   if (c->ping_sent <= last) {
+      //the plugin answers with MSG_PONG, any other traffic will do as well
+      json_object *obj = json_object_new_object();
+      append_json_uint64_val(obj, "id", ++c->ping_id);
+      c->send_data(MSG_PING, obj);
+      c->ping_sent = now;
+   }
+   c->cm->timers->schedule(&c->idle, limit - quiet);
+}
+
+bool Client::holdAck(uint64_t uid) {
+   if (!holding) {
+      return false;
+   }
+   sem_wait(&catchupLock);
+   bool res = holding;
+   if (res) {
+      HeldUpdate h = {uid, "", NULL};
+      held.push_back(h);
+   }
+   sem_post(&catchupLock);
+   return res;
+}
+
+bool Client::inScope(bool hasAddr, uint64_t ea) {
+   sem_wait(&filterLock);
+   bool result = filter.accepts(hasAddr, ea);
+   sem_post(&filterLock);
+   return result;
+}
+
+bool Client::inScope(json_object *update) {
+   uint64_t ea = 0;
+   bool hasAddr = AddrFilter::address(update, &ea);
+   return inScope(hasAddr, ea);
+}
 
 /**
  * similar to post, but does not check subscription status, and takes command as a arg
@@ -142,8 +457,19 @@ void Client::send_data(const char *command, json_object *obj) {
       }
       json_object_object_add_ex(obj, "type", json_object_new_string(command), JSON_NEW_CONST_KEY);
 
-      log(LDEBUG, "Client::send_data calling conn->writeJson\n");
-      conn->writeJson(obj);  //calls json_object_put
+      log(LDEBUG, "Client::send_data queueing %s\n", command);
+      //acks and project state belong with the updates they are about,
+      //everything else goes ahead of any updates still waiting.  Project
+      //state comes from a catch-up thread, acks from the dispatcher.
+      if (strcmp(command, MSG_PROJECT_STATE) == 0) {
+         queueBulk(obj, true);
+      }
+      else if (strcmp(command, MSG_ACK_UPDATEID) == 0) {
+         queueBulk(obj, false);
+      }
+      else if (!out->send(obj, LANE_CONTROL, false)) {
+         overflow();
+      }
       //fprintf(stderr, "send_data- cmd: %s\n");
 //      stats[0][command]++;    //figure out way to count messages - map???
 /*
@@ -185,8 +511,67 @@ void Client::send_error_msg(string theerror, const char *type) {
  */
 void Client::terminate() {
 //   log(LINFO, "Client %s:%s:%d terminating\n", hash.c_str(), conn->getPeerAddr().c_str(), conn->getPeerPort());
+   cm->timers->cancel(&idle);
+   sem_wait(&sockLock);
+   sock = -1;
+   sem_post(&sockLock);
    conn->close();
+   //closing the connection fails any write in progress
+   out->stop();
    cm->remove(this);
+   //the token stays good for a little while so the plugin can resume
+   cm->resume->release(resume_token);
+}
+
+/**
+ * send_join_reply sends MSG_PROJECT_JOIN_REPLY, on success it carries the
+ * project's gpid and a new resume token for this session
+ * @param success true if the client is now in a project
+ */
+void Client::send_join_reply(bool success) {
+   json_object *resp = json_object_new_object();
+   if (success) {
+      append_json_int32_val(resp, "reply", JOIN_REPLY_SUCCESS);
+      append_json_string_val(resp, "gpid", gpid);
+      ResumeInfo ri;
+      ri.user = UserInfo(username.c_str(), uid, upublish, usubscribe);
+      ri.pid = pid;
+      ri.gpid = gpid;
+      ri.hash = hash;
+      ri.pub = publish;
+      ri.sub = subscribe;
+      ri.rpub = rpublish;
+      ri.rsub = rsubscribe;
+      cm->resume->revoke(resume_token);
+      resume_token = cm->resume->issue(ri);
+      if (resume_token.length() > 0) {
+         append_json_string_val(resp, "resume", resume_token);
+      }
+   }
+   else {
+      append_json_int32_val(resp, "reply", JOIN_REPLY_FAIL);
+   }
+   send_data(MSG_PROJECT_JOIN_REPLY, resp);
+}
+
+/**
+ * resume puts a client that presented a resume token back into the project
+ * it was in and sends the plugin the usual join reply
+ * @param ri the session the token was issued for
+ */
+void Client::resume(const ResumeInfo &ri) {
+   if (cm->resumeProject(this, ri) >= 0) {
+      clog(LINFO, "%s resumed project %u\n", username.c_str(), pid);
+      send_join_reply(true);
+   }
+}
+
+void Client::handover() {
+   if ((caps & CAP_HANDOVER) == 0 || __sync_lock_test_and_set(&moved, 1) != 0) {
+      return;
+   }
+   clog(LINFO4, "Sending %s to the new server\n", username.c_str());
+   send_data(MSG_SERVER_RESTART, json_object_new_object());
 }
 
 /**
@@ -195,6 +580,7 @@ void Client::terminate() {
 string Client::dumpStats() {
 //   string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + ":" + conn.getPeerPort() + "\n";
    string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + "\n";
+   sb += out->dumpStats();
    sb += "command     rx     tx\n";
    for (int i = 0; i < 256; i++) {
       if (stats[0][i] != 0 || stats[1][i] != 0) {
@@ -251,8 +637,8 @@ string Client::getPeerAddr() {
 void Client::run() {
    //in here read and write from/to the socket in order
    //to give the service some functionality
+   bool done = false;
    try {
-      bool done = false;
       while (!done) {
          json_object *obj = conn->readJson();
          if (obj == NULL) {
@@ -260,6 +646,7 @@ void Client::run() {
             //received something that can't be parsed, bail
             break;
          }
+         last_rx = monotonic_ms();
          const char *cmd = string_from_json(obj, "type");
          log(LINFO, "processing %s\n", cmd);
          map<string,ClientMsgHandler>::iterator i = handlers->find(cmd);
@@ -278,7 +665,10 @@ void Client::run() {
                //only post if this client chose to publish,
                //(though they really shouldn't have sent any data if they are not publishing)
                if (checkPermissions(cmd, publish)) {
-                  cm->post(this, cmd, obj);
+                  //the limiter may hold this thread up, or take obj
+                  if (cm->limits->admit(this, obj)) {
+                     cm->post(this, cmd, obj);
+                  }
                }
                else {
                   log(LINFO, "Skipping update no permissions\n");
@@ -306,6 +696,10 @@ void Client::run() {
       log(LERROR, "An IOException occurred: %s\n", ex.getMessage().c_str());
    }
    log(LINFO, "Client loop has ended\n");
+   if (done) {
+      //make sure the plugin hears why it is being disconnected
+      out->stop(true);
+   }
    terminate();
 }
 
@@ -326,6 +720,8 @@ void Client::init_handlers() {
    (*handlers)[MSG_GET_REQ_PERMS] = msg_get_req_perms;
    (*handlers)[MSG_GET_PROJ_PERMS] = msg_get_proj_perms;
    (*handlers)[MSG_SET_PROJ_PERMS] = msg_set_proj_perms;
+   (*handlers)[MSG_SET_FILTER] = msg_set_filter;
+   (*handlers)[MSG_PONG] = msg_pong;
 
    perms_map[COMMAND_UNDEFINE] = MASK_UNDEFINE;
    perms_map[COMMAND_MAKE_CODE] = MASK_MAKE_CODE;
@@ -412,17 +808,14 @@ bool Client::msg_project_new_request(json_object *obj, Client *c) {
 
 //   c->clogln(LDEBUG, "desired new project pub " + pub + ", and sub " + sub);
    int lpid = c->cm->addProject(c, c->hash, desc, pub, sub);
-   json_object *resp = json_object_new_object();
    if (lpid >= 0) {
 //      c->clog(LDEBUG, "NEW PROJECT REQUEST success\n");
-      append_json_int32_val(resp, "reply", JOIN_REPLY_SUCCESS);
-      append_json_string_val(resp, "gpid", c->gpid);
+      c->send_join_reply(true);
    }
    else {
       c->clog(LINFO, "NEW PROJECT REQUEST fail\n");
-      append_json_int32_val(resp, "reply", JOIN_REPLY_FAIL);
+      c->send_join_reply(false);
    }
-   c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
    return false;
 }
 
@@ -436,17 +829,14 @@ bool Client::msg_project_join_request(json_object *obj, Client *c) {
    c->rsubscribe &= 0x7FFFFFFF;
 
 //   c->clog(LINFO, "attempting to join project " + lpid);
-   json_object *resp = json_object_new_object();
    if (c->cm->joinProject(c, lpid) >= 0 ) {
-      append_json_int32_val(resp, "reply", JOIN_REPLY_SUCCESS);
-      append_json_string_val(resp, "gpid", c->gpid);
+      c->send_join_reply(true);
 //      c->clogln(LINFO, "...success" + lpid);
    }
    else {
-      append_json_int32_val(resp, "reply", JOIN_REPLY_FAIL);
+      c->send_join_reply(false);
 //      c->clogln(LINFO, "...failed" + lpid);
    }
-   c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
    return false;
 }
 
@@ -470,15 +860,11 @@ bool Client::msg_project_rejoin_request(json_object *obj, Client *c) {
    c->rpublish = tpub;
    c->rsubscribe = tsub;
 //   c->clog(LDEBUG, "plugin requested rpub: " + rpublish + " rsub: " + rsubscribe);
-   json_object *resp = json_object_new_object();
    if (c->cm->joinProject(c, lpid) >= 0 ) {
-      append_json_int32_val(resp, "reply", JOIN_REPLY_SUCCESS);
-      append_json_string_val(resp, "gpid", gpid);
-      c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
+      c->send_join_reply(true);
    }
    else {
-      append_json_int32_val(resp, "reply", JOIN_REPLY_FAIL);
-      c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
+      c->send_join_reply(false);
       c->send_error("Tried to join a project that doesn't exist on this server:" + gpid);
       c->send_fatal("This idb is associated with a project not found on this server.\n Maybe you connected to the wrong collabREate server,\n or maybe the project has been deleted...");
       res = true;
@@ -507,22 +893,15 @@ bool Client::msg_project_snapshot_request(json_object *obj, Client *c) {
 
 bool Client::msg_project_fork_request(json_object *obj, Client *c) {
    string desc = string_from_json(obj, "description");
-   int response = JOIN_REPLY_FAIL;
    uint64_t lastupdateid;
    uint64_from_json(obj, "last_update", &lastupdateid);
 //                 logln("in FORK REQUEST", LDEBUG);
-   json_object *resp = json_object_new_object();
 
    //if the user set these at the time of the fork
    //they would be read here.  Instead we allow the owner to
    //manage permissions at any time via the modal dialog box
-   if (c->cm->forkProject(c, lastupdateid, desc) >= 0) {
-      //on successfull fork, join the 'new' project automatically
-      response = JOIN_REPLY_SUCCESS;
-      append_json_string_val(resp, "gpid", c->gpid);
-   }
-   append_json_int32_val(resp, "reply", response);
-   c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
+   //on successfull fork, join the 'new' project automatically
+   c->send_join_reply(c->cm->forkProject(c, lastupdateid, desc) >= 0);
    return false;
 }
 
@@ -534,25 +913,21 @@ bool Client::msg_project_snapfork_request(json_object *obj, Client *c) {
    pub &= 0x7FFFFFFF;
    uint64_from_json(obj, "sub", &sub);
    sub &= 0x7FFFFFFF;
-   int response = JOIN_REPLY_FAIL;
 //                 logln("in FORK REQUEST", LDEBUG);
-   json_object *resp = json_object_new_object();
 
    int lpid;
    int32_from_json(obj, "lpid", &lpid);
-   if (c->cm->snapforkProject(c, lpid, desc, pub, sub) >= 0) {
-      //on successfull fork from snapshop, join the 'new' project automatically
-      response = JOIN_REPLY_SUCCESS;
-      append_json_string_val(resp, "gpid", c->gpid);
-   }
-   append_json_int32_val(resp, "reply", response);
-   c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
+   //on successfull fork from snapshop, join the 'new' project automatically
+   c->send_join_reply(c->cm->snapforkProject(c, lpid, desc, pub, sub) >= 0);
    return false;
 }
 
 bool Client::msg_project_leave(json_object *obj, Client *c) {
    c->clog(LDEBUG, "in PROJECT LEAVE\n");
    c->cm->remove(c);
+   //no longer in a project, nothing to resume
+   c->cm->resume->revoke(c->resume_token);
+   c->resume_token.clear();
    return false;
 }
 
@@ -624,10 +999,49 @@ bool Client::msg_project_list(json_object *obj, Client *c) {
 }
 
 bool Client::msg_send_updates(json_object *obj, Client *c) {
-   uint64_t lastupdate;
+   uint64_t lastupdate = 0;
+   bool state = false;
    uint64_from_json(obj, "last_update", &lastupdate);
+   //clients that understand MSG_PROJECT_STATE ask for it on a cold join
+   bool_from_json(obj, "state", &state);
 //      c->clogln(LINFO1, "Received client->send_UPDATES request for %llu to current", lastupdate);
-   c->cm->sendLatestUpdates(c, lastupdate);
+   //streamed by a thread of its own, this one goes back to reading the client
+   c->cm->catchUp(c, lastupdate, state);
+   return false;
+}
+
+/*
+ * replace the client's address filter, an empty range list removes it
+ */
+bool Client::msg_set_filter(json_object *obj, Client *c) {
+   json_object *ranges;
+   bool unaddressed = true;
+   bool_from_json(obj, "unaddressed", &unaddressed);
+   sem_wait(&c->filterLock);
+   c->filter.clear();
+   c->filter.unaddressed = unaddressed;
+   if (json_object_object_get_ex(obj, "ranges", &ranges) && json_object_is_type(ranges, json_type_array)) {
+      size_t len = json_object_array_length(ranges);
+      for (size_t i = 0; i < len; i++) {
+         json_object *range = json_object_array_get_idx(ranges, i);
+         uint64_t start, end;
+         if (uint64_from_json(range, "start", &start) && uint64_from_json(range, "end", &end)) {
+            c->filter.add(start, end);
+         }
+      }
+   }
+   uint32_t count = (uint32_t)c->filter.ranges();
+   sem_post(&c->filterLock);
+   log(LINFO3, "client %s set an address filter with %u ranges\n", c->username.c_str(), count);
+   json_object *resp = json_object_new_object();
+   append_json_uint32_val(resp, "ranges", count);
+   append_json_bool_val(resp, "unaddressed", unaddressed);
+   c->send_data(MSG_SET_FILTER_REPLY, resp);
+   return false;
+}
+
+bool Client::msg_pong(json_object *obj, Client *c) {
+   //hearing from the client at all is what counts, see idleCheck
    return false;
 }
 
@@ -23,15 +23,21 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <stdint.h>
+#include <semaphore.h>
 #include <json-c/json.h>
 #include "io.h"
 #include "utils.h"
+#include "addrfilter.h"
+#include "timerwheel.h"
 
 using namespace std;
 
 class ConnectionManager;
 class Client;
+class Outbound;
+struct ResumeInfo;
 
 typedef bool (*ClientMsgHandler)(json_object *obj, Client *c);
 
@@ -47,9 +53,28 @@ typedef bool (*ClientMsgHandler)(json_object *obj, Client *c);
  */
 
 class Client {
+   friend class MicroBench;
 public:
 
-   Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid);
+   /**
+    * @param sock the socket under s, see connection_socket, or -1 if it
+    * isn't known, in which case the client can't be disconnected from
+    * another thread
+    */
+   Client(ConnectionManager *mgr, NetworkIO *s, uint32_t uid, int sock = -1);
+
+   /**
+    * acquire takes a reference to the client.  Its own thread, each ClientSet
+    * it belongs to and each queued Packet it originated hold one, so a
+    * client that disconnects lives until nothing can still be using it.
+    */
+   void acquire();
+
+   /**
+    * release drops a reference, the last one deletes the client.  Never
+    * delete a Client directly.
+    */
+   void release();
 
    void run();
 
@@ -137,8 +162,27 @@ public:
     * post is the function that actually posts updates to clients (if subscribing)
     * @param msg message being sent
     * @param obj message with associated parameters expressed as a json object
+    * @param wait true to wait for room behind the updates already queued,
+    * false to disconnect a client that has fallen that far behind.  Only
+    * catch-up threads may wait, the dispatcher serves everyone.
     */
-   void post(const char *msg, json_object *obj);
+   void post(const char *msg, json_object *obj, bool wait = false);
+
+   /**
+    * canReceive checks whether the client subscribes to a given command
+    * @param msg the command to check
+    */
+   bool canReceive(const char *msg) {
+      return checkPermissions(msg, subscribe);
+   }
+
+   /**
+    * inScope checks an update against the client's address filter
+    * @param hasAddr true if the update carries an address
+    * @param ea the update's address, ignored if hasAddr is false
+    */
+   bool inScope(bool hasAddr, uint64_t ea);
+   bool inScope(json_object *update);
 
    /**
     * similar to post, but does not check subscription status, and takes command as a arg
@@ -301,10 +345,129 @@ public:
       return username;
    }
 
+   /**
+    * resume puts a client that presented a resume token back into the project
+    * it was in and sends the plugin the usual join reply
+    * @param ri the session the token was issued for
+    */
+   void resume(const ResumeInfo &ri);
+
+   /**
+    * the CAP_ flags agreed with the plugin at auth time
+    */
+   uint32_t getCaps() {return caps;};
+   void setCaps(uint32_t c) {caps = c;};
+
+   /**
+    * deferAck notes that one of this client's updates has been dispatched,
+    * the ack is left for flushAck so one message can cover several updates.
+    * Only for clients with CAP_CUMULATIVE_ACK, and only called from the
+    * dispatch thread, as are flushAck and the accessors below.
+    * @param uid the updateid assigned to the update
+    */
+   void deferAck(uint64_t uid);
+
+   /**
+    * flushAck sends a single ack_updateid for every deferred update
+    * @return true if there was anything to ack
+    */
+   bool flushAck();
+
+   uint32_t pendingAcks() {return ack_count;};
+   uint64_t ackSince() {return ack_since;};
+
+   /**
+    * beginJoin is called as the client is added to a project, before it is
+    * visible to the dispatch thread.  Any catch-up still running for the
+    * previous project is cancelled and, for clients with CAP_JOIN_CATCHUP,
+    * live updates are held from here on.  endJoin must follow.
+    */
+   void beginJoin();
+
+   /**
+    * endJoin completes beginJoin
+    * @param mark the newest update stored for the project once the client
+    * was visible to the dispatch thread, anything up to it is left to catch-up
+    */
+   void endJoin(uint64_t mark);
+
+   /**
+    * leaveProject cancels any catch-up and drops held updates
+    */
+   void leaveProject();
+
+   /**
+    * handover tells the plugin a new server process has taken over, it
+    * reconnects and resumes its session there.  Sent once, and only to
+    * plugins with CAP_HANDOVER.
+    */
+   void handover();
+
+   /**
+    * joinCount identifies the client's current join, a catch-up requested
+    * under one join is abandoned if the client has joined again since
+    */
+   uint32_t joinCount() {return joins;};
+
+   /**
+    * beginCatchup starts holding live updates for a catch-up, waiting for
+    * any earlier catch-up of this client to finish first
+    * @param join the joinCount when the catch-up was requested
+    * @param mark receives the join mark, history after it arrives live
+    * @param rate bytes per second replay is paced to, 0 for no limit
+    * @return false if the client has joined again since, endCatchup must
+    * not be called
+    */
+   bool beginCatchup(uint32_t join, uint64_t *mark, uint32_t rate = 0);
+
+   /**
+    * endCatchup sends the held updates that follow the history just
+    * streamed, in updateid order, and goes back to posting live updates
+    * @param covered the last updateid the history (or state) covered
+    */
+   void endCatchup(uint64_t covered);
+
+   /**
+    * replay posts an update read from the project history during catch-up
+    * @param len the size of the update as stored, for pacing
+    * @return false if the catch-up was cancelled, the update is dropped
+    */
+   bool replay(const char *msg, json_object *obj, size_t len = 0);
+
+   /**
+    * catchupSent counts the updates replayed by the current catch-up
+    */
+   uint64_t catchupSent() {return catchup_sent;};
+
+   /**
+    * joinMark is the newest update stored for the project when the client
+    * joined it
+    */
+   uint64_t joinMark() {return join_mark;};
+
+   /**
+    * deliver is used by the dispatch thread in place of post, live updates
+    * the catch-up will send are dropped and the rest are held while one runs
+    * @param json the update as rendered for every recipient, deliver keeps a
+    * copy of its own if there is anything to send
+    * @param uid the updateid of the update
+    */
+   void deliver(const char *msg, const char *json, uint64_t uid);
+
+   /**
+    * holdAck is used by the dispatch thread before acking one of this
+    * client's updates, while a catch-up runs the ack is held with the updates
+    * so the plugin never records an updateid ahead of the history it has
+    * @return true if the ack was held
+    */
+   bool holdAck(uint64_t uid);
+
    void setChallenge(const uint8_t *data, uint32_t len);
    const uint8_t *getChallenge(uint32_t &len) {len = CHALLENGE_SIZE; return challenge;};
 
 private:
+   ~Client();
+
    /**
     * checkPermissions checks to see if the current client has permissions to perform an operation
     * @param command the command to check permissions on
@@ -317,7 +480,58 @@ private:
    bool checkPermissions(const char *command, uint64_t permType);
    static void init_handlers();
 
+   //a live update or, with obj NULL, an ack held during catch-up
+   struct HeldUpdate {
+      uint64_t uid;
+      string cmd;
+      json_object *obj;
+   };
+   void dropHeld();
+   void sendAck(uint64_t uid, uint32_t count, bool wait = false);
+
+   /**
+    * queueBulk queues an update or ack behind those already waiting
+    * @param wait as for post
+    */
+   void queueBulk(json_object *obj, bool wait);
+
+   /**
+    * overflow disconnects a client whose bulk lane was full when the
+    * dispatcher came to queue for it, or whose control lane was full, its
+    * own thread sees the connection end and terminates
+    */
+   void overflow();
+
+   /**
+    * disconnect shuts down the client's socket from another thread, its
+    * own thread sees the connection end and terminates.  Does nothing
+    * once terminate has started closing the connection.
+    */
+   void disconnect();
+
+   /**
+    * send_join_reply sends MSG_PROJECT_JOIN_REPLY, on success it carries the
+    * project's gpid and a new resume token for this session
+    * @param success true if the client is now in a project
+    */
+   void send_join_reply(bool success);
+
    NetworkIO *conn;
+   int sock;        //the descriptor under conn, -1 once it is being closed
+   sem_t sockLock;
+   Outbound *out;    //written by a thread of its own, control ahead of updates
+
+   /**
+    * idleCheck runs on the timer wheel.  A client that has been silent for
+    * half of ping_timeout is pinged, one silent for all of it is
+    * disconnected.  Reading doesn't touch the timer, it is pushed back
+    * here when it finds there has been traffic since it was set.
+    */
+   static void idleCheck(void *arg);
+   Timer idle;
+   volatile uint64_t last_rx;   //monotonic_ms when the client was last heard
+   uint64_t ping_sent;
+   uint64_t ping_id;
    string hash;
    string username;
 
@@ -331,14 +545,43 @@ private:
    uint64_t rpublish;
    uint64_t rsubscribe;
 
+   //optional address scoped subscription, set by MSG_SET_FILTER
+   AddrFilter filter;
+   sem_t filterLock;
+
    uint32_t uid;  //user id associated with this connection
    uint32_t pid;
 
    string gpid;  //project id associated with this connection
+   string resume_token;  //most recent token issued to this session
    uint8_t challenge[CHALLENGE_SIZE];
 
    ConnectionManager *cm;
 
+   volatile int refs;
+   volatile int moved;   //told to reconnect to the server taking over
+   volatile int overflowed;   //fell too far behind the dispatcher, see overflow
+
+   uint32_t caps;
+   //deferred acks, highest updateid, how many and when the first was deferred
+   uint64_t ack_uid;
+   uint32_t ack_count;
+   uint32_t ack_pid;
+   uint64_t ack_since;
+
+   //catch-up state, shared with the dispatch and catch-up threads
+   sem_t catchupLock;
+   sem_t catchupIdle;     //held by the running catch-up
+   volatile uint64_t join_mark;
+   uint32_t joins;
+   volatile bool holding;
+   bool cancelled;
+   vector<HeldUpdate> held;
+   uint32_t catchup_rate;
+   volatile uint64_t catchup_sent;
+   uint64_t catchup_bytes;
+   uint64_t catchup_start;
+
    int stats[2][MAX_COMMAND];
 
    static map<string,ClientMsgHandler> *handlers;
@@ -358,6 +601,8 @@ private:
    static bool msg_get_req_perms(json_object *obj, Client *c);
    static bool msg_get_proj_perms(json_object *obj, Client *c);
    static bool msg_set_proj_perms(json_object *obj, Client *c);
+   static bool msg_set_filter(json_object *obj, Client *c);
+   static bool msg_pong(json_object *obj, Client *c);
 
 };
 
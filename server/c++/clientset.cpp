@@ -18,52 +18,82 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <algorithm>
+
 #include "client.h"
 #include "clientset.h"
+#include "epoch.h"
+
+static void free_clients(void *ptr) {
+   delete (vector<Client*>*)ptr;
+}
+
+//drop the set's reference once no loop can still be visiting the client
+static void release_client(void *ptr) {
+   ((Client*)ptr)->release();
+}
 
 ClientSet::ClientSet() {
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init(&attr);
-   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-   pthread_mutex_init(&mutex, &attr);
-   pthread_mutexattr_destroy(&attr);
+   clients = new vector<Client*>;
+   pthread_mutex_init(&writer, NULL);
 }
 
 ClientSet::~ClientSet() {
-   pthread_mutex_destroy(&mutex);
+   delete clients;
+   pthread_mutex_destroy(&writer);
 }
 
 //add a new client
 void ClientSet::add(Client *c) {
-   pthread_mutex_lock(&mutex);
-   clients.insert(c);
-   pthread_mutex_unlock(&mutex);
+   vector<Client*> *old = NULL;
+   pthread_mutex_lock(&writer);
+   if (find(clients->begin(), clients->end(), c) == clients->end()) {
+      vector<Client*> *cl = new vector<Client*>(*clients);
+      cl->push_back(c);
+      c->acquire();
+      old = clients;
+      __sync_synchronize();
+      clients = cl;
+   }
+   pthread_mutex_unlock(&writer);
+   if (old) {
+      epoch_retire(free_clients, old);
+   }
 }
 
 //remove a client
 void ClientSet::remove(Client *c) {
-   pthread_mutex_lock(&mutex);
-   clients.erase(c);
-   pthread_mutex_unlock(&mutex);
+   vector<Client*> *old = NULL;
+   pthread_mutex_lock(&writer);
+   vector<Client*>::iterator i = find(clients->begin(), clients->end(), c);
+   if (i != clients->end()) {
+      vector<Client*> *cl = new vector<Client*>(clients->begin(), i);
+      cl->insert(cl->end(), i + 1, clients->end());
+      old = clients;
+      __sync_synchronize();
+      clients = cl;
+   }
+   pthread_mutex_unlock(&writer);
+   if (old) {
+      epoch_retire(free_clients, old);
+      epoch_retire(release_client, c);
+   }
 }
 
-//iterate over all clients in the set
+//iterate over all clients in the set, as of the time the loop started
 void ClientSet::loop(cb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (set<Client*>::iterator i = clients.begin(); i != clients.end(); i++) {
+   EpochGuard g;
+   const vector<Client*> *cl = clients;
+   for (vector<Client*>::const_iterator i = cl->begin(); i != cl->end(); i++) {
       Client *c = *i;
       if (!(*func)(c, user)) {
          break;
       }
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //return the size of the client set
 int ClientSet::size() {
-   pthread_mutex_lock(&mutex);
-   int res = clients.size();
-   pthread_mutex_unlock(&mutex);
-   return res;
+   EpochGuard g;
+   return clients->size();
 }
-
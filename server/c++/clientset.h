@@ -36,10 +36,19 @@ using namespace std;
 
 typedef bool (*cb)(Client *c, void *user);
 
+/**
+ * ClientSet
+ * The clients subscribed to a project.  Membership is an immutable array
+ * that is copied and republished on every add or remove, so iterating it
+ * never takes a lock and a slow fan-out never holds up a join or leave.
+ * Replaced arrays are freed through epoch reclamation.  Membership holds a
+ * reference to the client which is only dropped once every loop that may
+ * have seen it has finished.
+ */
 class ClientSet {
 private:
-   set<Client*> clients;
-   pthread_mutex_t mutex;
+   vector<Client*> *volatile clients;
+   pthread_mutex_t writer;      //serializes add and remove
 
 public:
    ClientSet();
@@ -0,0 +1,1056 @@
+/*
+   collabREate collab_bench.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <openssl/md5.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <json-c/json.h>
+
+#include "utils.h"
+
+using namespace std;
+
+/**
+ * collab_bench
+ * Standalone load generator for the collabREate server. Each simulated
+ * analyst speaks the same protocol as the IDA plugin: it answers the
+ * initial challenge, creates or rejoins a project and then publishes
+ * updates while reading everything the server reflects back to it.
+ * Works against both basic and database mode servers.
+ */
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT 5042
+#define DEFAULT_USER "bench"
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_UPDATES 1000
+#define DEFAULT_IDLE 10
+
+//stand in for the md5 of the input file that IDA would report
+#define BENCH_HASH "62656e63686d61726b636f6c6c616221"
+
+#define DEFAULT_MIX "renamed:40,cmt_changed:30,make_code:10,byte_patched:10,add_func:5,struc_created:5"
+
+//extra key added to every published update, carries the send time so
+//that the receiving clients can compute fan-out latency
+#define BENCH_TS "bench_ts"
+
+struct MixEntry {
+   string cmd;
+   int weight;
+};
+
+struct BenchConfig {
+   string host;
+   int port;
+   int nclients;
+   int nupdates;
+   int rate;          //updates per second per client, 0 is unthrottled
+   int idle;          //seconds without traffic before a reader gives up
+   string user;
+   string password;
+   vector<MixEntry> mix;
+   int total_weight;
+   vector<json_object*> trace;
+   pid_t server_pid;
+   bool catchup;
+   bool live;         //late joiner catches up while the others publish
+   bool state;        //late joiner asks for the project state
+   bool cumulative;   //accept acks that cover several updates, as the plugin does
+   int probe;         //ms between control requests sent by the late joiner, 0 for none
+   bool stall;        //add a subscriber that never reads
+   string takeover;   //HANDOVER_PATH of a server that must refuse to be taken over
+};
+
+static BenchConfig cfg;
+static string project_gpid;
+
+static uint64_t now_us() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+class BenchClient {
+public:
+   int idx;
+   int sock;
+   int rcvbuf;          //socket receive buffer, 0 for the system default
+   string json_buffer;
+   pthread_t writer;
+   pthread_t reader;
+
+   //updates this client is expected to publish and to receive
+   uint64_t planned;
+   uint64_t expected;
+
+   uint64_t sent;
+   uint64_t acked;
+   uint64_t ack_msgs;
+   uint64_t received;
+   uint64_t state_updates;   //received inside MSG_PROJECT_STATE chunks
+   uint64_t errors;
+   uint64_t bytes_out;
+
+   //a late joiner checks it sees each updateid once, in order
+   bool late;
+   uint64_t last_uid;
+   uint64_t misordered;
+
+   vector<uint32_t> fanout_us;
+   vector<uint32_t> ack_us;
+   vector<uint32_t> control_us;   //round trip of control requests during catch-up
+   volatile bool probing;
+
+   BenchClient(int idx);
+   ~BenchClient();
+
+   bool connectServer();
+   bool authenticate();
+   bool newProject();
+   bool rejoinProject(const string &gpid);
+   bool send(const char *type, json_object *obj);
+
+   //read the next non-ping message, NULL on timeout or error
+   json_object *next(time_t timeout);
+
+   static void *write_loop(void *arg);
+   static void *read_loop(void *arg);
+   static void *probe_loop(void *arg);
+
+private:
+   sem_t writeLock;
+   sem_t ackLock;
+   deque<uint64_t> inflight;
+   deque<uint64_t> probes;   //send times of unanswered control requests
+   bool joinReply();
+};
+
+BenchClient::BenchClient(int idx) {
+   this->idx = idx;
+   sock = -1;
+   rcvbuf = 0;
+   planned = expected = 0;
+   sent = acked = ack_msgs = received = state_updates = errors = bytes_out = 0;
+   late = false;
+   probing = false;
+   last_uid = misordered = 0;
+   sem_init(&writeLock, 0, 1);
+   sem_init(&ackLock, 0, 1);
+}
+
+BenchClient::~BenchClient() {
+   if (sock != -1) {
+      close(sock);
+   }
+}
+
+bool BenchClient::connectServer() {
+   struct addrinfo hints;
+   addrinfo *addr, *ap;
+   char str_port[16];
+
+   memset(&hints, 0, sizeof(addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+
+   snprintf(str_port, sizeof(str_port), "%d", cfg.port);
+   if (getaddrinfo(cfg.host.c_str(), str_port, &hints, &addr) != 0) {
+      fprintf(stderr, "client %d: failed to resolve %s\n", idx, cfg.host.c_str());
+      return false;
+   }
+   for (ap = addr; ap != NULL; ap = ap->ai_next) {
+      sock = socket(ap->ai_family, ap->ai_socktype, ap->ai_protocol);
+      if (sock == -1) {
+         continue;
+      }
+      if (rcvbuf > 0) {
+         //before connecting, the window is scaled to it
+         setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+      }
+      if (connect(sock, ap->ai_addr, ap->ai_addrlen) == 0) {
+         break;
+      }
+      close(sock);
+      sock = -1;
+   }
+   freeaddrinfo(addr);
+   if (sock == -1) {
+      fprintf(stderr, "client %d: couldn't connect to %s:%d\n", idx, cfg.host.c_str(), cfg.port);
+      return false;
+   }
+   return true;
+}
+
+bool BenchClient::send(const char *type, json_object *obj) {
+   if (type) {
+      json_object_object_add_ex(obj, "type", json_object_new_string(type), JSON_NEW_CONST_KEY);
+   }
+   size_t jlen;
+   json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+   sem_wait(&writeLock);
+   bool res = writeJson(sock, obj);   //calls json_object_put
+   sem_post(&writeLock);
+   bytes_out += jlen;
+   return res;
+}
+
+json_object *BenchClient::next(time_t timeout) {
+   json_object *obj;
+   while (true) {
+      if (!readJson(sock, json_buffer, &obj, timeout) || obj == NULL) {
+         return NULL;
+      }
+      const char *type = string_from_json(obj, "type");
+      if (type != NULL && strcmp(type, "ping") == 0) {
+         json_object_object_add_ex(obj, "type", json_object_new_string("pong"), JSON_C_OBJECT_KEY_IS_CONSTANT);
+         sem_wait(&writeLock);
+         writeJson(sock, obj);
+         sem_post(&writeLock);
+         continue;
+      }
+      return obj;
+   }
+}
+
+static void hmac_md5(const uint8_t *msg, int mlen, const uint8_t *key, int klen, uint8_t *res) {
+   uint8_t ipad[64];
+   uint8_t opad[64];
+   uint8_t md5[MD5_DIGEST_LENGTH];
+   memset(ipad, 0, sizeof(ipad));
+   memcpy(ipad, key, klen);
+   memcpy(opad, ipad, sizeof(ipad));
+   for (size_t i = 0; i < sizeof(ipad); i++) {
+      ipad[i] ^= 0x36;
+      opad[i] ^= 0x5c;
+   }
+   MD5_CTX ctx;
+   MD5_Init(&ctx);
+   MD5_Update(&ctx, ipad, sizeof(ipad));
+   MD5_Update(&ctx, msg, mlen);
+   MD5_Final(md5, &ctx);
+
+   MD5_Init(&ctx);
+   MD5_Update(&ctx, opad, sizeof(opad));
+   MD5_Update(&ctx, md5, sizeof(md5));
+   MD5_Final(res, &ctx);
+}
+
+bool BenchClient::authenticate() {
+   json_object *obj = next(cfg.idle);
+   const char *type = obj ? string_from_json(obj, "type") : NULL;
+   if (type == NULL || strcmp(type, MSG_INITIAL_CHALLENGE)) {
+      fprintf(stderr, "client %d: expected %s\n", idx, MSG_INITIAL_CHALLENGE);
+      if (obj) json_object_put(obj);
+      return false;
+   }
+   uint32_t clen;
+   uint8_t *challenge = hex_from_json(obj, "challenge", &clen);
+   json_object_put(obj);
+   if (challenge == NULL) {
+      return false;
+   }
+
+   //same construction the plugin uses, key is md5(password)
+   uint8_t pwhash[MD5_DIGEST_LENGTH];
+   uint8_t hmac[MD5_DIGEST_LENGTH];
+   MD5((const unsigned char*)cfg.password.c_str(), cfg.password.length(), pwhash);
+   hmac_md5(challenge, clen, pwhash, sizeof(pwhash), hmac);
+   delete [] challenge;
+
+   obj = json_object_new_object();
+   append_json_hex_val(obj, "hmac", hmac, sizeof(hmac));
+   append_json_int32_val(obj, "protocol", PROTOCOL_VERSION);
+   append_json_string_val(obj, "user", cfg.user);
+   uint32_t caps = cfg.cumulative ? CAP_CUMULATIVE_ACK : 0;
+   if (late) {
+      //only the late joiner follows its join with send_updates
+      caps |= CAP_JOIN_CATCHUP;
+   }
+   if (caps != 0) {
+      append_json_uint32_val(obj, "caps", caps);
+   }
+   send(MSG_AUTH_REQUEST, obj);
+
+   obj = next(cfg.idle);
+   type = obj ? string_from_json(obj, "type") : NULL;
+   int32_t reply = AUTH_REPLY_FAIL;
+   if (type != NULL && strcmp(type, MSG_AUTH_REPLY) == 0) {
+      int32_from_json(obj, "reply", &reply);
+   }
+   else if (type != NULL && strcmp(type, MSG_ERROR) == 0) {
+      fprintf(stderr, "client %d: %s\n", idx, string_from_json(obj, "error"));
+   }
+   if (obj) json_object_put(obj);
+   if (reply != AUTH_REPLY_SUCCESS) {
+      fprintf(stderr, "client %d: authentication failed for user %s\n", idx, cfg.user.c_str());
+      return false;
+   }
+   return true;
+}
+
+bool BenchClient::joinReply() {
+   bool result = false;
+   json_object *obj;
+   while ((obj = next(cfg.idle)) != NULL) {
+      const char *type = string_from_json(obj, "type");
+      if (type != NULL && strcmp(type, MSG_PROJECT_JOIN_REPLY) == 0) {
+         int32_t reply = JOIN_REPLY_FAIL;
+         int32_from_json(obj, "reply", &reply);
+         const char *gpid = string_from_json(obj, "gpid");
+         if (reply == JOIN_REPLY_SUCCESS && gpid != NULL) {
+            if (project_gpid.length() == 0) {
+               project_gpid = gpid;
+            }
+            result = true;
+         }
+         json_object_put(obj);
+         break;
+      }
+      if (type != NULL && strcmp(type, MSG_ERROR) == 0) {
+         fprintf(stderr, "client %d: %s\n", idx, string_from_json(obj, "error"));
+      }
+      json_object_put(obj);
+   }
+   if (!result) {
+      fprintf(stderr, "client %d: failed to join project\n", idx);
+   }
+   return result;
+}
+
+bool BenchClient::newProject() {
+   json_object *obj = json_object_new_object();
+   char desc[64];
+   snprintf(desc, sizeof(desc), "collab_bench %u", (uint32_t)getpid());
+   append_json_string_val(obj, "md5", BENCH_HASH);
+   append_json_string_val(obj, "description", desc);
+   append_json_uint64_val(obj, "pub", FULL_PERMISSIONS);
+   append_json_uint64_val(obj, "sub", FULL_PERMISSIONS);
+   send(MSG_PROJECT_NEW_REQUEST, obj);
+   return joinReply();
+}
+
+bool BenchClient::rejoinProject(const string &gpid) {
+   json_object *obj = json_object_new_object();
+   append_json_string_val(obj, "gpid", gpid);
+   append_json_uint64_val(obj, "pub", FULL_PERMISSIONS);
+   append_json_uint64_val(obj, "sub", FULL_PERMISSIONS);
+   send(MSG_PROJECT_REJOIN_REQUEST, obj);
+   return joinReply();
+}
+
+/*
+ * Build a synthetic update that looks like what the plugin hooks
+ * would generate for the given command
+ */
+static json_object *make_update(const string &cmd, unsigned int *seed) {
+   json_object *obj = json_object_new_object();
+   uint64_t ea = 0x401000 + (rand_r(seed) % 0x100000);
+   char name[64];
+   if (cmd == COMMAND_RENAMED) {
+      snprintf(name, sizeof(name), "sub_%" PRIx64 "_%u", ea, rand_r(seed) & 0xffff);
+      append_json_uint64_val(obj, "addr", ea);
+      append_json_bool_val(obj, "local", false);
+      append_json_string_val(obj, "name", name);
+   }
+   else if (cmd == COMMAND_CMT_CHANGED) {
+      snprintf(name, sizeof(name), "benchmark comment %u", rand_r(seed));
+      append_json_uint64_val(obj, "addr", ea);
+      append_json_string_val(obj, "text", name);
+      append_json_bool_val(obj, "rep", false);
+   }
+   else if (cmd == COMMAND_BYTE_PATCHED) {
+      append_json_uint64_val(obj, "addr", ea);
+      append_json_uint32_val(obj, "value", rand_r(seed) & 0xff);
+   }
+   else if (cmd == COMMAND_MAKE_CODE || cmd == COMMAND_MAKE_DATA) {
+      append_json_uint64_val(obj, "addr", ea);
+      append_json_uint64_val(obj, "length", 1 + rand_r(seed) % 8);
+      if (cmd == COMMAND_MAKE_DATA) {
+         append_json_uint64_val(obj, "flags", 0x400);
+      }
+   }
+   else if (cmd == COMMAND_ADD_FUNC) {
+      append_json_uint64_val(obj, "startea", ea);
+      append_json_uint64_val(obj, "endea", ea + 0x40 + rand_r(seed) % 0x400);
+   }
+   else if (cmd == COMMAND_TI_CHANGED) {
+      uint8_t ti[12];
+      for (size_t i = 0; i < sizeof(ti); i++) {
+         ti[i] = 1 + rand_r(seed) % 0x7f;
+      }
+      append_json_uint64_val(obj, "addr", ea);
+      append_json_hex_val(obj, "ti", ti, sizeof(ti));
+   }
+   else if (cmd == COMMAND_ADD_CREF || cmd == COMMAND_ADD_DREF) {
+      append_json_uint64_val(obj, "from", ea);
+      append_json_uint64_val(obj, "to", 0x401000 + (rand_r(seed) % 0x100000));
+      append_json_uint64_val(obj, "reftype", 17);
+   }
+   else if (cmd == COMMAND_STRUC_CREATED) {
+      snprintf(name, sizeof(name), "bench_struct_%u", rand_r(seed));
+      append_json_string_val(obj, "struc_name", name);
+      append_json_uint64_val(obj, "tid", 0xff000000 + (rand_r(seed) & 0xffff));
+      append_json_bool_val(obj, "union", false);
+   }
+   else if (cmd == COMMAND_ENUM_CREATED) {
+      snprintf(name, sizeof(name), "bench_enum_%u", rand_r(seed));
+      append_json_string_val(obj, "enum_name", name);
+   }
+   else {
+      append_json_uint64_val(obj, "addr", ea);
+   }
+   append_json_string_val(obj, "user", cfg.user);
+   json_object_object_add_ex(obj, "type", json_object_new_string(cmd.c_str()), JSON_NEW_CONST_KEY);
+   return obj;
+}
+
+static const string &pick_command(unsigned int *seed) {
+   int r = rand_r(seed) % cfg.total_weight;
+   for (vector<MixEntry>::iterator i = cfg.mix.begin(); i != cfg.mix.end(); i++) {
+      if (r < i->weight) {
+         return i->cmd;
+      }
+      r -= i->weight;
+   }
+   return cfg.mix.back().cmd;
+}
+
+void *BenchClient::write_loop(void *arg) {
+   BenchClient *bc = (BenchClient*)arg;
+   unsigned int seed = (unsigned int)(time(NULL) ^ (bc->idx * 7919));
+   uint64_t start = now_us();
+   for (uint64_t n = 0; n < bc->planned; n++) {
+      if (cfg.rate > 0) {
+         uint64_t due = start + n * 1000000 / cfg.rate;
+         uint64_t now = now_us();
+         if (due > now) {
+            usleep(due - now);
+         }
+      }
+      json_object *obj;
+      if (cfg.trace.size() > 0) {
+         //trace updates are handed out round robin
+         obj = NULL;
+         json_object_deep_copy(cfg.trace[n * cfg.nclients + bc->idx], &obj, NULL);
+      }
+      else {
+         obj = make_update(pick_command(&seed), &seed);
+      }
+      uint64_t ts = now_us();
+      append_json_uint64_val(obj, BENCH_TS, ts);
+      sem_wait(&bc->ackLock);
+      bc->inflight.push_back(ts);
+      sem_post(&bc->ackLock);
+      if (!bc->send(NULL, obj)) {
+         bc->errors++;
+         break;
+      }
+      bc->sent++;
+   }
+   return NULL;
+}
+
+void *BenchClient::read_loop(void *arg) {
+   BenchClient *bc = (BenchClient*)arg;
+   uint64_t last = now_us();
+   while (bc->acked < bc->planned || bc->received < bc->expected) {
+      json_object *obj = bc->next(1);
+      uint64_t now = now_us();
+      if (obj == NULL) {
+         if (now - last > (uint64_t)cfg.idle * 1000000) {
+            break;
+         }
+         continue;
+      }
+      last = now;
+      const char *type = string_from_json(obj, "type");
+      uint64_t ts;
+      if (type == NULL) {
+         bc->errors++;
+      }
+      else if (strcmp(type, MSG_ACK_UPDATEID) == 0) {
+         //the server acks our own updates in the order we sent them,
+         //a cumulative ack covers count of them
+         uint32_t count = 1;
+         uint32_from_json(obj, "count", &count);
+         sem_wait(&bc->ackLock);
+         for (uint32_t n = 0; n < count && bc->inflight.size() > 0; n++) {
+            bc->ack_us.push_back((uint32_t)(now - bc->inflight.front()));
+            bc->inflight.pop_front();
+         }
+         sem_post(&bc->ackLock);
+         bc->acked += count;
+         bc->ack_msgs++;
+      }
+      else if (strcmp(type, MSG_PROJECT_STATE) == 0) {
+         json_object *updates;
+         uint64_t updateid = 0;
+         bool last = false;
+         if (json_object_object_get_ex(obj, "updates", &updates)) {
+            size_t n = json_object_array_length(updates);
+            bc->received += n;
+            bc->state_updates += n;
+         }
+         uint64_from_json(obj, "updateid", &updateid);
+         bool_from_json(obj, "last", &last);
+         if (last && updateid > bc->last_uid) {
+            bc->last_uid = updateid;
+         }
+         if (last) {
+            //the bench project's updateids run from 1, so the updates still
+            //to come are the ones after the state's updateid
+            bc->expected = bc->received + (bc->expected > updateid ? bc->expected - updateid : 0);
+         }
+      }
+      else if (strcmp(type, MSG_GET_REQ_PERMS_REPLY) == 0) {
+         sem_wait(&bc->ackLock);
+         if (bc->probes.size() > 0) {
+            bc->control_us.push_back((uint32_t)(now - bc->probes.front()));
+            bc->probes.pop_front();
+         }
+         sem_post(&bc->ackLock);
+      }
+      else if (strcmp(type, MSG_ERROR) == 0 || strcmp(type, MSG_FATAL) == 0) {
+         fprintf(stderr, "client %d: %s\n", bc->idx, string_from_json(obj, "error"));
+         bc->errors++;
+      }
+      else if (uint64_from_json(obj, BENCH_TS, &ts)) {
+         bc->fanout_us.push_back((uint32_t)(now - ts));
+         bc->received++;
+         uint64_t uid = 0;
+         if (bc->late && uint64_from_json(obj, "updateid", &uid)) {
+            if (uid <= bc->last_uid) {
+               bc->misordered++;
+            }
+            else {
+               bc->last_uid = uid;
+            }
+         }
+      }
+      json_object_put(obj);
+   }
+   return NULL;
+}
+
+/*
+ * Sends a control request every cfg.probe ms while the late joiner is
+ * catching up, the server should answer each ahead of the queued history
+ */
+void *BenchClient::probe_loop(void *arg) {
+   BenchClient *bc = (BenchClient*)arg;
+   while (bc->probing) {
+      sem_wait(&bc->ackLock);
+      bc->probes.push_back(now_us());
+      sem_post(&bc->ackLock);
+      if (!bc->send(MSG_GET_REQ_PERMS, json_object_new_object())) {
+         break;
+      }
+      usleep(cfg.probe * 1000);
+   }
+   return NULL;
+}
+
+/*
+ * Read VmRSS and VmHWM (in kB) for the server process
+ */
+static bool server_rss(uint64_t *rss, uint64_t *hwm) {
+   char path[64];
+   char line[256];
+   if (cfg.server_pid <= 0) {
+      return false;
+   }
+   snprintf(path, sizeof(path), "/proc/%d/status", (int)cfg.server_pid);
+   FILE *f = fopen(path, "r");
+   if (f == NULL) {
+      return false;
+   }
+   *rss = *hwm = 0;
+   while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, "VmRSS:", 6) == 0) {
+         *rss = strtoull(line + 6, NULL, 10);
+      }
+      else if (strncmp(line, "VmHWM:", 6) == 0) {
+         *hwm = strtoull(line + 6, NULL, 10);
+      }
+   }
+   fclose(f);
+   return true;
+}
+
+static void print_distribution(const char *name, vector<uint32_t> &v) {
+   if (v.size() == 0) {
+      printf("%-14s no samples\n", name);
+      return;
+   }
+   sort(v.begin(), v.end());
+   size_t n = v.size();
+   printf("%-14s n=%zu p50=%uus p90=%uus p99=%uus p99.9=%uus max=%uus\n", name, n,
+          v[n * 50 / 100], v[n * 90 / 100], v[n * 99 / 100], v[n * 999 / 1000], v[n - 1]);
+}
+
+static bool parse_mix(const char *spec) {
+   char *s = strdup(spec);
+   char *save = NULL;
+   cfg.mix.clear();
+   cfg.total_weight = 0;
+   for (char *tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+      MixEntry e;
+      char *colon = strchr(tok, ':');
+      e.weight = 1;
+      if (colon) {
+         *colon = 0;
+         e.weight = atoi(colon + 1);
+      }
+      e.cmd = tok;
+      if (e.weight > 0) {
+         cfg.mix.push_back(e);
+         cfg.total_weight += e.weight;
+      }
+   }
+   free(s);
+   return cfg.total_weight > 0;
+}
+
+/*
+ * Load a file produced by the server manager's export option and keep
+ * its updates in order for replay
+ */
+static bool load_trace(const char *fname) {
+   json_object *exp = json_object_from_file(fname);
+   if (exp == NULL) {
+      fprintf(stderr, "Failed to parse export file %s\n", fname);
+      return false;
+   }
+   json_object *updates = json_object_object_get(exp, "updates");
+   if (updates == NULL || !json_object_is_type(updates, json_type_array)) {
+      fprintf(stderr, "No updates found in %s\n", fname);
+      json_object_put(exp);
+      return false;
+   }
+   size_t num = json_object_array_length(updates);
+   for (size_t i = 0; i < num; i++) {
+      json_object *u = json_object_array_get_idx(updates, i);
+      if (string_from_json(u, "type") == NULL) {
+         continue;
+      }
+      //server assigned fields are regenerated on replay
+      json_object_object_del(u, "updateid");
+      json_object_object_del(u, "pid");
+      cfg.trace.push_back(json_object_get(u));
+   }
+   json_object_put(exp);
+   return cfg.trace.size() > 0;
+}
+
+/*
+ * A late joiner asks for everything published so far, returns the
+ * microseconds until it had received expected updates
+ */
+static uint64_t late_join(BenchClient &late, uint64_t expected) {
+   late.late = true;
+   if (!late.connectServer() || !late.authenticate() || !late.rejoinProject(project_gpid)) {
+      return 0;
+   }
+   uint64_t cstart = now_us();
+   json_object *obj = json_object_new_object();
+   append_json_uint64_val(obj, "last_update", 0);
+   if (cfg.state) {
+      append_json_bool_val(obj, "state", true);
+   }
+   late.send(MSG_SEND_UPDATES, obj);
+   late.expected = expected;
+   pthread_t prober;
+   if (cfg.probe > 0) {
+      late.probing = true;
+      pthread_create(&prober, NULL, BenchClient::probe_loop, &late);
+   }
+   BenchClient::read_loop(&late);
+   uint64_t elapsed = now_us() - cstart;
+   if (late.probing) {
+      late.probing = false;
+      pthread_join(prober, NULL);
+   }
+   return elapsed;
+}
+
+/*
+ * A subscriber that never reads should be disconnected once the updates
+ * queued for it pass the server's OUT_QUEUE, rather than holding up the
+ * others.  Whatever did reach it is drained, then the connection must
+ * have been closed.
+ */
+static bool stalled_dropped(BenchClient &stalled) {
+   timeval tv = {2, 0};
+   setsockopt(stalled.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   char buf[65536];
+   while (true) {
+      ssize_t n = recv(stalled.sock, buf, sizeof(buf), 0);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+         return true;
+      }
+      if (n < 0 && errno != EINTR) {
+         //nothing for a while and still open
+         return false;
+      }
+   }
+}
+
+/*
+ * A basic mode server keeps its projects in memory, so a new process
+ * trying to take over through its HANDOVER_PATH must be refused, see
+ * handover.h, and the server must carry on serving, which the rest of the
+ * run checks.  The first message of the exchange should be the refusal.
+ */
+static bool takeover_refused(const string &path, string &error) {
+   sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+      error = string("couldn't connect to ") + path + ": " + strerror(errno);
+      if (fd >= 0) {
+         close(fd);
+      }
+      return false;
+   }
+   timeval tv = {5, 0};
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   //one length prefixed json object, any sockets sent along are dropped
+   uint32_t len = 0;
+   string text;
+   bool ok = recv(fd, &len, sizeof(len), MSG_WAITALL) == sizeof(len);
+   if (ok) {
+      len = ntohl(len);
+      text.resize(len);
+      ok = len < 1024 * 1024 && recv(fd, &text[0], len, MSG_WAITALL) == (ssize_t)len;
+   }
+   close(fd);
+   json_object *obj = ok ? json_tokener_parse(text.c_str()) : NULL;
+   const char *type = obj != NULL ? string_from_json(obj, "type") : NULL;
+   bool refused = type != NULL && strcmp(type, "handover_refused") == 0;
+   if (refused) {
+      const char *e = string_from_json(obj, "error");
+      error = e != NULL ? e : "";
+   }
+   else {
+      error = type != NULL ? string("answered ") + type : "no answer";
+   }
+   json_object_put(obj);
+   return refused;
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [options]\n", prog);
+   fprintf(stderr, "   -h host      server host (default %s)\n", DEFAULT_HOST);
+   fprintf(stderr, "   -p port      server port (default %d)\n", DEFAULT_PORT);
+   fprintf(stderr, "   -c conf      read SERVER_PORT from a server json config\n");
+   fprintf(stderr, "   -n clients   number of simulated analysts (default %d)\n", DEFAULT_CLIENTS);
+   fprintf(stderr, "   -m updates   updates published per analyst (default %d)\n", DEFAULT_UPDATES);
+   fprintf(stderr, "   -r rate      updates per second per analyst, 0 = unthrottled\n");
+   fprintf(stderr, "   -x mix       command mix, cmd:weight,... (default %s)\n", DEFAULT_MIX);
+   fprintf(stderr, "   -t file      replay the updates of an exported project instead\n");
+   fprintf(stderr, "   -u user      user to authenticate as (default %s)\n", DEFAULT_USER);
+   fprintf(stderr, "   -w password  password, only checked in database mode\n");
+   fprintf(stderr, "   -s pid       server pid for RSS reporting\n");
+   fprintf(stderr, "   -S pidfile   read the server pid from pidfile\n");
+   fprintf(stderr, "   -l           measure a late joiner catching up with send_updates\n");
+   fprintf(stderr, "   -L           as -l, but the late joiner accepts the project state\n");
+   fprintf(stderr, "   -j           with -l or -L, join late while the others are still publishing\n");
+   fprintf(stderr, "   -a           ask for one ack per update instead of cumulative acks\n");
+   fprintf(stderr, "   -P ms        with -l or -L, time a control request sent every ms during catch-up\n");
+   fprintf(stderr, "   -z           add a subscriber that never reads, the server should drop it\n");
+   fprintf(stderr, "                once more than OUT_QUEUE updates are waiting for it\n");
+   fprintf(stderr, "   -H path      check that a basic mode server refuses a takeover through\n");
+   fprintf(stderr, "                its HANDOVER_PATH and keeps serving\n");
+   fprintf(stderr, "   -i seconds   idle timeout (default %d)\n", DEFAULT_IDLE);
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   int opt;
+   cfg.host = DEFAULT_HOST;
+   cfg.port = DEFAULT_PORT;
+   cfg.nclients = DEFAULT_CLIENTS;
+   cfg.nupdates = DEFAULT_UPDATES;
+   cfg.rate = 0;
+   cfg.idle = DEFAULT_IDLE;
+   cfg.user = DEFAULT_USER;
+   cfg.password = "";
+   cfg.server_pid = 0;
+   cfg.catchup = false;
+   cfg.live = false;
+   cfg.state = false;
+   cfg.cumulative = true;
+   cfg.probe = 0;
+   cfg.stall = false;
+   parse_mix(DEFAULT_MIX);
+   //a client the server drops shows up as errors, not a dead bench
+   signal(SIGPIPE, SIG_IGN);
+
+   while ((opt = getopt(argc, argv, "h:p:c:n:m:r:x:t:u:w:s:S:lLjaP:i:zH:")) != -1) {
+      switch (opt) {
+         case 'h':
+            cfg.host = optarg;
+            break;
+         case 'p':
+            cfg.port = atoi(optarg);
+            break;
+         case 'c': {
+            json_object *conf = parseConf(optarg);
+            if (conf == NULL) {
+               fprintf(stderr, "Failed to parse json config file: %s\n", optarg);
+               exit(1);
+            }
+            cfg.port = getShortOption(conf, "SERVER_PORT", DEFAULT_PORT);
+            json_object_put(conf);
+            break;
+         }
+         case 'n':
+            cfg.nclients = atoi(optarg);
+            break;
+         case 'm':
+            cfg.nupdates = atoi(optarg);
+            break;
+         case 'r':
+            cfg.rate = atoi(optarg);
+            break;
+         case 'x':
+            if (!parse_mix(optarg)) {
+               usage(argv[0]);
+            }
+            break;
+         case 't':
+            if (!load_trace(optarg)) {
+               exit(1);
+            }
+            break;
+         case 'u':
+            cfg.user = optarg;
+            break;
+         case 'w':
+            cfg.password = optarg;
+            break;
+         case 's':
+            cfg.server_pid = atoi(optarg);
+            break;
+         case 'S': {
+            FILE *f = fopen(optarg, "r");
+            int pid;
+            if (f != NULL) {
+               if (fscanf(f, "%d", &pid) == 1) {
+                  cfg.server_pid = pid;
+               }
+               fclose(f);
+            }
+            break;
+         }
+         case 'l':
+            cfg.catchup = true;
+            break;
+         case 'a':
+            cfg.cumulative = false;
+            break;
+         case 'j':
+            cfg.live = true;
+            break;
+         case 'L':
+            cfg.catchup = true;
+            cfg.state = true;
+            break;
+         case 'P':
+            cfg.probe = atoi(optarg);
+            break;
+         case 'i':
+            cfg.idle = atoi(optarg);
+            break;
+         case 'z':
+            cfg.stall = true;
+            break;
+         case 'H':
+            cfg.takeover = optarg;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (cfg.nclients < 1) {
+      usage(argv[0]);
+   }
+
+   //decide up front how many updates each client sends so that every
+   //reader knows how much traffic to wait for
+   uint64_t total = 0;
+   vector<BenchClient*> clients;
+   for (int i = 0; i < cfg.nclients; i++) {
+      BenchClient *bc = new BenchClient(i);
+      if (cfg.trace.size() > 0) {
+         size_t n = cfg.trace.size();
+         bc->planned = n / cfg.nclients + ((size_t)i < n % cfg.nclients ? 1 : 0);
+      }
+      else {
+         bc->planned = cfg.nupdates;
+      }
+      total += bc->planned;
+      clients.push_back(bc);
+   }
+
+   string takeover_error;
+   bool refused = cfg.takeover.length() == 0 || takeover_refused(cfg.takeover, takeover_error);
+
+   uint64_t setup_start = now_us();
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      BenchClient *bc = *i;
+      bc->expected = total - bc->planned;
+      if (!bc->connectServer() || !bc->authenticate()) {
+         exit(1);
+      }
+      bool joined = bc == clients[0] ? bc->newProject() : bc->rejoinProject(project_gpid);
+      if (!joined) {
+         exit(1);
+      }
+   }
+   BenchClient stalled(cfg.nclients + 1);
+   if (cfg.stall) {
+      //a small window so the updates back up at the server soon
+      stalled.rcvbuf = 4096;
+      if (!stalled.connectServer() || !stalled.authenticate() || !stalled.rejoinProject(project_gpid)) {
+         exit(1);
+      }
+   }
+   uint64_t setup_us = now_us() - setup_start;
+
+   uint64_t rss_before = 0, rss_after = 0, hwm = 0;
+   bool have_rss = server_rss(&rss_before, &hwm);
+
+   uint64_t start = now_us();
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      pthread_create(&(*i)->reader, NULL, BenchClient::read_loop, *i);
+      pthread_create(&(*i)->writer, NULL, BenchClient::write_loop, *i);
+   }
+
+   BenchClient late(cfg.nclients);
+   uint64_t catchup_us = 0;
+   if (cfg.catchup && cfg.live) {
+      //join a third of the way through, the rest arrives while catching up
+      while (clients[0]->sent < clients[0]->planned / 3 && clients[0]->errors == 0) {
+         usleep(1000);
+      }
+      catchup_us = late_join(late, total);
+   }
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      pthread_join((*i)->writer, NULL);
+   }
+   uint64_t publish_us = now_us() - start;
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      pthread_join((*i)->reader, NULL);
+   }
+   uint64_t elapsed_us = now_us() - start;
+
+   uint64_t sent = 0, acked = 0, ack_msgs = 0, received = 0, expected = 0, errors = 0, bytes = 0;
+   vector<uint32_t> fanout;
+   vector<uint32_t> ack;
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      BenchClient *bc = *i;
+      sent += bc->sent;
+      acked += bc->acked;
+      ack_msgs += bc->ack_msgs;
+      received += bc->received;
+      expected += bc->expected;
+      errors += bc->errors;
+      bytes += bc->bytes_out;
+      fanout.insert(fanout.end(), bc->fanout_us.begin(), bc->fanout_us.end());
+      ack.insert(ack.end(), bc->ack_us.begin(), bc->ack_us.end());
+   }
+
+   if (cfg.catchup && !cfg.live) {
+      catchup_us = late_join(late, acked);
+   }
+
+   if (have_rss) {
+      server_rss(&rss_after, &hwm);
+   }
+
+   bool dropped = !cfg.stall || stalled_dropped(stalled);
+
+   printf("collab_bench %s:%d clients=%d %s\n", cfg.host.c_str(), cfg.port, cfg.nclients,
+          cfg.trace.size() ? "mode=replay" : "mode=synthetic");
+   printf("setup          %.3fs (connect, auth, join)\n", setup_us / 1e6);
+   printf("published      %" PRIu64 " updates, %" PRIu64 " bytes in %.3fs\n", sent, bytes, publish_us / 1e6);
+   printf("acked          %" PRIu64 "/%" PRIu64 " in %" PRIu64 " messages\n", acked, sent, ack_msgs);
+   printf("delivered      %" PRIu64 "/%" PRIu64 "\n", received, expected);
+   printf("throughput     %.1f updates/s in, %.1f deliveries/s out\n",
+          elapsed_us ? acked * 1e6 / elapsed_us : 0.0, elapsed_us ? received * 1e6 / elapsed_us : 0.0);
+   print_distribution("ack latency", ack);
+   print_distribution("fan-out", fanout);
+   if (cfg.catchup) {
+      printf("catch-up       %" PRIu64 "/%" PRIu64 " updates in %.3fs", late.received, late.expected, catchup_us / 1e6);
+      if (cfg.state) {
+         printf(", %" PRIu64 " from project state", late.state_updates);
+      }
+      if (late.misordered) {
+         printf(", %" PRIu64 " duplicated or out of order", late.misordered);
+      }
+      printf("\n");
+      if (cfg.probe > 0) {
+         print_distribution("control", late.control_us);
+      }
+   }
+   if (cfg.stall) {
+      printf("stalled reader %s\n", dropped ? "disconnected" : "still connected");
+   }
+   if (cfg.takeover.length() > 0) {
+      printf("takeover       %s: %s\n", refused ? "refused" : "not refused", takeover_error.c_str());
+   }
+   if (have_rss) {
+      printf("server rss     before=%" PRIu64 "kB after=%" PRIu64 "kB peak=%" PRIu64 "kB\n", rss_before, rss_after, hwm);
+   }
+   if (errors) {
+      printf("errors         %" PRIu64 "\n", errors);
+   }
+
+   for (vector<BenchClient*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      delete *i;
+   }
+   for (vector<json_object*>::iterator i = cfg.trace.begin(); i != cfg.trace.end(); i++) {
+      json_object_put(*i);
+   }
+   bool caught_up = !cfg.catchup || (late.received == late.expected && late.misordered == 0);
+   return (received == expected && acked == sent && caught_up && dropped && refused) ? 0 : 2;
+}
@@ -0,0 +1,556 @@
+/*
+   collabREate collab_microbench.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <json-c/json.h>
+
+#include "utils.h"
+#include "client.h"
+#include "cli_mgr.h"
+#include "basic_mgr.h"
+#include "proj_info.h"
+
+using namespace std;
+
+/**
+ * collab_microbench
+ * Repeatable microbenchmarks for the primitives every message passes
+ * through on the server. Each result is written as a single line json
+ * object so runs can be diffed or loaded into a spreadsheet.
+ */
+
+#define DEFAULT_REPEATS 5
+#define DEFAULT_PORT 5099
+
+//a typical update as stored by BasicProject and sent by dispatch
+#define SAMPLE_UPDATE "{\"addr\":4198400,\"local\":false,\"name\":\"sub_401000_decrypt_config\",\"user\":\"analyst\",\"type\":\"renamed\",\"updateid\":123456}"
+
+static const char *sample_cmds[] = {
+   COMMAND_RENAMED, COMMAND_CMT_CHANGED, COMMAND_MAKE_CODE, COMMAND_BYTE_PATCHED,
+   COMMAND_TI_CHANGED, COMMAND_STRUC_CREATED, COMMAND_ADD_FUNC, COMMAND_ADD_CREF,
+   NULL
+};
+
+static uint64_t now_ns() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//reads and discards everything arriving on a socket until EOF
+static void *drain(void *arg) {
+   int fd = (int)(intptr_t)arg;
+   char buf[65536];
+   while (read(fd, buf, sizeof(buf)) > 0) {
+   }
+   return NULL;
+}
+
+static void start_drain(int fd) {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   pthread_create(&tid, &attr, drain, (void*)(intptr_t)fd);
+}
+
+struct StreamArgs {
+   int fd;
+   string data;
+};
+
+static void *stream_writer(void *arg) {
+   StreamArgs *sa = (StreamArgs*)arg;
+   sendAll(sa->fd, sa->data.c_str(), sa->data.length());
+   return NULL;
+}
+
+class MicroBench {
+public:
+   MicroBench(int repeats, const char *filter, int port, FILE *out);
+   ~MicroBench();
+
+   void run_all();
+
+private:
+   int repeats;
+   const char *filter;
+   int port;
+   FILE *out;
+   Tcp6Service *svc;
+   BasicConnectionManager *mgr;
+
+   bool selected(const char *name);
+   void report(const char *name, uint64_t size, uint64_t iters, vector<uint64_t> &samples, uint64_t bytes = 0);
+   Client *connected_client(uint32_t uid);
+
+   void bench_hex(uint32_t size);
+   void bench_md5(uint32_t size);
+   void bench_read_json(uint32_t msgs, bool large);
+   void bench_write_json(uint32_t msgs);
+   void bench_check_permissions(uint32_t iters);
+   void bench_dispatch(uint32_t subscribers, uint32_t iters);
+   void bench_append_update(uint32_t iters);
+   void bench_send_latest(uint32_t updates);
+   void bench_addr_filter(uint32_t ranges, uint32_t iters);
+};
+
+MicroBench::MicroBench(int repeats, const char *filter, int port, FILE *out) {
+   this->repeats = repeats;
+   this->filter = filter;
+   this->port = port;
+   this->out = out;
+   svc = NULL;
+   mgr = new BasicConnectionManager(NULL);
+}
+
+MicroBench::~MicroBench() {
+   if (svc) {
+      svc->close();
+   }
+}
+
+bool MicroBench::selected(const char *name) {
+   return filter == NULL || strstr(name, filter) != NULL;
+}
+
+/*
+ * Emit one result line, the best (minimum) repeat is the headline figure
+ * as it is the least disturbed by scheduling noise
+ */
+void MicroBench::report(const char *name, uint64_t size, uint64_t iters, vector<uint64_t> &samples, uint64_t bytes) {
+   sort(samples.begin(), samples.end());
+   uint64_t best = samples[0];
+   uint64_t median = samples[samples.size() / 2];
+   json_object *obj = json_object_new_object();
+   append_json_string_val(obj, "bench", name);
+   append_json_uint64_val(obj, "size", size);
+   append_json_uint64_val(obj, "iters", iters);
+   append_json_uint32_val(obj, "repeats", samples.size());
+   json_object_object_add_ex(obj, "ns_per_op", json_object_new_double((double)best / iters), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(obj, "median_ns_per_op", json_object_new_double((double)median / iters), JSON_NEW_CONST_KEY);
+   json_object_object_add_ex(obj, "ops_per_sec", json_object_new_double(best ? iters * 1e9 / best : 0.0), JSON_NEW_CONST_KEY);
+   if (bytes) {
+      json_object_object_add_ex(obj, "mb_per_sec", json_object_new_double(best ? bytes * 1e3 / best : 0.0), JSON_NEW_CONST_KEY);
+   }
+   fprintf(out, "%s\n", json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
+   fflush(out);
+   json_object_put(obj);
+}
+
+/*
+ * Build a Client whose NetworkIO is the server side of a real loopback
+ * connection, the other end is drained by a background thread
+ */
+Client *MicroBench::connected_client(uint32_t uid) {
+   if (svc == NULL) {
+      svc = new Tcp6Service("localhost", port);
+   }
+   struct addrinfo hints;
+   addrinfo *addr, *ap;
+   char str_port[16];
+   int sock = -1;
+
+   memset(&hints, 0, sizeof(addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   snprintf(str_port, sizeof(str_port), "%d", port);
+   if (getaddrinfo("localhost", str_port, &hints, &addr) != 0) {
+      return NULL;
+   }
+   for (ap = addr; ap != NULL; ap = ap->ai_next) {
+      sock = socket(ap->ai_family, ap->ai_socktype, ap->ai_protocol);
+      if (sock == -1) {
+         continue;
+      }
+      if (connect(sock, ap->ai_addr, ap->ai_addrlen) == 0) {
+         break;
+      }
+      close(sock);
+      sock = -1;
+   }
+   freeaddrinfo(addr);
+   if (sock == -1) {
+      fprintf(stderr, "failed to connect to local port %d\n", port);
+      exit(1);
+   }
+   NetworkIO *nio = svc->accept();
+   start_drain(sock);
+   Client *c = new Client(mgr, nio, uid);
+   c->setPub(FULL_PERMISSIONS);
+   c->setSub(FULL_PERMISSIONS);
+   return c;
+}
+
+void MicroBench::bench_hex(uint32_t size) {
+   uint8_t *bin = new uint8_t[size];
+   fill_random(bin, size);
+   uint32_t iters = 4000000 / size + 100;
+   vector<uint64_t> enc, dec, tba;
+   const char *hex = hex_encode(bin, size);
+   string shex = hex;
+   for (int r = 0; r < repeats; r++) {
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         delete [] hex_encode(bin, size);
+      }
+      enc.push_back(now_ns() - start);
+
+      uint32_t len;
+      start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         delete [] hex_decode(hex, &len);
+      }
+      dec.push_back(now_ns() - start);
+
+      start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         delete [] toByteArray(shex, &len);
+      }
+      tba.push_back(now_ns() - start);
+   }
+   if (selected("hex_encode")) report("hex_encode", size, iters, enc, (uint64_t)size * iters);
+   if (selected("hex_decode")) report("hex_decode", size, iters, dec, (uint64_t)size * iters);
+   if (selected("toByteArray")) report("toByteArray", size, iters, tba, (uint64_t)size * iters);
+   delete [] hex;
+   delete [] bin;
+}
+
+void MicroBench::bench_md5(uint32_t size) {
+   uint8_t *bin = new uint8_t[size];
+   fill_random(bin, size);
+   uint32_t iters = 20000000 / size + 100;
+   vector<uint64_t> samples;
+   for (int r = 0; r < repeats; r++) {
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         getMD5(bin, size);
+      }
+      samples.push_back(now_ns() - start);
+   }
+   report("getMD5", size, iters, samples, (uint64_t)size * iters);
+   delete [] bin;
+}
+
+/*
+ * readJson framing: a writer thread streams back to back messages
+ * into one end of a socketpair and we extract them one at a time
+ */
+void MicroBench::bench_read_json(uint32_t msgs, bool large) {
+   string msg;
+   if (large) {
+      json_object *obj = json_object_new_object();
+      uint8_t ti[4096];
+      memset(ti, 0x41, sizeof(ti));
+      append_json_uint64_val(obj, "addr", 0x401000);
+      append_json_hex_val(obj, "ti", ti, sizeof(ti));
+      append_json_string_val(obj, "type", COMMAND_TI_CHANGED);
+      append_json_uint64_val(obj, "updateid", 123456);
+      msg = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+      json_object_put(obj);
+   }
+   else {
+      msg = SAMPLE_UPDATE;
+   }
+   StreamArgs sa;
+   for (uint32_t i = 0; i < msgs; i++) {
+      sa.data += msg;
+   }
+   vector<uint64_t> samples;
+   for (int r = 0; r < repeats; r++) {
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+         return;
+      }
+      sa.fd = sv[1];
+      pthread_t tid;
+      pthread_create(&tid, NULL, stream_writer, &sa);
+      string json_buffer;
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < msgs; i++) {
+         json_object *obj;
+         readJson(sv[0], json_buffer, &obj);
+         if (obj == NULL) {
+            break;
+         }
+         json_object_put(obj);
+      }
+      samples.push_back(now_ns() - start);
+      pthread_join(tid, NULL);
+      close(sv[0]);
+      close(sv[1]);
+   }
+   report(large ? "readJson_large" : "readJson", msg.length(), msgs, samples, (uint64_t)msg.length() * msgs);
+}
+
+void MicroBench::bench_write_json(uint32_t msgs) {
+   json_object *obj = json_tokener_parse(SAMPLE_UPDATE);
+   size_t jlen = strlen(SAMPLE_UPDATE);
+   vector<uint64_t> wj, sa;
+   for (int r = 0; r < repeats; r++) {
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+         return;
+      }
+      start_drain(sv[1]);
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < msgs; i++) {
+         writeJson(sv[0], json_object_get(obj));
+      }
+      wj.push_back(now_ns() - start);
+
+      start = now_ns();
+      for (uint32_t i = 0; i < msgs; i++) {
+         sendAll(sv[0], SAMPLE_UPDATE, jlen);
+      }
+      sa.push_back(now_ns() - start);
+      close(sv[0]);
+   }
+   if (selected("writeJson")) report("writeJson", jlen, msgs, wj, (uint64_t)jlen * msgs);
+   if (selected("sendAll")) report("sendAll", jlen, msgs, sa, (uint64_t)jlen * msgs);
+   json_object_put(obj);
+}
+
+void MicroBench::bench_check_permissions(uint32_t iters) {
+   Client c(mgr, NULL, BASIC_USER);
+   size_t ncmds = 0;
+   while (sample_cmds[ncmds]) {
+      ncmds++;
+   }
+   vector<uint64_t> samples;
+   uint32_t allowed = 0;
+   for (int r = 0; r < repeats; r++) {
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         allowed += c.checkPermissions(sample_cmds[i % ncmds], FULL_PERMISSIONS);
+      }
+      samples.push_back(now_ns() - start);
+   }
+   if (allowed == 0) {
+      fprintf(stderr, "checkPermissions rejected every command\n");
+   }
+   report("checkPermissions", ncmds, iters, samples);
+}
+
+/*
+ * Mirrors ConnectionManager::run, one Packet fanned out to a project
+ * with the given number of subscribers plus the originator
+ */
+void MicroBench::bench_dispatch(uint32_t subscribers, uint32_t iters) {
+   uint32_t pid = 1000 + subscribers;
+   vector<Client*> clients;
+   for (uint32_t i = 0; i <= subscribers; i++) {
+      Client *c = connected_client(i);
+      c->setPid(pid);
+      mgr->projects.addClient(c);
+      clients.push_back(c);
+   }
+   vector<uint64_t> samples;
+   for (int r = 0; r < repeats; r++) {
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         json_object *obj = json_tokener_parse(SAMPLE_UPDATE);
+         Packet *p = new Packet(clients[0], COMMAND_RENAMED, obj, i);
+         mgr->projects.loopProject(pid, ConnectionManager::dispatch, p);
+         json_object_put(p->obj);
+         delete p;
+      }
+      samples.push_back(now_ns() - start);
+   }
+   report("loopProject_dispatch", subscribers, iters, samples);
+   for (vector<Client*>::iterator i = clients.begin(); i != clients.end(); i++) {
+      mgr->projects.removeClient(*i);
+   }
+}
+
+void MicroBench::bench_append_update(uint32_t iters) {
+   vector<uint64_t> samples;
+   for (int r = 0; r < repeats; r++) {
+      BasicProject *bp = new BasicProject(1, "microbench");
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         bp->append_update(SAMPLE_UPDATE, bp->next_uid());
+      }
+      samples.push_back(now_ns() - start);
+      delete bp;
+   }
+   report("append_update", strlen(SAMPLE_UPDATE), iters, samples);
+}
+
+void MicroBench::bench_send_latest(uint32_t updates) {
+   Client *c = connected_client(0);
+   int lpid = mgr->addProject(c, "6d6963726f62656e63686d61726b2121", "microbench", FULL_PERMISSIONS, FULL_PERMISSIONS);
+   for (uint32_t i = 0; i < updates; i++) {
+      json_object *obj = json_tokener_parse(SAMPLE_UPDATE);
+      append_json_uint64_val(obj, "updateid", i + 1);
+      mgr->importUpdate("microbench", lpid, COMMAND_RENAMED, obj);
+      json_object_put(obj);
+   }
+   vector<uint64_t> samples;
+   for (int r = 0; r < repeats; r++) {
+      //as catchup_thread does, but with no join mark to stop at
+      uint64_t mark;
+      c->beginCatchup(c->joinCount(), &mark);
+      uint64_t start = now_ns();
+      mgr->sendLatestUpdates(c, 0);
+      samples.push_back(now_ns() - start);
+      c->endCatchup(0);
+   }
+   report("sendLatestUpdates", updates, updates, samples);
+   mgr->projects.removeClient(c);
+}
+
+/*
+ * Address filter lookups against a filter of the given number of ranges,
+ * half of the probes fall inside a range
+ */
+void MicroBench::bench_addr_filter(uint32_t ranges, uint32_t iters) {
+   AddrFilter filter;
+   for (uint32_t i = 0; i < ranges; i++) {
+      filter.add(0x400000 + (uint64_t)i * 0x2000, 0x400000 + (uint64_t)i * 0x2000 + 0x1000);
+   }
+   vector<uint64_t> samples;
+   uint32_t hits = 0;
+   for (int r = 0; r < repeats; r++) {
+      uint64_t start = now_ns();
+      for (uint32_t i = 0; i < iters; i++) {
+         hits += filter.accepts(true, 0x400000 + (uint64_t)(i % ranges) * 0x2000 + (i & 1) * 0x1000);
+      }
+      samples.push_back(now_ns() - start);
+   }
+   if (hits != (iters - iters / 2) * (uint32_t)repeats) {
+      fprintf(stderr, "AddrFilter_accepts: unexpected hit count %u\n", hits);
+   }
+   report("AddrFilter_accepts", ranges, iters, samples);
+}
+
+void MicroBench::run_all() {
+   json_object *meta = json_object_new_object();
+   append_json_string_val(meta, "bench", "meta");
+   append_json_int32_val(meta, "protocol", PROTOCOL_VERSION);
+   append_json_int32_val(meta, "file_ver", FILE_VER);
+   append_json_uint64_val(meta, "timestamp", (uint64_t)time(NULL));
+   append_json_int32_val(meta, "repeats", repeats);
+   fprintf(out, "%s\n", json_object_to_json_string_ext(meta, JSON_C_TO_STRING_PLAIN));
+   json_object_put(meta);
+
+   static const uint32_t hex_sizes[] = {16, 256, 4096};
+   for (size_t i = 0; i < sizeof(hex_sizes) / sizeof(hex_sizes[0]); i++) {
+      if (selected("hex_encode") || selected("hex_decode") || selected("toByteArray")) {
+         bench_hex(hex_sizes[i]);
+      }
+   }
+   if (selected("getMD5")) {
+      bench_md5(64);
+      bench_md5(4096);
+   }
+   if (selected("readJson")) {
+      bench_read_json(200000, false);
+   }
+   if (selected("readJson_large")) {
+      bench_read_json(5000, true);
+   }
+   if (selected("writeJson") || selected("sendAll")) {
+      bench_write_json(200000);
+   }
+   if (selected("checkPermissions")) {
+      bench_check_permissions(2000000);
+   }
+   if (selected("loopProject_dispatch")) {
+      bench_dispatch(1, 100000);
+      bench_dispatch(8, 20000);
+      bench_dispatch(32, 5000);
+   }
+   if (selected("append_update")) {
+      bench_append_update(500000);
+   }
+   if (selected("sendLatestUpdates")) {
+      bench_send_latest(50000);
+   }
+   if (selected("AddrFilter_accepts")) {
+      bench_addr_filter(1, 2000000);
+      bench_addr_filter(64, 2000000);
+      bench_addr_filter(4096, 2000000);
+   }
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [-r repeats] [-f filter] [-p port] [-o outfile]\n", prog);
+   fprintf(stderr, "   -r repeats  repetitions of each benchmark, best is reported (default %d)\n", DEFAULT_REPEATS);
+   fprintf(stderr, "   -f filter   only run benchmarks whose name contains filter\n");
+   fprintf(stderr, "   -p port     loopback port used for client connections (default %d)\n", DEFAULT_PORT);
+   fprintf(stderr, "   -o outfile  append results to outfile instead of stdout\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   int opt;
+   int repeats = DEFAULT_REPEATS;
+   int port = DEFAULT_PORT;
+   const char *filter = NULL;
+   FILE *out = stdout;
+   while ((opt = getopt(argc, argv, "r:f:p:o:")) != -1) {
+      switch (opt) {
+         case 'r':
+            repeats = atoi(optarg);
+            break;
+         case 'f':
+            filter = optarg;
+            break;
+         case 'p':
+            port = atoi(optarg);
+            break;
+         case 'o':
+            out = fopen(optarg, "a");
+            if (out == NULL) {
+               fprintf(stderr, "Failed to open %s\n", optarg);
+               exit(1);
+            }
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (repeats < 1) {
+      usage(argv[0]);
+   }
+   //writes to drained sockets that close early must not kill us
+   signal(SIGPIPE, SIG_IGN);
+
+   MicroBench mb(repeats, filter, port, out);
+   mb.run_all();
+   if (out != stdout) {
+      fclose(out);
+   }
+   return 0;
+}
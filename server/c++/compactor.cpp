@@ -0,0 +1,125 @@
+/*
+   collabREate compactor.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+#include "utils.h"
+#include "compactor.h"
+
+/*
+ * commands that completely replace the state of a single item
+ * the key is scope + item + command + slot
+ */
+static const struct {
+   const char *cmd;
+   const char *scope;
+   const char *item;   //field naming the item
+   const char *slot;   //optional field naming a slot within the item
+} setters[] = {
+   {COMMAND_RENAMED, "A:", "addr", NULL},
+   {COMMAND_CMT_CHANGED, "A:", "addr", "rep"},
+   {COMMAND_TI_CHANGED, "A:", "addr", NULL},
+   {COMMAND_OP_TI_CHANGED, "A:", "addr", "opnum"},
+   {COMMAND_OP_TYPE_CHANGED, "A:", "addr", "opnum"},
+   {COMMAND_SET_STACK_VAR_NAME, "A:", "func_addr", "offset"},
+   {COMMAND_STRUC_CMT_CHANGED, "S:", "struc_name", "rep"},
+   {COMMAND_SET_STRUCT_MEMBER_NAME, "S:", "struc_name", "offset"},
+   {COMMAND_ENUM_CMT_CHANGED, "E:", "enum_name", "rep"},
+   {NULL, NULL, NULL, NULL}
+};
+
+/*
+ * commands that change what existing keys refer to, keys for the named
+ * items (or the whole scope when no item is given) can no longer be superseded
+ */
+static const struct {
+   const char *cmd;
+   const char *scope;
+   const char *item1;
+   const char *item2;
+} barriers[] = {
+   {COMMAND_STRUC_RENAMED, "S:", "oldname", "newname"},
+   {COMMAND_STRUC_DELETED, "S:", "struc_name", NULL},
+   {COMMAND_ENUM_RENAMED, "E:", "oldname", "newname"},
+   {COMMAND_ENUM_DELETED, "E:", "enum_name", NULL},
+   {COMMAND_MOVE_SEGM, "A:", NULL, NULL},
+   {COMMAND_SEGM_MOVED, "A:", NULL, NULL},
+   {NULL, NULL, NULL, NULL}
+};
+
+Compactor::Compactor() {
+   watermark = 0;
+}
+
+void Compactor::invalidate(const string &prefix) {
+   map<string,uint64_t>::iterator first = live.lower_bound(prefix);
+   map<string,uint64_t>::iterator last = first;
+   while (last != live.end() && last->first.compare(0, prefix.length(), prefix) == 0) {
+      last++;
+   }
+   live.erase(first, last);
+}
+
+uint64_t Compactor::supersede(uint64_t updateid, json_object *update) {
+   const char *cmd = string_from_json(update, "type");
+   if (cmd == NULL) {
+      return 0;
+   }
+   for (int i = 0; setters[i].cmd; i++) {
+      if (strcmp(cmd, setters[i].cmd) == 0) {
+         json_object *item;
+         if (!json_object_object_get_ex(update, setters[i].item, &item)) {
+            return 0;
+         }
+         string key = setters[i].scope;
+         key += json_object_get_string(item);
+         key += ':';
+         key += cmd;
+         if (setters[i].slot) {
+            json_object *slot;
+            if (!json_object_object_get_ex(update, setters[i].slot, &slot)) {
+               return 0;
+            }
+            key += ':';
+            key += json_object_get_string(slot);
+         }
+         uint64_t &latest = live[key];
+         uint64_t prev = latest;
+         latest = updateid;
+         return prev;
+      }
+   }
+   for (int i = 0; barriers[i].cmd; i++) {
+      if (strcmp(cmd, barriers[i].cmd) == 0) {
+         if (barriers[i].item1 == NULL) {
+            invalidate(barriers[i].scope);
+            return 0;
+         }
+         const char *item = string_from_json(update, barriers[i].item1);
+         if (item) {
+            invalidate(string(barriers[i].scope) + item + ":");
+         }
+         if (barriers[i].item2 && (item = string_from_json(update, barriers[i].item2)) != NULL) {
+            invalidate(string(barriers[i].scope) + item + ":");
+         }
+         return 0;
+      }
+   }
+   return 0;
+}
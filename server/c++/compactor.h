@@ -0,0 +1,68 @@
+/*
+   collabREate compactor.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __COMPACTOR_H
+#define __COMPACTOR_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <json-c/json.h>
+
+using namespace std;
+
+/**
+ * Compactor
+ * Tracks which stored updates have been superseded by later ones. Updates
+ * that set the complete state of one item (a name, a comment, a type) are
+ * keyed by command and item, only the last update for each key needs to be
+ * replayed. Updates are never reordered, so anything a surviving update
+ * depends on (struct creation before a member is named, etc.) still comes
+ * first. Renames, deletes and segment moves change what a key refers to
+ * and act as barriers, nothing before them is superseded by updates after
+ * them for the affected keys.
+ */
+
+class Compactor {
+public:
+   Compactor();
+
+   /**
+    * supersede feeds the next update, in updateid order, through the compactor
+    * @param updateid the id of the update
+    * @param update the update itself
+    * @return the updateid of the earlier update this one makes redundant, 0 if none
+    */
+   uint64_t supersede(uint64_t updateid, json_object *update);
+
+   /**
+    * keys returns the number of items currently being tracked
+    */
+   size_t keys() const {return live.size();};
+
+   uint64_t watermark;   //all updates up to here have been fed to the compactor
+
+private:
+   map<string,uint64_t> live;   //key to updateid of the latest update for that key
+
+   void invalidate(const string &prefix);
+};
+
+#endif
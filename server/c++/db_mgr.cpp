@@ -26,6 +26,10 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
 #include <openssl/md5.h>
 #include <json-c/json.h>
 
@@ -33,6 +37,9 @@
 #include "db_mgr.h"
 #include "proj_info.h"
 #include "clientset.h"
+#include "snapshot.h"
+#include "resume.h"
+#include "usercache.h"
 
 using namespace std;
 
@@ -75,6 +82,32 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "postUpdate: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
+   res = PQprepare(dbConn, "postUpdateId",
+                   "insert into updates (updateid,username,pid,cmd,json) values ($1,$2,$3,$4,$5);",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "postUpdateId: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //a project's first lease starts above anything it already holds
+   res = PQprepare(dbConn, "leaseUpdateids",
+                   "update projects set updateid_hwm = (case when updateid_hwm > 0 then updateid_hwm "
+                   "else greatest(snapupdateid, (select coalesce(max(updateid), 0) from updates where pid = $1)) end) + $2 "
+                   "where pid = $1 returning updateid_hwm;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "leaseUpdateids: %s\n", PQerrorMessage(dbConn));
+      log(LERROR, "projects.updateid_hwm is missing, updateids will come from updates_updateid_seq\n");
+      updateid_block = 0;
+   }
+   PQclear(res);
+   res = PQprepare(dbConn, "floorUpdateids",
+                   "update projects set updateid_hwm = greatest(updateid_hwm, $2) where pid = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "floorUpdateids: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
    sem_init(&ap_sem, 0, 1);
    res = PQprepare(dbConn, "addProject",
                    "insert into projects (hash,gpid,description,owner,pub,sub,protocol) values ($1,$2,$3,$4,$5,$6,$7) returning pid;",
@@ -139,7 +172,6 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "getUserInfo: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&glu_sem, 0, 1);
    res = PQprepare(dbConn, "getLatestUpdates",
                    "select updateid,cmd,json from updates where updateid > $1 and pid = $2 order by updateid asc;",
                    0, NULL);
@@ -147,6 +179,13 @@ void DatabaseConnectionManager::init_queries() {
       log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
+   res = PQprepare(dbConn, "lastUpdateid",
+                   "select coalesce(max(updateid), 0) from updates where pid = $1;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      log(LSQL, "lastUpdateid: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
    sem_init(&cu_sem, 0, 1);
    res = PQprepare(dbConn, "copyUpdates",
                    "select copy_updates($1, $2, $3);",
@@ -166,10 +205,15 @@ void DatabaseConnectionManager::init_queries() {
    PQclear(res);
 }
 
-DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) : ConnectionManager(conf) {
+DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) :
+      ConnectionManager(conf), users(getIntOption(conf, "USER_CACHE_TTL", 300)) {
 //   if (dbConn) return;
-   map<string,string> dbkeys;
    sem_init(&map_sem, 0, 1);
+   sem_init(&rd_sem, 0, 1);
+   updateid_block = getIntOption(conf, "UPDATEID_BLOCK", 1000);
+   if (updateid_block == 0) {
+      updateid_block = 1;
+   }
 
    string dbHost = getStringOption(conf, "DB_HOST", "");
    if (dbHost.length() > 0) {
@@ -188,6 +232,31 @@ DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) : Connec
       dbkeys["password"] = dbPass;
    }
 
+   dbConn = connect();
+//   memset(dbPass, 0, strlen(dbPass));
+
+   /* Check to see that the backend connection was successfully made */
+   if (PQstatus(dbConn) != CONNECTION_OK) {
+      log(LSQL, "Connection to database failed: %s\n", PQerrorMessage(dbConn));
+      PQfinish(dbConn);
+   }
+   else {
+      init_queries();
+      if (users.enabled()) {
+         pthread_attr_t attr;
+         pthread_attr_init(&attr);
+         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+         pthread_t tid;
+         pthread_create(&tid, &attr, listen_thread, (void*)this);
+      }
+   }
+}
+
+/**
+ * connect opens a new connection to the database using the configured parameters
+ * @return the new connection, check its status before using it
+ */
+PGconn *DatabaseConnectionManager::connect() {
    char const **keywords = new char const *[dbkeys.size() + 1];
    char const **values = new char const *[dbkeys.size() + 1];
    int idx = 0;
@@ -195,28 +264,146 @@ DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) : Connec
       log(LDEBUG, "%s:%s\n", (*i).first.c_str(), (*i).second.c_str());
       keywords[idx] = (*i).first.c_str();
       values[idx] = (*i).second.c_str();
-      log(LDEBUG, "%s:%s\n", (*i).first.c_str(), (*i).second.c_str());
    }
    keywords[idx] = values[idx] = NULL;
-   dbConn = PQconnectdbParams(keywords, values, 0);
-//   memset(dbPass, 0, strlen(dbPass));
+   PGconn *conn = PQconnectdbParams(keywords, values, 0);
+   delete [] keywords;
+   delete [] values;
+   return conn;
+}
 
-   /* Check to see that the backend connection was successfully made */
-   if (PQstatus(dbConn) != CONNECTION_OK) {
-      log(LSQL, "Connection to database failed: %s\n", PQerrorMessage(dbConn));
-      PQfinish(dbConn);
+/**
+ * readerConn gets the calling thread's own connection for reading updates,
+ * opening it the first time and again if it has been lost
+ * @return the connection, NULL if one could not be opened
+ */
+PGconn *DatabaseConnectionManager::readerConn() {
+   pthread_t self = pthread_self();
+   sem_wait(&rd_sem);
+   PGconn *conn = readers[self];
+   sem_post(&rd_sem);
+   if (conn != NULL && PQstatus(conn) == CONNECTION_OK) {
+      return conn;
+   }
+   PQfinish(conn);
+   conn = connect();
+   if (PQstatus(conn) != CONNECTION_OK) {
+      log(LSQL, "catch-up connection failed: %s\n", PQerrorMessage(conn));
+      PQfinish(conn);
+      conn = NULL;
    }
    else {
-      init_queries();
+      PGresult *res = PQprepare(conn, "getLatestUpdates",
+                      "select updateid,cmd,json from updates where updateid > $1 and pid = $2 order by updateid asc;",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(conn));
+      }
+      PQclear(res);
    }
-   delete [] keywords;
-   delete [] values;
+   sem_wait(&rd_sem);
+   readers[self] = conn;
+   sem_post(&rd_sem);
+   return conn;
+}
+
+/**
+ * loadUsers fills the user cache with every row of the users table
+ * @param conn the connection to read from
+ */
+void DatabaseConnectionManager::loadUsers(PGconn *conn) {
+   uint64_t gen = users.generation();
+   PGresult *rset = PQexecParams(conn, "select userid,username,pwhash,pub,sub from users;",
+                                 0, NULL, NULL, NULL, NULL, 1);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      log(LSQL, "loadUsers: %s\n", PQerrorMessage(conn));
+   }
+   else {
+      int rows = PQntuples(rset);
+      for (int r = 0; r < rows; r++) {
+         users.store(PQgetvalue(rset, r, 1), ntohl(*(uint32_t*)PQgetvalue(rset, r, 0)),
+                     string(PQgetvalue(rset, r, 2), PQgetlength(rset, r, 2)),
+                     ntohll(*(uint64_t*)PQgetvalue(rset, r, 3)),
+                     ntohll(*(uint64_t*)PQgetvalue(rset, r, 4)), gen);
+      }
+      log(LINFO3, "cached %d users\n", rows);
+   }
+   PQclear(rset);
+}
+
+/**
+ * listenUsers keeps the user cache consistent with the users table. It holds
+ * its own connection, LISTENing for the notifications collab_mgr sends when
+ * it adds or changes a user. The payload is the username, or empty when any
+ * user may have changed. Whenever the connection is (re)established the cache
+ * is reloaded, since notifications may have been missed in the meantime.
+ */
+void DatabaseConnectionManager::listenUsers() {
+   while (!done) {
+      PGconn *conn = connect();
+      if (PQstatus(conn) != CONNECTION_OK) {
+         log(LSQL, "user cache listener failed to connect: %s\n", PQerrorMessage(conn));
+         PQfinish(conn);
+         users.clear();
+         sleep(5);
+         continue;
+      }
+      PGresult *res = PQexec(conn, "LISTEN " USER_NOTIFY_CHANNEL ";");
+      bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+      PQclear(res);
+      if (ok) {
+         //listening before loading means no change can slip between the two
+         users.clear();
+         loadUsers(conn);
+      }
+      int sock = PQsocket(conn);
+      while (ok && !done) {
+         fd_set fds;
+         FD_ZERO(&fds);
+         FD_SET(sock, &fds);
+         struct timeval tv = {1, 0};
+         if (select(sock + 1, &fds, NULL, NULL, &tv) < 0 && errno != EINTR) {
+            break;
+         }
+         if (PQconsumeInput(conn) == 0) {
+            log(LSQL, "user cache listener: %s\n", PQerrorMessage(conn));
+            break;
+         }
+         PGnotify *n;
+         while ((n = PQnotifies(conn)) != NULL) {
+            if (n->extra != NULL && n->extra[0] != 0) {
+               log(LINFO4, "user %s changed\n", n->extra);
+               users.invalidate(n->extra);
+            }
+            else {
+               log(LINFO4, "users changed\n");
+               users.clear();
+            }
+            PQfreemem(n);
+         }
+      }
+      PQfinish(conn);
+      //can't tell what we missed until we are listening again
+      users.clear();
+      if (!done) {
+         sleep(1);
+      }
+   }
+}
+
+void *DatabaseConnectionManager::listen_thread(void *arg) {
+   ((DatabaseConnectionManager*)arg)->listenUsers();
+   return NULL;
 }
 
 DatabaseConnectionManager::~DatabaseConnectionManager() {
    PGresult *res = PQexec(dbConn, "DEALLOCATE postUpdate;");
    PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE postUpdate;");
+   res = PQexec(dbConn, "DEALLOCATE postUpdateId;");
+   PQclear(res);
+   res = PQexec(dbConn, "DEALLOCATE leaseUpdateids;");
+   PQclear(res);
+   res = PQexec(dbConn, "DEALLOCATE floorUpdateids;");
    PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE addProject;");
    PQclear(res);
@@ -236,15 +423,20 @@ DatabaseConnectionManager::~DatabaseConnectionManager() {
    PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE getLatestUpdates;");
    PQclear(res);
+   res = PQexec(dbConn, "DEALLOCATE lastUpdateid;");
+   PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE copyUpdates;");
    PQclear(res);
    res = PQexec(dbConn, "DEALLOCATE projectPermsUpdate;");
    PQclear(res);
    PQfinish(dbConn);
    dbConn = NULL;
+   for (map<pthread_t,PGconn*>::iterator i = readers.begin(); i != readers.end(); i++) {
+      PQfinish(i->second);
+   }
 }
 
-uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio) {
+uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio, ResumeInfo *resumed, uint32_t *caps) {
    uint8_t challenge[CHALLENGE_SIZE];
    fill_random(challenge, CHALLENGE_SIZE);
    json_object *obj = json_object_new_object();
@@ -258,8 +450,14 @@ uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio) {
       return AUTH_FAIL;
    }
 
+   *caps = authCaps(obj);
    uint32_t rlen;
    const char *type = string_from_json(obj, "type");
+   if (type != NULL && strcmp(type, MSG_RESUME_REQUEST) == 0) {
+      uint32_t result = resumeAuth(obj, resumed);
+      json_object_put(obj);
+      return result;
+   }
    uint8_t *response = hex_from_json(obj, "hmac", &rlen);
    const char *user = string_from_json(obj, "user");
    json_object_put(obj);
@@ -267,12 +465,43 @@ uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio) {
       return AUTH_INVALID_PROTO;
    }
 
-   uint32_t result = AUTH_FAIL;
+   uint32_t result = AUTH_INVALID_USER;
+   CachedUser cu;
+   bool cached = users.lookup(user, cu);
+   if (cached || queryUser(user, cu)) {
+      bool ok = checkResponse(challenge, cu, response);
+      if (!ok && cached && queryUser(user, cu)) {
+         //the password may have changed since the user was cached
+         ok = checkResponse(challenge, cu, response);
+      }
+      if (ok) {
+         result = cu.uid;
+         setUserInfo(UserInfo(user, cu.uid, cu.pub, cu.sub));
+      }
+      else {
+#ifdef DEBUG
+         log(LDEBUG, "authenticate failure\n");
+#endif
+      }
+   }
+   delete [] response;
+   return result;
+}
+
+/**
+ * queryUser reads a user's row from the database and caches it
+ * @param user the username
+ * @param cu receives the row
+ * @return false if there is no such user
+ */
+bool DatabaseConnectionManager::queryUser(const char *user, CachedUser &cu) {
+   bool res = false;
    static const int plens[1] = {0};
    static const int pformats[1] = {0};
    //insert into files values(stream_id, fname);
    const char * const parms[1] = {user};
 
+   uint64_t gen = users.generation();
    sem_wait(&gui_sem);
    PGresult *rset = PQexecPrepared(dbConn, "getUserInfo",
                        1, //int nParams,   size of arrays that follow
@@ -285,39 +514,41 @@ uint32_t DatabaseConnectionManager::doAuth(NetworkIO *nio) {
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
       log(LSQL, "authenticate: %s (%s), %d\n", PQerrorMessage(dbConn), user, qres);
-      result = AUTH_INVALID_USER;
    }
    else {
-//         log(LSQL, "authenticate: good add file for %d\n", htonl(id));
       //userid,pwhash,pub,sub
-      uint32_t uid = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 0));
-      char *pwhash = PQgetvalue(rset, 0, 1);
-      uint32_t hashlen;
-      uint8_t *key = toByteArray(pwhash, &hashlen);
-      int hlen = PQgetlength(rset, 0, 1);
-      uint8_t *hmac = HmacMD5(challenge, CHALLENGE_SIZE, key, hlen / 2);
-      delete [] key;
-#ifdef DEBUG
-      log(LDEBUG, "Trying to authenticate uid: %d, pwhash %s, hashlen: %d\n", uid, pwhash, hlen);
-      log(LDEBUG, "   challenge: %s, hmac: %s\n", toHexString(challenge, CHALLENGE_SIZE).c_str(), toHexString(hmac, 16).c_str());
-      log(LDEBUG, "    response: %s, rlen: %d\n", toHexString(response, 16).c_str(), rlen);
-#endif
+      cu.uid = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 0));
+      cu.pwhash.assign(PQgetvalue(rset, 0, 1), PQgetlength(rset, 0, 1));
+      cu.pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 2));
+      cu.sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
+      users.store(user, cu.uid, cu.pwhash, cu.pub, cu.sub, gen);
+      res = true;
+   }
+   PQclear(rset);
+   return res;
+}
 
-      if (response != NULL && memcmp(response, hmac, 16) == 0) {
-         result = uid;
-         user_map[uid] = UserInfo(user, uid, ntohll(*(uint64_t*)PQgetvalue(rset, 0, 2)), ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3)));
-      }
-      else {
+/**
+ * checkResponse verifies a client's HMAC of the challenge against a user's password hash
+ * @param challenge the challenge sent to the client
+ * @param cu the user the client claims to be
+ * @param response the client's HMAC, MD5_SIZE bytes
+ * @return true if the response is correct
+ */
+bool DatabaseConnectionManager::checkResponse(const uint8_t *challenge, const CachedUser &cu, const uint8_t *response) {
+   uint32_t hashlen;
+   uint8_t *key = toByteArray(cu.pwhash, &hashlen);
+   int hlen = cu.pwhash.length();
+   uint8_t *hmac = HmacMD5(challenge, CHALLENGE_SIZE, key, hlen / 2);
+   delete [] key;
 #ifdef DEBUG
-         log(LDEBUG, "authenticate failure\n");
+   log(LDEBUG, "Trying to authenticate uid: %d, pwhash %s, hashlen: %d\n", cu.uid, cu.pwhash.c_str(), hlen);
+   log(LDEBUG, "   challenge: %s, hmac: %s\n", toHexString(challenge, CHALLENGE_SIZE).c_str(), toHexString(hmac, 16).c_str());
+   log(LDEBUG, "    response: %s\n", toHexString(response, 16).c_str());
 #endif
-         result = AUTH_INVALID_USER;
-      }
-      delete [] hmac;
-   }
-   delete [] response;
-   PQclear(rset);
-   return result;
+   bool res = memcmp(response, hmac, 16) == 0;
+   delete [] hmac;
+   return res;
 }
 
 /**
@@ -332,6 +563,18 @@ void DatabaseConnectionManager::importUpdate(const char *newowner, int pid, cons
    log(LERROR, "importing in DB mode should be handled using server manager.\n");
 }
 
+/**
+ * importUpdates archives a batch of migrated updates in one operation
+ * @param newowner the new uid to attribute the updates to
+ * @param pid the local project id for the migrated project
+ * @param updates json array of complete update objects
+ * @return the number of updates imported, -1 on failure
+ */
+int DatabaseConnectionManager::importUpdates(const char *newowner, int pid, json_object *updates) {
+   log(LERROR, "importing in DB mode should be handled using server manager.\n");
+   return -1;
+}
+
 /**
  * post both queues a newly received update to be sent to other clients and (if in DB mode)
  * archives the udpate in the database so that future clients can receive it
@@ -344,31 +587,47 @@ void DatabaseConnectionManager::importUpdate(const char *newowner, int pid, cons
 void DatabaseConnectionManager::post(Client *c, const char *cmd, json_object *obj) {
    uint64_t updateid = 0;
    //db insert
-   const int plens[4] = {0, 4, 0, 0};
-   static const int pformats[4] = {0, 1, 0, 0};
+   const int plens[5] = {8, 0, 4, 0, 0};
+   static const int pformats[5] = {1, 0, 1, 0, 0};
 
    int pid = htonl(c->getPid());
 
    size_t jlen;
    const char *jstr = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
 
-   const char * const parms[4] = {c->getUser().c_str(), (char*)&pid, cmd, jstr};
+   uint64_t nuid = 0;
+   const char * const parms[5] = {(char*)&nuid, c->getUser().c_str(), (char*)&pid, cmd, jstr};
 
+   //ids are assigned and queued under the same lock so updates fan out in updateid order
    sem_wait(&pu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                       4, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&pu_sem);
-   ExecStatusType qres = PQresultStatus(rset);
+   PGresult *rset = NULL;
+   if (updateid_block > 0) {
+      updateid = nextUpdateid(c->getPid());
+      if (updateid != 0) {
+         nuid = htonll(updateid);
+         rset = PQexecPrepared(dbConn, "postUpdateId", 5, parms, plens, pformats, 1);
+      }
+   }
+   else {
+      rset = PQexecPrepared(dbConn, "postUpdate",
+                          4, //int nParams,   size of arrays that follow
+                          parms + 1, //parms,  //const char * const *paramValues, array of string values
+                          plens + 1, //const int *paramLengths,
+                          pformats + 1, //const int *paramFormats,
+                          1); //int resultFormat); 0 == text, 1 == binary
+   }
+   ExecStatusType qres = rset ? PQresultStatus(rset) : PGRES_FATAL_ERROR;
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      log(LSQL, "postUpdate: %s\n", PQerrorMessage(dbConn));
+      if (rset) {
+         log(LSQL, "postUpdate: %s\n", PQerrorMessage(dbConn));
+      }
+      json_object_put(obj);
    }
    else {
-      //postgres integers are big endian so swap if necessary
-      updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+      if (updateid_block == 0) {
+         //postgres integers are big endian so swap if necessary
+         updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+      }
 //      log(LDEBUG, "Added update: %lld\n", updateid);
 //      log(LDEBUG, "Added update: %lld, cmd: %d, pid: %d, size: %d\n", updateid, cmd, pid, dlen);
 //      logln(LINFO4, "Added update: " + updateid + ", cmd: " + cmd + ", pid: " + pid + ", size: " + data.length);
@@ -377,7 +636,63 @@ void DatabaseConnectionManager::post(Client *c, const char *cmd, json_object *ob
       sem_post(&queueMutex);
       sem_post(&queueSem);
    }
+   sem_post(&pu_sem);
+   PQclear(rset);
+}
+
+/**
+ * nextUpdateid takes the next updateid from the project's lease, leasing a
+ * new block once the current one is used up. pu_sem must be held.
+ * @param pid the local pid of the project
+ * @return the updateid, 0 if a new block could not be leased
+ */
+uint64_t DatabaseConnectionManager::nextUpdateid(uint32_t pid) {
+   IdLease &lease = leases[pid];
+   if (lease.next == 0 || lease.next > lease.last) {
+      static const int plens[2] = {4, 8};
+      static const int pformats[2] = {1, 1};
+      int npid = htonl(pid);
+      uint64_t nblock = htonll((uint64_t)updateid_block);
+      const char * const parms[2] = {(char*)&npid, (char*)&nblock};
+      PGresult *rset = PQexecPrepared(dbConn, "leaseUpdateids", 2, parms, plens, pformats, 1);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+         log(LSQL, "leaseUpdateids: %s\n", PQerrorMessage(dbConn));
+         PQclear(rset);
+         return 0;
+      }
+      lease.last = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+      lease.next = lease.last - updateid_block + 1;
+      PQclear(rset);
+      log(LINFO4, "project %u leased updateids %llu-%llu\n", pid,
+          (unsigned long long)lease.next, (unsigned long long)lease.last);
+   }
+   return lease.next++;
+}
+
+/**
+ * floorUpdateids makes sure the project's future updateids are above floor,
+ * used when a fork inherits updates up to floor from its parent
+ * @param pid the local pid of the project
+ * @param floor the highest updateid the project may already contain
+ */
+void DatabaseConnectionManager::floorUpdateids(uint32_t pid, uint64_t floor) {
+   if (updateid_block == 0) {
+      return;
+   }
+   static const int plens[2] = {4, 8};
+   static const int pformats[2] = {1, 1};
+   int npid = htonl(pid);
+   uint64_t nfloor = htonll(floor);
+   const char * const parms[2] = {(char*)&npid, (char*)&nfloor};
+   sem_wait(&pu_sem);
+   PGresult *rset = PQexecPrepared(dbConn, "floorUpdateids", 2, parms, plens, pformats, 1);
+   if (PQresultStatus(rset) != PGRES_COMMAND_OK) {
+      log(LSQL, "floorUpdateids: %s\n", PQerrorMessage(dbConn));
+   }
    PQclear(rset);
+   //the next id comes from a lease taken above the new floor
+   leases.erase(pid);
+   sem_post(&pu_sem);
 }
 
 /**
@@ -387,30 +702,88 @@ void DatabaseConnectionManager::post(Client *c, const char *cmd, json_object *ob
  * this function is typically called when a user is re-joining a project that they had previously worked on
  * @param c the client requesting updates
  * @param lastUpdate the last update the client received
+ * @param state true if a cold joining client accepts the project snapshot
+ * @param until send nothing after this updateid, 0 for no limit
+ * @return the last updateid the client has been sent, in updates or state
  */
-void DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
+uint64_t DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate, bool state, uint64_t until) {
    static const int plens[2] = {8, 4};
    static const int pformats[2] = {1, 1};
 
    int pid = htonl(c->getPid());
 
+   Snapshot *s = NULL;
+   vector<json_object*> chunks;
+   if (state && lastUpdate == 0) {
+      //the snapshot is copied out and the tail after it fetched below, the
+      //snapshot is refreshed from the tail if it has grown long enough
+      s = getSnapshot(c->getPid());
+      sem_wait(&s->lock);
+      //a snapshot refreshed past until by someone else still works for
+      //clients holding live updates since they joined, the ones it covers
+      //are dropped when the held updates are sent
+      bool usable = until == 0 || s->updateid <= until || (c->getCaps() & CAP_JOIN_CATCHUP);
+      if (usable) {
+         s->chunks(c, chunks);
+         lastUpdate = s->updateid;
+      }
+      sem_post(&s->lock);
+      if (!usable) {
+         s = NULL;
+      }
+   }
+   uint64_t sent = lastUpdate;
+
    lastUpdate = htonll(lastUpdate);
    const char * const parms[2] = {(char*)&lastUpdate, (char*)&pid};
 
-   sem_wait(&glu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "getLatestUpdates",
+   PGconn *conn = readerConn();
+   if (conn == NULL) {
+      //fall back to the shared connection, under the lock the inserts take
+      conn = dbConn;
+      sem_wait(&pu_sem);
+   }
+   PGresult *rset = PQexecPrepared(conn, "getLatestUpdates",
                        2, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&glu_sem);
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
-      log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
+      log(LSQL, "getLatestUpdates: %s\n", PQerrorMessage(conn));
    }
-   else {
+   if (conn == dbConn) {
+      //the result is ours, the rows are sent without holding up the inserts
+      sem_post(&pu_sem);
+   }
+   if (qres == PGRES_TUPLES_OK) {
       int rows = PQntuples(rset);
+      //rows are in updateid order, drop any past until
+      while (until != 0 && rows > 0 && ntohll(*(uint64_t*)PQgetvalue(rset, rows - 1, 0)) > until) {
+         rows--;
+      }
+      if (s != NULL && (uint32_t)rows >= snapshot_interval) {
+         //someone else may have brought the snapshot forward since it was
+         //copied, only the rows past it still apply
+         sem_wait(&s->lock);
+         for (int i = 0; i < rows; i++) {
+            uint64_t updateid = ntohll(*(uint64_t*)PQgetvalue(rset, i, 0));
+            if (updateid <= s->updateid) {
+               continue;
+            }
+            json_object *obj = json_tokener_parse((const char*)PQgetvalue(rset, i, 2));
+            if (obj != NULL) {
+               s->apply(updateid, obj);
+               json_object_put(obj);
+            }
+         }
+         sem_post(&s->lock);
+      }
+      for (size_t i = 0; i < chunks.size(); i++) {
+         c->send_data(MSG_PROJECT_STATE, chunks[i]);
+      }
+      chunks.clear();
       for (int i = 0; i < rows; i++) {
          //integer values coming from database are big endian so swap if neccessary
          uint64_t updateid = *(uint64_t*)PQgetvalue(rset, i, 0);
@@ -424,13 +797,51 @@ void DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate
 //         log(LDEBUG, "posting %lld (cmd %d)\n", ntohll(updateid), cmd);
 //         logln(LDEBUG, "posting " + updateid + " (cmd " + cmd + ")");
 
+         if (!c->inScope(obj)) {
+            json_object_put(obj);
+            continue;
+         }
          json_object_object_del(obj, "updateid");  //make sure key doesn't exist from old update
          append_json_uint64_val(obj, "updateid", updateid);
-         c->post(cmd, obj);
+         if (!c->replay(cmd, obj, PQgetlength(rset, i, 2))) {
+            //the client has left or joined another project
+            break;
+         }
+         sent = updateid;
       }
    }
    PQclear(rset);
+   for (size_t i = 0; i < chunks.size(); i++) {
+      //the tail could not be fetched, the snapshot alone is still usable
+      c->send_data(MSG_PROJECT_STATE, chunks[i]);
+   }
+   return sent > until ? sent : until;
+}
+
+/**
+ * lastUpdateid gets the newest update stored for a project, taken under
+ * pu_sem so every update up to it has been inserted
+ * @param pid the local pid of the project
+ */
+uint64_t DatabaseConnectionManager::lastUpdateid(uint32_t pid) {
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+   uint64_t updateid = 0;
+
+   pid = htonl(pid);
+   const char * const parms[1] = {(char*)&pid};
 
+   sem_wait(&pu_sem);
+   PGresult *rset = PQexecPrepared(dbConn, "lastUpdateid", 1, parms, plens, pformats, 1);
+   sem_post(&pu_sem);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+      log(LSQL, "lastUpdateid: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   }
+   PQclear(rset);
+   return updateid;
 }
 
 /**
@@ -705,7 +1116,7 @@ int DatabaseConnectionManager::joinProject(Client *c, uint32_t lpid) {
    PQclear(rset);
 
    if (foundPid) {
-      projects.addClient(c);
+      addClient(c);
       rval = 0;
    }
    else {
@@ -914,6 +1325,8 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
       else {
 //         uint64_t lastinserted = *(uint64_t*)PQgetvalue(rset, 0, 0);
 //         logln("Last inserted was " + lastinserted + ", lastupdateid was " + lastupdateid, LINFO);
+         //the fork's own updates must follow everything it inherited
+         floorUpdateids(lpid, lastupdateid);
          rval = lpid;
       }
       PQclear(rset);
@@ -1068,6 +1481,7 @@ int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string
          else {
 //            uint64_t lastinserted = *(uint64_t*)PQgetvalue(rset, 0, 0);
 //            logln("Last inserted was " + lastinserted + ", lastupdateid was " + lastupdateid, LINFO);
+            floorUpdateids(lpid, ntohll(lastupdateid));
             rval = lpid;
          }
          PQclear(rset);
@@ -1097,13 +1511,30 @@ int DatabaseConnectionManager::importProject(const char *owner, const string &gp
 }
 
 /**
- * exportProject dumps all project updates
+ * exportProject streams project updates, in updateid order, to a callback
  * @param pid the local project id of the prject to be exported
+ * @param since only updates with an updateid greater than this are exported
+ * @param until only updates with an updateid up to this are exported, 0 for no limit
+ * @param func called with each serialized update, return false to stop
+ * @param user passed through to func
+ * @return the number of updates exported, -1 if the project doesn't exist
  */
 
-json_object *DatabaseConnectionManager::exportProject(uint32_t pid) {
+int DatabaseConnectionManager::exportProject(uint32_t pid, uint64_t since, uint64_t until, ecb func, void *user) {
    log(LERROR, "exporting in DB mode should be handled using server manager.\n");
-   return NULL;
+   return -1;
+}
+
+/**
+ * compactProject removes stored updates that are superseded by later ones
+ * @param pid the local project id of the project to compact
+ * @param watermark only updates up to this updateid are compacted, 0 for all
+ * @return the number of updates removed, -1 if the project doesn't exist
+ */
+
+int DatabaseConnectionManager::compactProject(uint32_t pid, uint64_t watermark) {
+   log(LERROR, "compacting in DB mode should be handled using server manager.\n");
+   return -1;
 }
 
 /**
@@ -1185,7 +1616,7 @@ int DatabaseConnectionManager::addProject(Client *c, const string &hash, const s
       PQclear(rset);
    }
    if (lpid != -1) {
-      projects.addClient(c);
+      addClient(c);
    }
    return lpid;
 }
@@ -1249,6 +1680,9 @@ void DatabaseConnectionManager::updateProjectPerms(Client *c, uint64_t pub, uint
    }
    PQclear(rset);
 
+   //tokens carry the old effective permissions
+   resume->revokeProject(c->getPid());
+
    log(LINFO3, "recalculating effective permissions for connected clients\n");
 
    UpdateArgs args = {c, pub, sub};
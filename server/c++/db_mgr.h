@@ -24,11 +24,13 @@
 #include <map>
 #include <stdint.h>
 #include <libpq-fe.h>
+#include <pthread.h>
 #include <semaphore.h>
 
 #include "cli_mgr.h"
 #include "client.h"
 #include "proj_info.h"
+#include "usercache.h"
 
 using namespace std;
 
@@ -41,13 +43,17 @@ public:
     * doAuth authenticates a user
     * bacially this is standard CHAP with HMAC (md5)
     * @param nio The network connection to authenticate
+    * @param resumed receives the session restored if the client presented a resume token
+    * @param caps receives the capabilities agreed with the plugin
     * @return the user id of an authenticated user, or failure code
     */
-   uint32_t doAuth(NetworkIO *nio);
+   uint32_t doAuth(NetworkIO *nio, ResumeInfo *resumed, uint32_t *caps);
 
    void importUpdate(const char *newowner, int pid, const char *cmd, json_object *obj);
+   int importUpdates(const char *newowner, int pid, json_object *updates);
    void post(Client *src, const char *cmd, json_object *obj);
-   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+   uint64_t sendLatestUpdates(Client *c, uint64_t lastUpdate, bool state = false, uint64_t until = 0);
+   uint64_t lastUpdateid(uint32_t pid);
    const Project *getProject(uint32_t pid);
 
    vector<const Project*> *getProjectList(const string &phash);
@@ -59,7 +65,8 @@ public:
    void sendForkFollows(Client *originator, int oldlpid, uint64_t lastupdateid, const string &desc);
    int snapforkProject(Client *c, int spid, const string &desc, uint64_t pub, uint64_t sub);
    int importProject(const char *owner, const string &gpid, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
-   json_object *exportProject(uint32_t pid);
+   int exportProject(uint32_t pid, uint64_t since, uint64_t until, ecb func, void *user);
+   int compactProject(uint32_t pid, uint64_t watermark);
    int addProject(Client *c, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
    void updateProjectPerms(Client *c, uint64_t pub, uint64_t sub);
    int gpid2lpid(const string &gpid);
@@ -68,6 +75,42 @@ private:
    map<uint32_t,Project*> pid_project_map;
       
    void init_queries();
+   PGconn *connect();
+
+   //credentials for doAuth, kept current by a thread LISTENing for changes
+   UserCache users;
+   bool queryUser(const char *user, CachedUser &cu);
+   bool checkResponse(const uint8_t *challenge, const CachedUser &cu, const uint8_t *response);
+   void loadUsers(PGconn *conn);
+   void listenUsers();
+   static void *listen_thread(void *arg);
+
+   //connection parameters, for the listener's and catch-up workers' own connections
+   map<string,string> dbkeys;
+
+   /*
+    * Catch-ups run on worker threads alongside the dispatcher's inserts, so
+    * each worker reads the updates it sends over a connection of its own
+    * rather than sharing dbConn. Guarded by rd_sem.
+    */
+   map<pthread_t,PGconn*> readers;
+   PGconn *readerConn();
+   sem_t rd_sem;
+
+   /*
+    * updateids are handed out locally from blocks leased per project. The
+    * end of each lease is stored in projects.updateid_hwm before any id in
+    * it is used, so ids stay unique and increasing across restarts. Guarded
+    * by pu_sem, along with the inserts that use the ids.
+    */
+   struct IdLease {
+      uint64_t next;
+      uint64_t last;
+   };
+   map<uint32_t,IdLease> leases;
+   uint32_t updateid_block;    //0 when the schema has no updateid_hwm
+   uint64_t nextUpdateid(uint32_t pid);
+   void floorUpdateids(uint32_t pid, uint64_t floor);
 
    sem_t pu_sem;
    sem_t ap_sem;
@@ -78,7 +121,6 @@ private:
    sem_t fpbp_sem;
    sem_t fpbg_sem;
    sem_t gui_sem;
-   sem_t glu_sem;
    sem_t cu_sem;
    sem_t ppu_sem;
    sem_t map_sem;
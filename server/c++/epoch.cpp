@@ -0,0 +1,163 @@
+/*
+   collabREate epoch.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#include "epoch.h"
+
+using namespace std;
+
+//epoch of a slot whose thread is outside any critical section
+#define EPOCH_IDLE UINT64_MAX
+
+/*
+ * Each thread that has ever read gets a slot, slots are never freed, a
+ * thread that exits gives its slot up for reuse by the next new reader
+ */
+struct EpochSlot {
+   volatile uint64_t epoch;   //global epoch seen on entry, EPOCH_IDLE outside
+   volatile int used;
+   uint32_t depth;            //nesting level, only touched by the owner
+   EpochSlot *next;
+};
+
+struct Retired {
+   void (*free_func)(void*);
+   void *ptr;
+   uint64_t epoch;            //readers that entered after this can't see ptr
+};
+
+static volatile uint64_t global_epoch = 1;
+static EpochSlot *volatile slots = NULL;
+static __thread EpochSlot *my_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+static vector<Retired> limbo;
+static volatile size_t limbo_size = 0;   //limbo.size(), read without the lock
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_slot(void *arg) {
+   EpochSlot *s = (EpochSlot*)arg;
+   s->depth = 0;
+   s->epoch = EPOCH_IDLE;
+   __sync_synchronize();
+   s->used = 0;
+}
+
+static void make_key() {
+   pthread_key_create(&slot_key, release_slot);
+}
+
+static EpochSlot *acquire_slot() {
+   pthread_once(&slot_once, make_key);
+   EpochSlot *s;
+   for (s = slots; s != NULL; s = s->next) {
+      if (s->used == 0 && __sync_bool_compare_and_swap(&s->used, 0, 1)) {
+         break;
+      }
+   }
+   if (s == NULL) {
+      s = new EpochSlot;
+      s->epoch = EPOCH_IDLE;
+      s->used = 1;
+      do {
+         s->next = slots;
+      } while (!__sync_bool_compare_and_swap(&slots, s->next, s));
+   }
+   s->depth = 0;
+   pthread_setspecific(slot_key, s);
+   my_slot = s;
+   return s;
+}
+
+//the oldest epoch any reader may still be using
+static uint64_t oldest_reader() {
+   uint64_t oldest = EPOCH_IDLE;
+   __sync_synchronize();
+   for (EpochSlot *s = slots; s != NULL; s = s->next) {
+      uint64_t e = s->epoch;
+      if (e < oldest) {
+         oldest = e;
+      }
+   }
+   return oldest;
+}
+
+//free whatever no reader can reach any more
+static void reclaim() {
+   vector<Retired> done;
+   uint64_t oldest = oldest_reader();
+   pthread_mutex_lock(&limbo_lock);
+   size_t keep = 0;
+   for (size_t i = 0; i < limbo.size(); i++) {
+      if (limbo[i].epoch < oldest) {
+         done.push_back(limbo[i]);
+      }
+      else {
+         limbo[keep++] = limbo[i];
+      }
+   }
+   limbo.resize(keep);
+   limbo_size = keep;
+   pthread_mutex_unlock(&limbo_lock);
+   for (size_t i = 0; i < done.size(); i++) {
+      (*done[i].free_func)(done[i].ptr);
+   }
+}
+
+void epoch_enter() {
+   EpochSlot *s = my_slot ? my_slot : acquire_slot();
+   if (s->depth++ == 0) {
+      s->epoch = global_epoch;
+      //the published pointer must not be read before the slot is visible
+      __sync_synchronize();
+   }
+}
+
+void epoch_exit() {
+   EpochSlot *s = my_slot;
+   if (--s->depth == 0) {
+      uint64_t entered = s->epoch;
+      __sync_synchronize();
+      s->epoch = EPOCH_IDLE;
+      //a retire that ran while we were inside could not free what we held,
+      //nobody else may retire for a while so free it now
+      if (entered != global_epoch && limbo_size != 0) {
+         reclaim();
+      }
+   }
+}
+
+void epoch_retire(void (*free_func)(void*), void *ptr) {
+   Retired r;
+   r.free_func = free_func;
+   r.ptr = ptr;
+   //the new pointer was published before this, anyone entering later sees it
+   __sync_synchronize();
+   r.epoch = __sync_fetch_and_add(&global_epoch, 1);
+   pthread_mutex_lock(&limbo_lock);
+   limbo.push_back(r);
+   limbo_size = limbo.size();
+   pthread_mutex_unlock(&limbo_lock);
+   reclaim();
+}
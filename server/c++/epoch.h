@@ -0,0 +1,59 @@
+/*
+   collabREate epoch.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+/*
+ * Epoch based reclamation for structures that are read without locks.
+ * A writer copies the structure, changes the copy, publishes it with a
+ * single pointer store and hands the old copy to epoch_retire.  Readers
+ * bracket their use of a published pointer with epoch_enter/epoch_exit
+ * (or an EpochGuard) and never block.  A retired copy is freed once every
+ * reader that could have seen it has left its critical section.
+ */
+
+/**
+ * epoch_enter starts a read side critical section, sections may nest
+ */
+void epoch_enter();
+
+/**
+ * epoch_exit ends the critical section started by the matching epoch_enter,
+ * if anything was retired while it ran whatever has become unreachable is
+ * freed
+ */
+void epoch_exit();
+
+/**
+ * epoch_retire frees a structure that is no longer published once no
+ * reader can hold it, this never waits for readers
+ * @param free_func called with ptr to release it
+ * @param ptr the unpublished structure
+ */
+void epoch_retire(void (*free_func)(void*), void *ptr);
+
+class EpochGuard {
+public:
+   EpochGuard() {epoch_enter();};
+   ~EpochGuard() {epoch_exit();};
+};
+
+#endif
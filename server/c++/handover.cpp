@@ -0,0 +1,369 @@
+/*
+   collabREate handover.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <map>
+
+#include "utils.h"
+#include "handover.h"
+
+//most listening sockets a server hands over
+#define MAX_HANDOVER_FDS 16
+
+//largest handover message accepted
+#define MAX_HANDOVER_MSG (64 * 1024 * 1024)
+
+//sockets taken over from the previous server, by port, until listen_on uses them
+static map<unsigned short,int> inherited;
+
+//the port of a listening TCP socket, 0 for anything else
+static unsigned short listener_port(int fd) {
+   int listening = 0;
+   socklen_t len = sizeof(listening);
+   if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening) {
+      return 0;
+   }
+   sockaddr_storage addr;
+   len = sizeof(addr);
+   if (getsockname(fd, (sockaddr*)&addr, &len) != 0) {
+      return 0;
+   }
+   if (addr.ss_family == AF_INET6) {
+      return ntohs(((sockaddr_in6*)&addr)->sin6_port);
+   }
+   if (addr.ss_family == AF_INET) {
+      return ntohs(((sockaddr_in*)&addr)->sin_port);
+   }
+   return 0;
+}
+
+//every listening TCP socket this process has, by descriptor
+static map<int,unsigned short> listeners() {
+   map<int,unsigned short> res;
+   int maxfd = getdtablesize();
+   for (int fd = 0; fd < maxfd; fd++) {
+      unsigned short port = listener_port(fd);
+      if (port != 0) {
+         res[fd] = port;
+      }
+   }
+   return res;
+}
+
+int find_listener(unsigned short port) {
+   map<int,unsigned short> l = listeners();
+   for (map<int,unsigned short>::iterator i = l.begin(); i != l.end(); i++) {
+      if (i->second == port) {
+         return i->first;
+      }
+   }
+   return -1;
+}
+
+//the address and port at the other end of a connected socket
+static bool peer_of(int fd, string &addr, unsigned short *port) {
+   sockaddr_storage peer;
+   socklen_t len = sizeof(peer);
+   if (getpeername(fd, (sockaddr*)&peer, &len) != 0) {
+      return false;
+   }
+   char buf[INET6_ADDRSTRLEN];
+   if (peer.ss_family == AF_INET6) {
+      sockaddr_in6 *sin6 = (sockaddr_in6*)&peer;
+      if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+         inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], buf, sizeof(buf));
+      }
+      else {
+         inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf));
+      }
+      *port = ntohs(sin6->sin6_port);
+   }
+   else if (peer.ss_family == AF_INET) {
+      inet_ntop(AF_INET, &((sockaddr_in*)&peer)->sin_addr, buf, sizeof(buf));
+      *port = ntohs(((sockaddr_in*)&peer)->sin_port);
+   }
+   else {
+      return false;
+   }
+   addr = buf;
+   return true;
+}
+
+int connection_socket(NetworkIO *nio) {
+   string want = nio->getPeerAddr();
+   //the io library may report a mapped IPv4 peer in either form
+   if (want.compare(0, 7, "::ffff:") == 0) {
+      want = want.substr(7);
+   }
+   unsigned short want_port = (unsigned short)nio->getPeerPort();
+   int maxfd = getdtablesize();
+   for (int fd = 0; fd < maxfd; fd++) {
+      string addr;
+      unsigned short port;
+      if (peer_of(fd, addr, &port) && port == want_port && addr == want) {
+         return fd;
+      }
+   }
+   return -1;
+}
+
+Tcp6Service *listen_on(const char *host, unsigned short port) {
+   map<unsigned short,int>::iterator i = inherited.find(port);
+   if (i == inherited.end()) {
+      if (host == NULL) {
+         return new Tcp6Service(port);
+      }
+      return new Tcp6Service(host, port);
+   }
+   int fd = i->second;
+   inherited.erase(i);
+   //the port is still bound by the socket we were handed, so bind a stand-in
+   //on any free port and swap the handed over socket in under it
+   map<int,unsigned short> before = listeners();
+   Tcp6Service *svc = new Tcp6Service("localhost", 0);
+   map<int,unsigned short> after = listeners();
+   bool taken = false;
+   for (map<int,unsigned short>::iterator j = after.begin(); j != after.end() && !taken; j++) {
+      if (before.find(j->first) == before.end()) {
+         taken = dup2(fd, j->first) >= 0;
+      }
+   }
+   if (taken) {
+      log(LINFO, "Took over the listening socket for port %d\n", port);
+   }
+   else {
+      log(LERROR, "Unable to take over the listening socket for port %d\n", port);
+   }
+   close(fd);
+   return svc;
+}
+
+int handover_listen(const string &path) {
+   sockaddr_un addr;
+   if (path.length() >= sizeof(addr.sun_path)) {
+      log(LERROR, "HANDOVER_PATH is too long: %s\n", path.c_str());
+      return -1;
+   }
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) {
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path.c_str());
+   unlink(path.c_str());
+   //only our own user may take the server over
+   mode_t old = umask(077);
+   int res = bind(fd, (sockaddr*)&addr, sizeof(addr));
+   umask(old);
+   if (res != 0 || listen(fd, 1) != 0) {
+      log(LERROR, "Unable to listen for a successor on %s: %s\n", path.c_str(), strerror(errno));
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+int handover_connect(const string &path) {
+   sockaddr_un addr;
+   if (path.length() >= sizeof(addr.sun_path)) {
+      return -1;
+   }
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) {
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path.c_str());
+   if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "Unable to reach the running server at %s: %s\n", path.c_str(), strerror(errno));
+      close(fd);
+      return -1;
+   }
+   vector<int> fds;
+   json_object *obj = handover_recv(fd, MSG_HANDOVER_LISTENERS, &fds);
+   if (obj == NULL) {
+      fprintf(stderr, "The running server did not hand over its sockets\n");
+      close(fd);
+      return HANDOVER_REFUSED;
+   }
+   json_object *ports = NULL;
+   json_object_object_get_ex(obj, "ports", &ports);
+   size_t n = ports != NULL ? json_object_array_length(ports) : 0;
+   for (size_t i = 0; i < fds.size(); i++) {
+      if (i < n) {
+         inherited[(unsigned short)json_object_get_int(json_object_array_get_idx(ports, i))] = fds[i];
+      }
+      else {
+         close(fds[i]);
+      }
+   }
+   json_object_put(obj);
+   return fd;
+}
+
+bool handover_listeners(int sock) {
+   json_object *obj = json_object_new_object();
+   append_json_string_val(obj, "type", MSG_HANDOVER_LISTENERS);
+   json_object *ports = json_object_new_array();
+   vector<int> fds;
+   map<int,unsigned short> l = listeners();
+   for (map<int,unsigned short>::iterator i = l.begin(); i != l.end() && fds.size() < MAX_HANDOVER_FDS; i++) {
+      json_object_array_add(ports, json_object_new_int(i->second));
+      fds.push_back(i->first);
+   }
+   json_object_object_add_ex(obj, "ports", ports, JSON_NEW_CONST_KEY);
+   return handover_send(sock, obj, &fds);
+}
+
+static bool write_fully(int sock, const char *buf, size_t len) {
+   while (len > 0) {
+      ssize_t n = write(sock, buf, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      buf += n;
+      len -= n;
+   }
+   return true;
+}
+
+static bool read_fully(int sock, char *buf, size_t len) {
+   while (len > 0) {
+      ssize_t n = read(sock, buf, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      buf += n;
+      len -= n;
+   }
+   return true;
+}
+
+bool handover_send(int sock, json_object *obj, const vector<int> *fds) {
+   string text = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+   json_object_put(obj);
+   uint32_t len = htonl((uint32_t)text.length());
+
+   //the descriptors go with the length, sendmsg writes all 4 bytes or none
+   iovec iov;
+   iov.iov_base = &len;
+   iov.iov_len = sizeof(len);
+   msghdr mh;
+   memset(&mh, 0, sizeof(mh));
+   mh.msg_iov = &iov;
+   mh.msg_iovlen = 1;
+   char control[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)];
+   size_t nfds = fds != NULL ? fds->size() : 0;
+   if (nfds > MAX_HANDOVER_FDS) {
+      nfds = MAX_HANDOVER_FDS;
+   }
+   if (nfds > 0) {
+      memset(control, 0, sizeof(control));
+      mh.msg_control = control;
+      mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+      cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+      memcpy(CMSG_DATA(cm), &(*fds)[0], sizeof(int) * nfds);
+   }
+   ssize_t n;
+   while ((n = sendmsg(sock, &mh, 0)) < 0 && errno == EINTR) {
+   }
+   if (n != sizeof(len)) {
+      return false;
+   }
+   return write_fully(sock, text.c_str(), text.length());
+}
+
+json_object *handover_recv(int sock, const char *type, vector<int> *fds) {
+   uint32_t len;
+   iovec iov;
+   iov.iov_base = &len;
+   iov.iov_len = sizeof(len);
+   msghdr mh;
+   memset(&mh, 0, sizeof(mh));
+   mh.msg_iov = &iov;
+   mh.msg_iovlen = 1;
+   char control[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)];
+   mh.msg_control = control;
+   mh.msg_controllen = sizeof(control);
+   ssize_t n;
+   while ((n = recvmsg(sock, &mh, MSG_WAITALL)) < 0 && errno == EINTR) {
+   }
+   for (cmsghdr *cm = CMSG_FIRSTHDR(&mh); n > 0 && cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+         int *received = (int*)CMSG_DATA(cm);
+         size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         for (size_t i = 0; i < count; i++) {
+            if (fds != NULL) {
+               fds->push_back(received[i]);
+            }
+            else {
+               close(received[i]);
+            }
+         }
+      }
+   }
+   if (n != sizeof(len)) {
+      return NULL;
+   }
+   len = ntohl(len);
+   if (len > MAX_HANDOVER_MSG) {
+      return NULL;
+   }
+   string text(len, '\0');
+   if (!read_fully(sock, &text[0], len)) {
+      return NULL;
+   }
+   json_object *obj = json_tokener_parse(text.c_str());
+   if (obj == NULL) {
+      return NULL;
+   }
+   const char *t = string_from_json(obj, "type");
+   if (t != NULL && strcmp(t, MSG_HANDOVER_REFUSED) == 0) {
+      const char *error = string_from_json(obj, "error");
+      log(LERROR, "Handover refused: %s\n", error != NULL ? error : "no reason given");
+      json_object_put(obj);
+      obj = NULL;
+   }
+   else if (t == NULL || strcmp(t, type) != 0) {
+      log(LERROR, "Expected %s during handover, got %s\n", type, t != NULL ? t : "nothing");
+      json_object_put(obj);
+      obj = NULL;
+   }
+   return obj;
+}
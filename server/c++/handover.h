@@ -0,0 +1,128 @@
+/*
+   collabREate handover.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __HANDOVER_H
+#define __HANDOVER_H
+
+#include <string>
+#include <vector>
+#include <json-c/json.h>
+
+#include "io.h"
+
+using namespace std;
+
+/*
+ * A running server hands over to a new server process (collab -u) through
+ * a Unix socket at HANDOVER_PATH.  The exchange, one length prefixed json
+ * object at a time:
+ *
+ *   old -> new   MSG_HANDOVER_LISTENERS, the ports of every listening
+ *                socket, the sockets themselves ride along as SCM_RIGHTS
+ *   new -> old   MSG_HANDOVER_READY once the new server is accepting
+ *   old -> new   MSG_HANDOVER_SESSIONS, the resume tokens of every session
+ *   new -> old   MSG_HANDOVER_DONE once they are redeemable
+ *
+ * The old server then tells its clients to reconnect, they land on the
+ * new server and resume their sessions, and it exits once they have all
+ * gone or HANDOVER_GRACE seconds have passed.
+ *
+ * A basic mode server keeps its projects in memory, a new process would
+ * start without them, so it answers MSG_HANDOVER_REFUSED with an error
+ * instead of MSG_HANDOVER_LISTENERS and keeps serving.
+ */
+#define DEFAULT_HANDOVER_PATH "/var/run/collab/handover.sock"
+
+#define MSG_HANDOVER_LISTENERS "handover_listeners"
+#define MSG_HANDOVER_READY     "handover_ready"
+#define MSG_HANDOVER_SESSIONS  "handover_sessions"
+#define MSG_HANDOVER_DONE      "handover_done"
+#define MSG_HANDOVER_REFUSED   "handover_refused"
+
+//handover_connect reached a running server that did not hand over
+#define HANDOVER_REFUSED -2
+
+/**
+ * find_listener finds the socket a service is listening on, the io library
+ * doesn't expose it
+ * @param port the port the socket is bound to
+ * @return the descriptor, or -1 if no listening socket is bound to port
+ */
+int find_listener(unsigned short port);
+
+/**
+ * connection_socket finds the socket under a client connection, the io
+ * library doesn't expose it either.  It scans every descriptor, so it is
+ * looked up once when the connection is accepted and kept with it.
+ * @param nio the connection
+ * @return the descriptor, or -1 if no socket is connected to its peer
+ */
+int connection_socket(NetworkIO *nio);
+
+/**
+ * listen_on creates the service for a port.  A socket for the port handed
+ * over by the previous server is taken over, otherwise a new one is bound.
+ * @param host the address to bind, NULL for any
+ * @param port the port to listen on
+ * @return the service, throws as Tcp6Service does on failure
+ */
+Tcp6Service *listen_on(const char *host, unsigned short port);
+
+/**
+ * handover_listen creates the Unix socket a successor connects to
+ * @param path where to create it, any stale socket there is removed
+ * @return the listening descriptor, or -1 on failure
+ */
+int handover_listen(const string &path);
+
+/**
+ * handover_connect connects a successor to the running server and takes
+ * over its listening sockets, listen_on uses them from here on
+ * @param path the running server's HANDOVER_PATH
+ * @return the connection to the running server, -1 if there is no server
+ * to take over from or HANDOVER_REFUSED if it did not hand over
+ */
+int handover_connect(const string &path);
+
+/**
+ * handover_listeners sends MSG_HANDOVER_LISTENERS with every listening
+ * TCP socket this process has
+ * @return true if they were sent
+ */
+bool handover_listeners(int sock);
+
+/**
+ * handover_send sends one message of the exchange
+ * @param obj the message, released by handover_send
+ * @param fds descriptors sent along with it, may be NULL
+ * @return true if it was sent
+ */
+bool handover_send(int sock, json_object *obj, const vector<int> *fds = NULL);
+
+/**
+ * handover_recv receives one message of the exchange
+ * @param type the message type expected
+ * @param fds receives any descriptors sent along with it, may be NULL
+ * @return the message, NULL on failure, on MSG_HANDOVER_REFUSED, which is
+ * logged, or on a message of any other type
+ */
+json_object *handover_recv(int sock, const char *type, vector<int> *fds = NULL);
+
+#endif
@@ -29,6 +29,7 @@
 #include "proj_info.h"
 #include "mgr_helper.h"
 #include "basic_mgr.h"
+#include "handover.h"
 
 using namespace std;
 
@@ -77,6 +78,7 @@ void ManagerHelper::initCommon() {
    }
    done = false;
    quit = false;
+   nio = NULL;
    bool localonly = DEFAULT_LOCAL;
    int port = DEFAULT_PORT;
    const char *mgr_host = NULL;
@@ -85,14 +87,12 @@ void ManagerHelper::initCommon() {
       localonly = getIntOption(conf, "MANAGE_LOCAL", 1) == 1;
       mgr_host = getCstringOption(conf, "MANAGE_HOST", NULL);
    }
+   //takes over the socket if a previous server handed it over
    if (localonly) {
-      ss = new Tcp6Service("localhost", port);
-   }
-   else if (mgr_host == NULL) {
-      ss = new Tcp6Service(port);
+      ss = listen_on("localhost", port);
    }
    else {
-      ss = new Tcp6Service(mgr_host, port);
+      ss = listen_on(mgr_host, port);
    }
 }
 
@@ -182,8 +182,10 @@ void ManagerHelper::init_handlers() {
    (*handlers)[MNG_SHUTDOWN] = mng_shutdown;
    (*handlers)[MNG_PROJECT_IMPORT] = mng_project_import;
    (*handlers)[MNG_IMPORT_UPDATE] = mng_import_update;
+   (*handlers)[MNG_IMPORT_UPDATES] = mng_import_updates;
    (*handlers)[MNG_PROJECT_LIST] = mng_project_list;
    (*handlers)[MNG_PROJECT_EXPORT] = mng_project_export;
+   (*handlers)[MNG_PROJECT_COMPACT] = mng_project_compact;
 }
 
 void ManagerHelper::mng_get_connections(json_object *obj, ManagerHelper *mh) {
@@ -269,6 +271,31 @@ void ManagerHelper::mng_import_update(json_object *obj, ManagerHelper *mh) {
    free((void*)uid);
 }
 
+void ManagerHelper::mng_import_updates(json_object *obj, ManagerHelper *mh) {
+   const char *uid = string_from_json(obj, "newowner");
+   json_object *updates = json_object_object_get(obj, "updates");
+   int count = mh->cm->importUpdates(uid, mh->pidForUpdates, updates);
+   if (count < 0) {
+      log(LERROR, "failed to import a batch of updates into project %d\n", mh->pidForUpdates);
+   }
+   else {
+      log(LDEBUG, "imported %d updates into project %d\n", count, mh->pidForUpdates);
+   }
+}
+
+void ManagerHelper::mng_project_compact(json_object *obj, ManagerHelper *mh) {
+   uint32_t pid = 0;
+   uint64_t watermark = 0;
+   uint32_from_json(obj, "pid", &pid);
+   uint64_from_json(obj, "watermark", &watermark);
+   log(LINFO, "client requested compaction of project %u\n", pid);
+   int removed = mh->cm->compactProject(pid, watermark);
+   json_object *resp = json_object_new_object();
+   append_json_int32_val(resp, "status", removed < 0 ? MNG_EXPORT_FAIL : MNG_EXPORT_SUCCESS);
+   append_json_int32_val(resp, "removed", removed < 0 ? 0 : removed);
+   mh->send_data(MNG_PROJECT_COMPACT_REPLY, resp);
+}
+
 void ManagerHelper::mng_project_list(json_object *obj, ManagerHelper *mh) {
    json_object *list = json_object_new_array();
    vector<Project*> *all = mh->cm->getAllProjects();
@@ -292,16 +319,68 @@ void ManagerHelper::mng_project_list(json_object *obj, ManagerHelper *mh) {
    delete all;
 }
 
+/*
+ * state for streaming a project export to the ServerManager in batches
+ */
+struct ExportBatch {
+   ManagerHelper *mh;
+   json_object *updates;
+   size_t bytes;
+   uint32_t seq;
+   uint64_t last;   //updateid of the most recently exported update
+};
+
+void ManagerHelper::flush_export(ExportBatch *eb) {
+   if (eb->updates == NULL) {
+      return;
+   }
+   json_object *reply = json_object_new_object();
+   json_object_object_add_ex(reply, "updates", eb->updates, JSON_NEW_CONST_KEY);
+   append_json_uint32_val(reply, "seq", eb->seq++);
+   append_json_uint64_val(reply, "last", eb->last);
+   eb->updates = NULL;
+   eb->bytes = 0;
+   eb->mh->send_data(MNG_EXPORT_UPDATES, reply);
+}
+
+/*
+ * export callback, the stored update text is wrapped rather than reparsed
+ * and a batch is sent whenever it grows past either of the export limits
+ */
+bool ManagerHelper::export_update(uint64_t updateid, const char *update, void *user) {
+   ExportBatch *eb = (ExportBatch*)user;
+   eb->last = updateid;
+   if (eb->updates == NULL) {
+      eb->updates = json_object_new_array();
+   }
+   json_object_array_add(eb->updates, json_object_new_raw(update));
+   eb->bytes += strlen(update);
+   if (json_object_array_length(eb->updates) >= EXPORT_BATCH_UPDATES || eb->bytes >= EXPORT_BATCH_BYTES) {
+      flush_export(eb);
+   }
+   return true;
+}
+
 void ManagerHelper::mng_project_export(json_object *obj, ManagerHelper *mh) {
    uint32_t pid;
-   json_object *reply = json_object_new_object();
+   int count = -1;
+   //optional bounds for an incremental export
+   uint64_t since = 0;
+   uint64_t until = 0;
+   uint64_from_json(obj, "since", &since);
+   uint64_from_json(obj, "until", &until);
+   ExportBatch eb = {mh, NULL, 0, 0, since};
    if (uint32_from_json(obj, "pid", &pid)) {
-      json_object *updates = mh->cm->exportProject(pid);
-      json_object_object_add_ex(reply, "updates", updates, JSON_NEW_CONST_KEY);
-      mh->send_data(MNG_EXPORT_UPDATES, reply);
+      count = mh->cm->exportProject(pid, since, until, export_update, &eb);
+      flush_export(&eb);
    }
    else {
-      append_json_string_val(reply, "msg", "Missing pid in project export request");
-      mh->send_data(MSG_ERROR, reply);
+      log(LERROR, "Missing pid in project export request\n");
    }
+   //always terminate the stream so the ServerManager stops waiting
+   json_object *end = json_object_new_object();
+   append_json_int32_val(end, "count", count < 0 ? 0 : count);
+   append_json_uint64_val(end, "last", eb.last);
+   append_json_int32_val(end, "status", count < 0 ? MNG_EXPORT_FAIL : MNG_EXPORT_SUCCESS);
+   mh->send_data(MNG_EXPORT_END, end);
 }
@@ -33,6 +33,7 @@ using namespace std;
 
 class ConnectionManager;
 class ManagerHelper;
+struct ExportBatch;
 
 typedef void (*MsgHandler)(json_object *obj, ManagerHelper *mh);
 
@@ -98,8 +99,13 @@ private:
    static void mng_shutdown(json_object *obj, ManagerHelper *mh);
    static void mng_project_import(json_object *obj, ManagerHelper *mh);
    static void mng_import_update(json_object *obj, ManagerHelper *mh);
+   static void mng_import_updates(json_object *obj, ManagerHelper *mh);
    static void mng_project_list(json_object *obj, ManagerHelper *mh);
    static void mng_project_export(json_object *obj, ManagerHelper *mh);
+   static void mng_project_compact(json_object *obj, ManagerHelper *mh);
+
+   static bool export_update(uint64_t updateid, const char *update, void *user);
+   static void flush_export(ExportBatch *eb);
 
    void init_handlers();
 
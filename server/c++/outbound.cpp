@@ -0,0 +1,197 @@
+/*
+   collabREate outbound.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+
+#include "io.h"
+#include "utils.h"
+#include "outbound.h"
+
+Outbound::Outbound(NetworkIO *conn, uint32_t limit) {
+   this->conn = conn;
+   this->limit = limit < 1 ? 1 : limit;
+   sem_init(&lock, 0, 1);
+   sem_init(&ready, 0, 0);
+   sem_init(&space, 0, this->limit);
+   closed = false;
+   failed = false;
+   for (int i = 0; i < NUM_LANES; i++) {
+      sent[i] = 0;
+   }
+   dropped = 0;
+   control_wait = 0;
+   control_max = 0;
+   running = pthread_create(&tid, NULL, writer, this) == 0;
+}
+
+Outbound::~Outbound() {
+   stop();
+   sem_destroy(&lock);
+   sem_destroy(&ready);
+   sem_destroy(&space);
+}
+
+static void wait_sem(sem_t *s) {
+   while (sem_wait(s) != 0 && errno == EINTR) {
+   }
+}
+
+bool Outbound::send(json_object *obj, int lane, bool wait) {
+   if (lane != LANE_CONTROL) {
+      lane = LANE_BULK;
+      //the writer frees a place each time it takes an update
+      if (wait) {
+         wait_sem(&space);
+      }
+      else if (sem_trywait(&space) != 0) {
+         sem_wait(&lock);
+         dropped++;
+         sem_post(&lock);
+         json_object_put(obj);
+         return false;
+      }
+   }
+   sem_wait(&lock);
+   if (closed || failed) {
+      dropped++;
+      sem_post(&lock);
+      if (lane == LANE_BULK) {
+         //pass the place on, stop may have others waiting for one
+         sem_post(&space);
+      }
+      json_object_put(obj);
+      return true;
+   }
+   if (lane == LANE_CONTROL && lanes[LANE_CONTROL].size() >= limit) {
+      //nothing waits for room here, a client this far behind isn't reading
+      dropped++;
+      sem_post(&lock);
+      json_object_put(obj);
+      return false;
+   }
+   Queued q = {obj, lane == LANE_CONTROL ? monotonic_ms() : 0};
+   lanes[lane].push_back(q);
+   sem_post(&lock);
+   sem_post(&ready);
+   return true;
+}
+
+//lock must be held
+void Outbound::drop(int lane) {
+   for (deque<Queued>::iterator i = lanes[lane].begin(); i != lanes[lane].end(); i++) {
+      json_object_put(i->obj);
+      if (lane == LANE_BULK) {
+         sem_post(&space);
+      }
+   }
+   dropped += lanes[lane].size();
+   lanes[lane].clear();
+}
+
+void Outbound::dropBulk() {
+   sem_wait(&lock);
+   drop(LANE_BULK);
+   sem_post(&lock);
+}
+
+void Outbound::stop(bool flush) {
+   sem_wait(&lock);
+   bool join = running;
+   running = false;
+   closed = true;
+   drop(LANE_BULK);
+   if (!flush) {
+      drop(LANE_CONTROL);
+   }
+   sem_post(&lock);
+   //wake the writer and start passing places to anyone waiting in send
+   sem_post(&ready);
+   sem_post(&space);
+   if (join) {
+      pthread_join(tid, NULL);
+   }
+}
+
+/**
+ * writer takes messages from the lanes in priority order and writes them
+ * out, one at a time, until the Outbound is stopped
+ */
+void *Outbound::writer(void *arg) {
+   Outbound *out = (Outbound*)arg;
+   while (true) {
+      wait_sem(&out->ready);
+      sem_wait(&out->lock);
+      if (out->closed && out->lanes[LANE_CONTROL].empty()) {
+         sem_post(&out->lock);
+         break;
+      }
+      int lane = 0;
+      while (lane < NUM_LANES && out->lanes[lane].empty()) {
+         lane++;
+      }
+      if (lane == NUM_LANES) {
+         //what woke us was dropped
+         sem_post(&out->lock);
+         continue;
+      }
+      bool failed = out->failed;
+      Queued q = out->lanes[lane].front();
+      out->lanes[lane].pop_front();
+      out->sent[lane]++;
+      if (lane == LANE_CONTROL) {
+         uint64_t waited = monotonic_ms() - q.since;
+         out->control_wait += waited;
+         if (waited > out->control_max) {
+            out->control_max = waited;
+         }
+      }
+      sem_post(&out->lock);
+      if (lane == LANE_BULK) {
+         sem_post(&out->space);
+      }
+      if (failed) {
+         json_object_put(q.obj);
+         continue;
+      }
+      try {
+         out->conn->writeJson(q.obj);   //calls json_object_put
+      } catch (IOException ex) {
+         log(LINFO, "Outbound write failed: %s\n", ex.getMessage().c_str());
+         //the client's own thread notices the dead connection and terminates,
+         //until then keep draining so nobody waits on the bulk lane
+         sem_wait(&out->lock);
+         out->failed = true;
+         sem_post(&out->lock);
+      }
+   }
+   return NULL;
+}
+
+string Outbound::dumpStats() {
+   char buf[256];
+   sem_wait(&lock);
+   double avg = sent[LANE_CONTROL] ? control_wait / (double)sent[LANE_CONTROL] : 0;
+   snprintf(buf, sizeof(buf), "lanes: control %llu sent, %u queued, %.1f ms avg / %llu ms max wait; bulk %llu sent, %u queued; %llu dropped\n",
+            (unsigned long long)sent[LANE_CONTROL], (uint32_t)lanes[LANE_CONTROL].size(), avg, (unsigned long long)control_max,
+            (unsigned long long)sent[LANE_BULK], (uint32_t)lanes[LANE_BULK].size(), (unsigned long long)dropped);
+   sem_post(&lock);
+   return buf;
+}
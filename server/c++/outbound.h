@@ -0,0 +1,123 @@
+/*
+   collabREate outbound.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __OUTBOUND_H
+#define __OUTBOUND_H
+
+#include <deque>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <json-c/json.h>
+
+using namespace std;
+
+class NetworkIO;
+
+//priority lanes of an Outbound, lower numbers are written first
+#define LANE_CONTROL 0    //replies, errors and notices, never wait behind updates
+#define LANE_BULK    1    //project updates, history and their acks
+#define NUM_LANES    2
+
+/**
+ * Outbound
+ * Everything sent to one client, written by a thread of its own.  Messages
+ * wait in one of NUM_LANES queues and the writer always takes from the
+ * highest priority lane that has anything, so a control message waits for
+ * at most the one update being written, however much history is queued.
+ * Messages within a lane keep their order.  The bulk lane is bounded.  It
+ * holds up a catch-up thread that fills it, which is what paces catch-ups
+ * to a slow client, but the dispatch thread is turned away instead so one
+ * slow client can't hold up everyone else.  The control lane has the same
+ * bound and never waits, a message that finds it full is turned away.
+ */
+class Outbound {
+public:
+   /**
+    * @param conn the client's connection, must outlive the Outbound
+    * @param limit most messages each lane holds before send waits or turns
+    * messages away
+    */
+   Outbound(NetworkIO *conn, uint32_t limit);
+
+   /**
+    * stops the writer, anything still queued is dropped
+    */
+   ~Outbound();
+
+   /**
+    * send queues a message for the writer
+    * @param obj the message, owned by the Outbound from here on and not
+    * shared with any other thread
+    * @param lane LANE_CONTROL or LANE_BULK
+    * @param wait true to wait for room in a full bulk lane, false to drop
+    * the message instead, control messages are never waited for
+    * @return false if the message was dropped because its lane was full
+    */
+   bool send(json_object *obj, int lane, bool wait = true);
+
+   /**
+    * dropBulk discards the updates still waiting in the bulk lane, used
+    * when the client leaves the project they belong to
+    */
+   void dropBulk();
+
+   /**
+    * stop drops the queued updates, wakes any thread waiting in send and
+    * waits for the writer, nothing is sent after it returns
+    * @param flush true to write out the queued control messages first, for
+    * a connection being closed on purpose, false to drop them as well
+    */
+   void stop(bool flush = false);
+
+   /**
+    * dumpStats describes the lanes
+    */
+   string dumpStats();
+
+private:
+   struct Queued {
+      json_object *obj;
+      uint64_t since;      //monotonic_ms when it was queued
+   };
+
+   static void *writer(void *arg);
+   void drop(int lane);   //lock must be held
+
+   NetworkIO *conn;
+   uint32_t limit;
+
+   sem_t lock;
+   sem_t ready;           //counts queued messages
+   sem_t space;           //counts free places in the bulk lane
+   deque<Queued> lanes[NUM_LANES];
+   bool closed;
+   bool failed;           //a write failed, the rest are dropped
+   pthread_t tid;
+   bool running;
+
+   uint64_t sent[NUM_LANES];
+   uint64_t dropped;
+   uint64_t control_wait;    //total ms control messages were queued
+   uint64_t control_max;     //longest a control message was queued
+};
+
+#endif
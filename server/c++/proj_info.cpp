@@ -19,10 +19,9 @@
  */
 
 #include <string.h>
+#include <algorithm>
 #include "proj_info.h"
 
-sem_t uidMutex;
-
 Project::Project(uint32_t localpid, const string &description, uint32_t currentlyconnected) {
    lpid = localpid;
    desc = description;
@@ -43,7 +42,8 @@ Project::Project(const Project &p) {
 BasicProject::BasicProject(uint32_t localpid, const string &description, uint32_t currentlyconnected, uint64_t init_uid) :
          Project(localpid, description, currentlyconnected) {
    updateid = init_uid;
-   sem_init(&uidMutex, 0, 1);
+   since_compact = 0;
+   sem_init(&compactMutex, 0, 1);
 }
 
 BasicProject::BasicProject(const BasicProject &bp) {
@@ -57,14 +57,68 @@ BasicProject::~BasicProject() {
 }
 
 uint64_t BasicProject::next_uid() {
-   uint64_t result;
-   sem_wait(&uidMutex);
-   result = ++updateid;
-   sem_post(&uidMutex);
-   return result;
+   return __sync_add_and_fetch(&updateid, 1);
+}
+
+uint64_t BasicProject::curr_uid() {
+   return updateid;
 }
 
-void BasicProject::append_update(const char *update) {
+//move updateid up to uid, never down
+void BasicProject::raise_uid(uint64_t uid) {
+   uint64_t cur = updateid;
+   while (uid > cur && !__sync_bool_compare_and_swap(&updateid, cur, uid)) {
+      cur = updateid;
+   }
+}
+
+/*
+ * stored updates must be appended in updateid order, migrated updates keep
+ * their original ids so make sure new ids are allocated above them
+ */
+void BasicProject::append_update(const char *update, uint64_t uid) {
    updates.push_back(strdup(update));
+   update_ids.push_back(uid);
+   raise_uid(uid);
+}
+
+void BasicProject::append_updates(const vector<const char*> &batch, const vector<uint64_t> &uids) {
+   updates.reserve(updates.size() + batch.size());
+   update_ids.reserve(update_ids.size() + uids.size());
+   for (size_t i = 0; i < batch.size(); i++) {
+      updates.push_back(strdup(batch[i]));
+      update_ids.push_back(uids[i]);
+   }
+   if (!uids.empty()) {
+      raise_uid(uids.back());
+   }
+}
+
+size_t BasicProject::first_after(uint64_t uid) {
+   return upper_bound(update_ids.begin(), update_ids.end(), uid) - update_ids.begin();
+}
+
+size_t BasicProject::remove_updates(const vector<uint64_t> &uids) {
+   if (uids.empty()) {
+      return 0;
+   }
+   size_t removed = 0;
+   size_t out = lower_bound(update_ids.begin(), update_ids.end(), uids.front()) - update_ids.begin();
+   vector<uint64_t>::const_iterator ri = uids.cbegin();
+   for (size_t in = out; in < update_ids.size(); in++) {
+      while (ri != uids.cend() && *ri < update_ids[in]) {
+         ri++;
+      }
+      if (ri != uids.cend() && *ri == update_ids[in]) {
+         free(updates[in]);
+         removed++;
+         continue;
+      }
+      updates[out] = updates[in];
+      update_ids[out++] = update_ids[in];
+   }
+   updates.resize(out);
+   update_ids.resize(out);
+   return removed;
 }
 
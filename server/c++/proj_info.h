@@ -25,6 +25,7 @@
 #include <semaphore.h>
 #include <string>
 #include <vector>
+#include "compactor.h"
 
 using namespace std;
 
@@ -66,13 +67,27 @@ public:
    uint64_t next_uid();
    uint64_t curr_uid();
 
-   void append_update(const char *update);
+   void append_update(const char *update, uint64_t uid);
+   void append_updates(const vector<const char*> &batch, const vector<uint64_t> &uids);
    const vector<char*> &get_updates() {return updates;};
+   const vector<uint64_t> &get_update_ids() {return update_ids;};
+
+   //index of the first stored update with an updateid greater than uid
+   size_t first_after(uint64_t uid);
+
+   //drop the stored updates with the given updateids, uids must be sorted
+   size_t remove_updates(const vector<uint64_t> &uids);
+
+   Compactor compactor;
+   sem_t compactMutex;       //one compaction at a time per project
+   uint32_t since_compact;   //updates posted since the last online compaction
 
 private:
-   sem_t uidMutex;
-   uint64_t updateid;
+   void raise_uid(uint64_t uid);
+
+   volatile uint64_t updateid;
    vector<char*> updates;
+   vector<uint64_t> update_ids;   //updateid of each entry in updates, ascending
 };
 
 #endif
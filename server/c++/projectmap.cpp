@@ -21,29 +21,32 @@
 #include "client.h"
 #include "projectmap.h"
 #include "clientset.h"
+#include "epoch.h"
+
+static void free_table(void *ptr) {
+   delete (ProjectTable*)ptr;
+}
 
 ProjectMap::ProjectMap() {
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init(&attr);
-   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-   pthread_mutex_init(&mutex, &attr);
-   pthread_mutexattr_destroy(&attr);
+   projects = new ProjectTable;
+   pthread_mutex_init(&writer, NULL);
 }
 
 ProjectMap::~ProjectMap() {
-   pthread_mutex_destroy(&mutex);
+   delete projects;
+   pthread_mutex_destroy(&writer);
 }
 
 //iterate over all projects in the set
 void ProjectMap::loop(pcb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (map<uint32_t,ClientSet*>::iterator i = projects.begin(); i != projects.end(); i++) {
+   EpochGuard g;
+   const ProjectTable *pt = projects;
+   for (ProjectTable::const_iterator i = pt->begin(); i != pt->end(); i++) {
       ClientSet *s = (*i).second;
       if (!(*func)(s, user)) {
          break;
       }
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //loop across all clients in a single project
@@ -56,89 +59,85 @@ void ProjectMap::loopProject(uint32_t key, ccb func, void *user) {
 
 //loop across all clients in all projects
 void ProjectMap::loopClients(ccb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (map<uint32_t,ClientSet*>::iterator i = projects.begin(); i != projects.end(); i++) {
+   EpochGuard g;
+   const ProjectTable *pt = projects;
+   for (ProjectTable::const_iterator i = pt->begin(); i != pt->end(); i++) {
       ClientSet *s = (*i).second;
       s->loop(func, user);
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //add a new project
 void ProjectMap::put(uint32_t key, ClientSet *val) {
-   pthread_mutex_lock(&mutex);
-   projects[key] = val;
-   pthread_mutex_unlock(&mutex);
+   pthread_mutex_lock(&writer);
+   ProjectTable *pt = new ProjectTable(*projects);
+   (*pt)[key] = val;
+   ProjectTable *old = projects;
+   __sync_synchronize();
+   projects = pt;
+   pthread_mutex_unlock(&writer);
+   epoch_retire(free_table, old);
 }
 
-//call this only if you already hold a lock
-ClientSet *ProjectMap::getPriv(uint32_t key) {
-   ClientSet *res = NULL;
-   map<uint32_t,ClientSet*>::iterator it = projects.find(key);
-   if (it != projects.end()) {
-      res = (*it).second;
+//find the given project, creating it if this is its first client
+ClientSet *ProjectMap::getOrCreate(uint32_t key) {
+   ClientSet *res = get(key);
+   if (res == NULL) {
+      ProjectTable *old = NULL;
+      pthread_mutex_lock(&writer);
+      //another thread may have created it while we waited
+      ProjectTable::iterator it = projects->find(key);
+      if (it != projects->end()) {
+         res = (*it).second;
+      }
+      else {
+         res = new ClientSet;
+         ProjectTable *pt = new ProjectTable(*projects);
+         (*pt)[key] = res;
+         old = projects;
+         __sync_synchronize();
+         projects = pt;
+      }
+      pthread_mutex_unlock(&writer);
+      if (old) {
+         epoch_retire(free_table, old);
+      }
    }
    return res;
 }
 
 //add client to the given project
 void ProjectMap::addClient(uint32_t key, Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(key);
-   if (proj == NULL) {
-      proj = new ClientSet;
-      //already have a lock don't neet to call put
-      projects[key] = proj;
-   }
-   proj->add(c);
-   pthread_mutex_unlock(&mutex);
+   getOrCreate(key)->add(c);
 }
 
 //add client to the given project
 void ProjectMap::addClient(Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(c->getPid());
-   if (proj == NULL) {
-      proj = new ClientSet;
-      //already have a lock don't neet to call put
-      projects[c->getPid()] = proj;
-   }
-   proj->add(c);
-   pthread_mutex_unlock(&mutex);
+   getOrCreate(c->getPid())->add(c);
 }
 
-//add client to the given project
+//remove client from the project it is in
 void ProjectMap::removeClient(Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(c->getPid());
+   ClientSet *proj = get(c->getPid());
    if (proj != NULL) {
       proj->remove(c);
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //number of clients connected to the given project
 int ProjectMap::numClients(uint32_t key) {
-   int res = 0;
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(key);
-   if (proj != NULL) {
-      res = proj->size();
-   }
-   pthread_mutex_unlock(&mutex);
-   return res;
+   ClientSet *proj = get(key);
+   return proj ? proj->size() : 0;
 }
 
 //get the list of clients connected to the given project
-//should this be a cloned set ?? probably
 ClientSet *ProjectMap::get(uint32_t key) {
    ClientSet *res = NULL;
-   pthread_mutex_lock(&mutex);
-   map<uint32_t,ClientSet*>::iterator it = projects.find(key);
-   if (it != projects.end()) {
+   EpochGuard g;
+   const ProjectTable *pt = projects;
+   ProjectTable::const_iterator it = pt->find(key);
+   if (it != pt->end()) {
       res = (*it).second;
    }
-   pthread_mutex_unlock(&mutex);
    return res;
 }
-
@@ -39,12 +39,21 @@ typedef bool (*pcb)(ClientSet *c, void *user);
 //client callback function
 typedef bool (*ccb)(Client *c, void *user);
 
+typedef map<uint32_t,ClientSet*> ProjectTable;
+
+/**
+ * ProjectMap
+ * The ClientSet of every project that has had a client, keyed by local pid.
+ * Like ClientSet the table is an immutable copy republished when a project
+ * is added, so lookups and loops never lock.  ClientSets are never freed,
+ * a pointer returned by get remains valid.
+ */
 class ProjectMap {
 private:
-   map<uint32_t,ClientSet*> projects;
-   pthread_mutex_t mutex;
+   ProjectTable *volatile projects;
+   pthread_mutex_t writer;      //serializes changes to the table
 
-   ClientSet *getPriv(uint32_t key);
+   ClientSet *getOrCreate(uint32_t key);
 
 public:
    ProjectMap();
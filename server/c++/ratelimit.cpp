@@ -0,0 +1,382 @@
+/*
+   collabREate ratelimit.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "client.h"
+#include "cli_mgr.h"
+#include "ratelimit.h"
+
+//spilled updates wait while the dispatch queue is longer than this
+#define SPILL_QUEUE_DEPTH 256
+
+//how often a rejected client is reminded, in ms
+#define REJECT_NOTICE_MS 1000
+
+//no end to the wait
+#define FOREVER 0xffffffffffffffffULL
+
+void TokenBucket::init(double rate, double burst, uint64_t now) {
+   this->rate = rate;
+   this->burst = burst;
+   tokens = burst;
+   last = now;
+}
+
+uint64_t TokenBucket::wait(double n, uint64_t now) {
+   if (rate == 0) {
+      return 0;
+   }
+   tokens += (now - last) * rate / 1000;
+   if (tokens > burst) {
+      tokens = burst;
+   }
+   last = now;
+   //an update bigger than the whole bucket only has to wait for a full one
+   if (n > burst) {
+      n = burst;
+   }
+   if (tokens >= n) {
+      return 0;
+   }
+   return (uint64_t)((n - tokens) * 1000 / rate) + 1;
+}
+
+PublishLimiter::PublishLimiter(ConnectionManager *cm, json_object *conf) {
+   this->cm = cm;
+   user_rate = getIntOption(conf, "PUBLISH_USER_RATE", 0);
+   user_bps = getIntOption(conf, "PUBLISH_USER_KBPS", 0) * 1024.0;
+   project_rate = getIntOption(conf, "PUBLISH_PROJECT_RATE", 0);
+   project_bps = getIntOption(conf, "PUBLISH_PROJECT_KBPS", 0) * 1024.0;
+   burst = getIntOption(conf, "PUBLISH_BURST_SECS", 5);
+   if (burst < 1) {
+      burst = 1;
+   }
+   spill_max = getIntOption(conf, "PUBLISH_SPILL_MAX", 10000);
+   spill_project_max = getIntOption(conf, "PUBLISH_SPILL_PROJECT_MAX", 100000);
+   string act = getStringOption(conf, "PUBLISH_LIMIT_ACTION", "delay");
+   if (act == "reject") {
+      action = LIMIT_REJECT;
+   }
+   else if (act == "spill") {
+      action = LIMIT_SPILL;
+   }
+   else {
+      if (act != "delay") {
+         log(LERROR, "Unknown PUBLISH_LIMIT_ACTION %s, using delay\n", act.c_str());
+      }
+      action = LIMIT_DELAY;
+   }
+   measure = user_bps != 0 || project_bps != 0;
+   enabled = measure || user_rate != 0 || project_rate != 0;
+   sem_init(&lock, 0, 1);
+   sem_init(&wake, 0, 0);
+   sem_init(&posting, 0, 1);
+   last_spill = NULL;
+   delayed = delay_ms = rejected = spilled = dropped = 0;
+}
+
+void PublishLimiter::start() {
+   if (enabled && action == LIMIT_SPILL) {
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      pthread_t tid;
+      pthread_create(&tid, &attr, drain, this);
+      pthread_attr_destroy(&attr);
+   }
+}
+
+PublishLimiter::Limits &PublishLimiter::userLimits(const string &user, uint64_t now) {
+   map<string,Limits>::iterator i = users.find(user);
+   if (i != users.end()) {
+      return i->second;
+   }
+   Limits &l = users[user];
+   l.updates.init(user_rate, user_rate * burst, now);
+   l.bytes.init(user_bps, user_bps * burst, now);
+   l.events = 0;
+   l.noticed = 0;
+   l.waiting = 0;
+   return l;
+}
+
+PublishLimiter::Limits &PublishLimiter::projectLimits(uint32_t pid, uint64_t now) {
+   map<uint32_t,Limits>::iterator i = projects.find(pid);
+   if (i != projects.end()) {
+      return i->second;
+   }
+   Limits &l = projects[pid];
+   l.updates.init(project_rate, project_rate * burst, now);
+   l.bytes.init(project_bps, project_bps * burst, now);
+   l.events = 0;
+   l.noticed = 0;
+   l.waiting = 0;
+   return l;
+}
+
+/**
+ * wait says how long until an update of len bytes fits every bucket it
+ * is counted against, lock must be held
+ */
+uint64_t PublishLimiter::wait(Limits &u, Limits &p, size_t len, uint64_t now) {
+   uint64_t w = u.updates.wait(1, now);
+   uint64_t x = p.updates.wait(1, now);
+   if (x > w) {
+      w = x;
+   }
+   if (measure) {
+      x = u.bytes.wait(len, now);
+      if (x > w) {
+         w = x;
+      }
+      x = p.bytes.wait(len, now);
+      if (x > w) {
+         w = x;
+      }
+   }
+   return w;
+}
+
+//lock must be held
+void PublishLimiter::take(Limits &u, Limits &p, size_t len) {
+   u.updates.take(1);
+   p.updates.take(1);
+   u.bytes.take(len);
+   p.bytes.take(len);
+}
+
+bool PublishLimiter::admit(Client *c, json_object *obj) {
+   if (!enabled) {
+      return true;
+   }
+   size_t len = 0;
+   if (measure) {
+      json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &len);
+   }
+   uint64_t now = monotonic_ms();
+   bool notice = false;
+   sem_wait(&lock);
+   Limits &u = userLimits(c->getUser(), now);
+   Limits &p = projectLimits(c->getPid(), now);
+   map<Client*,deque<Spilled> >::iterator si = spill.find(c);
+   //once a client has spilled, the rest of its updates follow in order
+   uint64_t w = si != spill.end() ? FOREVER : wait(u, p, len, now);
+   if (w == 0) {
+      take(u, p, len);
+      sem_post(&lock);
+      return true;
+   }
+   u.events++;
+   p.events++;
+   if (action == LIMIT_DELAY) {
+      //borrow the tokens now so clients delayed together queue up in turn
+      take(u, p, len);
+      delayed++;
+      delay_ms += w;
+      sem_post(&lock);
+      usleep(w * 1000);
+      return true;
+   }
+   if (action == LIMIT_REJECT) {
+      rejected++;
+      if (now - u.noticed >= REJECT_NOTICE_MS) {
+         u.noticed = now;
+         notice = true;
+      }
+      sem_post(&lock);
+      json_object_put(obj);
+      if (notice) {
+         c->send_error("Publish rate limit exceeded, updates are being dropped\n");
+      }
+      return false;
+   }
+   if ((spill_max != 0 && si != spill.end() && si->second.size() >= spill_max) ||
+       (spill_project_max != 0 && p.waiting >= spill_project_max)) {
+      //too far behind to be worth holding on to, later updates still wait
+      //behind the ones already spilled
+      dropped++;
+      if (now - u.noticed >= REJECT_NOTICE_MS) {
+         u.noticed = now;
+         notice = true;
+      }
+      sem_post(&lock);
+      json_object_put(obj);
+      if (notice) {
+         c->send_error("Publish rate limit exceeded and too many updates waiting, updates are being dropped\n");
+      }
+      return false;
+   }
+   if (si == spill.end()) {
+      si = spill.insert(make_pair(c, deque<Spilled>())).first;
+      c->acquire();
+   }
+   Spilled s = {obj, c->getPid(), len};
+   si->second.push_back(s);
+   p.waiting++;
+   spilled++;
+   sem_post(&lock);
+   sem_post(&wake);
+   return false;
+}
+
+void PublishLimiter::forget(Client *c) {
+   if (!enabled || action != LIMIT_SPILL) {
+      return;
+   }
+   sem_wait(&lock);
+   map<Client*,deque<Spilled> >::iterator si = spill.find(c);
+   bool found = si != spill.end();
+   if (found) {
+      for (deque<Spilled>::iterator i = si->second.begin(); i != si->second.end(); i++) {
+         json_object_put(i->obj);
+         projects[i->pid].waiting--;
+      }
+      dropped += si->second.size();
+      spill.erase(si);
+      if (last_spill == c) {
+         last_spill = NULL;
+      }
+   }
+   sem_post(&lock);
+   //wait out a spilled update of c that is being posted right now
+   sem_wait(&posting);
+   sem_post(&posting);
+   if (found) {
+      c->release();
+   }
+}
+
+/**
+ * drain posts spilled updates as their buckets refill, taking one client
+ * at a time in turn, whenever the dispatch queue is short
+ */
+void *PublishLimiter::drain(void *arg) {
+   PublishLimiter *pl = (PublishLimiter*)arg;
+   while (true) {
+      uint64_t next = FOREVER;
+      Client *c = NULL;
+      Spilled s;
+      sem_wait(&pl->lock);
+      if (!pl->spill.empty() && pl->cm->queueDepth() > SPILL_QUEUE_DEPTH) {
+         next = 5;
+      }
+      else if (!pl->spill.empty()) {
+         uint64_t now = monotonic_ms();
+         map<Client*,deque<Spilled> >::iterator si = pl->spill.upper_bound(pl->last_spill);
+         for (size_t n = 0; n < pl->spill.size(); n++, si++) {
+            if (si == pl->spill.end()) {
+               si = pl->spill.begin();
+            }
+            Spilled &head = si->second.front();
+            Limits &u = pl->userLimits(si->first->getUser(), now);
+            Limits &p = pl->projectLimits(head.pid, now);
+            uint64_t w = pl->wait(u, p, head.len, now);
+            if (w == 0) {
+               pl->take(u, p, head.len);
+               p.waiting--;
+               c = si->first;
+               s = head;
+               break;
+            }
+            if (w < next) {
+               next = w;
+            }
+         }
+         if (c != NULL) {
+            pl->last_spill = c;
+            si->second.pop_front();
+            c->acquire();
+            if (si->second.empty()) {
+               pl->spill.erase(si);
+               c->release();
+            }
+            sem_wait(&pl->posting);
+         }
+      }
+      sem_post(&pl->lock);
+      if (c != NULL) {
+         if (c->getPid() == s.pid) {
+            pl->cm->post(c, string_from_json(s.obj, "type"), s.obj);
+         }
+         else {
+            json_object_put(s.obj);
+         }
+         sem_post(&pl->posting);
+         c->release();
+         continue;
+      }
+      if (next == FOREVER) {
+         sem_wait(&pl->wake);
+      }
+      else {
+         struct timespec ts;
+         clock_gettime(CLOCK_REALTIME, &ts);
+         ts.tv_sec += next / 1000;
+         ts.tv_nsec += (next % 1000) * 1000000;
+         if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+         }
+         while (sem_timedwait(&pl->wake, &ts) != 0 && errno == EINTR) {
+         }
+      }
+   }
+   return NULL;
+}
+
+string PublishLimiter::dumpStats() {
+   if (!enabled) {
+      return "";
+   }
+   static const char *actions[] = {"delay", "reject", "spill"};
+   char buf[256];
+   string sb;
+   sem_wait(&lock);
+   uint64_t waiting = 0;
+   for (map<Client*,deque<Spilled> >::iterator i = spill.begin(); i != spill.end(); i++) {
+      waiting += i->second.size();
+   }
+   snprintf(buf, sizeof(buf), "Publish limits (%s):\n%llu delayed (%llu ms), %llu rejected, %llu spilled, %llu waiting, %llu dropped\n",
+            actions[action], (unsigned long long)delayed, (unsigned long long)delay_ms, (unsigned long long)rejected,
+            (unsigned long long)spilled, (unsigned long long)waiting, (unsigned long long)dropped);
+   sb += buf;
+   for (map<string,Limits>::iterator i = users.begin(); i != users.end(); i++) {
+      if (i->second.events != 0) {
+         snprintf(buf, sizeof(buf), "  user %s over the limit %llu times\n", i->first.c_str(),
+                  (unsigned long long)i->second.events);
+         sb += buf;
+      }
+   }
+   for (map<uint32_t,Limits>::iterator i = projects.begin(); i != projects.end(); i++) {
+      if (i->second.events != 0) {
+         snprintf(buf, sizeof(buf), "  project %u over the limit %llu times\n", i->first,
+                  (unsigned long long)i->second.events);
+         sb += buf;
+      }
+   }
+   sem_post(&lock);
+   return sb;
+}
@@ -0,0 +1,145 @@
+/*
+   collabREate ratelimit.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __RATELIMIT_H
+#define __RATELIMIT_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <stdint.h>
+#include <semaphore.h>
+#include <json-c/json.h>
+
+using namespace std;
+
+class Client;
+class ConnectionManager;
+
+//what PublishLimiter does with an update over the limit
+#define LIMIT_DELAY  0    //hold up the publishing client until it fits
+#define LIMIT_REJECT 1    //drop it and tell the client with MSG_ERROR
+#define LIMIT_SPILL  2    //post it later, once the dispatch queue is short
+
+/**
+ * TokenBucket
+ * Allows rate tokens per second on average and up to burst at once.
+ * tokens goes negative when a delayed update borrows from the future.
+ */
+struct TokenBucket {
+   double rate;      //0 for no limit
+   double burst;
+   double tokens;
+   uint64_t last;    //monotonic_ms of the last refill
+
+   void init(double rate, double burst, uint64_t now);
+
+   /**
+    * wait refills the bucket and says how long until n tokens are available
+    * @return ms to wait, 0 if they can be taken now
+    */
+   uint64_t wait(double n, uint64_t now);
+
+   void take(double n) {if (rate != 0) tokens -= n;};
+};
+
+/**
+ * PublishLimiter
+ * Token bucket limits on the updates and bytes each user and each project
+ * may publish, so one runaway script or plugin can't take the storage and
+ * fan-out from everyone else. Limits are off unless configured.
+ */
+class PublishLimiter {
+public:
+   PublishLimiter(ConnectionManager *cm, json_object *conf);
+
+   /**
+    * start launches the thread that posts spilled updates, if there can be any
+    */
+   void start();
+
+   /**
+    * admit is called by a client's thread before it posts an update
+    * @param c the publishing client
+    * @param obj the update, released by admit if it returns false
+    * @return true if the caller should post the update now, possibly after
+    * having been delayed, false if it was rejected or spilled
+    */
+   bool admit(Client *c, json_object *obj);
+
+   /**
+    * forget drops any spilled updates of a client that is leaving its project
+    */
+   void forget(Client *c);
+
+   /**
+    * dumpStats describes the limits and how often they have been hit
+    */
+   string dumpStats();
+
+private:
+   struct Limits {
+      TokenBucket updates;
+      TokenBucket bytes;
+      uint64_t events;     //updates found over the limit
+      uint64_t noticed;    //when a rejected client was last told
+      uint32_t waiting;    //spilled updates not posted yet
+   };
+
+   struct Spilled {
+      json_object *obj;
+      uint32_t pid;        //the project the update was published to
+      size_t len;
+   };
+
+   static void *drain(void *arg);
+
+   //the following require lock
+   Limits &userLimits(const string &user, uint64_t now);
+   Limits &projectLimits(uint32_t pid, uint64_t now);
+   uint64_t wait(Limits &u, Limits &p, size_t len, uint64_t now);
+   void take(Limits &u, Limits &p, size_t len);
+
+   ConnectionManager *cm;
+   bool enabled;
+   bool measure;          //a byte limit is set, updates must be serialized
+   int action;
+   double user_rate, user_bps;
+   double project_rate, project_bps;
+   double burst;          //seconds of rate allowed at once
+   uint32_t spill_max;          //most updates spilled per client, 0 for no limit
+   uint32_t spill_project_max;  //most updates spilled per project, 0 for no limit
+
+   sem_t lock;
+   map<string,Limits> users;
+   map<uint32_t,Limits> projects;
+   map<Client*,deque<Spilled> > spill;    //each client holds a reference
+   Client *last_spill;    //client most recently drained
+   sem_t wake;            //posted when an update is spilled
+   sem_t posting;         //held while a spilled update is posted
+
+   uint64_t delayed;
+   uint64_t delay_ms;
+   uint64_t rejected;
+   uint64_t spilled;
+   uint64_t dropped;      //over a spill limit, or spilled by a client that left before they were posted
+};
+
+#endif
@@ -0,0 +1,203 @@
+/*
+   collabREate resume.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "utils.h"
+#include "resume.h"
+
+//bytes of randomness in each token
+#define RESUME_TOKEN_SIZE 32
+
+ResumeInfo::ResumeInfo() {
+   pid = INVALID_PID;
+   pub = 0;
+   sub = 0;
+   rpub = 0;
+   rsub = 0;
+   expires = 0;
+}
+
+ResumeTokens::ResumeTokens(uint32_t ttl) {
+   this->ttl = ttl;
+   next_sweep = 0;
+   sem_init(&lock, 0, 1);
+}
+
+ResumeTokens::~ResumeTokens() {
+   sem_destroy(&lock);
+}
+
+//drop tokens whose time is up, lock must be held
+void ResumeTokens::sweep(time_t now) {
+   if (now < next_sweep) {
+      return;
+   }
+   for (map<string,ResumeInfo>::iterator i = tokens.begin(); i != tokens.end(); ) {
+      if (i->second.expires != 0 && i->second.expires <= now) {
+         tokens.erase(i++);
+      }
+      else {
+         i++;
+      }
+   }
+   next_sweep = now + ttl;
+}
+
+string ResumeTokens::issue(const ResumeInfo &info) {
+   if (ttl == 0) {
+      return "";
+   }
+   uint8_t bytes[RESUME_TOKEN_SIZE];
+   //a guessable token is worse than none, fill_random falls back to rand()
+   if (fill_random(bytes, sizeof(bytes)) == 0) {
+      return "";
+   }
+   string token = toHexString(bytes, sizeof(bytes));
+   time_t now = time(NULL);
+   sem_wait(&lock);
+   sweep(now);
+   ResumeInfo &ri = tokens[token];
+   ri = info;
+   ri.expires = 0;
+   sem_post(&lock);
+   return token;
+}
+
+bool ResumeTokens::redeem(const string &token, ResumeInfo &info) {
+   bool res = false;
+   time_t now = time(NULL);
+   sem_wait(&lock);
+   map<string,ResumeInfo>::iterator i = tokens.find(token);
+   if (i != tokens.end()) {
+      //a token whose session has not noticed its connection is gone yet is
+      //still good, that session's socket is dead or about to be
+      if (i->second.expires == 0 || now < i->second.expires) {
+         info = i->second;
+         res = true;
+      }
+      tokens.erase(i);
+   }
+   sem_post(&lock);
+   return res;
+}
+
+void ResumeTokens::release(const string &token) {
+   if (token.empty()) {
+      return;
+   }
+   sem_wait(&lock);
+   map<string,ResumeInfo>::iterator i = tokens.find(token);
+   if (i != tokens.end()) {
+      i->second.expires = time(NULL) + ttl;
+   }
+   sem_post(&lock);
+}
+
+void ResumeTokens::revoke(const string &token) {
+   if (token.empty()) {
+      return;
+   }
+   sem_wait(&lock);
+   tokens.erase(token);
+   sem_post(&lock);
+}
+
+void ResumeTokens::revokeProject(uint32_t pid) {
+   sem_wait(&lock);
+   for (map<string,ResumeInfo>::iterator i = tokens.begin(); i != tokens.end(); ) {
+      if (i->second.pid == pid) {
+         tokens.erase(i++);
+      }
+      else {
+         i++;
+      }
+   }
+   sem_post(&lock);
+}
+
+size_t ResumeTokens::size() {
+   sem_wait(&lock);
+   size_t n = tokens.size();
+   sem_post(&lock);
+   return n;
+}
+
+json_object *ResumeTokens::save() {
+   json_object *res = json_object_new_array();
+   sem_wait(&lock);
+   for (map<string,ResumeInfo>::iterator i = tokens.begin(); i != tokens.end(); i++) {
+      ResumeInfo &ri = i->second;
+      json_object *t = json_object_new_object();
+      append_json_string_val(t, "token", i->first);
+      append_json_string_val(t, "user", ri.user.username);
+      append_json_uint32_val(t, "uid", ri.user.uid);
+      append_json_uint64_val(t, "upub", ri.user.pub);
+      append_json_uint64_val(t, "usub", ri.user.sub);
+      append_json_uint32_val(t, "pid", ri.pid);
+      append_json_string_val(t, "gpid", ri.gpid);
+      append_json_string_val(t, "hash", ri.hash);
+      append_json_uint64_val(t, "pub", ri.pub);
+      append_json_uint64_val(t, "sub", ri.sub);
+      append_json_uint64_val(t, "rpub", ri.rpub);
+      append_json_uint64_val(t, "rsub", ri.rsub);
+      append_json_uint64_val(t, "expires", (uint64_t)ri.expires);
+      json_object_array_add(res, t);
+   }
+   sem_post(&lock);
+   return res;
+}
+
+size_t ResumeTokens::restore(json_object *saved) {
+   if (ttl == 0 || saved == NULL || !json_object_is_type(saved, json_type_array)) {
+      return 0;
+   }
+   size_t count = 0;
+   time_t now = time(NULL);
+   sem_wait(&lock);
+   for (size_t i = 0; i < json_object_array_length(saved); i++) {
+      json_object *t = json_object_array_get_idx(saved, i);
+      const char *token = string_from_json(t, "token");
+      const char *user = string_from_json(t, "user");
+      uint64_t expires = 0;
+      ResumeInfo ri;
+      if (token == NULL || user == NULL ||
+          !uint32_from_json(t, "uid", &ri.user.uid) || !uint32_from_json(t, "pid", &ri.pid)) {
+         continue;
+      }
+      ri.user.username = user;
+      uint64_from_json(t, "upub", &ri.user.pub);
+      uint64_from_json(t, "usub", &ri.user.sub);
+      const char *gpid = string_from_json(t, "gpid");
+      ri.gpid = gpid != NULL ? gpid : "";
+      const char *hash = string_from_json(t, "hash");
+      ri.hash = hash != NULL ? hash : "";
+      uint64_from_json(t, "pub", &ri.pub);
+      uint64_from_json(t, "sub", &ri.sub);
+      uint64_from_json(t, "rpub", &ri.rpub);
+      uint64_from_json(t, "rsub", &ri.rsub);
+      uint64_from_json(t, "expires", &expires);
+      ri.expires = expires != 0 ? (time_t)expires : now + ttl;
+      if (ri.expires > now) {
+         tokens[token] = ri;
+         count++;
+      }
+   }
+   sem_post(&lock);
+   return count;
+}
@@ -0,0 +1,132 @@
+/*
+   collabREate resume.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __RESUME_H
+#define __RESUME_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+#include <semaphore.h>
+#include <json-c/json.h>
+
+#include "cli_mgr.h"
+
+using namespace std;
+
+/**
+ * ResumeInfo
+ * Everything needed to put a client back into the session a resume
+ * token was issued for without asking the database: the authenticated
+ * user, the project it had joined and the permissions it held there.
+ */
+struct ResumeInfo {
+   ResumeInfo();
+   UserInfo user;
+   uint32_t pid;        //INVALID_PID when no session was resumed
+   string gpid;
+   string hash;
+   uint64_t pub;        //effective permissions
+   uint64_t sub;
+   uint64_t rpub;       //permissions requested by the plugin
+   uint64_t rsub;
+   time_t expires;      //0 while the session holding the token is connected
+};
+
+/**
+ * ResumeTokens
+ * Short lived, single use tokens handed to a client each time it joins a
+ * project. A client that loses its connection may present the token in
+ * place of an auth request and is put straight back into its project with
+ * no challenge, no password check and no database queries. A token only
+ * starts to age once the session it was issued to has ended, and is good
+ * for ttl seconds after that. Redeeming a token consumes it, the resumed
+ * session is issued a new one.
+ */
+class ResumeTokens {
+public:
+   /**
+    * @param ttl seconds a token remains valid after its session ends, 0 disables resumption
+    */
+   ResumeTokens(uint32_t ttl);
+   ~ResumeTokens();
+
+   /**
+    * issue creates a token for a connected session
+    * @param info the session to restore, expires is ignored
+    * @return the new token, empty if resumption is disabled
+    */
+   string issue(const ResumeInfo &info);
+
+   /**
+    * redeem consumes a token
+    * @param token the token presented by the client
+    * @param info receives the session the token was issued for
+    * @return true if the token was valid
+    */
+   bool redeem(const string &token, ResumeInfo &info);
+
+   /**
+    * release starts the clock on a token once its session has ended
+    * @param token the session's token
+    */
+   void release(const string &token);
+
+   /**
+    * revoke discards a token, e.g. when its session leaves the project
+    * @param token the token to discard
+    */
+   void revoke(const string &token);
+
+   /**
+    * revokeProject discards every token for a project, used when the
+    * permissions captured in them are no longer accurate
+    * @param pid the local pid of the project
+    */
+   void revokeProject(uint32_t pid);
+
+   size_t size();
+
+   /**
+    * save describes every token for a server taking over from this one
+    * @return an array with one object per token
+    */
+   json_object *save();
+
+   /**
+    * restore adds the tokens saved by the server this one took over from.
+    * The sessions they belong to are about to reconnect, so the clock is
+    * started on any that were still connected.
+    * @param tokens the array returned by save
+    * @return the number of tokens added
+    */
+   size_t restore(json_object *tokens);
+
+private:
+   void sweep(time_t now);
+
+   map<string,ResumeInfo> tokens;
+   sem_t lock;
+   uint32_t ttl;
+   time_t next_sweep;
+};
+
+#endif
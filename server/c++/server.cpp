@@ -26,6 +26,7 @@
 #include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -43,6 +44,8 @@
 #include "db_mgr.h"
 #include "mgr_helper.h"
 #include "client.h"
+#include "resume.h"
+#include "handover.h"
 
 #define ERROR_NO_USER "Failed to find user %s"
 #define ERROR_NO_PRIVS "drop_privs failed!"
@@ -51,10 +54,16 @@
 #define ERROR_SET_SIGCHLD "Unable to set SIGCHLD handler"
 #define ERROR_SET_SIGTERM "Unable to set SIGTERM handler"
 
+//upper bound on ACCEPT_THREADS
+#define MAX_ACCEPT_THREADS 16
+
 json_object *conf = NULL;
 
 ManagerHelper *helper;
 
+//connection to the server this one is taking over from, see take_sessions
+static int predecessor = -1;
+
 /*
  * This farms exit status from forked children to avoid
  * having any zombie processes lying around
@@ -80,29 +89,72 @@ void sigchld(int sig) {
 }
 
 struct ClientArgs {
-   ClientArgs(ConnectionManager *_cm, NetworkIO *_nio) : cm(_cm), nio(_nio) {};
+   ClientArgs(ConnectionManager *_cm, NetworkIO *_nio) : cm(_cm), nio(_nio), sock(-1) {};
    ConnectionManager *cm;
    NetworkIO *nio;
+   int sock;   //the descriptor under nio, see connection_socket
 };
 
 #define AUTH_TRIES 3
 
+//a connection that hasn't authenticated in time is shut down, failing
+//doAuth's read, client_func still owns it and cancels this before closing it
+static void auth_deadline(void *arg) {
+   ClientArgs *ca = (ClientArgs*)arg;
+   log(LINFO, "Authentication timed out for %s:%d\n", ca->nio->getPeerAddr().c_str(), ca->nio->getPeerPort());
+   if (ca->sock >= 0) {
+      shutdown(ca->sock, SHUT_RDWR);
+   }
+}
+
 //perform authentication on the new connection before instantiating and running a new Client
 void *client_func(void *arg) {
    if (arg) {
       ClientArgs *ca = (ClientArgs*)arg;
+      if (ca->cm->moving) {
+         //accepted after the handover, send the plugin on to the new server
+         json_object *obj = json_object_new_object();
+         append_json_string_val(obj, "type", MSG_SERVER_RESTART);
+         ca->nio->writeJson(obj);
+         ca->nio->close();
+         delete ca;
+         return NULL;
+      }
+      //looked up once, before anything else can close the connection
+      ca->sock = connection_socket(ca->nio);
+      Timer deadline(auth_deadline, ca);
+      if (ca->cm->authTimeout() > 0) {
+         ca->cm->timers->schedule(&deadline, ca->cm->authTimeout() * 1000);
+      }
+      bool authed = false;
       for (int i = 0; i < AUTH_TRIES; i++) {
          json_object *response = json_object_new_object();
          append_json_string_val(response, "type", MSG_AUTH_REPLY);
 
-         uint32_t uid = ca->cm->doAuth(ca->nio);
+         ResumeInfo resumed;
+         uint32_t caps = 0;
+         uint32_t uid = ca->cm->doAuth(ca->nio, &resumed, &caps);
          if (uid < FIRST_BAD_UID) {
+            ca->cm->timers->cancel(&deadline);
+            authed = true;
             append_json_int32_val(response, "reply", AUTH_REPLY_SUCCESS);
+            if (caps != 0) {
+               append_json_uint32_val(response, "caps", caps);
+            }
+            if (resumed.pid != INVALID_PID) {
+               //the join reply follows, the plugin should not rejoin itself
+               append_json_bool_val(response, "resumed", true);
+            }
             ca->nio->writeJson(response);
-            Client *c = new Client(ca->cm, ca->nio, uid);
+            Client *c = new Client(ca->cm, ca->nio, uid, ca->sock);
+            c->setCaps(caps);
             delete ca;
+            if (resumed.pid != INVALID_PID) {
+               c->resume(resumed);
+            }
             c->run();
-            delete c;
+            //anything still dispatching to c holds its own reference
+            c->release();
             break;
          }
          else {
@@ -110,6 +162,11 @@ void *client_func(void *arg) {
             ca->nio->writeJson(response);
          }
       }
+      if (!authed) {
+         ca->cm->timers->cancel(&deadline);
+         ca->nio->close();
+         delete ca;
+      }
    }
    return NULL;
 }
@@ -124,10 +181,189 @@ void start_client(ConnectionManager *cm, NetworkIO *nio) {
    pthread_create(&tid, &attr, client_func, new ClientArgs(cm, nio));
 }
 
+/*
+ * Apply the accept backlog and socket options from the config file to the
+ * listening socket.  Linux copies TCP_NODELAY and the keepalive settings
+ * to every socket accept returns, so clients need no per connection setup.
+ */
+void tune_listener(unsigned short port) {
+   int fd = find_listener(port);
+   if (fd < 0) {
+      fprintf(stderr, "Unable to find listening socket for port %d\n", port);
+      return;
+   }
+   int backlog = getIntOption(conf, "LISTEN_BACKLOG", 1024);
+   //listening again only changes the backlog
+   if (backlog > 0 && listen(fd, backlog) != 0) {
+      fprintf(stderr, "Unable to set listen backlog: %s\n", strerror(errno));
+   }
+   int nodelay = getIntOption(conf, "TCP_NODELAY", 1) ? 1 : 0;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+#ifdef TCP_NOTSENT_LOWAT
+   int lowat = getIntOption(conf, "NOTSENT_LOWAT", 0);
+   if (lowat > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0) {
+      fprintf(stderr, "Unable to set unsent data limit: %s\n", strerror(errno));
+   }
+#endif
+   int idle = getIntOption(conf, "KEEPALIVE_IDLE", 0);
+   if (idle > 0) {
+      int on = 1;
+      int intvl = getIntOption(conf, "KEEPALIVE_INTERVAL", 30);
+      int cnt = getIntOption(conf, "KEEPALIVE_COUNT", 4);
+      if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0 ||
+          setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0 ||
+          setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) != 0 ||
+          setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) != 0) {
+         fprintf(stderr, "Unable to enable keepalive: %s\n", strerror(errno));
+      }
+   }
+}
+
+struct AcceptArgs {
+   AcceptArgs(NetworkService *svc, ConnectionManager *cm, ManagerHelper *hlp) : svc(svc), cm(cm), hlp(hlp) {};
+   NetworkService *svc;
+   ConnectionManager *cm;
+   ManagerHelper *hlp;
+};
+
+//every thread in accept_clients, so a handover can wake them
+static pthread_t acceptor_tids[MAX_ACCEPT_THREADS];
+static volatile int num_acceptors = 0;
+
+//SIGUSR1 is installed without SA_RESTART, so it fails a blocked accept
+static void wakeup(int sig) {
+}
+
+//accept clients until the manager shuts the server down
+static void accept_clients(NetworkService *svc, ConnectionManager *cm, ManagerHelper *hlp) {
+   acceptor_tids[__sync_fetch_and_add(&num_acceptors, 1)] = pthread_self();
+   while (!hlp->done) {
+      NetworkIO *nio = svc->accept();
+      if (nio) {
+         start_client(cm, nio);
+      }
+   }
+}
+
+void *acceptor_func(void *arg) {
+   AcceptArgs *aa = (AcceptArgs*)arg;
+   accept_clients(aa->svc, aa->cm, aa->hlp);
+   delete aa;
+   return NULL;
+}
+
+/*
+ * Hand this server over to the new process connected on sock, see
+ * handover.h for the exchange.  Returns false, with nothing changed, if
+ * this server can't hand over or the new process gives up before it has
+ * taken the sessions.
+ */
+static bool hand_over(int sock, ConnectionManager *cm, ManagerHelper *hlp) {
+   if (!cm->persistent()) {
+      //the projects live in this process, a new one would start without them
+      log(LERROR, "Refusing to hand over, projects are not kept in basic mode\n");
+      json_object *obj = json_object_new_object();
+      append_json_string_val(obj, "type", MSG_HANDOVER_REFUSED);
+      append_json_string_val(obj, "error", "Server is in basic mode, its projects can't be handed over");
+      handover_send(sock, obj);
+      return false;
+   }
+   log(LINFO, "A new server is taking over\n");
+   if (!handover_listeners(sock)) {
+      return false;
+   }
+   //both processes accept on the shared sockets until the sessions have moved
+   json_object *obj = handover_recv(sock, MSG_HANDOVER_READY);
+   if (obj == NULL) {
+      log(LERROR, "The new server failed to start\n");
+      return false;
+   }
+   json_object_put(obj);
+   obj = json_object_new_object();
+   append_json_string_val(obj, "type", MSG_HANDOVER_SESSIONS);
+   json_object_object_add_ex(obj, "tokens", cm->resume->save(), JSON_NEW_CONST_KEY);
+   if (!handover_send(sock, obj) || (obj = handover_recv(sock, MSG_HANDOVER_DONE)) == NULL) {
+      log(LERROR, "The new server failed to take the sessions\n");
+      return false;
+   }
+   json_object_put(obj);
+   //stop accepting, anyone an acceptor still picks up is sent straight on
+   hlp->done = true;
+   cm->handover();
+   for (int i = 0; i < num_acceptors; i++) {
+      pthread_kill(acceptor_tids[i], SIGUSR1);
+   }
+   uint32_t grace = getIntOption(conf, "HANDOVER_GRACE", 60);
+   uint64_t start = monotonic_ms();
+   while (cm->numClients() > 0 && monotonic_ms() - start < grace * 1000ULL) {
+      usleep(100000);
+   }
+   log(LINFO, "Handover complete, %u clients left behind\n", cm->numClients());
+   return true;
+}
+
+/*
+ * Wait for a new server process to take over from this one, then shut
+ * down once our clients have moved to it
+ */
+void *handover_func(void *arg) {
+   AcceptArgs *aa = (AcceptArgs*)arg;
+   string path = getStringOption(conf, "HANDOVER_PATH", DEFAULT_HANDOVER_PATH);
+   int lsock = handover_listen(path);
+   while (lsock >= 0) {
+      int sock = accept(lsock, NULL, NULL);
+      if (sock < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         break;
+      }
+      bool moved = hand_over(sock, aa->cm, aa->hlp);
+      close(sock);
+      if (moved) {
+         //the path is the new server's now
+         close(lsock);
+         aa->hlp->shutdown();
+      }
+   }
+   delete aa;
+   return NULL;
+}
+
+/*
+ * Finish taking over from the previous server once we are accepting on the
+ * sockets it handed over: get its clients' resume tokens so they can
+ * resume their sessions here when it sends them on
+ */
+static void take_sessions(ConnectionManager *cm) {
+   json_object *obj = json_object_new_object();
+   append_json_string_val(obj, "type", MSG_HANDOVER_READY);
+   if (!handover_send(predecessor, obj) || (obj = handover_recv(predecessor, MSG_HANDOVER_SESSIONS)) == NULL) {
+      log(LERROR, "The previous server did not hand over its sessions\n");
+   }
+   else {
+      json_object *tokens = NULL;
+      size_t n = 0;
+      if (json_object_object_get_ex(obj, "tokens", &tokens)) {
+         n = cm->resume->restore(tokens);
+      }
+      json_object_put(obj);
+      log(LINFO, "Took over %u resumable sessions\n", (uint32_t)n);
+      obj = json_object_new_object();
+      append_json_string_val(obj, "type", MSG_HANDOVER_DONE);
+      handover_send(predecessor, obj);
+   }
+   close(predecessor);
+   predecessor = -1;
+}
+
 /*
  * Enter a threaded accept loop.  Create a new thread using the
  * client_callback function for each new client connection.  If
- * the client thread crashes, the entire server crashes.
+ * the client thread crashes, the entire server crashes.  Several
+ * threads block in accept on the shared listening socket so a burst
+ * of connections (every plugin reconnecting after a restart) isn't
+ * serialized behind the thread creation for each one.
  */
 void loop(NetworkService *svc) {
    ConnectionManager *mgr;
@@ -151,14 +387,37 @@ void loop(NetworkService *svc) {
    ManagerHelper hlp(mgr, conf);
    hlp.start();
    helper = &hlp;
-   while (!hlp.done) {
-      NetworkIO *nio = svc->accept();
-      fprintf(stderr, "Accepted new client\n");
-      if (nio) {
-         start_client(mgr, nio);
-      }
+   int acceptors = getIntOption(conf, "ACCEPT_THREADS", 0);
+   if (acceptors <= 0) {
+      acceptors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (acceptors > MAX_ACCEPT_THREADS) {
+      acceptors = MAX_ACCEPT_THREADS;
+   }
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = wakeup;
+   sigaction(SIGUSR1, &sa, NULL);
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   //this thread is the last acceptor
+   for (int i = 1; i < acceptors; i++) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, acceptor_func, new AcceptArgs(svc, mgr, &hlp));
+   }
+   if (predecessor >= 0) {
+      take_sessions(mgr);
+   }
+   if (getStringOption(conf, "HANDOVER_PATH", DEFAULT_HANDOVER_PATH).length() > 0) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, handover_func, new AcceptArgs(svc, mgr, &hlp));
+   }
+   pthread_attr_destroy(&attr);
+   accept_clients(svc, mgr, &hlp);
+   while (!hlp.quit) {
+      sleep(1);
    }
-   while (!hlp.quit) {};
 }
 
 /*
@@ -269,7 +528,8 @@ int main(int argc, char **argv, char **envp) {
 #endif
    }
    int opt;
-   while ((opt = getopt(argc, argv, "c:")) != -1) {
+   bool takeover = false;
+   while ((opt = getopt(argc, argv, "c:u")) != -1) {
       switch (opt) {
          case 'c':
             conf = parseConf(optarg);
@@ -277,6 +537,10 @@ int main(int argc, char **argv, char **envp) {
                fprintf(stderr, "Failed to parse json config file: %s\n", optarg);
             }
             break;
+         case 'u':
+            //take over from the server already running, see handover.h
+            takeover = true;
+            break;
          default:
             break;
       }
@@ -284,16 +548,19 @@ int main(int argc, char **argv, char **envp) {
    short svc_port = getShortOption(conf, "SERVER_PORT", 5042);
    string svc_host = getStringOption(conf, "SERVER_HOST", "");
    const char *svc_user = getCstringOption(conf, "RUN_AS", NULL);
-   try {
-      if (svc_host.length() == 0) {
-         svc = new Tcp6Service(svc_port);
-      }
-      else {
-         svc = new Tcp6Service(svc_host.c_str(), svc_port);
+   if (takeover) {
+      predecessor = handover_connect(getStringOption(conf, "HANDOVER_PATH", DEFAULT_HANDOVER_PATH));
+      if (predecessor == HANDOVER_REFUSED) {
+         //the running server still has the port, and keeps serving
+         exit(-1);
       }
+   }
+   try {
+      svc = listen_on(svc_host.length() == 0 ? NULL : svc_host.c_str(), svc_port);
    } catch (int e) {
       exit(e);
    }
+   tune_listener(svc_port);
    if (svc_user != NULL) {
       drop_privs_user(svc_user);
    }
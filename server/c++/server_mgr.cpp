@@ -92,6 +92,10 @@ ServerManager::ServerManager(json_object *p) {
    config = p;
    dbConn = NULL;
    json_fd = -1;
+   export_count = 0;
+   export_done = true;
+   export_since = export_until = export_last = 0;
+   export_offset = 0;
    port = getShortOption(config, "MANAGE_PORT", 5043);
    host = getStringOption(config, "MANAGE_HOST", DEFAULT_HOST);
    mode = getStringOption(config, "SERVER_MODE", "basic") == "database" ? MODE_DB : MODE_BASIC;
@@ -195,19 +199,32 @@ void ServerManager::mng_import_reply(json_object *obj, ServerManager *sm) {
          sm->send_data(MNG_IMPORT_UPDATE, obj);
       }
 */
+      //send the updates in MNG_IMPORT_UPDATES batches, each update is serialized
+      //once and its text is embedded in the batch as is
+      json_object *batch = NULL;
+      size_t bytes = 0;
       for (size_t i = 0; i < num_updates; i++) {
          json_object *update = json_object_array_get_idx(updates, i);
-         //printf("update:" + updateid + " orig uid " + uid + " oldpid " + pid + " cmd " + cmd + " datalen " + datalen );
-         printf(".");
-         const char *type = string_from_json(update, "type");
-         append_json_string_val(update, "utype", type);
-         json_object_object_del(update, "type");
-         append_json_string_val(update, "newowner", sm->import_owner.c_str());
-         json_object_get(update);
-         sm->send_data(MNG_IMPORT_UPDATE, update);
+         size_t jlen;
+         const char *json = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
+         if (batch == NULL) {
+            batch = json_object_new_array();
+         }
+         json_object_array_add(batch, json_object_new_raw(json));
+         bytes += jlen;
+         if (json_object_array_length(batch) >= EXPORT_BATCH_UPDATES || bytes >= EXPORT_BATCH_BYTES || i == (num_updates - 1)) {
+            json_object *msg = json_object_new_object();
+            append_json_string_val(msg, "newowner", sm->import_owner.c_str());
+            json_object_object_add_ex(msg, "updates", batch, JSON_NEW_CONST_KEY);
+            sm->send_data(MNG_IMPORT_UPDATES, msg);
+            batch = NULL;
+            bytes = 0;
+            printf(".");
+            fflush(stdout);
+         }
       }
 
-      printf("\n");
+      printf("\nSent %u updates\n", (unsigned int)num_updates);
    }
 }
 
@@ -238,36 +255,61 @@ void ServerManager::mng_project_list(json_object *reply, ServerManager *sm)  {
    }
 }
 
+/*
+ * one batch of a streamed export, the elements are appended to the open
+ * updates array and the array is closed by mng_export_end
+ */
 void ServerManager::mng_export_updates(json_object *obj, ServerManager *sm) {
    json_object *updates = json_object_object_get(obj, "updates");
-   write(sm->json_fd, ",\"updates\":[", 12);
    if (updates == NULL) {
       fprintf(stderr, "No updates received while requesting export\n");
+      return;
    }
-   else {
-      printf("processing updates\n");
-      size_t num_updates = json_object_array_length(updates);
-      for (size_t i = 0; i < num_updates; i++) {
-         //printf("processing update %d...", (i + 1));
-         printf(".");
-         json_object *update = json_object_array_get_idx(updates, i);
+   size_t num_updates = json_object_array_length(updates);
+   for (size_t i = 0; i < num_updates; i++) {
+      json_object *update = json_object_array_get_idx(updates, i);
 
-         size_t jlen;
-         const char *json = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
+      size_t jlen;
+      const char *json = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
 
-         write(sm->json_fd, json, jlen);
-         if (i != (num_updates - 1)) {
-            write(sm->json_fd, ",", 1);
-         }
-      }
-      if (num_updates == 0 ) {
-         printf("NO UPDATES FOUND FOR EXPORTING\n");
-      }
-      else {
-         printf("Processed %u updates\n", (unsigned int)num_updates);
+      if (sm->export_count++ != 0) {
+         write(sm->json_fd, ",", 1);
       }
+      write(sm->json_fd, json, jlen);
+   }
+   uint64_from_json(obj, "last", &sm->export_last);
+   sm->saveExportCheckpoint();
+   printf(".");
+   fflush(stdout);
+}
+
+void ServerManager::mng_export_end(json_object *obj, ServerManager *sm) {
+   int32_t status = MNG_EXPORT_FAIL;
+   int32_from_json(obj, "status", &status);
+   printf("\n");
+   if (status != MNG_EXPORT_SUCCESS) {
+      fprintf(stderr, "Server failed to export the project\n");
+   }
+   else if (sm->export_count == 0) {
+      printf("NO UPDATES FOUND FOR EXPORTING\n");
+   }
+   else {
+      printf("Processed %u updates\n", sm->export_count);
+   }
+   sm->finishExport(status == MNG_EXPORT_SUCCESS);
+}
+
+void ServerManager::mng_compact_reply(json_object *obj, ServerManager *sm) {
+   int32_t status = MNG_EXPORT_FAIL;
+   int32_t removed = 0;
+   int32_from_json(obj, "status", &status);
+   int32_from_json(obj, "removed", &removed);
+   if (status != MNG_EXPORT_SUCCESS) {
+      fprintf(stderr, "Server failed to compact the project\n");
+   }
+   else {
+      printf("Removed %d superseded updates\n", removed);
    }
-   write(sm->json_fd, "]}", 2);
 }
 
 void ServerManager::msg_error(json_object *obj, ServerManager *sm) {
@@ -358,6 +400,20 @@ void ServerManager::deleteProject(int pid) {
    }
 }
 
+/**
+ * notifyUserChange tells running servers to drop what they have cached about a user
+ * @param conn the database connection
+ * @param username the user that changed, empty if it could be anyone
+ */
+static void notifyUserChange(PGconn *conn, const string &username) {
+   const char * const parms[2] = {USER_NOTIFY_CHANNEL, username.c_str()};
+   PGresult *rset = PQexecParams(conn, "select pg_notify($1, $2);", 2, NULL, parms, NULL, NULL, 0);
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK) {
+      fprintf(stderr, "Error notifying servers of user change: %s\n", PQerrorMessage(conn));
+   }
+   PQclear(rset);
+}
+
 /**
  * addUsers adds a user to this server
  * @param username the username to add
@@ -388,7 +444,9 @@ int ServerManager::addUser(string username, string password, uint64_t pub, uint6
       }
       else {
          rval = ntohl(*(int*)PQgetvalue(rset, 0, 0));
+         notifyUserChange(dbConn, username);
       }
+      PQclear(rset);
    }
    else {
       fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
@@ -428,7 +486,10 @@ int ServerManager::updateUser(string username, string password, uint64_t pub, ui
       }
       else {
          rval = ntohl(*(int*)PQgetvalue(rset, 0, 0));
+         //the update may have renamed the user, the old name isn't known here
+         notifyUserChange(dbConn, "");
       }
+      PQclear(rset);
    }
    else {
       fprintf(stderr, "it appears that the server is configured for BASIC mode\n");
@@ -541,11 +602,11 @@ void ServerManager::initQueries() {
          fprintf(stderr, "findUserByUID: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
-      res = PQprepare(dbConn, "getAllUpdates",
-                      "select updateid,username,pid,json,created from updates where pid=$1 order by updateid asc",
+      res = PQprepare(dbConn, "getUpdateRange",
+                      "select updateid,username,pid,json,created from updates where pid=$1 and updateid>$2 and updateid<=$3 order by updateid asc",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-         fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
+         fprintf(stderr, "getUpdateRange: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
       res = PQprepare(dbConn, "deleteUpdatesByPID",
@@ -555,6 +616,13 @@ void ServerManager::initQueries() {
          fprintf(stderr, "deleteUpdatesByPID: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
+      res = PQprepare(dbConn, "deleteUpdatesByID",
+                      "delete from updates where pid=$1 and updateid = any($2::bigint[])",
+                      0, NULL);
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "deleteUpdatesByID: %s\n", PQerrorMessage(dbConn));
+      }
+      PQclear(res);
       res = PQprepare(dbConn, "deleteProjectByPID",
                       "delete from projects where pid=$1",
                       0, NULL);
@@ -697,13 +765,120 @@ static time_t PQ_to_time_t(double pqtime) {
 }
 */
 
+/**
+ * beginExport writes the export file header and the initial checkpoint
+ * or, when resuming, rewinds the file to the last checkpoint
+ * @param pi the project being exported
+ * @param since only updates with an updateid greater than this are exported
+ * @param until only updates with an updateid up to this are exported, 0 for no limit
+ * @param resume true to continue from the checkpoint loaded by loadExportCheckpoint
+ */
+void ServerManager::beginExport(const Project &pi, uint64_t since, uint64_t until, bool resume) {
+   export_done = false;
+   if (resume) {
+      //drop anything written after the last checkpoint and carry on from there
+      ftruncate(json_fd, export_offset);
+      lseek(json_fd, 0, SEEK_END);
+      printf("resuming export of %d (%s) after update %" PRIu64 "\n", pi.lpid, pi.gpid.c_str(), export_last);
+      return;
+   }
+   export_gpid = pi.gpid;
+   export_since = since;
+   export_until = until;
+   export_last = since;
+   export_count = 0;
+
+   json_object *obj = json_object_new_object();
+   append_json_int32_val(obj, "version", FILE_VER);
+   append_json_string_val(obj, "gpid", pi.gpid);
+   append_json_string_val(obj, "hash", pi.hash);
+   append_json_uint64_val(obj, "subscribe", pi.sub);
+   append_json_uint64_val(obj, "publish", pi.pub);
+   append_json_string_val(obj, "description", pi.desc);
+   append_json_string_val(obj, "magic", FILE_SIG);
+   append_json_uint64_val(obj, "since", since);
+   append_json_uint64_val(obj, "until", until);
+
+   size_t jlen;
+   const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+   write(json_fd, "{\"meta\":", 8);
+   write(json_fd, json, jlen);
+   json_object_put(obj);
+   write(json_fd, ",\"updates\":[", 12);
+   saveExportCheckpoint();
+}
+
+/**
+ * finishExport closes the updates array and records the last exported updateid
+ * the checkpoint is kept if the export failed so that it can be resumed
+ * @param success true if every requested update was written
+ */
+void ServerManager::finishExport(bool success) {
+   char trailer[64];
+   int len = snprintf(trailer, sizeof(trailer), "],\"last\":%" PRIu64 "}", export_last);
+   write(json_fd, trailer, len);
+   if (success) {
+      unlink(export_ckpt.c_str());
+   }
+   else {
+      fprintf(stderr, "export incomplete, it may be resumed from update %" PRIu64 "\n", export_last);
+   }
+   export_done = true;
+}
+
+/**
+ * saveExportCheckpoint records how far an export has progressed so that an
+ * interrupted export can be resumed without starting over
+ */
+void ServerManager::saveExportCheckpoint() {
+   export_offset = lseek(json_fd, 0, SEEK_CUR);
+   json_object *ckpt = json_object_new_object();
+   append_json_string_val(ckpt, "gpid", export_gpid);
+   append_json_uint64_val(ckpt, "since", export_since);
+   append_json_uint64_val(ckpt, "until", export_until);
+   append_json_uint64_val(ckpt, "last", export_last);
+   append_json_uint32_val(ckpt, "count", export_count);
+   append_json_uint64_val(ckpt, "offset", export_offset);
+   string tmp = export_ckpt + ".tmp";
+   if (json_object_to_file_ext(tmp.c_str(), ckpt, JSON_C_TO_STRING_PLAIN) == 0) {
+      rename(tmp.c_str(), export_ckpt.c_str());
+   }
+   json_object_put(ckpt);
+}
+
+/**
+ * loadExportCheckpoint checks for an interrupted export to the given file
+ * @param efile the export file name
+ * @return true if a usable checkpoint was found
+ */
+bool ServerManager::loadExportCheckpoint(const char *efile) {
+   export_ckpt = string(efile) + ".ckpt";
+   json_object *ckpt = json_object_from_file(export_ckpt.c_str());
+   if (ckpt == NULL) {
+      return false;
+   }
+   const char *gpid = string_from_json(ckpt, "gpid");
+   bool ok = gpid != NULL && uint64_from_json(ckpt, "since", &export_since) &&
+             uint64_from_json(ckpt, "until", &export_until) &&
+             uint64_from_json(ckpt, "last", &export_last) &&
+             uint32_from_json(ckpt, "count", &export_count) &&
+             uint64_from_json(ckpt, "offset", &export_offset);
+   if (ok) {
+      export_gpid = gpid;
+   }
+   json_object_put(ckpt);
+   return ok;
+}
+
 /**
  * exportDatabaseProject exports a project to a binary file
  * @param lpid the local PID for the project to export
- * @param efile the filename to export to
+ * @param since only updates with an updateid greater than this are exported
+ * @param until only updates with an updateid up to this are exported, 0 for no limit
+ * @param resume true to continue an interrupted export from its checkpoint
  * @return 0 on success
  */
-int ServerManager::exportDatabaseProject(uint32_t lpid) {
+int ServerManager::exportDatabaseProject(uint32_t lpid, uint64_t since, uint64_t until, bool resume) {
    int rval = -1;
    if (mode == MODE_DB) {
       Project pi(1, "none");
@@ -712,87 +887,103 @@ int ServerManager::exportDatabaseProject(uint32_t lpid) {
             fprintf(stderr, "snapshot exporting is currently not implimented\n");
             return -1;
          }
+         if (resume && pi.gpid != export_gpid) {
+            fprintf(stderr, "the interrupted export was for a different project\n");
+            return -1;
+         }
          printf("exporting %d (%s)\n", lpid, pi.gpid.c_str());
          if (pi.parent > 0 ) {
             fprintf(stderr, "This project was forked.  Note: lineage is not preserved with export.\n");
          }
 
-         json_object *obj = json_object_new_object();
-         append_json_int32_val(obj, "version", FILE_VER);
-         append_json_string_val(obj, "gpid", pi.gpid);
-         append_json_string_val(obj, "hash", pi.hash);
-         append_json_uint64_val(obj, "subscribe", pi.sub);
-         append_json_uint64_val(obj, "publish", pi.pub);
-         append_json_string_val(obj, "description", pi.desc);
-         append_json_string_val(obj, "magic", FILE_SIG);
-
-         size_t jlen;
-         const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
-
-         write(json_fd, "{\"meta\":", 8);
-         write(json_fd, json, jlen);
-         json_object_put(obj);
-         write(json_fd, ",\"updates\":[", 12);
-
-         static const int plens[1] = {4};
-         static const int pformats[1] = {1};
-         //insert into files values(stream_id, fname);
-         const char * const parms[1] = {(char*)&lpid};
-         lpid = htonl(lpid);
-         PGresult *rset = PQexecPrepared(dbConn, "getAllUpdates",
-                             1, //int nParams,   size of arrays that follow
+         beginExport(pi, since, until, resume);
+
+         static const int plens[3] = {4, 8, 8};
+         static const int pformats[3] = {1, 1, 1};
+         uint64_t from = htonll(export_last);
+         uint64_t to = htonll(export_until ? export_until : INT64_MAX);
+         int pid = htonl(lpid);
+         const char * const parms[3] = {(char*)&pid, (char*)&from, (char*)&to};
+         //fetch rows one at a time so that memory use doesn't grow with the project
+         if (!PQsendQueryPrepared(dbConn, "getUpdateRange",
+                             3, //int nParams,   size of arrays that follow
                              parms, //parms,  //const char * const *paramValues, array of string values
                              plens, //const int *paramLengths,
                              pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-
-         ExecStatusType qres = PQresultStatus(rset);
-         if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-            fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
+                             1) //int resultFormat); 0 == text, 1 == binary
+             || !PQsetSingleRowMode(dbConn)) {
+            fprintf(stderr, "getUpdateRange: %s\n", PQerrorMessage(dbConn));
          }
          else {
             printf("processing updates\n");
-            int rows = PQntuples(rset);
-            for (int i = 0; i < rows; i++) {
-               //printf("processing update %d...", (i + 1));
-               printf(".");
-               uint64_t updateid = htonll(*((uint64_t*)PQgetvalue(rset, i, 0)));
-               //const char *uid = PQgetvalue(rset, i, 1);
-               int pid = ntohl(*(int*)PQgetvalue(rset, i, 2));
-               const char *json = (const char*)PQgetvalue(rset, i, 3);
-
-               /* available, but currently unused
-               double created_d = *(double*)PQgetvalue(rset, i, 4);
-               time_t created = PQ_to_time_t(created_d);
-               */
-
-               json_object *update = json_tokener_parse(json);
-               append_json_uint64_val(update, "updateid", updateid);
-               //append_json_string_val(update, "uid", uid);
-               append_json_int32_val(update, "pid", pid);
-
-               //write timestamp?
-               json = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
-
-               write(json_fd, json, jlen);
-               if (i != (rows - 1)) {
-                  write(json_fd, ",", 1);
+            int rows = 0;
+            rval = 0;
+            PGresult *rset;
+            while ((rset = PQgetResult(dbConn)) != NULL) {
+               ExecStatusType qres = PQresultStatus(rset);
+               if (qres == PGRES_SINGLE_TUPLE) {
+                  rows++;
+                  uint64_t updateid = htonll(*((uint64_t*)PQgetvalue(rset, 0, 0)));
+                  //const char *uid = PQgetvalue(rset, 0, 1);
+                  int upid = ntohl(*(int*)PQgetvalue(rset, 0, 2));
+                  const char *json = (const char*)PQgetvalue(rset, 0, 3);
+
+                  /* available, but currently unused
+                  double created_d = *(double*)PQgetvalue(rset, 0, 4);
+                  time_t created = PQ_to_time_t(created_d);
+                  */
+
+                  //write the stored text as is and splice updateid and pid in
+                  //ahead of its closing brace, keys that come later win so any
+                  //stale copies stored with the update are overridden
+                  const char *start = json;
+                  while (isspace(*start)) start++;
+                  const char *end = start + strlen(start);
+                  while (end > start && isspace(end[-1])) end--;
+                  if (*start != '{' || end - start < 2 || end[-1] != '}') {
+                     fprintf(stderr, "\nupdate %" PRIu64 " is not a json object, stopping the export\n", updateid);
+                     rval = -1;
+                  }
+                  if (rval != 0) {
+                     //drain the remaining rows, the checkpoint stays at the last good one
+                     PQclear(rset);
+                     continue;
+                  }
+                  const char *body = end - 1;
+                  while (body > start + 1 && isspace(body[-1])) body--;
+                  char suffix[64];
+                  int slen = snprintf(suffix, sizeof(suffix), "%s\"updateid\":%" PRIu64 ",\"pid\":%d}",
+                                      body == start + 1 ? "" : ",", updateid, upid);
+                  if (export_count++ != 0) {
+                     write(json_fd, ",", 1);
+                  }
+                  write(json_fd, start, body - start);
+                  write(json_fd, suffix, slen);
+                  export_last = updateid;
+                  if ((rows % EXPORT_BATCH_UPDATES) == 0) {
+                     saveExportCheckpoint();
+                     printf(".");
+                     fflush(stdout);
+                  }
+               }
+               else if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
+                  fprintf(stderr, "getUpdateRange: %s\n", PQerrorMessage(dbConn));
+                  rval = -1;
                }
-               json_object_put(update);
+               PQclear(rset);
             }
+            printf("\n");
             if (rows == 0 ) {
                printf("NO UPDATES FOUND FOR EXPORTING\n");
             }
             else {
                printf("Processed %d updates\n", rows);
             }
-            rval = 0;
          }
-         write(json_fd, "]}", 2);
-         PQclear(rset);
+         finishExport(rval == 0);
       }
       else {
-         printf("Project %d not found.\n", ntohl(lpid));
+         printf("Project %d not found.\n", lpid);
       }
       printf("\n");
    }
@@ -805,48 +996,140 @@ int ServerManager::exportDatabaseProject(uint32_t lpid) {
 /**
  * exportBasicProject exports a project to a binary file
  * @param lpid the local PID for the project to export
- * @param efile the filename to export to
+ * @param since only updates with an updateid greater than this are exported
+ * @param until only updates with an updateid up to this are exported, 0 for no limit
+ * @param resume true to continue an interrupted export from its checkpoint
  * @return 0 on success
  */
-int ServerManager::exportBasicProject(uint32_t lpid) {
+int ServerManager::exportBasicProject(uint32_t lpid, uint64_t since, uint64_t until, bool resume) {
    Project pi(1, "none");
    if (getProject(lpid, &pi) == 0) {
       if (pi.snapupdateid > 0 ) {
          fprintf(stderr, "snapshot exporting is currently not implimented\n");
          return -1;
       }
+      if (resume && pi.gpid != export_gpid) {
+         fprintf(stderr, "the interrupted export was for a different project\n");
+         return -1;
+      }
       printf("exporting %d (%s)\n", lpid, pi.gpid.c_str());
       if (pi.parent > 0 ) {
          fprintf(stderr, "This project was forked.  Note: lineage is not preserved with export.\n");
       }
 
-      json_object *obj = json_object_new_object();
-      append_json_int32_val(obj, "version", FILE_VER);
-      append_json_string_val(obj, "gpid", pi.gpid);
-      append_json_string_val(obj, "hash", pi.hash);
-      append_json_uint64_val(obj, "subscribe", pi.sub);
-      append_json_uint64_val(obj, "publish", pi.pub);
-      append_json_string_val(obj, "description", pi.desc);
-      append_json_string_val(obj, "magic", FILE_SIG);
-
-      size_t jlen;
-      const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
-      write(json_fd, "{\"meta\":", 8);
-      write(json_fd, json, jlen);
-      json_object_put(obj);
+      beginExport(pi, since, until, resume);
 
-      obj = json_object_new_object();
+      //updates arrive in batches, the reader posts waiter after each one
+      json_object *obj = json_object_new_object();
       append_json_uint32_val(obj, "pid", lpid);
+      append_json_uint64_val(obj, "since", export_last);
+      append_json_uint64_val(obj, "until", export_until);
       send_data(MNG_PROJECT_EXPORT, obj);
-      sem_wait(&waiter);
+      while (!export_done) {
+         sem_wait(&waiter);
+      }
       return 0;
    }
    else {
-      printf("Project %d not found.\n", ntohl(lpid));
+      printf("Project %d not found.\n", lpid);
       return 1;
    }
 }
 
+/**
+ * compactDatabaseProject removes stored updates that are superseded by later ones
+ * this runs directly against the database, so the server may stay up
+ * @param lpid the local PID for the project to compact
+ * @param watermark only updates up to this updateid are compacted, 0 for all
+ * @return the number of updates removed, -1 on failure
+ */
+int ServerManager::compactDatabaseProject(uint32_t lpid, uint64_t watermark) {
+   if (mode != MODE_DB) {
+      return -1;
+   }
+   if (!execCommand("BEGIN;")) {
+      return -1;
+   }
+   static const int plens[3] = {4, 8, 8};
+   static const int pformats[3] = {1, 1, 1};
+   uint64_t from = 0;
+   uint64_t to = htonll(watermark ? watermark : INT64_MAX);
+   int pid = htonl(lpid);
+   const char * const parms[3] = {(char*)&pid, (char*)&from, (char*)&to};
+   Compactor compactor;
+   vector<uint64_t> superseded;
+   bool ok = false;
+   //fetch rows one at a time so that memory use doesn't grow with the project
+   if (!PQsendQueryPrepared(dbConn, "getUpdateRange", 3, parms, plens, pformats, 1)
+       || !PQsetSingleRowMode(dbConn)) {
+      fprintf(stderr, "getUpdateRange: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      ok = true;
+      PGresult *rset;
+      while ((rset = PQgetResult(dbConn)) != NULL) {
+         ExecStatusType qres = PQresultStatus(rset);
+         if (qres == PGRES_SINGLE_TUPLE) {
+            uint64_t updateid = htonll(*((uint64_t*)PQgetvalue(rset, 0, 0)));
+            json_object *update = json_tokener_parse(PQgetvalue(rset, 0, 3));
+            uint64_t prev = compactor.supersede(updateid, update);
+            if (prev != 0) {
+               superseded.push_back(prev);
+            }
+            json_object_put(update);
+         }
+         else if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
+            fprintf(stderr, "getUpdateRange: %s\n", PQerrorMessage(dbConn));
+            ok = false;
+         }
+         PQclear(rset);
+      }
+   }
+   //delete in batches, ids are passed as a text format bigint[]
+   char spid[16];
+   snprintf(spid, sizeof(spid), "%u", lpid);
+   for (size_t i = 0; ok && i < superseded.size(); i += EXPORT_BATCH_UPDATES) {
+      string ids = "{";
+      for (size_t j = i; j < superseded.size() && j < i + EXPORT_BATCH_UPDATES; j++) {
+         char id[24];
+         snprintf(id, sizeof(id), "%s%" PRIu64, j == i ? "" : ",", superseded[j]);
+         ids += id;
+      }
+      ids += "}";
+      const char * const dparms[2] = {spid, ids.c_str()};
+      PGresult *rset = PQexecPrepared(dbConn, "deleteUpdatesByID", 2, dparms, NULL, NULL, 0);
+      if (PQresultStatus(rset) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "deleteUpdatesByID: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(rset);
+   }
+   if (!ok) {
+      execCommand("ROLLBACK;");
+      return -1;
+   }
+   if (!execCommand("COMMIT;")) {
+      return -1;
+   }
+   printf("Removed %u superseded updates\n", (uint32_t)superseded.size());
+   return (int)superseded.size();
+}
+
+/**
+ * compactBasicProject asks the server to compact a project
+ * @param lpid the local PID for the project to compact
+ * @param watermark only updates up to this updateid are compacted, 0 for all
+ * @return 0 once the server has replied
+ */
+int ServerManager::compactBasicProject(uint32_t lpid, uint64_t watermark) {
+   json_object *obj = json_object_new_object();
+   append_json_uint32_val(obj, "pid", lpid);
+   append_json_uint64_val(obj, "watermark", watermark);
+   send_data(MNG_PROJECT_COMPACT, obj);
+   sem_wait(&waiter);
+   return 0;
+}
+
 /**
  * createDatabaseProject adds a project to the database
  * @param gpid unique global id for the incoming project
@@ -888,6 +1171,109 @@ int ServerManager::createDatabaseProject(const string &gpid, const string &hash,
    return lpid;
 }
 
+/**
+ * execCommand runs a single sql statement that returns no rows
+ * @param sql the statement to execute
+ * @return true on success
+ */
+bool ServerManager::execCommand(const char *sql) {
+   PGresult *res = PQexec(dbConn, sql);
+   bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+   if (!ok) {
+      fprintf(stderr, "%s %s\n", sql, PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   return ok;
+}
+
+/*
+ * append a field to a COPY text format row, escaping the characters that
+ * COPY treats specially
+ */
+static void copy_field(string &row, const char *val) {
+   for (const char *p = val; *p; p++) {
+      switch (*p) {
+         case '\\':
+            row += "\\\\";
+            break;
+         case '\t':
+            row += "\\t";
+            break;
+         case '\n':
+            row += "\\n";
+            break;
+         case '\r':
+            row += "\\r";
+            break;
+         default:
+            row += *p;
+            break;
+      }
+   }
+}
+
+/**
+ * copyUpdates bulk loads updates into a project using COPY FROM STDIN
+ * @param pid the local project id the updates belong to
+ * @param updates json array of update objects
+ * @return the number of updates loaded, -1 on failure
+ */
+int ServerManager::copyUpdates(int pid, json_object *updates) {
+   PGresult *res = PQexec(dbConn, "COPY updates (username,pid,cmd,json) FROM STDIN;");
+   if (PQresultStatus(res) != PGRES_COPY_IN) {
+      fprintf(stderr, "copy updates: %s\n", PQerrorMessage(dbConn));
+      PQclear(res);
+      return -1;
+   }
+   PQclear(res);
+
+   char pidstr[16];
+   snprintf(pidstr, sizeof(pidstr), "%d", pid);
+   string buf;
+   buf.reserve(EXPORT_BATCH_BYTES + MAX_COMMAND);
+   bool ok = true;
+   size_t num_updates = json_object_array_length(updates);
+   for (size_t i = 0; i < num_updates && ok; i++) {
+      json_object *update = json_object_array_get_idx(updates, i);
+      const char *cmd = string_from_json(update, "type");
+      size_t jlen;
+      const char *jstr = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
+
+      copy_field(buf, import_owner.c_str());
+      buf += '\t';
+      buf += pidstr;
+      buf += '\t';
+      copy_field(buf, cmd ? cmd : "");
+      buf += '\t';
+      copy_field(buf, jstr);
+      buf += '\n';
+
+      if (buf.length() >= EXPORT_BATCH_BYTES) {
+         ok = PQputCopyData(dbConn, buf.c_str(), buf.length()) == 1;
+         buf.clear();
+         printf(".");
+         fflush(stdout);
+      }
+   }
+   if (ok && buf.length() > 0) {
+      ok = PQputCopyData(dbConn, buf.c_str(), buf.length()) == 1;
+   }
+   if (PQputCopyEnd(dbConn, ok ? NULL : "import aborted") != 1) {
+      ok = false;
+   }
+   while ((res = PQgetResult(dbConn)) != NULL) {
+      if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+         fprintf(stderr, "copy updates: %s\n", PQerrorMessage(dbConn));
+         ok = false;
+      }
+      PQclear(res);
+   }
+   if (ok) {
+      printf("\nImported %u updates\n", (unsigned int)num_updates);
+   }
+   return ok ? (int)num_updates : -1;
+}
+
 /**
  * importDatabaseProject imports a project from a binary file
  */
@@ -914,6 +1300,10 @@ int ServerManager::importDatabaseProject() {
          printf("This doesn't appear to be a collabREate dump file\n");
          return -1;
       }
+      uint64_t since;
+      if (uint64_from_json(obj, "since", &since) && since > 0) {
+         printf("Note: this is an incremental export holding only the updates after %" PRIu64 "\n", since);
+      }
 
       const char *gpid = string_from_json(obj, "gpid");
       const char *hash = string_from_json(obj, "hash");
@@ -923,40 +1313,21 @@ int ServerManager::importDatabaseProject() {
       uint64_from_json(obj, "publish", &pub);
       uint64_from_json(obj, "subscribe", &sub);
 
+      //the project and all of its updates go in as a single transaction
+      if (!execCommand("BEGIN;")) {
+         json_object_put(import);
+         return -1;
+      }
       int newpid = createDatabaseProject(gpid, hash, desc, pub, sub);
-
-      size_t num_updates = json_object_array_length(updates);
-      for (size_t i = 0; i < num_updates; i++) {
-         json_object *update = json_object_array_get_idx(updates, i);
-
-         //printf("update:" + updateid + " orig uid " + uid + " oldpid " + pid + " cmd " + cmd + " datalen " + datalen );
-         printf(".");
-         const char *cmd = string_from_json(update, "type");
-
-         const int plens[4] = {0, 4, 0, 0};
-         static const int pformats[4] = {0, 1, 0, 0};
-
-         int pid = htonl(newpid);
-
-         size_t jlen;
-         const char *jstr = json_object_to_json_string_length(update, JSON_C_TO_STRING_PLAIN, &jlen);
-         const char * const parms[4] = {import_owner.c_str(), (char*)&pid, cmd, jstr};
-
-         PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                             4, //int nParams,   size of arrays that follow
-                             parms, //parms,  //const char * const *paramValues, array of string values
-                             plens, //const int *paramLengths,
-                             pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         ExecStatusType qres = PQresultStatus(rset);
-         if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-            fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
-         }
-         else {
-      //      uint64_t updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
-      //      logln(LINFO4, "migrated update: " + updateid + "cmd: " + cmd + "pid: " + pid + " size: " + dlen);
-         }
-         PQclear(rset);
+      if (newpid < 0 || copyUpdates(newpid, updates) < 0) {
+         execCommand("ROLLBACK;");
+         fprintf(stderr, "Error importing project, no changes were made\n");
+         json_object_put(import);
+         return -1;
+      }
+      if (!execCommand("COMMIT;")) {
+         json_object_put(import);
+         return -1;
       }
       json_object_put(import);
       rval = 0;
@@ -1001,6 +1372,10 @@ int ServerManager::importBasicProject() {
          printf("This doesn't appear to be a collabREate dump file\n");
          return -1;
       }
+      uint64_t since;
+      if (uint64_from_json(obj, "since", &since) && since > 0) {
+         printf("Note: this is an incremental export holding only the updates after %" PRIu64 "\n", since);
+      }
 
       //addproject
       //set the new project owner
@@ -1194,10 +1569,12 @@ void ServerManager::closeDB() {
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE findUserByUID;");
       PQclear(res);
-      res = PQexec(dbConn, "DEALLOCATE getAllUpdates;");
+      res = PQexec(dbConn, "DEALLOCATE getUpdateRange;");
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE deleteUpdatesByPID;");
       PQclear(res);
+      res = PQexec(dbConn, "DEALLOCATE deleteUpdatesByID;");
+      PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE deleteProjectByPID;");
       PQclear(res);
       res = PQexec(dbConn, "DEALLOCATE addProject;");
@@ -1273,6 +1650,8 @@ void ServerManager::exec(int argc, char **argv) {
    handlers[MNG_PROJECT_IMPORT_REPLY] = mng_import_reply;
    handlers[MNG_PROJECT_LIST_REPLY] = mng_project_list;
    handlers[MNG_EXPORT_UPDATES] = mng_export_updates;
+   handlers[MNG_EXPORT_END] = mng_export_end;
+   handlers[MNG_PROJECT_COMPACT_REPLY] = mng_compact_reply;
    handlers[MSG_ERROR] = msg_error;
 
 //   printf("Got %d args\n", argc);
@@ -1307,6 +1686,7 @@ void ServerManager::exec(int argc, char **argv) {
       printf("8)  Import a Project from file *\n");
       printf("9)  Delete a Project\n");
       printf("10) Quit\n");
+      printf("12) Compact a Project\n");
       printf("\n");
       printf(" * requires CollabREate Server to be running\n");
       printf("   others commands only require the database to be running \n");
@@ -1552,20 +1932,43 @@ void ServerManager::exec(int argc, char **argv) {
                if (readLine(resp, sizeof(resp)) == NULL) {
                   return;
                }
+               bool resume = false;
+               uint64_t since = 0;
+               uint64_t until = 0;
                struct stat sbuf;
                if (stat(resp, &sbuf) == 0) {
-                  printf("file %s exists, overwrite? ", resp);
-                  if (!askyn()) {
-                    printf("continuing\n");
-                    continue;
+                  if (sm->loadExportCheckpoint(resp)) {
+                     printf("an interrupted export to %s was found, resume it? ", resp);
+                     resume = askyn();
+                  }
+                  if (!resume) {
+                     printf("file %s exists, overwrite? ", resp);
+                     if (!askyn()) {
+                       printf("continuing\n");
+                       continue;
+                     }
                   }
                }
-               sm->json_fd = open(resp, O_CREAT | O_WRONLY, 0644);
+               if (!resume) {
+                  sm->export_ckpt = string(resp) + ".ckpt";
+                  char bound[64];
+                  printf("Export updates after which updateid (0 for all)? ");
+                  if (readLine(bound, sizeof(bound)) == NULL) {
+                     return;
+                  }
+                  since = strtoull(bound, NULL, 0);
+                  printf("Export updates up to which updateid (0 for no limit)? ");
+                  if (readLine(bound, sizeof(bound)) == NULL) {
+                     return;
+                  }
+                  until = strtoull(bound, NULL, 0);
+               }
+               sm->json_fd = open(resp, resume ? O_WRONLY : (O_CREAT | O_WRONLY | O_TRUNC), 0644);
                if (sm->getMode() == MODE_DB) {
-                  sm->exportDatabaseProject(lpid);
+                  sm->exportDatabaseProject(lpid, since, until, resume);
                }
                else if (sm->getMode() == MODE_BASIC) {
-                  sm->exportBasicProject(lpid);
+                  sm->exportBasicProject(lpid, since, until, resume);
                }
                close(sm->json_fd);
                sm->json_fd = -1;
@@ -1641,6 +2044,29 @@ void ServerManager::exec(int argc, char **argv) {
             }
             break;
          }
+         case 12: {
+            sm->listProjects();
+            printf("Which project would you like to compact (enter PID)? : ");
+            if (readLine(resp, sizeof(resp)) == NULL) {
+               return;
+            }
+            if (isNumeric(resp)) {
+               uint32_t lpid = strtoul(resp, NULL, 0);
+               char bound[64];
+               printf("Compact updates up to which updateid (0 for all)? ");
+               if (readLine(bound, sizeof(bound)) == NULL) {
+                  return;
+               }
+               uint64_t watermark = strtoull(bound, NULL, 0);
+               if (sm->getMode() == MODE_DB) {
+                  sm->compactDatabaseProject(lpid, watermark);
+               }
+               else if (sm->getMode() == MODE_BASIC) {
+                  sm->compactBasicProject(lpid, watermark);
+               }
+            }
+            break;
+         }
          default:
             printf("Invalid command.\n");
             break;
@@ -63,6 +63,16 @@ private:
 
    sem_t waiter;
 
+   //progress of an export being streamed from the server in batches
+   uint32_t export_count;
+   bool export_done;
+   string export_gpid;
+   string export_ckpt;      //checkpoint file used to resume an interrupted export
+   uint64_t export_since;
+   uint64_t export_until;
+   uint64_t export_last;    //updateid of the last update written
+   uint64_t export_offset;  //export file length at the last checkpoint
+
    json_object *readJson();
 
    vector<Project*> plist;
@@ -75,6 +85,8 @@ private:
    static void mng_import_reply(json_object *obj, ServerManager *sm);
    static void mng_project_list(json_object *obj, ServerManager *sm);
    static void mng_export_updates(json_object *obj, ServerManager *sm);
+   static void mng_export_end(json_object *obj, ServerManager *sm);
+   static void mng_compact_reply(json_object *obj, ServerManager *sm);
    static void msg_error(json_object *obj, ServerManager *sm);
 
 public:
@@ -156,11 +168,42 @@ private:
    /**
     * exportProject exports a project to a binary final
     * @param lpid the local PID for the project to export
-    * @param efile the filename to export to
+    * @param since only updates with an updateid greater than this are exported
+    * @param until only updates with an updateid up to this are exported, 0 for no limit
+    * @param resume true to continue an interrupted export from its checkpoint
     * @return 0 on success
     */
-   int exportDatabaseProject(uint32_t lpid);
-   int exportBasicProject(uint32_t lpid);
+   int exportDatabaseProject(uint32_t lpid, uint64_t since = 0, uint64_t until = 0, bool resume = false);
+   int exportBasicProject(uint32_t lpid, uint64_t since = 0, uint64_t until = 0, bool resume = false);
+
+   /**
+    * compactProject removes stored updates that are superseded by later ones
+    * @param lpid the local PID for the project to compact
+    * @param watermark only updates up to this updateid are compacted, 0 for all
+    * @return the number of updates removed, -1 on failure
+    */
+   int compactDatabaseProject(uint32_t lpid, uint64_t watermark);
+   int compactBasicProject(uint32_t lpid, uint64_t watermark);
+
+   void beginExport(const Project &pi, uint64_t since, uint64_t until, bool resume);
+   void finishExport(bool success);
+   void saveExportCheckpoint();
+   bool loadExportCheckpoint(const char *efile);
+
+   /**
+    * copyUpdates bulk loads updates into a project using COPY FROM STDIN
+    * @param pid the local project id the updates belong to
+    * @param updates json array of update objects
+    * @return the number of updates loaded, -1 on failure
+    */
+   int copyUpdates(int pid, json_object *updates);
+
+   /**
+    * execCommand runs a single sql statement that returns no rows
+    * @param sql the statement to execute
+    * @return true on success
+    */
+   bool execCommand(const char *sql);
 
    int createDatabaseProject(const string &gpid, const string &hash,
                             const string &desc, uint64_t pub, uint64_t sub);
@@ -0,0 +1,85 @@
+/*
+   collabREate snapshot.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include "utils.h"
+#include "client.h"
+#include "snapshot.h"
+
+Snapshot::Snapshot() {
+   updateid = 0;
+   sem_init(&lock, 0, 1);
+}
+
+Snapshot::~Snapshot() {
+   sem_destroy(&lock);
+}
+
+void Snapshot::apply(uint64_t updateid, json_object *update) {
+   if (updateid > this->updateid) {
+      this->updateid = updateid;
+   }
+   const char *cmd = string_from_json(update, "type");
+   if (cmd == NULL) {
+      return;
+   }
+   uint64_t prev = compactor.supersede(updateid, update);
+   if (prev != 0) {
+      live.erase(prev);
+   }
+   uint64_t uid;
+   if (!uint64_from_json(update, "updateid", &uid)) {
+      append_json_uint64_val(update, "updateid", updateid);
+   }
+   Entry &e = live[updateid];
+   e.type = cmd;
+   e.hasAddr = AddrFilter::address(update, &e.addr);
+   e.json = json_object_to_json_string_ext(update, JSON_C_TO_STRING_PLAIN);
+}
+
+void Snapshot::chunks(Client *c, vector<json_object*> &out) {
+   json_object *chunk = json_object_new_array();
+   size_t bytes = 0;
+   uint32_t seq = 0;
+   map<uint64_t,Entry>::iterator i = live.begin();
+   while (true) {
+      bool last = i == live.end();
+      if (!last && c->canReceive(i->second.type.c_str()) && c->inScope(i->second.hasAddr, i->second.addr)) {
+         json_object_array_add(chunk, json_object_new_raw(i->second.json.c_str()));
+         bytes += i->second.json.length();
+      }
+      if (last || json_object_array_length(chunk) >= STATE_CHUNK_UPDATES || bytes >= STATE_CHUNK_BYTES) {
+         //the final chunk is always sent, even if empty, so the client
+         //learns the updateid to continue from
+         json_object *obj = json_object_new_object();
+         append_json_uint64_val(obj, "updateid", updateid);
+         append_json_uint32_val(obj, "seq", seq++);
+         append_json_bool_val(obj, "last", last);
+         json_object_object_add_ex(obj, "updates", chunk, JSON_NEW_CONST_KEY);
+         out.push_back(obj);
+         if (last) {
+            break;
+         }
+         chunk = json_object_new_array();
+         bytes = 0;
+      }
+      i++;
+   }
+}
@@ -0,0 +1,90 @@
+/*
+   collabREate snapshot.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <semaphore.h>
+#include <json-c/json.h>
+#include "compactor.h"
+
+using namespace std;
+
+class Client;
+
+/**
+ * Snapshot
+ * The materialized state of a project as of a given updateid, kept as the
+ * ordered set of updates that still contribute to that state. Anything the
+ * Compactor reports as superseded is dropped as the snapshot is brought
+ * forward, so its size follows the amount of live state rather than the
+ * age of the project. A cold joining client receives the snapshot as a
+ * series of MSG_PROJECT_STATE chunks followed by the updates after
+ * the snapshot's updateid.
+ */
+
+class Snapshot {
+public:
+   Snapshot();
+   ~Snapshot();
+
+   /**
+    * apply brings the snapshot forward by one update, in updateid order
+    * @param updateid the id of the update
+    * @param update the update itself, an updateid field is added if missing
+    */
+   void apply(uint64_t updateid, json_object *update);
+
+   /**
+    * chunks copies the snapshot out as the MSG_PROJECT_STATE chunks for a
+    * client, updates the client may not subscribe to or that fall outside
+    * of its address filter are left out.  Called with lock held, the chunks
+    * are sent once it has been released.
+    * @param c the client the chunks are for
+    * @param out receives the chunks, in the order they are to be sent
+    */
+   void chunks(Client *c, vector<json_object*> &out);
+
+   /**
+    * size returns the number of updates held in the snapshot
+    */
+   size_t size() const {return live.size();};
+
+   uint64_t updateid;   //all updates up to here are reflected in the snapshot
+   sem_t lock;          //held while the snapshot is refreshed or copied out
+
+private:
+   struct Entry {
+      string type;
+      string json;
+      bool hasAddr;
+      uint64_t addr;
+   };
+
+   Compactor compactor;
+   map<uint64_t,Entry> live;   //updateid to surviving update
+};
+
+#endif
@@ -0,0 +1,191 @@
+/*
+   collabREate timerwheel.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "timerwheel.h"
+
+//longest delay the wheel can hold, in ticks, later timers are brought in
+#define MAX_DELAY ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+Timer::Timer(TimerFunc func, void *arg) {
+   this->func = func;
+   this->arg = arg;
+   expires = 0;
+   next = NULL;
+   pprev = NULL;
+}
+
+TimerWheel::TimerWheel() {
+   sem_init(&lock, 0, 1);
+   sem_init(&firing, 0, 1);
+   memset(slots, 0, sizeof(slots));
+   expired = NULL;
+   now = 0;
+   pending = 0;
+   fired = 0;
+}
+
+void TimerWheel::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   pthread_create(&tid, &attr, run, this);
+   pthread_attr_destroy(&attr);
+}
+
+//lock must be held
+void TimerWheel::add(Timer *t) {
+   uint64_t delta = t->expires > now ? t->expires - now : 0;
+   if (delta > MAX_DELAY) {
+      delta = MAX_DELAY;
+      t->expires = now + delta;
+   }
+   Timer **slot;
+   if (t->expires < now) {
+      //already due, goes out with the next tick
+      slot = &slots[0][now & WHEEL_MASK];
+   }
+   else {
+      int level = 0;
+      while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+         level++;
+      }
+      slot = &slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+   }
+   t->next = *slot;
+   if (t->next != NULL) {
+      t->next->pprev = &t->next;
+   }
+   *slot = t;
+   t->pprev = slot;
+}
+
+//lock must be held and t scheduled
+void TimerWheel::unlink(Timer *t) {
+   *t->pprev = t->next;
+   if (t->next != NULL) {
+      t->next->pprev = t->pprev;
+   }
+   t->next = NULL;
+   t->pprev = NULL;
+}
+
+/**
+ * cascade moves the timers of the current slot of a level down to the
+ * levels below, lock must be held
+ * @return the slot's index, 0 when the next level is due to cascade too
+ */
+uint32_t TimerWheel::cascade(int level) {
+   uint32_t index = (now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+   Timer *t = slots[level][index];
+   slots[level][index] = NULL;
+   while (t != NULL) {
+      Timer *next = t->next;
+      add(t);
+      t = next;
+   }
+   return index;
+}
+
+void TimerWheel::schedule(Timer *t, uint64_t ms) {
+   uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+   sem_wait(&lock);
+   if (t->pprev != NULL) {
+      unlink(t);
+      pending--;
+   }
+   t->expires = now + ticks;
+   add(t);
+   pending++;
+   sem_post(&lock);
+}
+
+void TimerWheel::cancel(Timer *t) {
+   sem_wait(&lock);
+   if (t->pprev != NULL) {
+      unlink(t);
+      pending--;
+   }
+   sem_post(&lock);
+   //wait out a callback of t that may already be running
+   sem_wait(&firing);
+   sem_post(&firing);
+}
+
+/**
+ * tick runs the timers due at the current tick and moves the wheel on
+ */
+void TimerWheel::tick() {
+   sem_wait(&firing);
+   sem_wait(&lock);
+   uint32_t index = now & WHEEL_MASK;
+   if (index == 0) {
+      //each level cascades as the one below it wraps
+      for (int level = 1; level < WHEEL_LEVELS && cascade(level) == 0; level++) {
+      }
+   }
+   now++;
+   //moved aside so callbacks can still schedule and cancel any of them
+   expired = slots[0][index];
+   slots[0][index] = NULL;
+   if (expired != NULL) {
+      expired->pprev = &expired;
+   }
+   while (expired != NULL) {
+      Timer *t = expired;
+      unlink(t);
+      pending--;
+      fired++;
+      sem_post(&lock);
+      (*t->func)(t->arg);
+      sem_wait(&lock);
+   }
+   sem_post(&lock);
+   sem_post(&firing);
+}
+
+void *TimerWheel::run(void *arg) {
+   TimerWheel *tw = (TimerWheel*)arg;
+   uint64_t start = monotonic_ms();
+   while (true) {
+      uint64_t elapsed = monotonic_ms() - start;
+      //catch up on any ticks missed while callbacks ran long
+      while (tw->now * TIMER_TICK_MS <= elapsed) {
+         tw->tick();
+      }
+      usleep((tw->now * TIMER_TICK_MS - elapsed) * 1000);
+   }
+   return NULL;
+}
+
+string TimerWheel::dumpStats() {
+   char buf[128];
+   sem_wait(&lock);
+   snprintf(buf, sizeof(buf), "Timers: %llu scheduled, %llu fired\n",
+            (unsigned long long)pending, (unsigned long long)fired);
+   sem_post(&lock);
+   return buf;
+}
@@ -0,0 +1,106 @@
+/*
+   collabREate timerwheel.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __TIMERWHEEL_H
+#define __TIMERWHEEL_H
+
+#include <string>
+#include <stdint.h>
+#include <semaphore.h>
+
+using namespace std;
+
+//resolution of a TimerWheel in ms
+#define TIMER_TICK_MS 100
+
+//slots per level are 1 << WHEEL_BITS, four levels reach about 19 days
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+typedef void (*TimerFunc)(void *arg);
+
+/**
+ * Timer
+ * Embedded in whatever it times, the TimerWheel links it into its slots
+ * so scheduling never allocates.  Only touch the fields through the wheel.
+ */
+struct Timer {
+   Timer(TimerFunc func, void *arg);
+
+   TimerFunc func;
+   void *arg;
+   uint64_t expires;    //in ticks
+   Timer *next;
+   Timer **pprev;       //NULL while not scheduled
+};
+
+/**
+ * TimerWheel
+ * Hierarchical timing wheel.  A timer sits in the slot of the lowest level
+ * whose span covers it and moves down a level each time the level below
+ * wraps, so scheduling, cancelling and each tick cost O(1) however many
+ * connections have timers.  Callbacks run one at a time on the wheel's
+ * thread and must not block, cancel or release anything that cancels.
+ */
+class TimerWheel {
+public:
+   TimerWheel();
+
+   /**
+    * start launches the thread that turns the wheel
+    */
+   void start();
+
+   /**
+    * schedule runs a timer's callback once, ms from now to within a tick,
+    * replacing any earlier schedule of the same timer.  May be called by
+    * callbacks.
+    */
+   void schedule(Timer *t, uint64_t ms);
+
+   /**
+    * cancel unschedules a timer, once it returns the callback is not
+    * running and won't run unless scheduled again
+    */
+   void cancel(Timer *t);
+
+   string dumpStats();
+
+private:
+   static void *run(void *arg);
+   void tick();
+
+   //the following require lock
+   void add(Timer *t);
+   void unlink(Timer *t);
+   uint32_t cascade(int level);
+
+   sem_t lock;
+   sem_t firing;          //held while callbacks run, see cancel
+   Timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+   Timer *expired;        //due at the tick being run
+   uint64_t now;          //the next tick to run
+   uint64_t pending;
+   uint64_t fired;
+};
+
+#endif
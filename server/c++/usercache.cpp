@@ -0,0 +1,103 @@
+/*
+   collabREate usercache.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "usercache.h"
+
+UserCache::UserCache(uint32_t ttl) {
+   this->ttl = ttl;
+   hits = misses = invalidations = 0;
+   gen = 0;
+   for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+      sem_init(&shards[i].lock, 0, 1);
+   }
+}
+
+UserCache::~UserCache() {
+   for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+      sem_destroy(&shards[i].lock);
+   }
+}
+
+UserCache::Shard &UserCache::shard(const string &user) {
+   uint32_t h = 2166136261u;
+   for (size_t i = 0; i < user.length(); i++) {
+      h = (h ^ (uint8_t)user[i]) * 16777619u;
+   }
+   return shards[h % USER_CACHE_SHARDS];
+}
+
+bool UserCache::lookup(const string &user, CachedUser &cu) {
+   bool res = false;
+   if (ttl == 0) {
+      return false;
+   }
+   Shard &s = shard(user);
+   sem_wait(&s.lock);
+   map<string,CachedUser>::iterator i = s.users.find(user);
+   if (i != s.users.end()) {
+      if (time(NULL) < i->second.expires) {
+         cu = i->second;
+         res = true;
+      }
+      else {
+         s.users.erase(i);
+      }
+   }
+   sem_post(&s.lock);
+   __sync_fetch_and_add(res ? &hits : &misses, 1);
+   return res;
+}
+
+void UserCache::store(const string &user, uint32_t uid, const string &pwhash, uint64_t pub, uint64_t sub, uint64_t gen) {
+   if (ttl == 0) {
+      return;
+   }
+   Shard &s = shard(user);
+   sem_wait(&s.lock);
+   //invalidations take the shard lock, so this can't miss one
+   if (gen == this->gen) {
+      CachedUser &cu = s.users[user];
+      cu.uid = uid;
+      cu.pwhash = pwhash;
+      cu.pub = pub;
+      cu.sub = sub;
+      cu.expires = time(NULL) + ttl;
+   }
+   sem_post(&s.lock);
+}
+
+void UserCache::invalidate(const string &user) {
+   Shard &s = shard(user);
+   sem_wait(&s.lock);
+   __sync_fetch_and_add(&gen, 1);
+   s.users.erase(user);
+   sem_post(&s.lock);
+   __sync_fetch_and_add(&invalidations, 1);
+}
+
+void UserCache::clear() {
+   __sync_fetch_and_add(&gen, 1);
+   for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+      sem_wait(&shards[i].lock);
+      shards[i].users.clear();
+      sem_post(&shards[i].lock);
+   }
+   __sync_fetch_and_add(&invalidations, 1);
+}
@@ -0,0 +1,113 @@
+/*
+   collabREate usercache.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __USERCACHE_H
+#define __USERCACHE_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+#include <semaphore.h>
+
+using namespace std;
+
+//number of independently locked parts of the cache
+#define USER_CACHE_SHARDS 16
+
+/**
+ * CachedUser
+ * One row of the users table, as needed to authenticate the user
+ */
+struct CachedUser {
+   uint32_t uid;
+   string pwhash;     //hex md5 of the password, as stored in the database
+   uint64_t pub;
+   uint64_t sub;
+   time_t expires;
+};
+
+/**
+ * UserCache
+ * Credentials and permissions of database mode users, so authentication
+ * doesn't have to query the database. The map is split into shards, each
+ * with its own lock, so concurrent logins of different users rarely wait on
+ * each other. Entries are dropped ttl seconds after they were loaded, or
+ * sooner when collab_mgr announces that a user has changed.
+ */
+class UserCache {
+public:
+   /**
+    * @param ttl seconds an entry is trusted, 0 disables caching
+    */
+   UserCache(uint32_t ttl);
+   ~UserCache();
+
+   /**
+    * lookup finds a user that was cached no more than ttl seconds ago
+    * @param user the username
+    * @param cu receives the cached row
+    * @return true on a hit
+    */
+   bool lookup(const string &user, CachedUser &cu);
+
+   /**
+    * generation changes with every invalidation, read it before querying
+    * the database and pass it to store
+    */
+   uint64_t generation() {return gen;};
+
+   /**
+    * store caches a row read from the users table, unless the cache has
+    * been invalidated since the read started and the row may be stale
+    * @param gen the generation read before the query
+    */
+   void store(const string &user, uint32_t uid, const string &pwhash, uint64_t pub, uint64_t sub, uint64_t gen);
+
+   /**
+    * invalidate drops a single user
+    * @param user the username
+    */
+   void invalidate(const string &user);
+
+   /**
+    * clear drops every user
+    */
+   void clear();
+
+   bool enabled() {return ttl > 0;};
+
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t invalidations;
+
+private:
+   struct Shard {
+      sem_t lock;
+      map<string,CachedUser> users;
+   };
+   Shard &shard(const string &user);
+
+   Shard shards[USER_CACHE_SHARDS];
+   uint32_t ttl;
+   volatile uint64_t gen;
+};
+
+#endif
@@ -205,34 +205,37 @@ void log(int verbosity, const char *format, ...) {
 //returns true: a read was performed, check *obj
 //       false: a timeout occurred
 bool readJson(int sock, string &json_buffer, json_object **obj, time_t timeout) {
-   char buf[2048];
+   char buf[65536];
    json_tokener *tok = json_tokener_new();
    enum json_tokener_error jerr;
    bool result = true;
+   size_t parsed = 0;   //bytes of json_buffer already handed to the tokener
    *obj = NULL;
    while (1) {
       //start by seeing if we have a complete json object already buffered
-      json_tokener_reset(tok);
-      *obj = json_tokener_parse_ex(tok, json_buffer.c_str(), json_buffer.length());
-      jerr = json_tokener_get_error(tok);
-      if (jerr == json_tokener_continue) {
-         //json object is syntactically correct, but incomplete
-         log(LDEBUG, "json_tokener_continue for %s\n", json_buffer.c_str());
-      }
-      else if (jerr != json_tokener_success) {
-         //need to reconnect socket and in the meantime start caching event locally
-         log(LERROR, "jerr != json_tokener_success for %s\n", json_buffer.c_str());
-         break;
-      }
-      else if (*obj != NULL) {
-         //we extracted a json object from the front of the string
-         //queue it and trim the string
-         log(LDEBUG, "jerr == json_tokener_success for %s\n", json_buffer.c_str());
-         json_buffer.erase(0, tok->char_offset);
-         break;
-      }
-      else {
-         //can we ever get here?
+      //the tokener keeps its state so only newly received data is parsed
+      if (parsed < json_buffer.length()) {
+         size_t start = parsed;
+         *obj = json_tokener_parse_ex(tok, json_buffer.c_str() + start, json_buffer.length() - start);
+         jerr = json_tokener_get_error(tok);
+         if (jerr == json_tokener_continue) {
+            //json object is syntactically correct, but incomplete
+            parsed = json_buffer.length();
+         }
+         else if (jerr != json_tokener_success) {
+            //need to reconnect socket and in the meantime start caching event locally
+            log(LERROR, "jerr != json_tokener_success for %s\n", json_buffer.c_str());
+            break;
+         }
+         else if (*obj != NULL) {
+            //we extracted a json object from the front of the string
+            //queue it and trim the string
+            json_buffer.erase(0, start + tok->char_offset);
+            break;
+         }
+         else {
+            //can we ever get here?
+         }
       }
 
       //couldn't buid a json object so we need to read more data
@@ -262,7 +265,9 @@ ssize_t sendAll(int fd, const void *buf, ssize_t size) {
    const unsigned char *b = (const unsigned char *)buf;
    while (total < size) {
       ssize_t nbytes = write(fd, b + total, size - total);
-      if (nbytes == 0) return -1;
+      if (nbytes < 0 && errno == EINTR) continue;
+      //the peer is gone, don't let -1 walk total backwards
+      if (nbytes <= 0) return -1;
       total += nbytes;
    }
    return total;
@@ -339,6 +344,12 @@ void RC4::crypt(unsigned char *blob, int len) {
    }
 }
 
+uint64_t monotonic_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int fill_random(unsigned char *buf, size_t size) {
    int urand = open("/dev/urandom", O_RDONLY);
    if (urand < 0) {
@@ -450,6 +461,22 @@ uint8_t *hex_decode(const char *hex, uint32_t *len) {
    return res;
 }
 
+static int raw_serializer(json_object *obj, printbuf *pb, int level, int flags) {
+   const char *json = (const char*)json_object_get_userdata(obj);
+   return printbuf_memappend(pb, json, strlen(json));
+}
+
+/*
+ * Wrap already serialized json text so that it can be placed inside another
+ * object and written out verbatim without being reparsed. The text is
+ * copied and freed along with the returned object.
+ */
+json_object *json_object_new_raw(const char *json) {
+   json_object *obj = json_object_new_object();
+   json_object_set_serializer(obj, raw_serializer, strdup(json), json_object_free_userdata);
+   return obj;
+}
+
 void append_json_hex_val(json_object *obj, const char *key, const uint8_t *value, uint32_t len) {
    if (len == 0) {
       len = strlen((const char*)value);
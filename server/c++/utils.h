@@ -116,6 +116,7 @@ using namespace std;
 #define MSG_INITIAL_CHALLENGE        "initial_challenge"
 #define MSG_AUTH_REQUEST             "auth_request"
 #define MSG_AUTH_REPLY               "auth_reply"
+#define MSG_RESUME_REQUEST           "resume_request"
 #define AUTH_REPLY_SUCCESS           1
 #define AUTH_REPLY_FAIL              0
 #define MSG_PROJECT_LIST             "project_list"
@@ -127,6 +128,8 @@ using namespace std;
 #define MSG_SEND_UPDATES             "send_updates"
 #define MSG_PROJECT_REJOIN_REQUEST   "project_rejoin_request"
 #define MSG_ACK_UPDATEID             "ack_updateid"
+#define MSG_PROJECT_STATE            "project_state"
+#define MSG_CATCHUP_STATUS           "catchup_status"
 #define MSG_PROJECT_SNAPSHOT_REQUEST "project_snapshot_request"
 #define MSG_PROJECT_SNAPSHOT_REPLY   "project_snapshot_reply"
 #define PROJECT_SNAPSHOT_SUCCESS 1
@@ -143,9 +146,14 @@ using namespace std;
 #define MSG_GET_PROJ_PERMS_REPLY     "get_proj_perms_reply"
 #define MSG_SET_PROJ_PERMS           "set_proj_perms"
 #define MSG_SET_PROJ_PERMS_REPLY     "set_proj_perms_reply"
+#define MSG_SET_FILTER               "set_filter"
+#define MSG_SET_FILTER_REPLY         "set_filter_reply"
 
 #define MSG_ERROR                    "collab_error"
 #define MSG_FATAL                    "collab_fatal"
+#define MSG_PING                     "ping"
+#define MSG_PONG                     "pong"
+#define MSG_SERVER_RESTART           "server_restart"
 
 
 #define default_pub 0x3fff
@@ -155,6 +163,12 @@ using namespace std;
 
 #define PROTOCOL_VERSION             4
 
+//optional features a plugin lists in the "caps" of its auth or resume
+//request, the auth reply carries the subset the server will use
+#define CAP_CUMULATIVE_ACK           0x00000001   //one ack_updateid may cover several updates
+#define CAP_JOIN_CATCHUP             0x00000002   //send_updates always follows a join, hold live updates until then
+#define CAP_HANDOVER                 0x00000004   //reconnects and resumes when sent MSG_SERVER_RESTART
+
    //the above commands are grouped in order to provide
    //permissions based on these masks
 
@@ -178,6 +192,9 @@ using namespace std;
 #define SERVER_RENAME_STRUCT        201
 
 #define MNG_CONTROL_FIRST            2000
+//collab_mgr NOTIFYs this channel after changing a user, the payload is
+//the username or empty if any user may have changed
+#define USER_NOTIFY_CHANNEL          "collab_users"
 #define MNG_GET_CONNECTIONS          "mng_get_connections"
 #define MNG_CONNECTIONS              "mng_connections"
 #define MNG_GET_STATS                "mng_get_stats"
@@ -189,12 +206,28 @@ using namespace std;
 #define MNG_PROJECT_IMPORT           "mng_project_import"
 #define MNG_PROJECT_IMPORT_REPLY     "mng_project_import_reply"
 #define MNG_IMPORT_UPDATE            "mng_import_update"
+#define MNG_IMPORT_UPDATES           "mng_import_updates"
 #define MNG_EXPORT_UPDATES           "mng_export_updates"
+#define MNG_EXPORT_END               "mng_export_end"
+#define MNG_PROJECT_COMPACT          "mng_project_compact"
+#define MNG_PROJECT_COMPACT_REPLY    "mng_project_compact_reply"
 #define MNG_MIGRATE_REPLY_SUCCESS    1
 #define MNG_MIGRATE_REPLY_FAIL       0
 
+#define MNG_EXPORT_SUCCESS           1
+#define MNG_EXPORT_FAIL              0
+
 #define MAX_COMMAND 2048
 
+//limits on a single MNG_EXPORT_UPDATES or MNG_IMPORT_UPDATES batch,
+//whichever is reached first
+#define EXPORT_BATCH_UPDATES 1000
+#define EXPORT_BATCH_BYTES   (1024 * 1024)
+
+//limits on a single MSG_PROJECT_STATE chunk, whichever is reached first
+#define STATE_CHUNK_UPDATES  1000
+#define STATE_CHUNK_BYTES    (256 * 1024)
+
 #define MD5_SIZE         16
 #define GPID_SIZE        32
 #define CHALLENGE_SIZE   32
@@ -211,7 +244,7 @@ using namespace std;
 #define LDEBUG   15
 
 const char * const FILE_SIG = "collabRE";
-#define FILE_VER 2
+#define FILE_VER 3
 
 //could extend to CollabreateManagerInterface i guess
 #define MODE_DB 1
@@ -269,6 +302,9 @@ public:
 
 int fill_random(unsigned char *buf, size_t size);
 
+//milliseconds from an arbitrary fixed point, unaffected by clock changes
+uint64_t monotonic_ms();
+
 json_object *parseConf(const char *conf);
 short getShortOption(json_object *conf, const string &opt, short defaultValue);
 int getIntOption(json_object *conf, const string &opt, int defaultValue);
@@ -278,6 +314,8 @@ const char *getCstringOption(json_object *conf, const string &opt, const char *d
 const char *hex_encode(const void *bin, uint32_t len);
 uint8_t *hex_decode(const char *hex, uint32_t *len);
 
+json_object *json_object_new_raw(const char *json);
+
 void append_json_hex_val(json_object *obj, const char *key, const uint8_t *value, uint32_t len = 0);
 void append_json_string_val(json_object *obj, const char *key, const char *value);
 void append_json_string_val(json_object *obj, const char *key, const string &value);